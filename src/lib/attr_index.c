@@ -0,0 +1,357 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attr_index.h"
+#include "attrs.h"
+#include "log.h"
+#include "object.h"
+#include "pkcs11.h"
+#include "utils.h"
+
+/* the attributes applications look objects up by */
+static const CK_ATTRIBUTE_TYPE indexed_types[] = {
+    CKA_CLASS,
+    CKA_KEY_TYPE,
+    CKA_ID,
+    CKA_LABEL,
+    CKA_ISSUER,
+    CKA_SERIAL_NUMBER,
+    CKA_SUBJECT,
+};
+
+#define ATTR_INDEX_MIN_BUCKETS 64
+
+typedef struct attr_index_entry attr_index_entry;
+struct attr_index_entry {
+    attr_index_entry *next;
+    uint64_t hash;
+    CK_ATTRIBUTE_TYPE type;
+    CK_ULONG len;
+    void *value;
+
+    /* the tobjects with this value, in token order, see tobject.seq */
+    tobject **objs;
+    size_t cnt;
+    size_t max;
+};
+
+struct attr_index {
+    attr_index_entry **buckets;
+    size_t bucket_cnt;
+    size_t entry_cnt;
+};
+
+static bool is_indexed(CK_ATTRIBUTE_TYPE type) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(indexed_types); i++) {
+        if (indexed_types[i] == type) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+
+    const unsigned char *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static uint64_t hash_attr(CK_ATTRIBUTE_TYPE type, const void *value, CK_ULONG len) {
+
+    uint64_t h = hash_bytes(0xcbf29ce484222325ULL, &type, sizeof(type));
+    return len ? hash_bytes(h, value, len) : h;
+}
+
+static attr_index_entry **find_entry(attr_index *idx, uint64_t hash,
+        CK_ATTRIBUTE_TYPE type, const void *value, CK_ULONG len) {
+
+    attr_index_entry **e = &idx->buckets[hash & (idx->bucket_cnt - 1)];
+    while (*e) {
+        if ((*e)->hash == hash
+                && (*e)->type == type
+                && (*e)->len == len
+                && (!len || !memcmp((*e)->value, value, len))) {
+            break;
+        }
+        e = &(*e)->next;
+    }
+
+    return e;
+}
+
+static void grow(attr_index *idx) {
+
+    size_t new_cnt = idx->bucket_cnt * 2;
+    attr_index_entry **buckets = calloc(new_cnt, sizeof(*buckets));
+    if (!buckets) {
+        /* not fatal, the chains just get longer */
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < idx->bucket_cnt; i++) {
+        attr_index_entry *e = idx->buckets[i];
+        while (e) {
+            attr_index_entry *next = e->next;
+            attr_index_entry **b = &buckets[e->hash & (new_cnt - 1)];
+            e->next = *b;
+            *b = e;
+            e = next;
+        }
+    }
+
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->bucket_cnt = new_cnt;
+}
+
+static void entry_free(attr_index_entry *e) {
+
+    free(e->objs);
+    free(e->value);
+    free(e);
+}
+
+CK_RV attr_index_new(attr_index **idx) {
+
+    attr_index *i = calloc(1, sizeof(*i));
+    if (!i) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    i->buckets = calloc(ATTR_INDEX_MIN_BUCKETS, sizeof(*i->buckets));
+    if (!i->buckets) {
+        LOGE("oom");
+        free(i);
+        return CKR_HOST_MEMORY;
+    }
+
+    i->bucket_cnt = ATTR_INDEX_MIN_BUCKETS;
+
+    *idx = i;
+
+    return CKR_OK;
+}
+
+void attr_index_free(attr_index *idx) {
+
+    if (!idx) {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < idx->bucket_cnt; i++) {
+        attr_index_entry *e = idx->buckets[i];
+        while (e) {
+            attr_index_entry *next = e->next;
+            entry_free(e);
+            e = next;
+        }
+    }
+
+    free(idx->buckets);
+    free(idx);
+}
+
+static CK_RV add_one(attr_index *idx, tobject *tobj, CK_ATTRIBUTE_PTR a) {
+
+    uint64_t hash = hash_attr(a->type, a->pValue, a->ulValueLen);
+    attr_index_entry **b = find_entry(idx, hash, a->type, a->pValue,
+            a->ulValueLen);
+
+    attr_index_entry *e = *b;
+    if (!e) {
+        e = calloc(1, sizeof(*e));
+        if (!e) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+
+        if (a->ulValueLen) {
+            e->value = malloc(a->ulValueLen);
+            if (!e->value) {
+                LOGE("oom");
+                free(e);
+                return CKR_HOST_MEMORY;
+            }
+            memcpy(e->value, a->pValue, a->ulValueLen);
+        }
+
+        e->hash = hash;
+        e->type = a->type;
+        e->len = a->ulValueLen;
+    }
+
+    if (e->cnt == e->max) {
+        size_t max = e->max ? e->max * 2 : 1;
+        tobject **objs = realloc(e->objs, max * sizeof(*objs));
+        if (!objs) {
+            LOGE("oom");
+            if (!*b) {
+                entry_free(e);
+            }
+            return CKR_HOST_MEMORY;
+        }
+        e->objs = objs;
+        e->max = max;
+    }
+
+    /* new objects go last, re-indexed ones back to where they were */
+    size_t lo = 0;
+    size_t hi = e->cnt;
+    if (hi && e->objs[hi - 1]->seq > tobj->seq) {
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (e->objs[mid]->seq < tobj->seq) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        memmove(&e->objs[lo + 1], &e->objs[lo], (e->cnt - lo) * sizeof(*e->objs));
+    }
+
+    e->objs[hi] = tobj;
+    e->cnt++;
+
+    if (!*b) {
+        *b = e;
+        idx->entry_cnt++;
+        if (idx->entry_cnt > idx->bucket_cnt) {
+            grow(idx);
+        }
+    }
+
+    return CKR_OK;
+}
+
+static void remove_one(attr_index *idx, tobject *tobj, CK_ATTRIBUTE_PTR a) {
+
+    uint64_t hash = hash_attr(a->type, a->pValue, a->ulValueLen);
+    attr_index_entry **b = find_entry(idx, hash, a->type, a->pValue,
+            a->ulValueLen);
+
+    attr_index_entry *e = *b;
+    if (!e) {
+        LOGW("Object not in attribute index, type: 0x%lx", a->type);
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < e->cnt; i++) {
+        if (e->objs[i] == tobj) {
+            break;
+        }
+    }
+
+    if (i == e->cnt) {
+        LOGW("Object not in attribute index, type: 0x%lx", a->type);
+        return;
+    }
+
+    /* keep token order, find results come out in it */
+    memmove(&e->objs[i], &e->objs[i + 1], (e->cnt - i - 1) * sizeof(*e->objs));
+    e->cnt--;
+
+    if (!e->cnt) {
+        *b = e->next;
+        idx->entry_cnt--;
+        entry_free(e);
+    }
+}
+
+CK_RV attr_index_add(attr_index *idx, tobject *tobj, attr_list *attrs) {
+
+    if (!attrs) {
+        return CKR_OK;
+    }
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(indexed_types); i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, indexed_types[i]);
+        if (!a) {
+            continue;
+        }
+
+        CK_RV rv = add_one(idx, tobj, a);
+        if (rv != CKR_OK) {
+            /* undo what was added so far */
+            while (i--) {
+                a = attr_get_attribute_by_type(attrs, indexed_types[i]);
+                if (a) {
+                    remove_one(idx, tobj, a);
+                }
+            }
+            return rv;
+        }
+    }
+
+    return CKR_OK;
+}
+
+void attr_index_remove(attr_index *idx, tobject *tobj, attr_list *attrs) {
+
+    if (!attrs) {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(indexed_types); i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, indexed_types[i]);
+        if (a) {
+            remove_one(idx, tobj, a);
+        }
+    }
+}
+
+bool attr_index_lookup(attr_index *idx, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        tobject * const **objs, size_t *len) {
+
+    bool found = false;
+
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        CK_ATTRIBUTE_PTR t = &templ[i];
+        if (!is_indexed(t->type)) {
+            continue;
+        }
+
+        if (t->ulValueLen && !t->pValue) {
+            continue;
+        }
+
+        attr_index_entry *e = *find_entry(idx,
+                hash_attr(t->type, t->pValue, t->ulValueLen),
+                t->type, t->pValue, t->ulValueLen);
+
+        size_t cnt = e ? e->cnt : 0;
+        if (!found || cnt < *len) {
+            *objs = e ? e->objs : NULL;
+            *len = cnt;
+            found = true;
+        }
+
+        /* nothing can beat no candidates */
+        if (!cnt) {
+            break;
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_ATTR_INDEX_H_
+#define SRC_LIB_ATTR_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "attrs.h"
+#include "pkcs11.h"
+
+typedef struct tobject tobject;
+
+/*
+ * A per token index from the value of the attributes applications search
+ * by, like CKA_ID and CKA_LABEL, to the tobjects having that value.
+ */
+typedef struct attr_index attr_index;
+
+/**
+ * Creates an empty attribute index.
+ * @param idx
+ *  The index to create.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV attr_index_new(attr_index **idx);
+
+void attr_index_free(attr_index *idx);
+
+/**
+ * Adds a tobject under the indexed attributes of an attribute list. On
+ * failure the index is left unchanged.
+ * @param idx
+ *  The index.
+ * @param tobj
+ *  The tobject to add.
+ * @param attrs
+ *  The attributes to index it by, usually tobj->attrs.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV attr_index_add(attr_index *idx, tobject *tobj, attr_list *attrs);
+
+/**
+ * Removes a tobject from the index, attrs must hold the same indexed
+ * values as when it was added. Adding a tobject under a new attribute
+ * list and then removing it under the old one re-indexes it.
+ * @param idx
+ *  The index.
+ * @param tobj
+ *  The tobject to remove.
+ * @param attrs
+ *  The attributes it was added with.
+ */
+void attr_index_remove(attr_index *idx, tobject *tobj, attr_list *attrs);
+
+/**
+ * Finds the candidates for a search template, which is the shortest list
+ * of tobjects matching one of the indexed template attributes. The
+ * candidates are in token order and still have to be checked against the
+ * whole template.
+ * @param idx
+ *  The index.
+ * @param templ
+ *  The search template.
+ * @param count
+ *  The number of template attributes.
+ * @param objs
+ *  The candidates, valid until the index is changed.
+ * @param len
+ *  The number of candidates, which may be 0.
+ * @return
+ *  false when no template attribute is indexed and all tobjects are
+ *  candidates, true otherwise.
+ */
+bool attr_index_lookup(attr_index *idx, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        tobject * const **objs, size_t *len);
+
+#endif /* SRC_LIB_ATTR_INDEX_H_ */
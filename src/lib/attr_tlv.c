@@ -0,0 +1,315 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include "config.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attr_tlv.h"
+#include "attrs.h"
+#include "log.h"
+#include "pkcs11.h"
+#include "twist.h"
+#include "typed_memory.h"
+#include "utils.h"
+
+#define HDR_LEN    5
+#define REC_LEN    13  /* type + memory type + length */
+#define ULONG_LEN  8
+
+static const unsigned char hdr[HDR_LEN] = { 0x00, 'T', 'L', 'V', ATTR_TLV_VERSION };
+
+static void put_u64(unsigned char *p, uint64_t v) {
+
+    size_t i;
+    for (i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+
+    size_t i;
+    for (i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+
+    uint64_t v = 0;
+    size_t i;
+    for (i = 8; i > 0; i--) {
+        v = (v << 8) | p[i - 1];
+    }
+
+    return v;
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+
+    uint32_t v = 0;
+    size_t i;
+    for (i = 4; i > 0; i--) {
+        v = (v << 8) | p[i - 1];
+    }
+
+    return v;
+}
+
+static bool is_kept(const CK_ATTRIBUTE_TYPE *keep, size_t keep_len,
+        CK_ATTRIBUTE_TYPE type) {
+
+    if (!keep) {
+        return true;
+    }
+
+    size_t i;
+    for (i = 0; i < keep_len; i++) {
+        if (keep[i] == type) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool attr_tlv_is_tlv(const unsigned char *buf, size_t len) {
+
+    /* any version, so a newer one is reported instead of parsed as YAML */
+    return len >= HDR_LEN && !memcmp(buf, hdr, HDR_LEN - 1);
+}
+
+static size_t encoded_len(CK_ATTRIBUTE_PTR a, CK_BYTE memtype) {
+
+    switch (memtype) {
+    case TYPE_BYTE_INT:
+        return ULONG_LEN;
+    case TYPE_BYTE_INT_SEQ:
+        return a->ulValueLen / sizeof(CK_ULONG) * ULONG_LEN;
+    default:
+        return a->ulValueLen;
+    }
+}
+
+WEAK twist attr_tlv_encode(attr_list *attrs) {
+    assert(attrs);
+
+    CK_ULONG count = attr_list_get_count(attrs);
+    const CK_ATTRIBUTE_PTR _attrs = attr_list_get_ptr(attrs);
+
+    size_t total = HDR_LEN;
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        CK_ATTRIBUTE_PTR a = &_attrs[i];
+        CK_BYTE memtype = type_from_ptr(a->pValue, a->ulValueLen);
+
+        size_t len = encoded_len(a, memtype);
+        if (len > UINT32_MAX) {
+            LOGE("Attribute too big to encode: 0x%lx", a->type);
+            return NULL;
+        }
+
+        safe_adde(total, REC_LEN);
+        safe_adde(total, len);
+    }
+
+    twist t = twist_calloc(total);
+    if (!t) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    unsigned char *p = (unsigned char *)t;
+    memcpy(p, hdr, HDR_LEN);
+    p += HDR_LEN;
+
+    for (i = 0; i < count; i++) {
+        CK_ATTRIBUTE_PTR a = &_attrs[i];
+        CK_BYTE memtype = type_from_ptr(a->pValue, a->ulValueLen);
+        size_t len = encoded_len(a, memtype);
+
+        put_u64(p, a->type);
+        p[8] = memtype;
+        put_u32(&p[9], (uint32_t)len);
+        p += REC_LEN;
+
+        switch (memtype) {
+        case TYPE_BYTE_INT:
+            put_u64(p, *(CK_ULONG_PTR)a->pValue);
+            break;
+        case TYPE_BYTE_INT_SEQ: {
+            CK_ULONG_PTR seq = (CK_ULONG_PTR)a->pValue;
+            size_t j;
+            for (j = 0; j < len / ULONG_LEN; j++) {
+                put_u64(&p[j * ULONG_LEN], seq[j]);
+            }
+        } break;
+        case TYPE_BYTE_BOOL:
+        case TYPE_BYTE_HEX_STR:
+            if (len) {
+                memcpy(p, a->pValue, len);
+            }
+            break;
+        default:
+            LOGE("unknown type, perhaps memory corruption issue?");
+            twist_free(t);
+            return NULL;
+        }
+
+        p += len;
+    }
+
+    return t;
+}
+
+static bool decode_one(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BYTE memtype,
+        const unsigned char *value, size_t len) {
+
+    switch (memtype) {
+    case TYPE_BYTE_INT: {
+        if (len != ULONG_LEN) {
+            LOGE("Bad integer length for 0x%lx, got: %zu", type, len);
+            return false;
+        }
+        uint64_t v = get_u64(value);
+        if (v > (CK_ULONG)-1) {
+            LOGE("Integer does not fit a CK_ULONG for 0x%lx", type);
+            return false;
+        }
+        return attr_list_add_int(l, type, (CK_ULONG)v);
+    }
+    case TYPE_BYTE_BOOL:
+        if (len != sizeof(CK_BBOOL)) {
+            LOGE("Bad bool length for 0x%lx, got: %zu", type, len);
+            return false;
+        }
+        return attr_list_add_bool(l, type, value[0] ? CK_TRUE : CK_FALSE);
+    case TYPE_BYTE_INT_SEQ: {
+        if (len % ULONG_LEN) {
+            LOGE("Bad sequence length for 0x%lx, got: %zu", type, len);
+            return false;
+        }
+        size_t cnt = len / ULONG_LEN;
+        if (!cnt) {
+            return attr_list_add_int_seq(l, type, NULL, 0);
+        }
+
+        CK_ULONG_PTR seq = calloc(cnt, sizeof(*seq));
+        if (!seq) {
+            LOGE("oom");
+            return false;
+        }
+
+        size_t i;
+        for (i = 0; i < cnt; i++) {
+            uint64_t v = get_u64(&value[i * ULONG_LEN]);
+            if (v > (CK_ULONG)-1) {
+                LOGE("Integer does not fit a CK_ULONG for 0x%lx", type);
+                free(seq);
+                return false;
+            }
+            seq[i] = (CK_ULONG)v;
+        }
+
+        bool r = attr_list_add_int_seq(l, type, (CK_BYTE_PTR)seq,
+                cnt * sizeof(*seq));
+        free(seq);
+        return r;
+    }
+    case TYPE_BYTE_HEX_STR:
+        return attr_list_add_buf(l, type, len ? (CK_BYTE_PTR)value : NULL, len);
+    default:
+        LOGE("Unknown memory type for 0x%lx, got: %u", type, memtype);
+        return false;
+    }
+}
+
+CK_RV attr_tlv_decode(const unsigned char *buf, size_t len,
+        const CK_ATTRIBUTE_TYPE *keep, size_t keep_len, attr_list **attrs) {
+
+    if (!attr_tlv_is_tlv(buf, len)) {
+        LOGE("Attributes are not in the binary format");
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (buf[HDR_LEN - 1] != ATTR_TLV_VERSION) {
+        LOGE("Unknown attribute encoding version, got: %u, expected: %u",
+                buf[HDR_LEN - 1], ATTR_TLV_VERSION);
+        return CKR_GENERAL_ERROR;
+    }
+
+    attr_list *l = attr_list_new();
+    if (!l) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    /*
+     * Size the list up front so it is a single allocation, encoded
+     * values are never smaller than decoded ones. Bad records are
+     * reported by the decode loop.
+     */
+    CK_ULONG count = 0;
+    size_t bytes = 0;
+    size_t off = HDR_LEN;
+    while (len - off >= REC_LEN) {
+        const unsigned char *p = &buf[off];
+        size_t vlen = get_u32(&p[9]);
+        off += REC_LEN;
+        if (vlen > len - off) {
+            break;
+        }
+        if (is_kept(keep, keep_len, (CK_ATTRIBUTE_TYPE)get_u64(p))) {
+            count++;
+            bytes += vlen;
+        }
+        off += vlen;
+    }
+
+    if (!attr_list_reserve(l, count, bytes)) {
+        attr_list_free(l);
+        return CKR_HOST_MEMORY;
+    }
+
+    off = HDR_LEN;
+    while (off < len) {
+        if (len - off < REC_LEN) {
+            LOGE("Truncated attribute record at offset: %zu", off);
+            goto error;
+        }
+
+        const unsigned char *p = &buf[off];
+        uint64_t type = get_u64(p);
+        CK_BYTE memtype = p[8];
+        size_t vlen = get_u32(&p[9]);
+        off += REC_LEN;
+
+        if (vlen > len - off) {
+            LOGE("Truncated attribute value at offset: %zu", off);
+            goto error;
+        }
+
+        if (type > (CK_ULONG)-1) {
+            LOGE("Attribute type does not fit a CK_ULONG");
+            goto error;
+        }
+
+        /* skipping is just moving past the value */
+        if (is_kept(keep, keep_len, (CK_ATTRIBUTE_TYPE)type)
+                && !decode_one(l, (CK_ATTRIBUTE_TYPE)type, memtype, &buf[off], vlen)) {
+            goto error;
+        }
+
+        off += vlen;
+    }
+
+    *attrs = l;
+
+    return CKR_OK;
+
+error:
+    attr_list_free(l);
+    return CKR_GENERAL_ERROR;
+}
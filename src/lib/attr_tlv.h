@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_ATTR_TLV_H_
+#define SRC_LIB_ATTR_TLV_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "attrs.h"
+#include "debug.h"
+#include "pkcs11.h"
+#include "twist.h"
+
+/*
+ * The binary format object attributes are stored in, a header followed by
+ * one record per attribute:
+ *
+ *   header: 0x00 'T' 'L' 'V' <version>
+ *   record: <type:8> <memory type:1> <length:4> <value:length>
+ *
+ * Integers are little endian and CK_ULONG values, on their own or in a
+ * sequence, always take 8 bytes so stores can move between platforms.
+ * Byte strings are stored as is. The leading NUL never starts a YAML
+ * document, which is how rows written before the format are told apart.
+ */
+#define ATTR_TLV_VERSION 1
+
+/**
+ * Checks if serialized attributes are in the binary format.
+ * @param buf
+ *  The serialized attributes.
+ * @param len
+ *  The size of buf.
+ * @return
+ *  true when buf starts with the binary header, false for YAML.
+ */
+bool attr_tlv_is_tlv(const unsigned char *buf, size_t len);
+
+/**
+ * Serializes an attribute list.
+ * @param attrs
+ *  The attributes to serialize.
+ * @return
+ *  The binary encoding, NULL on error. Free with twist_free().
+ */
+WEAK twist attr_tlv_encode(attr_list *attrs);
+
+/**
+ * De-serializes attributes from the binary format.
+ * @param buf
+ *  The serialized attributes.
+ * @param len
+ *  The size of buf.
+ * @param keep
+ *  The attribute types to decode, others are skipped without copying
+ *  their values. NULL to decode all of them.
+ * @param keep_len
+ *  The number of types in keep.
+ * @param attrs
+ *  The decoded attributes.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV attr_tlv_decode(const unsigned char *buf, size_t len,
+        const CK_ATTRIBUTE_TYPE *keep, size_t keep_len, attr_list **attrs);
+
+#endif /* SRC_LIB_ATTR_TLV_H_ */
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "config.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <openssl/crypto.h>
@@ -11,12 +12,104 @@
 #include "typed_memory.h"
 #include "utils.h"
 
+/*
+ * Attribute values live in arena chunks owned by the list, each value
+ * followed by its inline type tag (see type_from_ptr()). Chunks are never
+ * moved, so value pointers stay valid as the list grows.
+ */
+typedef struct attr_chunk attr_chunk;
+struct attr_chunk {
+    attr_chunk *next;
+    size_t len;
+    size_t used;
+    CK_ULONG data[];
+};
+
+#define CHUNK_MIN 512
+#define CHUNK_MAX (64 * 1024)
+
 struct attr_list {
     CK_ULONG max;
     CK_ULONG count;
     CK_ATTRIBUTE_PTR attrs;
+
+    /* newest first, new values go in the first one */
+    attr_chunk *chunks;
+    /* attrs was carved out of a chunk, it is not freed on its own */
+    bool attrs_in_arena;
+
+    /*
+     * Open addressing table from type to position + 1 in attrs, 0 is a free
+     * slot. Only built for lists long enough that a scan shows up, objects
+     * with certificates carry 40+ attributes.
+     */
+    CK_ULONG *index;
+    size_t index_len;
 };
 
+#define INDEX_MIN_COUNT 8
+#define INDEX_MIN_LEN   32
+
+static size_t index_slot(CK_ATTRIBUTE_TYPE type, size_t len) {
+
+    uint64_t h = (uint64_t)type * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h ^ (h >> 32)) & (len - 1);
+}
+
+static void index_insert(attr_list *l, CK_ULONG pos) {
+
+    CK_ATTRIBUTE_TYPE type = l->attrs[pos].type;
+
+    size_t i = index_slot(type, l->index_len);
+    while (l->index[i]) {
+        /* the first one wins, like a scan */
+        if (l->attrs[l->index[i] - 1].type == type) {
+            return;
+        }
+        i = (i + 1) & (l->index_len - 1);
+    }
+
+    l->index[i] = pos + 1;
+}
+
+static void index_build(attr_list *l) {
+
+    free(l->index);
+    l->index = NULL;
+    l->index_len = 0;
+
+    if (l->count < INDEX_MIN_COUNT) {
+        return;
+    }
+
+    /* at most half full so probe chains stay short */
+    size_t len = INDEX_MIN_LEN;
+    while (len < l->count * 2) {
+        len *= 2;
+    }
+
+    /* not fatal, lookups fall back to a scan */
+    l->index = calloc(len, sizeof(*l->index));
+    if (!l->index) {
+        return;
+    }
+    l->index_len = len;
+
+    CK_ULONG i;
+    for (i = 0; i < l->count; i++) {
+        index_insert(l, i);
+    }
+}
+
+static void index_added(attr_list *l) {
+
+    if (l->index && l->count * 2 <= l->index_len) {
+        index_insert(l, l->count - 1);
+    } else if (l->count >= INDEX_MIN_COUNT) {
+        index_build(l);
+    }
+}
+
 #define ADD_ATTR_HANDLER(t, m) { .type = t, .name = #t, .memtype = m }
 
 typedef struct attr_handler2 attr_handler2;
@@ -28,36 +121,161 @@ struct attr_handler2 {
 
 #define ALLOC_LEN 16
 
-static bool _attr_list_add(attr_list *l,
-        CK_ATTRIBUTE_TYPE type, CK_ULONG len, CK_BYTE_PTR buf,
-        int memtype) {
+static attr_chunk *chunk_push(attr_list *l, size_t len) {
 
-    /* do we need space in the attribute list? if so realloc */
-    if (l->count == l->max) {
-        bool res = __builtin_add_overflow(l->max, ALLOC_LEN, &l->max);
-        if (res) {
-            LOGE("add overflow\n");
-            return false;
+    size_t bytes = sizeof(attr_chunk);
+    safe_adde(bytes, len);
+
+    attr_chunk *c = malloc(bytes);
+    if (!c) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    c->len = len;
+    c->used = 0;
+    c->next = l->chunks;
+    l->chunks = c;
+
+    return c;
+}
+
+static void *arena_alloc(attr_list *l, size_t len) {
+
+    size_t need = 0;
+    safe_add(need, len, sizeof(CK_ULONG) - 1);
+    need &= ~(sizeof(CK_ULONG) - 1);
+
+    attr_chunk *c = l->chunks;
+    if (!c || c->len - c->used < need) {
+        size_t clen = c ? c->len * 2 : CHUNK_MIN;
+        if (clen > CHUNK_MAX) {
+            clen = CHUNK_MAX;
+        }
+        if (clen < need) {
+            clen = need;
         }
 
-        size_t bytes = 0;
-        safe_mul(bytes, l->max, sizeof(*l->attrs));
+        c = chunk_push(l, clen);
+        if (!c) {
+            return NULL;
+        }
+    }
 
-        void *tmp = realloc(l->attrs, bytes);
-        if (!tmp) {
-            LOGE("oom");
-            return false;
+    void *p = (unsigned char *)c->data + c->used;
+    c->used += need;
+
+    return p;
+}
+
+static void *value_alloc(attr_list *l, CK_ULONG len, CK_BYTE memtype) {
+
+    size_t bytes = 0;
+    safe_add(bytes, len, 1);
+
+    CK_BYTE_PTR p = arena_alloc(l, bytes);
+    if (!p) {
+        return NULL;
+    }
+
+    memset(p, 0, len);
+    p[len] = memtype;
+
+    return p;
+}
+
+static bool attrs_reserve(attr_list *l, CK_ULONG need) {
+
+    if (need <= l->max) {
+        return true;
+    }
+
+    size_t blocks = need / ALLOC_LEN;
+    safe_adde(blocks, need % ALLOC_LEN ? 1 : 0);
+
+    CK_ULONG max = 0;
+    safe_mul(max, blocks, ALLOC_LEN);
+
+    size_t bytes = 0;
+    safe_mul(bytes, max, sizeof(*l->attrs));
+
+    CK_ATTRIBUTE_PTR tmp = NULL;
+    if (l->attrs_in_arena) {
+        /* the old array stays behind in its chunk */
+        tmp = malloc(bytes);
+        if (tmp) {
+            memcpy(tmp, l->attrs, l->count * sizeof(*l->attrs));
+            l->attrs_in_arena = false;
         }
+    } else {
+        tmp = realloc(l->attrs, bytes);
+    }
+
+    if (!tmp) {
+        LOGE("oom");
+        return false;
+    }
 
-        l->attrs = (CK_ATTRIBUTE_PTR)tmp;
+    /* clear the newly allocated region */
+    memset(&tmp[l->count], 0, (max - l->count) * sizeof(*tmp));
 
-        /*
-         * clear the newly allocated region
-         * If the mul operation didn't overflow above, then
-         * mul cannot overflow here, so use regular mul
-         */
-        safe_mul(bytes, ALLOC_LEN, sizeof(*l->attrs));
-        memset(&l->attrs[l->count], 0, bytes);
+    l->attrs = tmp;
+    l->max = max;
+
+    return true;
+}
+
+bool attr_list_reserve(attr_list *l, CK_ULONG count, size_t bytes) {
+    assert(l);
+
+    /* only a fresh list gets everything in one allocation */
+    if (l->attrs || l->chunks) {
+        return true;
+    }
+
+    size_t array = 0;
+    safe_mul(array, count, sizeof(CK_ATTRIBUTE));
+    safe_adde(array, sizeof(CK_ULONG) - 1);
+    array &= ~(sizeof(CK_ULONG) - 1);
+
+    /* each value carries a tag and padding */
+    size_t values = 0;
+    safe_mul(values, count, sizeof(CK_ULONG));
+    safe_adde(values, bytes);
+
+    size_t total = 0;
+    safe_add(total, array, values);
+    if (!total) {
+        return true;
+    }
+
+    attr_chunk *c = chunk_push(l, total);
+    if (!c) {
+        return false;
+    }
+
+    if (count) {
+        l->attrs = (CK_ATTRIBUTE_PTR)c->data;
+        memset(l->attrs, 0, array);
+        l->attrs_in_arena = true;
+        l->max = count;
+        c->used = array;
+    }
+
+    return true;
+}
+
+static bool _attr_list_add(attr_list *l,
+        CK_ATTRIBUTE_TYPE type, CK_ULONG len, CK_BYTE_PTR buf,
+        int memtype) {
+
+    /* do we need space in the attribute list? */
+    if (l->count == l->max) {
+        CK_ULONG need = 0;
+        safe_add(need, l->count, 1);
+        if (!attrs_reserve(l, need)) {
+            return false;
+        }
     }
 
     /* only hex strings and sequences can be empty */
@@ -71,12 +289,12 @@ static bool _attr_list_add(attr_list *l,
         assert(!l->attrs[l->count].pValue);
         assert(!l->attrs[l->count].ulValueLen);
         l->count++;
+        index_added(l);
         return true;
     }
 
-    void *newnode = type_calloc(1, len, memtype);
+    void *newnode = value_alloc(l, len, memtype);
     if (!newnode) {
-        LOGE("oom");
         return false;
     }
     memcpy(newnode, buf, len);
@@ -85,6 +303,8 @@ static bool _attr_list_add(attr_list *l,
     l->attrs[l->count].ulValueLen = len;
     l->attrs[l->count++].pValue = newnode;
 
+    index_added(l);
+
     return true;
 }
 
@@ -230,9 +450,8 @@ CK_ATTRIBUTE_PTR attr_list_get_ptr(attr_list *l) {
 
 void attr_pfree_cleanse(CK_ATTRIBUTE_PTR attr) {
     if (attr && attr->pValue) {
-        /* Don't use clear_free because OSSL is not used for alloc */
+        /* the memory belongs to the list's arena */
         OPENSSL_cleanse(attr->pValue, attr->ulValueLen);
-        free(attr->pValue);
         attr->pValue = NULL;
         attr->ulValueLen = 0;
     }
@@ -244,13 +463,19 @@ void attr_list_free(attr_list *attrs) {
         return;
     }
 
-    CK_ULONG i;
-    for (i=0; i < attrs->count; i++) {
-        const CK_ATTRIBUTE_PTR a = &attrs->attrs[i];
-        attr_pfree_cleanse(a);
+    attr_chunk *c = attrs->chunks;
+    while (c) {
+        attr_chunk *next = c->next;
+        OPENSSL_cleanse(c->data, c->used);
+        free(c);
+        c = next;
     }
 
-    free(attrs->attrs);
+    if (!attrs->attrs_in_arena) {
+        free(attrs->attrs);
+    }
+
+    free(attrs->index);
     free(attrs);
 }
 
@@ -314,53 +539,104 @@ bool attr_typify(CK_ATTRIBUTE_PTR attrs, CK_ULONG cnt, attr_list **copy) {
     return true;
 }
 
-CK_RV attr_list_dup(attr_list *old, attr_list **new) {
-    assert(old);
-    assert(new);
+static CK_RV dup_arena(attr_list *old, attr_list *tmp) {
 
-    CK_RV rv = CKR_GENERAL_ERROR;
+    attr_chunk *o = old->chunks;
 
-    /* create the container */
-    attr_list *tmp = calloc(1, sizeof(attr_list));
-    if (!tmp) {
+    size_t bytes = sizeof(attr_chunk);
+    safe_adde(bytes, o->used);
+
+    attr_chunk *c = malloc(bytes);
+    if (!c) {
         LOGE("oom");
         return CKR_HOST_MEMORY;
     }
 
-    /* create the attribute list */
-    tmp->attrs = calloc(old->max, sizeof(CK_ATTRIBUTE));
-    if (!tmp->attrs) {
-        LOGE("oom");
-        free(tmp);
+    /* one copy, then move the pointers over to the new chunk */
+    memcpy(c->data, o->data, o->used);
+    c->len = c->used = o->used;
+    c->next = NULL;
+
+    unsigned char *obase = (unsigned char *)o->data;
+    unsigned char *nbase = (unsigned char *)c->data;
+
+    tmp->chunks = c;
+    tmp->attrs = (CK_ATTRIBUTE_PTR)(nbase + ((unsigned char *)old->attrs - obase));
+    tmp->attrs_in_arena = true;
+    tmp->max = old->max;
+    tmp->count = old->count;
+
+    CK_ULONG i;
+    for (i=0; i < tmp->count; i++) {
+        CK_ATTRIBUTE_PTR a = &tmp->attrs[i];
+        if (a->pValue) {
+            a->pValue = nbase + ((unsigned char *)a->pValue - obase);
+        }
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV dup_compact(attr_list *old, attr_list *tmp) {
+
+    size_t bytes = 0;
+    CK_ULONG i;
+    for (i=0; i < old->count; i++) {
+        safe_adde(bytes, old->attrs[i].ulValueLen);
+    }
+
+    if (!attr_list_reserve(tmp, old->max, bytes)) {
         return CKR_HOST_MEMORY;
     }
-    tmp->max = old->max;
 
-    /* deep copy the attrs */
-    size_t i;
     for (i=0; i < old->count; i++) {
         CK_ATTRIBUTE_PTR o = &old->attrs[i];
         CK_ATTRIBUTE_PTR n = &tmp->attrs[i];
 
         n->type = o->type;
         if (o->pValue && o->ulValueLen) {
-            rv = type_mem_dup(o->pValue, o->ulValueLen, &n->pValue);
-            if (rv != CKR_OK) {
-                goto error;
+            n->pValue = value_alloc(tmp, o->ulValueLen,
+                    type_from_ptr(o->pValue, o->ulValueLen));
+            if (!n->pValue) {
+                return CKR_HOST_MEMORY;
             }
+            memcpy(n->pValue, o->pValue, o->ulValueLen);
             n->ulValueLen = o->ulValueLen;
         }
 
         tmp->count++;
     }
 
+    return CKR_OK;
+}
+
+CK_RV attr_list_dup(attr_list *old, attr_list **new) {
+    assert(old);
+    assert(new);
+
+    /* create the container */
+    attr_list *tmp = calloc(1, sizeof(attr_list));
+    if (!tmp) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    /*
+     * A list that lives in a single chunk, like the ones loaded from the
+     * store, is copied in one go. Anything else is compacted into one.
+     */
+    CK_RV rv = old->attrs_in_arena && old->chunks && !old->chunks->next ?
+            dup_arena(old, tmp) : dup_compact(old, tmp);
+    if (rv != CKR_OK) {
+        attr_list_free(tmp);
+        return rv;
+    }
+
+    index_build(tmp);
+
     *new = tmp;
 
     return CKR_OK;
-
-error:
-    attr_list_free(tmp);
-    return rv;
 }
 
 CK_ATTRIBUTE_PTR attr_get_attribute_by_type_raw(CK_ATTRIBUTE_PTR haystack, CK_ULONG haystack_count,
@@ -384,7 +660,20 @@ CK_ATTRIBUTE_PTR attr_get_attribute_by_type(attr_list *haystack, CK_ATTRIBUTE_TY
 
     assert(haystack);
 
-    return attr_get_attribute_by_type_raw(haystack->attrs, haystack->count, needle);
+    if (!haystack->index) {
+        return attr_get_attribute_by_type_raw(haystack->attrs, haystack->count, needle);
+    }
+
+    size_t i = index_slot(needle, haystack->index_len);
+    while (haystack->index[i]) {
+        CK_ATTRIBUTE_PTR a = &haystack->attrs[haystack->index[i] - 1];
+        if (a->type == needle) {
+            return a;
+        }
+        i = (i + 1) & (haystack->index_len - 1);
+    }
+
+    return NULL;
 }
 
 attr_list *attr_list_append_attrs(
@@ -412,29 +701,8 @@ attr_list *attr_list_append_attrs(
         return old_attrs;
     }
 
-    // need to fit 500 have space for 16
-    if (total_len > old_attrs->max) {
-
-        size_t blocks = total_len / ALLOC_LEN;
-        safe_adde(blocks, total_len % ALLOC_LEN ? 1 : 0);
-
-        CK_ULONG alloc_items = 0;
-        safe_mul(alloc_items, blocks, ALLOC_LEN);
-
-        size_t bytes = 0;
-        safe_mul(bytes, alloc_items, sizeof(CK_ATTRIBUTE));
-        void *tmp = realloc(old_attrs->attrs, bytes);
-        if (!tmp) {
-            return NULL;
-        }
-        old_attrs->attrs = tmp;
-        CK_ATTRIBUTE_PTR clear_point = &old_attrs->attrs[old_attrs->max];
-
-        /* clear the delta */
-        size_t delta = alloc_items - old_attrs->max;
-        safe_mul(bytes, delta, sizeof(CK_ATTRIBUTE));
-        memset(clear_point, 0, bytes);
-        old_attrs->max = alloc_items;
+    if (!attrs_reserve(old_attrs, total_len)) {
+        return NULL;
     }
 
     CK_ATTRIBUTE_PTR cpy_point = &old_attrs->attrs[old_len];
@@ -446,7 +714,20 @@ attr_list *attr_list_append_attrs(
 
     old_attrs->count = total_len;
 
-    free((*new_attrs)->attrs);
+    /* the values move over with their chunks */
+    attr_chunk **tail = &(*new_attrs)->chunks;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = old_attrs->chunks;
+    old_attrs->chunks = (*new_attrs)->chunks;
+
+    index_build(old_attrs);
+
+    if (!(*new_attrs)->attrs_in_arena) {
+        free((*new_attrs)->attrs);
+    }
+    free((*new_attrs)->index);
     free(*new_attrs);
     *new_attrs = NULL;
 
@@ -1284,12 +1565,13 @@ CK_RV attr_list_update_entry(attr_list *attrs, CK_ATTRIBUTE_PTR untrusted_attr)
     CK_ULONG ulValueLen = untrusted_attr->ulValueLen;
 
     if (ulValueLen != found->ulValueLen) {
-        void *new_pValue = type_zrealloc(found->pValue, ulValueLen, handler->memtype);
+        void *new_pValue = value_alloc(attrs, ulValueLen, handler->memtype);
         if (!new_pValue) {
-            LOGE("oom");
             return CKR_HOST_MEMORY;
         }
-        /* update the found node with the new resized memory */
+        /* the old value stays in the arena until the list is freed */
+        attr_pfree_cleanse(found);
+        /* update the found node with the new memory */
         found->ulValueLen = ulValueLen;
         found->pValue = new_pValue;
     }
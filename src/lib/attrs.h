@@ -46,6 +46,21 @@ struct attr_handler {
  */
 attr_list *attr_list_new(void);
 
+/**
+ * Sizes a new attribute list so the attributes about to be added, and their
+ * values, go into a single allocation. Lists that are not empty are left
+ * alone, adding past the reserve still works.
+ * @param l
+ *  The list to size.
+ * @param count
+ *  The number of attributes.
+ * @param bytes
+ *  The total length of their values.
+ * @return
+ *  true on success, false on oom.
+ */
+bool attr_list_reserve(attr_list *l, CK_ULONG count, size_t bytes);
+
 /**
  * Duplicates an attribute list.
  * @param old
@@ -148,7 +163,8 @@ CK_ATTRIBUTE_PTR attr_list_get_ptr(attr_list *l);
 void attr_list_free(attr_list *attrs);
 
 /**
- * Scrubs the memory pointed to by the pValue pointer and frees it.
+ * Scrubs the memory pointed to by the pValue pointer and drops it, the
+ * memory itself is owned by the list and released by attr_list_free().
  * The attribute pointer is expected to be contained within in attr_list.
  * The attribute is NOT REMOVED from the list and type remains unchanged.
  * Sets ulValueLen to 0.
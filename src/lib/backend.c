@@ -95,6 +95,13 @@ CK_RV backend_destroy(void) {
     return rv;
 }
 
+CK_RV backend_fork_child(void) {
+    LOGV("Re-initializing backends after fork");
+
+    /* fapi keeps no connection across calls, nothing to do */
+    return esysdb_init ? backend_esysdb_fork_child() : CKR_OK;
+}
+
 CK_RV backend_ctx_new(token *t) {
     enum backend backend = get_backend();
 
@@ -111,6 +118,8 @@ void backend_ctx_free(token *t) {
     } else {
         backend_fapi_ctx_free(t);
     }
+    tpm_ctx_pool_free(t->tctx_pool);
+    t->tctx_pool = NULL;
     tpm_ctx_free(t->tctx);
 }
 
@@ -119,6 +128,16 @@ void backend_ctx_reset(token *t) {
     /* fapi doesn't appear to need anything */
 }
 
+CK_RV backend_ctx_fork_child(token *t) {
+    if (t->type == token_type_esysdb) {
+        return backend_esysdb_ctx_fork_child(t);
+    }
+
+    /* the fapi context owns its TPM connection, it can't be swapped out */
+    LOGE("Cannot carry FAPI token %u across fork, call C_Initialize", t->id);
+    return CKR_GENERAL_ERROR;
+}
+
 /** Create a new token
  *
  * Create a new sealed object and store it in the data store.
@@ -154,8 +173,9 @@ CK_RV backend_create_token_seal(token *t, const twist hexwrappingkey,
 
 /** Retrieve all tokens available.
  *
- * The returned list is a set of all stored tokens with all
- * objects inside the token structure.
+ * The returned list is a set of all stored tokens. Store tokens only
+ * have what was read from the token table, the rest is brought up by
+ * backend_load_token() on first use. FAPI tokens are loaded right away.
  * @param[out] tok The list of tokens.
  * @param[out] len The number of entries in tok.
  * @returns TODO
@@ -223,7 +243,7 @@ CK_RV backend_get_tokens(token **tok, size_t *len) {
     }
 
     *len += 1;
-    rv = token_min_init(t);
+    rv = token_slot_init(t);
     if (rv != CKR_OK) {
         token_free_list(&tmp, len);
         return rv;
@@ -236,6 +256,36 @@ CK_RV backend_get_tokens(token **tok, size_t *len) {
     return rv;
 }
 
+CK_RV backend_get_new_tokens(const unsigned *known, size_t known_len,
+        token *tok, size_t max, size_t *len) {
+
+    *len = 0;
+
+    if (!esysdb_init) {
+        return CKR_OK;
+    }
+
+    return backend_esysdb_get_new_tokens(known, known_len, tok, max, len);
+}
+
+CK_RV backend_get_store_version(int *version) {
+
+    if (!esysdb_init) {
+        *version = 0;
+        return CKR_OK;
+    }
+
+    return backend_esysdb_get_store_version(version);
+}
+
+int backend_watch_store(void) {
+    return esysdb_init ? backend_esysdb_watch_store() : -1;
+}
+
+void backend_watch_drain(int fd) {
+    backend_esysdb_watch_drain(fd);
+}
+
 /** Initialize the user PIN data for a given token.
  *
  * @param[in,out] t The token to initialize user pin for.
@@ -371,6 +421,64 @@ CK_RV backend_token_unseal_wrapping_key(token *tok, bool user, twist tpin) {
     }
 }
 
+bool backend_tobjects_changed(token *t) {
+
+    switch (t->type) {
+    case token_type_esysdb:
+        return backend_esysdb_tobjects_changed(t);
+    case token_type_fapi:
+        /* fapi keeps no change log, its objects are loaded once */
+        return false;
+    default:
+        assert(1);
+        return false;
+    }
+}
+
+CK_RV backend_load_token(token *t) {
+
+    switch (t->type) {
+    case token_type_esysdb:
+        return backend_esysdb_load_token(t);
+    case token_type_fapi:
+        /* fapi tokens are loaded by backend_get_tokens() */
+        return CKR_OK;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
+bool backend_is_write_protected(token *t) {
+
+    switch (t->type) {
+    case token_type_esysdb:
+        return backend_esysdb_is_write_protected(t);
+    case token_type_fapi:
+        return false;
+    default:
+        assert(1);
+        return false;
+    }
+}
+
+CK_RV backend_wait_for_writes(void) {
+    return esysdb_init ? backend_esysdb_wait_for_writes() : CKR_OK;
+}
+
+CK_RV backend_refresh_tobjects(token *t) {
+
+    switch (t->type) {
+    case token_type_esysdb:
+        return backend_esysdb_refresh_tobjects(t);
+    case token_type_fapi:
+        return CKR_OK;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
 /** Change the authValue of a token's seal blob.
  *
  * @param[in,out] tok The token to remove from.
@@ -11,14 +11,77 @@
 CK_RV backend_init(void);
 CK_RV backend_destroy(void);
 
+/**
+ * Re-establishes the backend store connections in the child of a fork().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV backend_fork_child(void);
+
 CK_RV backend_ctx_new(token *t);
 void backend_ctx_free(token *t);
 void backend_ctx_reset(token *t);
+
+/**
+ * Replaces the TPM contexts of a token in the child of a fork() and
+ * reloads its primary object in them. The parent's contexts are left
+ * alone, they share the parent's TPM connection.
+ * @param t
+ *  The token.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV backend_ctx_fork_child(token *t);
 CK_RV backend_create_token_seal(token *t, const twist hexwrappingkey,
                         const twist newauth, const twist newsalthex);
 
 CK_RV backend_get_tokens(token **tok, size_t *len);
 
+/**
+ * Loads tokens added to the store by other processes since startup.
+ * Only the esysdb store can change under us, with FAPI this returns
+ * no tokens.
+ * @param known
+ *  The ids of the tokens already loaded.
+ * @param known_len
+ *  The number of known ids.
+ * @param tok
+ *  Storage for the new tokens.
+ * @param max
+ *  The number of tokens tok can hold.
+ * @param len
+ *  The number of new tokens loaded.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV backend_get_new_tokens(const unsigned *known, size_t known_len,
+        token *tok, size_t max, size_t *len);
+
+/**
+ * Gets a version number of the store that changes when another process
+ * modifies it.
+ * @param version
+ *  The version.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV backend_get_store_version(int *version);
+
+/**
+ * Creates a non-blocking file descriptor that becomes readable when the
+ * store may have changed.
+ * @return
+ *  The file descriptor or -1 if the store cannot be watched.
+ */
+int backend_watch_store(void);
+
+/**
+ * Clears the readable state of a backend_watch_store() descriptor.
+ * @param fd
+ *  The file descriptor.
+ */
+void backend_watch_drain(int fd);
+
 CK_RV backend_init_user(token *t, const twist sealdata,
                         const twist newauthhex, const twist newsalthex);
 
@@ -30,6 +93,53 @@ CK_RV backend_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs);
 
 CK_RV backend_rm_tobject(token *tok, tobject *tobj);
 
+/**
+ * Checks if the store was written to by someone else since the token's
+ * objects were last loaded or refreshed.
+ * @param t
+ *  The token to check.
+ * @return
+ *  true if backend_refresh_tobjects() may have something to do.
+ */
+bool backend_tobjects_changed(token *t);
+
+/**
+ * Loads the primary object, seal objects and objects of a token read by
+ * backend_get_tokens(), see token_load().
+ * @param t
+ *  The token to load, with its TPM context up.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV backend_load_token(token *t);
+
+/**
+ * Checks if the token's objects and PINs can be changed.
+ * @param t
+ *  The token to check.
+ * @return
+ *  true if the backing store is read only.
+ */
+bool backend_is_write_protected(token *t);
+
+/**
+ * Merges the object changes made to the store by other processes into the
+ * token, call with the token locked exclusive.
+ * @param t
+ *  The token to refresh.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV backend_refresh_tobjects(token *t);
+
+/**
+ * Waits for the store writes of the calling thread to be committed. Call
+ * with no token locked.
+ * @return
+ *  CKR_OK if they were committed or none were pending.
+ */
+CK_RV backend_wait_for_writes(void);
+
 CK_RV backend_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
 CK_RV backend_token_changeauth(token *tok, bool user, twist toldpin, twist tnewpin);
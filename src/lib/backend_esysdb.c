@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include "config.h"
+#include <string.h>
+
 #include "backend_esysdb.h"
 #include "db.h"
 #include "ssl_util.h"
@@ -20,8 +22,18 @@ CK_RV backend_esysdb_destroy(void) {
     return CKR_OK;
 }
 
+CK_RV backend_esysdb_fork_child(void) {
+    return db_fork_child();
+}
+
 CK_RV backend_esysdb_ctx_new(token *t) {
-    return tpm_ctx_new(t->config.tcti, &t->tctx);
+    CK_RV rv = tpm_ctx_new(t->config.tcti, &t->tctx);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return tpm_ctx_pool_new(t->config.tcti, t->config.tpm_ctx_pool_size,
+            &t->tctx_pool);
 }
 
 static void sealobject_free(sealobject *sealobj) {
@@ -47,6 +59,38 @@ void backend_esysdb_ctx_free(token *t) {
     sealobject_free(&t->esysdb.sealobject);
 }
 
+CK_RV backend_esysdb_ctx_fork_child(token *t) {
+
+    /*
+     * The old context talks over the parent's TPM connection, freeing it
+     * would flush sessions and objects from under the parent, so drop it.
+     */
+    t->tctx = NULL;
+    t->tctx_pool = NULL;
+    memset(t->tctx_pool_primary, 0, sizeof(t->tctx_pool_primary));
+
+    CK_RV rv = backend_esysdb_ctx_new(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* no primary object yet, it is created on first use */
+    if (!t->pid) {
+        return CKR_OK;
+    }
+
+    /* ESYS_TR handles are only valid in the context that made them */
+    pobject *pobj = &t->pobject;
+    if (pobj->config.is_transient) {
+        return tpm_create_transient_primary_from_template(t->tctx,
+                pobj->config.template_name, pobj->objauth, &pobj->handle);
+    }
+
+    bool res = tpm_deserialize_handle(t->tctx, pobj->config.blob,
+            &pobj->handle);
+    return res ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
 static CK_RV get_or_create_primary(token *t) {
 
     /* if there is no primary object ... */
@@ -160,6 +204,23 @@ CK_RV backend_esysdb_get_tokens(token *tok, size_t *len) {
     return db_get_tokens(tok, len);
 }
 
+CK_RV backend_esysdb_get_new_tokens(const unsigned *known, size_t known_len,
+        token *tok, size_t max, size_t *len) {
+    return db_get_new_tokens(known, known_len, tok, max, len);
+}
+
+CK_RV backend_esysdb_get_store_version(int *version) {
+    return db_get_data_version(version);
+}
+
+int backend_esysdb_watch_store(void) {
+    return db_watch_new();
+}
+
+void backend_esysdb_watch_drain(int fd) {
+    db_watch_drain(fd);
+}
+
 static void change_token_mem_data(token *tok, bool is_so,
         twist newsalthex, twist newprivblob, twist newpubblob) {
 
@@ -268,6 +329,50 @@ CK_RV backend_esysdb_rm_tobject(tobject *tobj) {
     return db_delete_object(tobj);
 }
 
+bool backend_esysdb_tobjects_changed(token *t) {
+
+    if (db_is_immutable()) {
+        return false;
+    }
+
+    /* a failed group commit undid writes already applied to the objects */
+    if (db_get_failed_commits() != t->esysdb.failed_commits) {
+        return true;
+    }
+
+    int version = 0;
+    CK_RV rv = db_get_data_version(&version);
+
+    /* on error let the refresh find out what's wrong */
+    return rv != CKR_OK || version != t->esysdb.store_version;
+}
+
+CK_RV backend_esysdb_load_token(token *t) {
+
+    /* the empty slot has nothing in the store yet */
+    if (!t->pid) {
+        return CKR_OK;
+    }
+
+    return db_load_token(t);
+}
+
+bool backend_esysdb_is_write_protected(token *t) {
+    UNUSED(t);
+
+    return db_is_immutable();
+}
+
+CK_RV backend_esysdb_refresh_tobjects(token *t) {
+
+    return db_refresh_tobjects(t);
+}
+
+CK_RV backend_esysdb_wait_for_writes(void) {
+
+    return db_wait_for_writes();
+}
+
 /** Unseal a token's wrapping key.
  *
  * see backend_token_unseal_wrapping_key()
@@ -326,12 +431,15 @@ CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin
     if (tok->wrappingkey) {
         twist_free(wrappingkeyhex);
     } else {
-        tok->wrappingkey = twistbin_unhexlify(wrappingkeyhex);
+        twist wrappingkey = twistbin_unhexlify(wrappingkeyhex);
         twist_free(wrappingkeyhex);
-        if (!tok->wrappingkey) {
+        if (!wrappingkey) {
             LOGE("Expected internal wrapping key in base 16 format");
             goto error;
         }
+
+        /* published for token_lease_tpm(), which reads it unlocked */
+        __atomic_store_n(&tok->wrappingkey, wrappingkey, __ATOMIC_RELEASE);
     }
 
     return CKR_OK;
@@ -8,16 +8,27 @@
 
 CK_RV backend_esysdb_init(void);
 CK_RV backend_esysdb_destroy(void);
+CK_RV backend_esysdb_fork_child(void);
 
 CK_RV backend_esysdb_ctx_new(token *t);
 void backend_esysdb_ctx_free(token *t);
 void backend_esysdb_ctx_reset(token *t);
+CK_RV backend_esysdb_ctx_fork_child(token *t);
 
 CK_RV backend_esysdb_create_token_seal(token *t, const twist hexwrappingkey,
                        const twist newauth, const twist newsalthex);
 
 CK_RV backend_esysdb_get_tokens(token *tok, size_t *len);
 
+CK_RV backend_esysdb_get_new_tokens(const unsigned *known, size_t known_len,
+        token *tok, size_t max, size_t *len);
+
+CK_RV backend_esysdb_get_store_version(int *version);
+
+int backend_esysdb_watch_store(void);
+
+void backend_esysdb_watch_drain(int fd);
+
 CK_RV backend_esysdb_init_user(token *t, const twist sealdata,
                         const twist newauthhex, const twist newsalthex);
 
@@ -29,6 +40,16 @@ CK_RV backend_esysdb_update_tobject_attrs(tobject *tobj, attr_list *attrs);
 
 CK_RV backend_esysdb_rm_tobject(tobject *tobj);
 
+bool backend_esysdb_tobjects_changed(token *t);
+
+bool backend_esysdb_is_write_protected(token *t);
+
+CK_RV backend_esysdb_load_token(token *t);
+
+CK_RV backend_esysdb_refresh_tobjects(token *t);
+
+CK_RV backend_esysdb_wait_for_writes(void);
+
 CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
 CK_RV backend_esysdb_token_changeauth(token *tok, bool user, twist toldpin, twist tnewpin);
@@ -3,10 +3,13 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <libgen.h>
@@ -15,11 +18,13 @@
 #include <linux/limits.h>
 
 #include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <sqlite3.h>
 
+#include "attr_tlv.h"
 #include "db.h"
 #include "debug.h"
 #include "emitter.h"
@@ -35,12 +40,13 @@
 #include "typed_memory.h"
 
 #include <openssl/evp.h>
+#include <openssl/rand.h>
 
 #ifndef TPM2_PKCS11_STORE_DIR
 #define TPM2_PKCS11_STORE_DIR "/etc/tpm2_pkcs11"
 #endif
 
-#define DB_VERSION 8
+#define DB_VERSION 11
 
 #define goto_oom(x, l) if (!x) { LOGE("oom"); goto l; }
 #define goto_error(x, l) if (x) { goto l; }
@@ -49,6 +55,8 @@
 #define TRANSACTION_START \
     do { \
         bool _transaction_active = false; \
+        db_lock(); \
+        queue_flush(); \
         if (start() != SQLITE_OK) { \
             goto error; \
         } \
@@ -67,14 +75,155 @@
                 rollback(); \
             } \
         } \
+        db_unlock(); \
     } while (0);
 
 #define CKR_VENDOR_SKIP (CKR_VENDOR_DEFINED | 0x01)
 
+/*
+ * The statements of the hot paths, see stmt_prepare().
+ */
+typedef enum stmt_id stmt_id;
+enum stmt_id {
+    STMT_INIT_TOBJECTS,
+    STMT_INIT_POBJECT,
+    STMT_INIT_SEALOBJECTS,
+    STMT_DATA_VERSION,
+    STMT_CHANGE_RANGE,
+    STMT_ADD_TOBJECT,
+    STMT_UPDATE_TOBJECT_ATTRS,
+    STMT_UPDATE_TOBJECT_COLUMNS,
+    STMT_GET_TOBJECT_ATTRS,
+    STMT_DELETE_TOBJECT,
+    STMT_UPDATE_TOKEN_CONFIG,
+    STMT_CNT
+};
+
 static struct {
     sqlite3 *db;
+    /*
+     * The connection is shared by all tokens, which lock independently, so
+     * transactions and sqlite3_last_insert_rowid() need their own lock.
+     */
+    void *mutex;
+    /* tags this connection's entries in tobject_changes, see db_track_origin() */
+    sqlite3_int64 origin;
+    /* the connection stmts were prepared on, NULL when not caching */
+    sqlite3 *stmt_db;
+    sqlite3_stmt *stmts[STMT_CNT];
+    /* opened read only, see db_open_immutable() */
+    bool is_immutable;
+    /* group commits that failed, undoing writes the tokens already applied */
+    unsigned failed_commits;
+    /*
+     * The largest object id handed out. A failed commit would make sqlite
+     * reuse the ids of the rows it rolled back, while their objects may
+     * still be in a token, so new ids are always above it.
+     */
+    sqlite3_int64 max_tobject_id;
 } global;
 
+/* for the calls that write to the store */
+static bool is_write_protected(void) {
+
+    if (global.is_immutable) {
+        LOGE("Store is immutable, cannot write to it");
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Every change to tobjects is logged so other processes can merge just the
+ * changed rows, see db_refresh_tobjects(). The log keeps the most recent
+ * CHANGE_LOG_LEN entries, a reader that fell further behind compares all
+ * of its objects instead.
+ */
+#define CHANGE_LOG_LEN "4096"
+
+static const char *tobject_changes_sql[] = {
+    "CREATE TABLE tobject_changes("
+        "seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+        "tokid INTEGER NOT NULL,"
+        "id INTEGER NOT NULL,"
+        "origin INTEGER"
+    ");",
+    "CREATE TRIGGER log_tobject_insert\n"
+    "AFTER INSERT ON tobjects\n"
+    "BEGIN\n"
+    "    INSERT INTO tobject_changes (tokid, id) VALUES (new.tokid, new.id);\n"
+    "END;\n",
+    "CREATE TRIGGER log_tobject_update\n"
+    "AFTER UPDATE ON tobjects\n"
+    "BEGIN\n"
+    "    INSERT INTO tobject_changes (tokid, id) VALUES (new.tokid, new.id);\n"
+    "END;\n",
+    "CREATE TRIGGER log_tobject_delete\n"
+    "AFTER DELETE ON tobjects\n"
+    "BEGIN\n"
+    "    INSERT INTO tobject_changes (tokid, id) VALUES (old.tokid, old.id);\n"
+    "END;\n",
+    "CREATE TRIGGER prune_tobject_changes\n"
+    "AFTER INSERT ON tobject_changes\n"
+    "BEGIN\n"
+    "    DELETE FROM tobject_changes WHERE seq <= new.seq - "CHANGE_LOG_LEN";\n"
+    "END;\n",
+};
+
+/*
+ * The attributes objects are searched by are kept in columns next to the
+ * encoded ones. Tokens load from the covering tobjects_summary index and
+ * leave the attrs column, which can be big, until an object is used, see
+ * db_get_tobject_attrs(). Must cover the summary types in object.c.
+ */
+typedef struct tobject_column tobject_column;
+struct tobject_column {
+    const char *name;
+    CK_ATTRIBUTE_TYPE type;
+    CK_BYTE memtype;
+};
+
+static const tobject_column tobject_columns[] = {
+    { "class",    CKA_CLASS,         TYPE_BYTE_INT     },
+    { "private",  CKA_PRIVATE,       TYPE_BYTE_BOOL    },
+    { "key_type", CKA_KEY_TYPE,      TYPE_BYTE_INT     },
+    { "ckaid",    CKA_ID,            TYPE_BYTE_HEX_STR },
+    { "label",    CKA_LABEL,         TYPE_BYTE_HEX_STR },
+    { "issuer",   CKA_ISSUER,        TYPE_BYTE_HEX_STR },
+    { "serial",   CKA_SERIAL_NUMBER, TYPE_BYTE_HEX_STR },
+    { "subject",  CKA_SUBJECT,       TYPE_BYTE_HEX_STR },
+};
+
+/* the columns in tobject_columns order */
+#define TOBJECT_COLUMNS \
+    "class, private, key_type, ckaid, label, issuer, serial, subject"
+
+static const char *tobject_columns_sql[] = {
+    "ALTER TABLE tobjects ADD COLUMN class INTEGER;",
+    "ALTER TABLE tobjects ADD COLUMN private INTEGER;",
+    "ALTER TABLE tobjects ADD COLUMN key_type INTEGER;",
+    "ALTER TABLE tobjects ADD COLUMN ckaid BLOB;",
+    "ALTER TABLE tobjects ADD COLUMN label BLOB;",
+    "ALTER TABLE tobjects ADD COLUMN issuer BLOB;",
+    "ALTER TABLE tobjects ADD COLUMN serial BLOB;",
+    "ALTER TABLE tobjects ADD COLUMN subject BLOB;",
+    "CREATE INDEX tobjects_summary ON tobjects (tokid, "TOBJECT_COLUMNS");",
+};
+
+static inline void db_lock(void) {
+    /* NULL when db_init() was never called, ie unit tests */
+    if (global.mutex) {
+        mutex_lock_fatal(global.mutex);
+    }
+}
+
+static inline void db_unlock(void) {
+    if (global.mutex) {
+        mutex_unlock_fatal(global.mutex);
+    }
+}
+
 static inline void _sqlite3_finalize_warn(sqlite3 *db, sqlite3_stmt *stmt) {
 
     int rc = sqlite3_finalize(stmt);
@@ -89,6 +238,74 @@ static inline void sqlite3_finalize_warn(sqlite3_stmt *stmt) {
     }
 }
 
+/*
+ * Prepares the statement for sql, or hands out the one kept from a previous
+ * call on the same connection. A kept statement is taken out of the cache
+ * while in use, so concurrent or nested users of the same sql just prepare
+ * their own. Return it with stmt_release().
+ */
+static int stmt_prepare(sqlite3 *db, stmt_id id, const char *sql,
+        sqlite3_stmt **stmt) {
+
+    if (db && db == global.stmt_db) {
+        *stmt = __atomic_exchange_n(&global.stmts[id], NULL, __ATOMIC_ACQUIRE);
+        if (*stmt) {
+            return SQLITE_OK;
+        }
+    }
+
+    return sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
+}
+
+/*
+ * Resets a statement from stmt_prepare() and keeps it for the next call,
+ * it's finalized when the slot is taken or the connection isn't cached.
+ */
+static void stmt_release(sqlite3 *db, stmt_id id, sqlite3_stmt *stmt) {
+
+    if (!stmt) {
+        return;
+    }
+
+    if (db && db == global.stmt_db) {
+        /* the error of the last step, already handled by the caller */
+        UNUSED(sqlite3_reset(stmt));
+        /* bindings may point to memory about to be freed */
+        sqlite3_clear_bindings(stmt);
+
+        sqlite3_stmt *expected = NULL;
+        if (__atomic_compare_exchange_n(&global.stmts[id], &expected, stmt,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    _sqlite3_finalize_warn(db, stmt);
+}
+
+/*
+ * Starts keeping statements for global.db. Not done for connections used
+ * without db_init(), ie unit tests, so they see every prepare and finalize.
+ */
+static void stmt_cache_init(void) {
+
+    memset(global.stmts, 0, sizeof(global.stmts));
+    global.stmt_db = global.db;
+}
+
+static void stmt_cache_free(void) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(global.stmts); i++) {
+        if (global.stmts[i]) {
+            _sqlite3_finalize_warn(global.stmt_db, global.stmts[i]);
+            global.stmts[i] = NULL;
+        }
+    }
+
+    global.stmt_db = NULL;
+}
+
 static int _get_blob(sqlite3_stmt *stmt, int i, bool can_be_null, twist *blob) {
 
 	/* This cannot return < 0 */
@@ -128,6 +345,103 @@ struct token_get_cb_ud {
     token *tokens;
 };
 
+static const tobject_column *find_tobject_column(const char *name) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(tobject_columns); i++) {
+        if (!strcmp(tobject_columns[i].name, name)) {
+            return &tobject_columns[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool column_to_attr(sqlite3_stmt *stmt, int i, const tobject_column *col,
+        attr_list *attrs) {
+
+    /* the object doesn't have it */
+    if (sqlite3_column_type(stmt, i) == SQLITE_NULL) {
+        return true;
+    }
+
+    switch (col->memtype) {
+    case TYPE_BYTE_INT:
+        return attr_list_add_int(attrs, col->type,
+                (CK_ULONG)sqlite3_column_int64(stmt, i));
+    case TYPE_BYTE_BOOL:
+        return attr_list_add_bool(attrs, col->type,
+                sqlite3_column_int64(stmt, i) ? CK_TRUE : CK_FALSE);
+    default: {
+        const void *blob = sqlite3_column_blob(stmt, i);
+        int bytes = sqlite3_column_bytes(stmt, i);
+        return attr_list_add_buf(attrs, col->type, (CK_BYTE_PTR)blob, bytes);
+    }
+    }
+}
+
+static CK_RV update_tobject_columns(sqlite3 *db, unsigned id, attr_list *attrs) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    const char *sql =
+          "UPDATE tobjects SET"
+            " class=?, private=?, key_type=?, ckaid=?,"
+            " label=?, issuer=?, serial=?, subject=?"
+            " WHERE id=?;";
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = stmt_prepare(db, STMT_UPDATE_TOBJECT_COLUMNS, sql, &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    int i;
+    for (i = 0; i < (int)ARRAY_LEN(tobject_columns); i++) {
+        const tobject_column *col = &tobject_columns[i];
+
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, col->type);
+        if (!a) {
+            rc = sqlite3_bind_null(stmt, i + 1);
+        } else if (type_from_ptr(a->pValue, a->ulValueLen) != col->memtype) {
+            LOGE("Unexpected memory type for attribute: 0x%lx", a->type);
+            goto error;
+        } else if (col->memtype == TYPE_BYTE_INT) {
+            rc = sqlite3_bind_int64(stmt, i + 1,
+                    (sqlite3_int64)*(CK_ULONG_PTR)a->pValue);
+        } else if (col->memtype == TYPE_BYTE_BOOL) {
+            rc = sqlite3_bind_int(stmt, i + 1, !!*(CK_BBOOL *)a->pValue);
+        } else if (a->ulValueLen) {
+            rc = sqlite3_bind_blob(stmt, i + 1, a->pValue, a->ulValueLen,
+                    SQLITE_STATIC);
+        } else {
+            /* empty is not the same as absent */
+            rc = sqlite3_bind_zeroblob(stmt, i + 1, 0);
+        }
+
+        if (rc != SQLITE_OK) {
+            LOGE("cannot bind %s", col->name);
+            goto error;
+        }
+    }
+
+    rc = sqlite3_bind_int(stmt, i + 1, id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("Could not execute stmt: %s", sqlite3_errmsg(db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+error:
+    stmt_release(db, STMT_UPDATE_TOBJECT_COLUMNS, stmt);
+    return rv;
+}
+
 DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
 
     tobject *tobj = tobject_new();
@@ -136,48 +450,71 @@ DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
         return NULL;
     }
 
+    /* the attributes or just the summary columns, see tobject_columns */
+    bool has_attrs = false;
+    attr_list *summary = NULL;
+
     int i;
     int col_count = sqlite3_data_count(stmt);
     for (i=0; i < col_count; i++) {
         const char *name = sqlite3_column_name(stmt, i);
+        const tobject_column *col = find_tobject_column(name);
 
-        if (!strcmp(name, "id")) {
+        if (col) {
+            if (!summary) {
+                summary = attr_list_new();
+                goto_oom(summary, error);
+            }
+
+            if (!column_to_attr(stmt, i, col, summary)) {
+                goto error;
+            }
+        } else if (!strcmp(name, "id")) {
             tobj->id = sqlite3_column_int(stmt, i);
 
         } else if (!strcmp(name, "tokid")) {
             // Ignore sid we don't need it as token has that data.
         } else if (!strcmp(name, "attrs")) {
 
+            /* binary since schema 9, YAML text before */
+            const unsigned char *attrs = sqlite3_column_blob(stmt, i);
             int bytes = sqlite3_column_bytes(stmt, i);
-            const unsigned char *attrs = sqlite3_column_text(stmt, i);
             if (!attrs || !bytes) {
                 LOGE("tobject does not have attributes");
                 goto error;
             }
 
-            bool res = parse_attributes_from_string(attrs, bytes,
-                    &tobj->attrs);
-            if (!res) {
-                LOGE("Could not parse DB attrs, got: \"%s\"", attrs);
+            /* decoding all of them waits for first use */
+            CK_RV rv = tobject_set_raw_attrs(tobj, attrs, bytes);
+            if (rv != CKR_OK) {
+                LOGE("Could not parse DB attrs");
                 goto error;
             }
+
+            has_attrs = true;
         } else {
             LOGE("Unknown row, got: %s", name);
             goto error;
         }
     }
 
-    assert(tobj->id);
-
-    CK_RV rv = object_init_from_attrs(tobj);
-    if (rv != CKR_OK) {
-        LOGE("Object initialization failed");
+    if (has_attrs) {
+        /* the summary comes from the attributes */
+        attr_list_free(summary);
+    } else if (summary) {
+        /* the attributes are read on first use, see tobject_decode_attrs() */
+        tobj->summary = summary;
+    } else {
+        LOGE("tobject does not have attributes");
         goto error;
     }
 
+    assert(tobj->id);
+
     return tobj;
 
 error:
+    attr_list_free(summary);
     tobject_free(tobj);
     return NULL;
 }
@@ -186,13 +523,33 @@ WEAK DEBUG_VISIBILITY tobject *db_tobject_new(sqlite3_stmt *stmt) {
     return __real_db_tobject_new(stmt);
 }
 
+static tobject *db_tobject_new_decoded(sqlite3_stmt *stmt) {
+
+    tobject *tobj = db_tobject_new(stmt);
+    if (!tobj) {
+        return NULL;
+    }
+
+    CK_RV rv = tobject_decode_attrs(tobj);
+    if (rv != CKR_OK) {
+        tobject_free(tobj);
+        return NULL;
+    }
+
+    return tobj;
+}
+
 DEBUG_VISIBILITY int __real_init_tobjects(token *tok) {
 
+    /*
+     * Just the index, the attributes are read on first use. Rows come out of
+     * it sorted by the columns, the token keeps them in the order added.
+     */
     const char *sql =
-            "SELECT * FROM tobjects WHERE tokid=?";
+            "SELECT id, "TOBJECT_COLUMNS" FROM tobjects WHERE tokid=? ORDER BY id";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(global.db, STMT_INIT_TOBJECTS, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("Cannot prepare tobject query: %s\n", sqlite3_errmsg(global.db));
         return rc;
@@ -222,7 +579,7 @@ DEBUG_VISIBILITY int __real_init_tobjects(token *tok) {
     rc = SQLITE_OK;
 
 error:
-    sqlite3_finalize(stmt);
+    stmt_release(global.db, STMT_INIT_TOBJECTS, stmt);
     return rc;
 }
 
@@ -230,6 +587,81 @@ WEAK DEBUG_VISIBILITY int init_tobjects(token *tok) {
     return __real_init_tobjects(tok);
 }
 
+static CK_RV get_data_version(int *version) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    int rc = stmt_prepare(global.db, STMT_DATA_VERSION, "PRAGMA data_version", &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare data_version query: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("Cannot step data_version query: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    *version = sqlite3_column_int(stmt, 0);
+
+    rv = CKR_OK;
+
+out:
+    stmt_release(global.db, STMT_DATA_VERSION, stmt);
+
+    return rv;
+}
+
+static int get_change_range(int64_t *max, int64_t *min) {
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = stmt_prepare(global.db, STMT_CHANGE_RANGE,
+            "SELECT ifnull(max(seq), 0), ifnull(min(seq), 0) FROM tobject_changes",
+            &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare change log query: %s", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("Cannot step change log query: %s", sqlite3_errmsg(global.db));
+        stmt_release(global.db, STMT_CHANGE_RANGE, stmt);
+        return rc;
+    }
+
+    *max = sqlite3_column_int64(stmt, 0);
+    *min = sqlite3_column_int64(stmt, 1);
+
+    stmt_release(global.db, STMT_CHANGE_RANGE, stmt);
+
+    return SQLITE_OK;
+}
+
+DEBUG_VISIBILITY int __real_init_tobject_changes(token *tok) {
+
+    /*
+     * Taken before the objects are read, a change committed in between is
+     * merged again by the first refresh, which is harmless.
+     */
+    CK_RV rv = get_data_version(&tok->esysdb.store_version);
+    if (rv != CKR_OK) {
+        return SQLITE_ERROR;
+    }
+
+    tok->esysdb.failed_commits = global.failed_commits;
+
+    int64_t min = 0;
+    return get_change_range(&tok->esysdb.change_seq, &min);
+}
+
+WEAK DEBUG_VISIBILITY int init_tobject_changes(token *tok) {
+    return __real_init_tobject_changes(tok);
+}
+
 static void pobject_v3_free(pobject_v3 *old_pobj) {
 
     twist_free(old_pobj->handle);
@@ -311,16 +743,26 @@ DEBUG_VISIBILITY CK_RV convert_pobject_v3_to_v4(pobject_v3 *old_pobj, pobject_v4
     return CKR_OK;
 }
 
-static int start2(sqlite3 *db) {
-    int rc = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+static int start2(sqlite3 *db, const char *sql) {
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(db));
     }
     return rc;
 }
 
+/*
+ * Write transactions take the write lock up front. A deferred one that read
+ * first can't wait for it, sqlite fails it with SQLITE_BUSY right away as
+ * another writer may have changed what it read.
+ */
 static int start(void) {
-    return start2(global.db);
+    return start2(global.db, "BEGIN IMMEDIATE TRANSACTION");
+}
+
+/* a consistent snapshot for reading, doesn't hold off writers */
+static int start_read(void) {
+    return start2(global.db, "BEGIN TRANSACTION");
 }
 
 static int commit2(sqlite3 *db) {
@@ -339,75 +781,514 @@ static int rollback(void) {
     return rollback2(global.db);
 }
 
-DEBUG_VISIBILITY CK_RV db_add_pobject_v4(sqlite3 *updb, pobject_v4 *new_pobj) {
+/*
+ * The write queue, enabled with TPM2_PKCS11_STORE_COMMIT_WINDOW. Object
+ * writes from all sessions go into one open transaction, each in its own
+ * savepoint, which the committer thread commits at most the window after
+ * the first of them. So a burst of writes costs one sync of the store
+ * rather than one each.
+ *
+ * Writers don't wait for the commit with db_lock() or their token held,
+ * or other writers of the token could never join the batch. They wait in
+ * db_wait_for_writes() once the PKCS#11 call dropped its locks. With
+ * TPM2_PKCS11_STORE_WRITE_BEHIND updates and deletes don't wait at all,
+ * new objects still do.
+ *
+ * A failed commit undoes writes the tokens already applied to their
+ * objects, including objects they already added, so they read them all
+ * again on their next refresh, see global.failed_commits. The ids of rows
+ * rolled back are not handed out again, see global.max_tobject_id.
+ *
+ * Anything else writing or taking a snapshot commits the open batch first,
+ * see queue_flush(). Lock order is db_lock() then queue.lock.
+ */
+#define PKCS11_STORE_COMMIT_WINDOW_ENV_VAR "TPM2_PKCS11_STORE_COMMIT_WINDOW"
+#define PKCS11_STORE_WRITE_BEHIND_ENV_VAR "TPM2_PKCS11_STORE_WRITE_BEHIND"
+
+/* bounds how long other processes are held off the store, in ms */
+#define STORE_COMMIT_WINDOW_MAX 1000
+
+typedef struct db_batch db_batch;
+struct db_batch {
+    /* the queue's plus one per writer waiting for the commit */
+    unsigned refs;
+    bool is_done;
+    CK_RV rv;
+};
 
-    CK_RV rv = CKR_GENERAL_ERROR;
+static struct {
+    /* in ms, 0 when the queue is disabled */
+    unsigned window;
+    bool is_write_behind;
 
-    sqlite3_stmt *stmt = NULL;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t committer;
+    bool is_running;
+    bool stop;
 
-    const char *sql =
-          "INSERT INTO pobjects2 ("
-            "id,"             // index: 1 type: INT
-            "hierarchy, "     // index: 2 type: TEXT
-            "config,"         // index: 3 type: TEXT
-            "objauth"         // index: 4 type: TEXT
-          ") VALUES ("
-            "?,?,?,?"
-          ");";
+    /* the open batch, set and cleared with db_lock() held too */
+    db_batch *cur;
+    struct timespec deadline;
+} queue;
 
-    int rc = sqlite3_prepare_v2(updb, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(updb));
-        goto error;
+static void batch_unref(db_batch *b) {
+
+    if (--b->refs == 0) {
+        free(b);
     }
+}
 
-    rc = sqlite3_bind_int(stmt, 1, new_pobj->id);
-    gotobinderror(rc, "id");
+/*
+ * The batch the calling thread's last writes went into and the result of
+ * an earlier one, for db_wait_for_writes().
+ */
+static __thread db_batch *queue_pending;
+static __thread CK_RV queue_pending_rv;
 
-    rc = sqlite3_bind_text(stmt, 2, new_pobj->hierarchy, -1, SQLITE_STATIC);
-    gotobinderror(rc, "hierarchy");
+/* with db_lock() held */
+static void queue_failed(void) {
 
-    rc = sqlite3_bind_text(stmt, 3, new_pobj->config, -1, SQLITE_STATIC);
-    gotobinderror(rc, "config");
+    rollback();
+    __atomic_add_fetch(&global.failed_commits, 1, __ATOMIC_RELEASE);
+}
 
-    rc = sqlite3_bind_text(stmt, 4, new_pobj->objauth, -1, SQLITE_STATIC);
-    gotobinderror(rc, "objauth");
+/* with db_lock() and queue.lock held */
+static void queue_commit_locked(void) {
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(updb));
-        goto error;
+    db_batch *b = queue.cur;
+    if (!b) {
+        return;
     }
 
-    rv = CKR_OK;
-error:
-    rc = sqlite3_finalize(stmt);
-    if (rc != SQLITE_OK) {
-        LOGW("Could not finalize stmt: %d", rc);
+    b->rv = CKR_OK;
+    if (commit() != SQLITE_OK) {
+        LOGE("Cannot commit queued writes: %s", sqlite3_errmsg(global.db));
+        queue_failed();
+        b->rv = CKR_GENERAL_ERROR;
     }
 
-    return rv;
+    b->is_done = true;
+    queue.cur = NULL;
+    batch_unref(b);
+
+    pthread_cond_broadcast(&queue.cond);
 }
 
-DEBUG_VISIBILITY int init_pobject_from_stmt(sqlite3_stmt *stmt, tpm_ctx *tpm, pobject *pobj) {
+/* with db_lock() held */
+static void queue_flush(void) {
 
-    /* Get the YAML config and:
-     *   - parse it to the config structure
-     *   - if persistent deserializes the ESYS_TR into the handle
-     *   - if transient, verify that the template_name is set
-     */
-    size_t yaml_size = sqlite3_column_bytes(stmt, 0);
-    const unsigned char *pobj_yaml_conf = sqlite3_column_text(stmt, 0);
-    bool res = parse_pobject_config_from_string(pobj_yaml_conf, yaml_size,
-            &pobj->config);
-    if (!res) {
-        LOGE("Could not parse pobject config");
-        return SQLITE_ERROR;
+    if (!queue.window) {
+        return;
     }
 
-    if (!pobj->config.is_transient) {
-        if (!pobj->config.blob) {
-            LOGE("Expected persistent pobject config to have ESYS_TR blob");
+    pthread_mutex_lock(&queue.lock);
+    queue_commit_locked();
+    pthread_mutex_unlock(&queue.lock);
+}
+
+static void *queue_committer(void *arg) {
+    UNUSED(arg);
+
+    pthread_mutex_lock(&queue.lock);
+
+    while (!queue.stop) {
+        if (!queue.cur) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+            continue;
+        }
+
+        /* woken early when the batch was flushed or on stop, look again */
+        struct timespec deadline = queue.deadline;
+        if (pthread_cond_timedwait(&queue.cond, &queue.lock, &deadline) != ETIMEDOUT) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&queue.lock);
+        db_lock();
+        pthread_mutex_lock(&queue.lock);
+
+        /* may be a newer batch by now, it's only committed once it's due */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (queue.cur && (now.tv_sec > queue.deadline.tv_sec
+                || (now.tv_sec == queue.deadline.tv_sec
+                        && now.tv_nsec >= queue.deadline.tv_nsec))) {
+            queue_commit_locked();
+        }
+
+        pthread_mutex_unlock(&queue.lock);
+        db_unlock();
+        pthread_mutex_lock(&queue.lock);
+    }
+
+    pthread_mutex_unlock(&queue.lock);
+
+    return NULL;
+}
+
+static CK_RV queue_start(void) {
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&queue.lock, NULL);
+
+    queue.stop = false;
+
+    int rc = pthread_create(&queue.committer, NULL, queue_committer, NULL);
+    if (rc) {
+        LOGE("Could not start the store committer: %s", strerror(rc));
+        return CKR_GENERAL_ERROR;
+    }
+
+    queue.is_running = true;
+
+    return CKR_OK;
+}
+
+/*
+ * Parses a time in ms from the environment. Only plain decimal digits are
+ * taken, str_to_ul() would also read "", "-1" or "10ms" as some number.
+ */
+static bool env_to_ms(const char *env, unsigned long max, unsigned *ms) {
+
+    if (env[0] < '0' || env[0] > '9') {
+        return false;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long val = strtoul(env, &end, 10);
+    if (errno || *end != '\0' || val > max) {
+        return false;
+    }
+
+    *ms = (unsigned)val;
+    return true;
+}
+
+static CK_RV queue_init(void) {
+
+    const char *env = getenv(PKCS11_STORE_COMMIT_WINDOW_ENV_VAR);
+    if (!env) {
+        return CKR_OK;
+    }
+
+    unsigned val = 0;
+    if (!env_to_ms(env, STORE_COMMIT_WINDOW_MAX, &val)) {
+        LOGE("Invalid "PKCS11_STORE_COMMIT_WINDOW_ENV_VAR", expected 0 to %u ms, got: \"%s\"",
+                STORE_COMMIT_WINDOW_MAX, env);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (!val) {
+        return CKR_OK;
+    }
+
+    queue.is_write_behind = !!getenv(PKCS11_STORE_WRITE_BEHIND_ENV_VAR);
+
+    CK_RV rv = queue_start();
+    if (rv == CKR_OK) {
+        queue.window = val;
+        LOGV("Committing store writes every %u ms%s", queue.window,
+                queue.is_write_behind ? ", writing behind" : "");
+    }
+
+    return rv;
+}
+
+/* commits what is still queued, with no other users of the store left */
+static void queue_destroy(void) {
+
+    if (!queue.is_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    queue.stop = true;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    pthread_join(queue.committer, NULL);
+    queue.is_running = false;
+
+    db_lock();
+    queue_flush();
+    db_unlock();
+
+    queue.window = 0;
+
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.lock);
+}
+
+/*
+ * The committer thread doesn't exist in a fork()ed child and the locks may
+ * have been held by threads that don't either, start over. An open batch on
+ * a connection that was replaced is the parent's to commit.
+ */
+static CK_RV queue_fork_child(bool is_new_connection) {
+
+    if (!queue.is_running) {
+        return CKR_OK;
+    }
+
+    queue.is_running = false;
+    if (is_new_connection) {
+        queue.cur = NULL;
+    } else if (queue.cur) {
+        /* nobody in the child is waiting for it */
+        queue.cur->refs = 1;
+    }
+
+    CK_RV rv = queue_start();
+    if (rv != CKR_OK) {
+        queue.window = 0;
+    }
+
+    return rv;
+}
+
+/* with db_lock() held, starts an own transaction when not queueing */
+static int queue_join(bool *is_queued) {
+
+    *is_queued = false;
+
+    if (!queue.window) {
+        return start();
+    }
+
+    pthread_mutex_lock(&queue.lock);
+
+    int rc = SQLITE_OK;
+    if (!queue.cur) {
+        db_batch *b = calloc(1, sizeof(*b));
+        if (!b) {
+            LOGE("oom");
+            rc = SQLITE_NOMEM;
+            goto out;
+        }
+
+        rc = start();
+        if (rc != SQLITE_OK) {
+            free(b);
+            goto out;
+        }
+
+        b->refs = 1;
+        queue.cur = b;
+
+        clock_gettime(CLOCK_MONOTONIC, &queue.deadline);
+        queue.deadline.tv_nsec += (long)queue.window * 1000000;
+        queue.deadline.tv_sec += queue.deadline.tv_nsec / 1000000000;
+        queue.deadline.tv_nsec %= 1000000000;
+
+        pthread_cond_broadcast(&queue.cond);
+    }
+
+    rc = sqlite3_exec(global.db, "SAVEPOINT queued_write", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    *is_queued = true;
+
+out:
+    pthread_mutex_unlock(&queue.lock);
+    return rc;
+}
+
+/*
+ * Ends a write started with queue_join() and releases db_lock(). A queued
+ * write is waited for with db_wait_for_writes(), unless writing behind and
+ * can_write_behind is set.
+ */
+static CK_RV queue_leave(bool is_queued, bool can_write_behind, CK_RV rv) {
+
+    if (!is_queued) {
+        if (rv == CKR_OK) {
+            if (commit() != SQLITE_OK) {
+                rollback();
+                rv = CKR_GENERAL_ERROR;
+            }
+        } else {
+            rollback();
+        }
+        db_unlock();
+        return rv;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+
+    /* just this write is undone, the others in the batch stay */
+    int rc = sqlite3_exec(global.db, rv == CKR_OK ?
+            "RELEASE queued_write" :
+            "ROLLBACK TO queued_write; RELEASE queued_write",
+            NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot end queued write: %s", sqlite3_errmsg(global.db));
+        queue_failed();
+        queue.cur->rv = CKR_GENERAL_ERROR;
+        queue.cur->is_done = true;
+        batch_unref(queue.cur);
+        queue.cur = NULL;
+        pthread_cond_broadcast(&queue.cond);
+        rv = CKR_GENERAL_ERROR;
+    }
+
+    db_unlock();
+
+    db_batch *b = queue.cur;
+    if (rv != CKR_OK || !b || (queue.is_write_behind && can_write_behind)) {
+        pthread_mutex_unlock(&queue.lock);
+        return rv;
+    }
+
+    if (queue_pending != b) {
+        /* a batch is only replaced once it is done */
+        if (queue_pending) {
+            assert(queue_pending->is_done);
+            if (queue_pending_rv == CKR_OK) {
+                queue_pending_rv = queue_pending->rv;
+            }
+            batch_unref(queue_pending);
+        }
+
+        b->refs++;
+        queue_pending = b;
+    }
+
+    pthread_mutex_unlock(&queue.lock);
+
+    return CKR_OK;
+}
+
+CK_RV db_wait_for_writes(void) {
+
+    CK_RV rv = queue_pending_rv;
+    db_batch *b = queue_pending;
+
+    queue_pending_rv = CKR_OK;
+    queue_pending = NULL;
+
+    if (!b) {
+        return rv;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+
+    while (!b->is_done) {
+        pthread_cond_wait(&queue.cond, &queue.lock);
+    }
+
+    if (rv == CKR_OK) {
+        rv = b->rv;
+    }
+    batch_unref(b);
+
+    pthread_mutex_unlock(&queue.lock);
+
+    return rv;
+}
+
+unsigned db_get_failed_commits(void) {
+    return __atomic_load_n(&global.failed_commits, __ATOMIC_ACQUIRE);
+}
+
+#define QUEUED_TRANSACTION_START \
+    do { \
+        bool _is_queued = false; \
+        bool _transaction_active = false; \
+        db_lock(); \
+        if (queue_join(&_is_queued) != SQLITE_OK) { \
+            goto error; \
+        } \
+        \
+        _transaction_active = true;
+
+/* can_write_behind is false for writes that must not be lost silently */
+#define QUEUED_TRANSACTION_END(rx, can_write_behind) \
+    error: \
+        if (_transaction_active) { \
+            rx = queue_leave(_is_queued, can_write_behind, rx); \
+        } else { \
+            db_unlock(); \
+        } \
+    } while (0);
+
+DEBUG_VISIBILITY CK_RV db_add_pobject_v4(sqlite3 *updb, pobject_v4 *new_pobj) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    const char *sql =
+          "INSERT INTO pobjects2 ("
+            "id,"             // index: 1 type: INT
+            "hierarchy, "     // index: 2 type: TEXT
+            "config,"         // index: 3 type: TEXT
+            "objauth"         // index: 4 type: TEXT
+          ") VALUES ("
+            "?,?,?,?"
+          ");";
+
+    int rc = sqlite3_prepare_v2(updb, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, new_pobj->id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_bind_text(stmt, 2, new_pobj->hierarchy, -1, SQLITE_STATIC);
+    gotobinderror(rc, "hierarchy");
+
+    rc = sqlite3_bind_text(stmt, 3, new_pobj->config, -1, SQLITE_STATIC);
+    gotobinderror(rc, "config");
+
+    rc = sqlite3_bind_text(stmt, 4, new_pobj->objauth, -1, SQLITE_STATIC);
+    gotobinderror(rc, "objauth");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    rv = CKR_OK;
+error:
+    rc = sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK) {
+        LOGW("Could not finalize stmt: %d", rc);
+    }
+
+    return rv;
+}
+
+DEBUG_VISIBILITY int init_pobject_from_stmt(sqlite3_stmt *stmt, tpm_ctx *tpm, pobject *pobj) {
+
+    /* Get the YAML config and:
+     *   - parse it to the config structure
+     *   - if persistent deserializes the ESYS_TR into the handle
+     *   - if transient, verify that the template_name is set
+     */
+    size_t yaml_size = sqlite3_column_bytes(stmt, 0);
+    const unsigned char *pobj_yaml_conf = sqlite3_column_text(stmt, 0);
+    bool res = parse_pobject_config_from_string(pobj_yaml_conf, yaml_size,
+            &pobj->config);
+    if (!res) {
+        LOGE("Could not parse pobject config");
+        return SQLITE_ERROR;
+    }
+
+    if (!pobj->config.is_transient) {
+        if (!pobj->config.blob) {
+            LOGE("Expected persistent pobject config to have ESYS_TR blob");
             return SQLITE_ERROR;
         }
         res = tpm_deserialize_handle(tpm, pobj->config.blob, &pobj->handle);
@@ -450,7 +1331,7 @@ DEBUG_VISIBILITY int __real_init_pobject(unsigned pid, pobject *pobj, tpm_ctx *t
             "SELECT config,objauth FROM pobjects WHERE id=?";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(global.db, STMT_INIT_POBJECT, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("Cannot prepare sobject query: %s\n", sqlite3_errmsg(global.db));
         return rc;
@@ -471,7 +1352,7 @@ DEBUG_VISIBILITY int __real_init_pobject(unsigned pid, pobject *pobj, tpm_ctx *t
     rc = init_pobject_from_stmt(stmt, tpm, pobj);
 
 error:
-    sqlite3_finalize(stmt);
+    stmt_release(global.db, STMT_INIT_POBJECT, stmt);
 
     return rc;
 }
@@ -491,7 +1372,7 @@ DEBUG_VISIBILITY int __real_init_sealobjects(unsigned tokid, sealobject *sealobj
             "SELECT * FROM sealobjects WHERE tokid=?";
 
     sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(global.db, STMT_INIT_SEALOBJECTS, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("Cannot prepare sealobject query: %s\n", sqlite3_errmsg(global.db));
         return rc;
@@ -544,7 +1425,7 @@ DEBUG_VISIBILITY int __real_init_sealobjects(unsigned tokid, sealobject *sealobj
     rc = SQLITE_OK;
 
 error:
-    sqlite3_finalize(stmt);
+    stmt_release(global.db, STMT_INIT_SEALOBJECTS, stmt);
 
     return rc;
 }
@@ -558,6 +1439,95 @@ DEBUG_VISIBILITY WEAK void db_get_label(token *t, sqlite3_stmt *stmt, int iCol)
                         sqlite3_column_text(stmt, iCol));
 }
 
+/*
+ * Fills in the token id, pid, label and config from a row of the tokens table.
+ */
+static CK_RV db_token_from_row(sqlite3_stmt *stmt, token *t) {
+
+    int col_count = sqlite3_data_count(stmt);
+
+    int i;
+    for (i=0; i < col_count; i++) {
+        const char *name = sqlite3_column_name(stmt, i);
+
+        if (!strcmp(name, "id")) {
+            t->id = sqlite3_column_int(stmt, i);
+
+        } else if(!strcmp(name, "pid")) {
+            t->pid = sqlite3_column_int(stmt, i);
+
+        } else if (!strcmp(name, "label")) {
+            db_get_label(t, stmt, i);
+
+        } else if (!strcmp(name, "config")) {
+            int bytes = sqlite3_column_bytes(stmt, i);
+            const unsigned char *config = sqlite3_column_text(stmt, i);
+            if (!config || !bytes) {
+                LOGE("Expected token config to contain config data");
+                return CKR_GENERAL_ERROR;
+            }
+            bool result = parse_token_config_from_string(config, bytes, &t->config);
+            if (!result) {
+                LOGE("Could not parse token config, got: \"%s\"", config);
+                return CKR_GENERAL_ERROR;
+            }
+
+        } else {
+            LOGE("Unknown key: %s", name);
+            return CKR_GENERAL_ERROR;
+        }
+    } /* done with sql key value search */
+
+    return CKR_OK;
+}
+
+/*
+ * Tokens are loaded while other tokens use the connection, so the rows are
+ * read like db_refresh_tobjects() does. The primary object is read first,
+ * creating a transient one takes the TPM a while.
+ */
+CK_RV db_load_token(token *t) {
+
+    /* tokens in the DB store already have an associated primary object */
+    int rc = init_pobject(t->pid, &t->pobject, t->tctx);
+    if (rc != SQLITE_OK) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (!t->config.is_initialized) {
+        LOGV("skipping further initialization of token tid: %u", t->id);
+        return CKR_OK;
+    }
+
+    db_lock();
+
+    /* the change log position and the objects are read from one snapshot */
+    queue_flush();
+    if (start_read() != SQLITE_OK) {
+        db_unlock();
+        return CKR_GENERAL_ERROR;
+    }
+
+    rc = init_sealobjects(t->id, &t->esysdb.sealobject);
+    if (rc == SQLITE_OK) {
+        rc = init_tobject_changes(t);
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = init_tobjects(t);
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = commit();
+    } else {
+        rollback();
+    }
+
+    db_unlock();
+
+    return rc == SQLITE_OK ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
 CK_RV db_get_tokens(token *tok, size_t *len) {
 
     size_t cnt = 0;
@@ -572,93 +1542,439 @@ CK_RV db_get_tokens(token *tok, size_t *len) {
         goto error;
     }
 
-    size_t row = 0;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
+    size_t row = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+
+        if (cnt >= MAX_TOKEN_CNT) {
+            LOGE("Too many tokens, must have less than %d", MAX_TOKEN_CNT);
+            goto error;
+        }
+
+        token *t = &tok[row++];
+
+        CK_RV rv = db_token_from_row(stmt, t);
+        if (rv != CKR_OK) {
+            goto error;
+        }
+
+        /* the rest waits for the token to be used, see db_load_token() */
+        rv = token_slot_init(t);
+        if (rv != CKR_OK) {
+            goto error;
+        }
+
+        /* token initialized, bump cnt */
+        cnt++;
+    }
+
+    *len = cnt;
+    sqlite3_finalize(stmt);
+
+    return CKR_OK;
+
+error:
+    token_free_list(&tok, &cnt);
+    *len = 0;
+    if (stmt) {
+        sqlite3_finalize(stmt);
+    }
+    return CKR_GENERAL_ERROR;
+}
+
+CK_RV db_get_new_tokens(const unsigned *known, size_t known_len,
+        token *tok, size_t max, size_t *len) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    size_t cnt = 0;
+
+    const char *sql =
+            "SELECT * FROM tokens";
+
+    sqlite3_stmt *stmt = NULL;
+
+    /* keep other threads' transactions on the shared connection out of the read */
+    db_lock();
+
+    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject query: %s\n", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+
+        if (cnt >= max) {
+            LOGW("Too many tokens, not loading the rest");
+            break;
+        }
+
+        token *t = &tok[cnt];
+
+        rv = db_token_from_row(stmt, t);
+        if (rv != CKR_OK) {
+            token_config_free(&t->config);
+            goto error;
+        }
+
+        size_t i;
+        for (i=0; i < known_len; i++) {
+            if (known[i] == t->id) {
+                break;
+            }
+        }
+
+        /* already have it */
+        if (i < known_len) {
+            token_config_free(&t->config);
+            memset(t, 0, sizeof(*t));
+            continue;
+        }
+
+        rv = token_slot_init(t);
+        if (rv != CKR_OK) {
+            token_free(t);
+            memset(t, 0, sizeof(*t));
+            goto error;
+        }
+
+        LOGV("Found new token tid: %u", t->id);
+        cnt++;
+    }
+
+    *len = cnt;
+    sqlite3_finalize(stmt);
+    db_unlock();
+
+    return CKR_OK;
+
+error:
+    while (cnt) {
+        token_free(&tok[--cnt]);
+    }
+    *len = 0;
+    if (stmt) {
+        sqlite3_finalize(stmt);
+    }
+    db_unlock();
+    return rv;
+}
+
+CK_RV db_get_data_version(int *version) {
+
+    db_lock();
+    CK_RV rv = get_data_version(version);
+    db_unlock();
+
+    return rv;
+}
+
+typedef struct tobject_change tobject_change;
+struct tobject_change {
+    unsigned id;
+    tobject *tobj;   /* the row as it is now, NULL if it was deleted */
+    bool is_merged;
+};
+
+static int tobject_change_cmp(const void *a, const void *b) {
+
+    unsigned x = ((const tobject_change *)a)->id;
+    unsigned y = ((const tobject_change *)b)->id;
+
+    return x < y ? -1 : x > y;
+}
+
+static CK_RV read_tobject_changes(token *tok, bool is_full,
+        tobject_change **changes, size_t *len) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    /* the rows changed since the last refresh, by anyone but us */
+    const char *sql = is_full ?
+            "SELECT id, attrs FROM tobjects WHERE tokid=?1" :
+            "SELECT c.id AS id, t.attrs AS attrs FROM "
+                "(SELECT DISTINCT id FROM tobject_changes "
+                    "WHERE tokid=?1 AND seq>?2 AND origin IS NOT ?3) AS c "
+                "LEFT JOIN tobjects AS t ON t.id=c.id AND t.tokid=?1";
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject changes query: %s", sqlite3_errmsg(global.db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    gotobinderror(rc, "tokid");
+
+    if (!is_full) {
+        rc = sqlite3_bind_int64(stmt, 2, tok->esysdb.change_seq);
+        gotobinderror(rc, "seq");
+
+        rc = sqlite3_bind_int64(stmt, 3, global.origin);
+        gotobinderror(rc, "origin");
+    }
+
+    size_t max = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        if (*len == max) {
+            max = max ? max * 2 : 16;
+            tobject_change *tmp = realloc(*changes, max * sizeof(*tmp));
+            goto_oom(tmp, error);
+            *changes = tmp;
+        }
+
+        tobject_change *c = &(*changes)[*len];
+        memset(c, 0, sizeof(*c));
+        c->id = sqlite3_column_int(stmt, 0);
+
+        if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
+            c->tobj = db_tobject_new(stmt);
+            if (!c->tobj) {
+                LOGE("Failed to initialize tobject from db");
+                goto error;
+            }
+        }
+
+        (*len)++;
+    }
+
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step tobject changes query: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+error:
+    sqlite3_finalize(stmt);
+    return rv;
+}
+
+static bool tobject_differs(tobject *tobj, tobject *row) {
+
+    /* never used, a copy of the row costs as little */
+    if (!tobj->attrs_raw && !tobj->attrs) {
+        return true;
+    }
+
+    const unsigned char *raw = (const unsigned char *)row->attrs_raw;
+    size_t len = twist_len(row->attrs_raw);
+
+    /* not decoded yet, still exactly what was read */
+    if (tobj->attrs_raw) {
+        return twist_len(tobj->attrs_raw) != len
+                || memcmp(tobj->attrs_raw, raw, len);
+    }
+
+    twist cur = attr_tlv_encode(tobj->attrs);
+    if (!cur) {
+        return true;
+    }
+
+    bool differs = twist_len(cur) != len || memcmp(cur, raw, len);
+    twist_free(cur);
+
+    return differs;
+}
+
+static CK_RV merge_tobject_changes(token *tok, tobject_change *changes,
+        size_t len, bool is_full, bool *is_deferred) {
+
+    list *cur = tok->tobjects.head ? &tok->tobjects.head->l : NULL;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+
+        tobject_change key = { .id = tobj->id };
+        tobject_change *c = bsearch(&key, changes, len, sizeof(*changes),
+                tobject_change_cmp);
+        if (c) {
+            c->is_merged = true;
+        } else if (!is_full) {
+            continue;
+        }
+
+        /* when all rows are read, missing ones were deleted */
+        tobject *row = c ? c->tobj : NULL;
+        if (row && !tobject_differs(tobj, row)) {
+            continue;
+        }
+
+        /* retried on the next refresh */
+        if (tobject_is_busy(tobj)) {
+            LOGV("Object %u changed in the store while in use", tobj->id);
+            *is_deferred = true;
+            continue;
+        }
+
+        if (!row) {
+            LOGV("Object %u was removed from the store", tobj->id);
+            token_rm_tobject(tok, tobj);
+            tobject_free(tobj);
+            continue;
+        }
+
+        LOGV("Object %u was updated in the store", tobj->id);
+        CK_RV rv = token_replace_tobject(tok, tobj, row);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        c->tobj = NULL;
+        tobject_free(tobj);
+    }
+
+    size_t i;
+    for (i = 0; i < len; i++) {
+        tobject_change *c = &changes[i];
+        if (c->is_merged || !c->tobj) {
+            continue;
+        }
+
+        LOGV("Object %u was added to the store", c->id);
+        CK_RV rv = token_add_tobject(tok, c->tobj);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        c->tobj = NULL;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV db_refresh_tobjects(token *tok) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    tobject_change *changes = NULL;
+    size_t len = 0;
+    bool is_full = false;
+    int64_t max = 0;
+    int64_t min = 0;
+
+    db_lock();
+
+    /* a flush below may fail too, so it's read after it */
+    queue_flush();
+
+    unsigned failed_commits = global.failed_commits;
+    bool is_undone = failed_commits != tok->esysdb.failed_commits;
+
+    int version = 0;
+    rv = get_data_version(&version);
+    if (rv != CKR_OK || (version == tok->esysdb.store_version && !is_undone)) {
+        db_unlock();
+        return rv;
+    }
+
+    /* the log and the rows are read from one snapshot */
+    if (start_read() != SQLITE_OK) {
+        db_unlock();
+        return CKR_GENERAL_ERROR;
+    }
+
+    rv = get_change_range(&max, &min) == SQLITE_OK ?
+            CKR_OK : CKR_GENERAL_ERROR;
+    if (rv == CKR_OK) {
+        /*
+         * The entries after the last refresh were pruned from the log, or a
+         * failed commit undid writes, which leaves no entries at all.
+         */
+        is_full = is_undone || min > tok->esysdb.change_seq + 1;
+        rv = read_tobject_changes(tok, is_full, &changes, &len);
+    }
 
-        if (cnt >= MAX_TOKEN_CNT) {
-            LOGE("Too many tokens, must have less than %d", MAX_TOKEN_CNT);
-            goto error;
+    if (rv == CKR_OK) {
+        if (commit() != SQLITE_OK) {
+            rv = CKR_GENERAL_ERROR;
         }
+    } else {
+        rollback();
+    }
 
-        token *t = &tok[row++];
-        int col_count = sqlite3_data_count(stmt);
-
-        int i;
-        for (i=0; i < col_count; i++) {
-            const char *name = sqlite3_column_name(stmt, i);
-
-            if (!strcmp(name, "id")) {
-                t->id = sqlite3_column_int(stmt, i);
-
-            } else if(!strcmp(name, "pid")) {
-                t->pid = sqlite3_column_int(stmt, i);
-
-            } else if (!strcmp(name, "label")) {
-                db_get_label(t, stmt, i);
-
-            } else if (!strcmp(name, "config")) {
-                int bytes = sqlite3_column_bytes(stmt, i);
-                const unsigned char *config = sqlite3_column_text(stmt, i);
-                if (!config || !bytes) {
-                    LOGE("Expected token config to contain config data");
-                    goto error;
-                }
-                bool result = parse_token_config_from_string(config, bytes, &t->config);
-                if (!result) {
-                    LOGE("Could not parse token config, got: \"%s\"", config);
-                    goto error;
-                }
-
-            } else {
-                LOGE("Unknown key: %s", name);
-                goto error;
-            }
-        } /* done with sql key value search */
+    db_unlock();
 
-        CK_RV rv = token_min_init(t);
-        if (rv != CKR_OK) {
-            goto error;
-        }
+    if (rv != CKR_OK) {
+        goto out;
+    }
 
-        /* tokens in the DB store already have an associated primary object */
-        rc = init_pobject(t->pid, &t->pobject, t->tctx);
-        if (rc != SQLITE_OK) {
-            goto error;
-        }
+    qsort(changes, len, sizeof(*changes), tobject_change_cmp);
 
-        if (!t->config.is_initialized) {
-            LOGV("skipping further initialization of token tid: %u", t->id);
-            /* token initialized, bump cnt */
-            cnt++;
-            continue;
-        }
+    bool is_deferred = false;
+    rv = merge_tobject_changes(tok, changes, len, is_full, &is_deferred);
+    if (rv == CKR_OK && !is_deferred) {
+        tok->esysdb.store_version = version;
+        tok->esysdb.change_seq = max;
+        tok->esysdb.failed_commits = failed_commits;
+    }
 
-        rc = init_sealobjects(t->id, &t->esysdb.sealobject);
-        if (rc != SQLITE_OK) {
-            goto error;
-        }
+out:
+    while (len) {
+        tobject_free(changes[--len].tobj);
+    }
+    free(changes);
 
-        rc = init_tobjects(t);
-        if (rc != SQLITE_OK) {
-            goto error;
-        }
+    return rv;
+}
 
-        /* token initialized, bump cnt */
-        cnt++;
+int db_watch_new(void) {
+
+    if (global.is_immutable) {
+        /* nothing will change it */
+        return -1;
     }
 
-    *len = cnt;
-    sqlite3_finalize(stmt);
+    const char *path = sqlite3_db_filename(global.db, "main");
+    if (!path || path[0] == '\0') {
+        /* in memory, nothing to watch */
+        return -1;
+    }
 
-    return CKR_OK;
+    char *pathdup = strdup(path);
+    if (!pathdup) {
+        LOGE("oom");
+        return -1;
+    }
 
-error:
-    token_free_list(&tok, &cnt);
-    *len = 0;
-    if (stmt) {
-        sqlite3_finalize(stmt);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        LOGW("Could not create inotify instance: %s", strerror(errno));
+        free(pathdup);
+        return -1;
     }
-    return CKR_GENERAL_ERROR;
+
+    /*
+     * Watch the directory rather than the file, sqlite writes the
+     * journal or WAL next to it and may replace the file.
+     */
+    const char *dir = dirname(pathdup);
+    int wd = inotify_add_watch(fd, dir,
+            IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_DELETE);
+    if (wd < 0) {
+        LOGW("Could not watch store directory \"%s\": %s", dir, strerror(errno));
+        close(fd);
+        fd = -1;
+    }
+
+    free(pathdup);
+
+    return fd;
+}
+
+bool db_is_immutable(void) {
+    return global.is_immutable;
+}
+
+void db_watch_drain(int fd) {
+
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    /* the fd is non-blocking, read until it is empty */
+    while (read(fd, buf, sizeof(buf)) > 0);
 }
 
 CK_RV db_update_for_pinchange(
@@ -672,6 +1988,10 @@ CK_RV db_update_for_pinchange(
         twist newprivblob,
         twist newpubblob) {
 
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sqlite3_stmt *stmt = NULL;
@@ -757,36 +2077,44 @@ CK_RV db_update_for_pinchange(
 
 CK_RV db_add_new_object(token *tok, tobject *tobj) {
 
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sqlite3_stmt *stmt = NULL;
 
-    char *attrs = emit_attributes_to_string(tobj->attrs);
+    twist attrs = attr_tlv_encode(tobj->attrs);
     if (!attrs) {
         return CKR_GENERAL_ERROR;
     }
 
     const char *sql =
           "INSERT INTO tobjects ("
-            "tokid, "     // index: 1 type: INT
-            "attrs"       // index: 2 type: TEXT (JSON)
+            "id, "        // index: 1 type: INT
+            "tokid, "     // index: 2 type: INT
+            "attrs"       // index: 3 type: BLOB (TLV)
           ") VALUES ("
-            "?,?"
+            "(SELECT max(ifnull(max(id), 0), ?) + 1 FROM tobjects),?,?"
           ");";
 
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(global.db, STMT_ADD_TOBJECT, sql, &stmt);
     if (rc != SQLITE_OK) {
-        free(attrs);
+        twist_free(attrs);
         LOGE("%s", sqlite3_errmsg(global.db));
         return CKR_GENERAL_ERROR;
     }
 
-    TRANSACTION_START;
+    QUEUED_TRANSACTION_START;
 
-    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    rc = sqlite3_bind_int64(stmt, 1, global.max_tobject_id);
+    gotobinderror(rc, "id");
+
+    rc = sqlite3_bind_int(stmt, 2, tok->id);
     gotobinderror(rc, "tokid");
 
-    rc = sqlite3_bind_text(stmt, 2, attrs, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_blob(stmt, 3, attrs, twist_len(attrs), SQLITE_STATIC);
     gotobinderror(rc, "attrs");
 
     rc = sqlite3_step(stmt);
@@ -807,20 +2135,29 @@ CK_RV db_add_new_object(token *tok, tobject *tobj) {
     }
 
     tobject_set_id(tobj, (unsigned)id);
+    global.max_tobject_id = id;
+
+    if (update_tobject_columns(global.db, (unsigned)id, tobj->attrs) != CKR_OK) {
+        goto error;
+    }
 
     rv = CKR_OK;
 
-    TRANSACTION_END(rv);
+    QUEUED_TRANSACTION_END(rv, false);
 
-    sqlite3_finalize_warn(stmt);
+    stmt_release(global.db, STMT_ADD_TOBJECT, stmt);
 
-    free(attrs);
+    twist_free(attrs);
 
     return rv;
 }
 
 CK_RV db_delete_object(tobject *tobj) {
 
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sqlite3_stmt *stmt = NULL;
@@ -828,13 +2165,13 @@ CK_RV db_delete_object(tobject *tobj) {
     static const char *sql =
       "DELETE FROM tobjects WHERE id=?;";
 
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(global.db, STMT_DELETE_TOBJECT, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(global.db));
         return CKR_GENERAL_ERROR;
     }
 
-    TRANSACTION_START;
+    QUEUED_TRANSACTION_START;
 
     rc = sqlite3_bind_int(stmt, 1, tobj->id);
     gotobinderror(rc, "id");
@@ -847,8 +2184,8 @@ CK_RV db_delete_object(tobject *tobj) {
 
     rv = CKR_OK;
 
-    TRANSACTION_END(rv);
-    sqlite3_finalize_warn(stmt);
+    QUEUED_TRANSACTION_END(rv, true);
+    stmt_release(global.db, STMT_DELETE_TOBJECT, stmt);
 
     return rv;
 }
@@ -856,6 +2193,10 @@ CK_RV db_delete_object(tobject *tobj) {
 CK_RV db_add_primary(pobject *pobj, unsigned *pid) {
     assert(pid);
 
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     char *yaml_conf = NULL;
@@ -925,6 +2266,10 @@ CK_RV db_add_primary(pobject *pobj, unsigned *pid) {
 CK_RV db_update_token_config(token *tok) {
     assert(tok);
 
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sqlite3_stmt *stmt = NULL;
@@ -939,7 +2284,7 @@ CK_RV db_update_token_config(token *tok) {
           "UPDATE tokens SET"
             " config=?"      // index: 1 type: TEXT (JSON)
             " WHERE id=?;";  // Index 2 type: int
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(global.db, STMT_UPDATE_TOKEN_CONFIG, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(global.db));
         goto error;
@@ -954,7 +2299,7 @@ CK_RV db_update_token_config(token *tok) {
     rv = CKR_OK;
 
 error:
-    sqlite3_finalize_warn(stmt);
+    stmt_release(global.db, STMT_UPDATE_TOKEN_CONFIG, stmt);
     free(config);
     return rv;
 }
@@ -966,7 +2311,7 @@ CK_RV _db_update_tobject_attrs(sqlite3 *db, unsigned id, attr_list *attrs) {
 
     sqlite3_stmt *stmt = NULL;
 
-    char *attr_str = emit_attributes_to_string(attrs);
+    twist attr_str = attr_tlv_encode(attrs);
     if (!attr_str) {
         LOGE("Could not emit tobject attributes");
         return CKR_GENERAL_ERROR;
@@ -974,15 +2319,15 @@ CK_RV _db_update_tobject_attrs(sqlite3 *db, unsigned id, attr_list *attrs) {
 
     const char *sql =
           "UPDATE tobjects SET"
-            " attrs=?"      // index: 1 type: TEXT (JSON)
+            " attrs=?"      // index: 1 type: BLOB (TLV)
             " WHERE id=?;";  // Index 2 type: int
-    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    int rc = stmt_prepare(db, STMT_UPDATE_TOBJECT_ATTRS, sql, &stmt);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(db));
         goto error;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, attr_str, -1, SQLITE_STATIC);
+    rc = sqlite3_bind_blob(stmt, 1, attr_str, twist_len(attr_str), SQLITE_STATIC);
     gotobinderror(rc, "attrs");
 
     rc = sqlite3_bind_int(stmt, 2, id);
@@ -997,15 +2342,75 @@ CK_RV _db_update_tobject_attrs(sqlite3 *db, unsigned id, attr_list *attrs) {
     rv = CKR_OK;
 
 error:
-    sqlite3_finalize_warn(stmt);
-    free(attr_str);
+    stmt_release(db, STMT_UPDATE_TOBJECT_ATTRS, stmt);
+    twist_free(attr_str);
     return rv;
 }
 
 CK_RV db_update_tobject_attrs(unsigned id, attr_list *attrs) {
     assert(attrs);
 
-    return _db_update_tobject_attrs(global.db, id,  attrs);
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    QUEUED_TRANSACTION_START;
+
+    rv = _db_update_tobject_attrs(global.db, id,  attrs);
+    if (rv == CKR_OK) {
+        rv = update_tobject_columns(global.db, id, attrs);
+    }
+
+    QUEUED_TRANSACTION_END(rv, true);
+
+    return rv;
+}
+
+CK_RV db_get_tobject_attrs(unsigned id, twist *attrs) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    db_lock();
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = stmt_prepare(global.db, STMT_GET_TOBJECT_ATTRS,
+            "SELECT attrs FROM tobjects WHERE id=?", &stmt);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject attrs query: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject id: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        /* removed by someone else since the token was loaded */
+        LOGE("Object %u is no longer in the store", id);
+        rv = CKR_OBJECT_HANDLE_INVALID;
+        goto out;
+    } else if (rc != SQLITE_ROW) {
+        LOGE("Cannot step tobject attrs query: %s", sqlite3_errmsg(global.db));
+        goto out;
+    }
+
+    rc = get_blob(stmt, 0, attrs);
+    if (rc != SQLITE_OK) {
+        LOGE("tobject does not have attributes");
+        goto out;
+    }
+
+    rv = CKR_OK;
+
+out:
+    stmt_release(global.db, STMT_GET_TOBJECT_ATTRS, stmt);
+    db_unlock();
+    return rv;
 }
 
 CK_RV db_add_token(token *tok) {
@@ -1014,6 +2419,10 @@ CK_RV db_add_token(token *tok) {
     /* This function is only called from token_initialize, hence... */
     assert(tok->config.is_initialized);
 
+    if (is_write_protected()) {
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sqlite3_stmt *stmt = NULL;
@@ -1164,6 +2573,15 @@ error:
 
 #define DB_NAME "tpm2_pkcs11.sqlite3"
 #define PKCS11_STORE_ENV_VAR "TPM2_PKCS11_STORE"
+#define PKCS11_STORE_JOURNAL_ENV_VAR "TPM2_PKCS11_STORE_JOURNAL"
+#define PKCS11_STORE_SYNC_ENV_VAR "TPM2_PKCS11_STORE_SYNC"
+#define PKCS11_STORE_BUSY_TIMEOUT_ENV_VAR "TPM2_PKCS11_STORE_BUSY_TIMEOUT"
+#define PKCS11_STORE_IMMUTABLE_ENV_VAR "TPM2_PKCS11_STORE_IMMUTABLE"
+
+/* how long to wait for other processes holding the store, in ms */
+#define STORE_BUSY_TIMEOUT_DEFAULT 5000
+/* the busy handler sleeps 1, 2, 4, ... ms, up to this many */
+#define STORE_BUSY_MAX_SHIFT 6
 
 static CK_RV handle_env_var(char *path, size_t len, bool *skip) {
 
@@ -1800,7 +3218,7 @@ static CK_RV dbup_handler_from_4_to_5(sqlite3 *updb) {
 
         CK_MECHANISM_TYPE *new_mechs = NULL;
 
-        tobject *tobj = db_tobject_new(stmt);
+        tobject *tobj = db_tobject_new_decoded(stmt);
         if (!tobj) {
             LOGE("Could not process tobjects for upgrade");
             goto error;
@@ -1950,7 +3368,7 @@ static CK_RV dbup_handler_from_5_to_6(sqlite3 *updb) {
     while (rc == SQLITE_ROW) {
 
 
-        tobject *tobj = db_tobject_new(stmt);
+        tobject *tobj = db_tobject_new_decoded(stmt);
         if (!tobj) {
             LOGE("Could not process tobjects for upgrade");
             goto error;
@@ -2097,7 +3515,7 @@ static CK_RV dbup_handler_from_6_to_7(sqlite3 *updb) {
 
     while (rc == SQLITE_ROW) {
 
-        tobject *tobj = db_tobject_new(stmt);
+        tobject *tobj = db_tobject_new_decoded(stmt);
         if (!tobj) {
             LOGE("Could not process tobjects for upgrade");
             goto error;
@@ -2152,41 +3570,164 @@ static CK_RV dbup_handler_from_7_to_8(sqlite3 *updb) {
         goto error;
     }
 
-    rc = sqlite3_step(stmt);
-    if (rc == SQLITE_DONE) {
-        goto out;
-    } else if (rc != SQLITE_ROW) {
-        LOGE("Failed to step: %s", sqlite3_errmsg(updb));
-        goto error;
-    }
-
-    while (rc == SQLITE_ROW) {
-        tobject *tobj = db_tobject_new(stmt);
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        goto out;
+    } else if (rc != SQLITE_ROW) {
+        LOGE("Failed to step: %s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    while (rc == SQLITE_ROW) {
+        tobject *tobj = db_tobject_new_decoded(stmt);
+        if (!tobj) {
+            LOGE("Could not process tobjects for upgrade");
+            goto error;
+        }
+
+        /* for each tobject */
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_ALLOWED_MECHANISMS);
+        CK_BYTE type = type_from_ptr(a->pValue, a->ulValueLen);
+        if (type != TYPE_BYTE_INT_SEQ) {
+            rv = _db_update_tobject_attrs(updb, tobj->id, tobj->attrs);
+        }
+
+        tobject_free(tobj);
+        if (rv != CKR_OK) {
+            goto error;
+        }
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            LOGE("Failed to fetch data: %s\n", sqlite3_errmsg(updb));
+            goto error;
+        }
+    }
+
+out:
+    rv = CKR_OK;
+
+error:
+    sqlite3_finalize(stmt);
+    return rv;
+}
+
+static CK_RV dbup_handler_from_8_to_9(sqlite3 *updb) {
+
+    /*
+     * Between version 8 and 9 of the DB the following changes need to be made:
+     *
+     * Table tobjects:
+     *
+     * The attributes are stored in the binary format of attr_tlv.h instead
+     * of YAML.
+     */
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+    sqlite3_stmt *stmt = NULL;
+
+    int rc = sqlite3_prepare_v2(updb, "SELECT * from tobjects", -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        LOGE("Failed to fetch data: %s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        goto out;
+    } else if (rc != SQLITE_ROW) {
+        LOGE("Failed to step: %s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    while (rc == SQLITE_ROW) {
+        tobject *tobj = db_tobject_new_decoded(stmt);
+        if (!tobj) {
+            LOGE("Could not process tobjects for upgrade");
+            goto error;
+        }
+
+        rv = _db_update_tobject_attrs(updb, tobj->id, tobj->attrs);
+        tobject_free(tobj);
+        if (rv != CKR_OK) {
+            goto error;
+        }
+
+        rc = sqlite3_step(stmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+            LOGE("Failed to fetch data: %s\n", sqlite3_errmsg(updb));
+            rv = CKR_GENERAL_ERROR;
+            goto error;
+        }
+    }
+
+out:
+    rv = CKR_OK;
+
+error:
+    sqlite3_finalize(stmt);
+    return rv;
+}
+
+static CK_RV dbup_handler_from_9_to_10(sqlite3 *updb) {
+
+    /*
+     * Between version 9 and 10 of the DB the following changes need to be made:
+     *
+     * Table tobject_changes:
+     *
+     * New, a log of the changed tobjects rows filled in by triggers, see
+     * db_refresh_tobjects().
+     */
+
+    return run_sql_list(updb, tobject_changes_sql, ARRAY_LEN(tobject_changes_sql));
+}
+
+static CK_RV dbup_handler_from_10_to_11(sqlite3 *updb) {
+
+    /*
+     * Between version 10 and 11 of the DB the following changes need to be made:
+     *
+     * Table tobjects:
+     *
+     * New columns holding the attributes objects are searched by, see
+     * tobject_columns, and the tobjects_summary index over them.
+     */
+
+    CK_RV rv = run_sql_list(updb, tobject_columns_sql, ARRAY_LEN(tobject_columns_sql));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = CKR_GENERAL_ERROR;
+    sqlite3_stmt *stmt = NULL;
+
+    int rc = sqlite3_prepare_v2(updb, "SELECT id, attrs from tobjects", -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        LOGE("Failed to fetch data: %s", sqlite3_errmsg(updb));
+        goto error;
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        tobject *tobj = db_tobject_new_decoded(stmt);
         if (!tobj) {
             LOGE("Could not process tobjects for upgrade");
             goto error;
         }
 
-        /* for each tobject */
-        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_ALLOWED_MECHANISMS);
-        CK_BYTE type = type_from_ptr(a->pValue, a->ulValueLen);
-        if (type != TYPE_BYTE_INT_SEQ) {
-            rv = _db_update_tobject_attrs(updb, tobj->id, tobj->attrs);
-        }
-
+        rv = update_tobject_columns(updb, tobj->id, tobj->attrs);
         tobject_free(tobj);
         if (rv != CKR_OK) {
             goto error;
         }
+    }
 
-        rc = sqlite3_step(stmt);
-        if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
-            LOGE("Failed to fetch data: %s\n", sqlite3_errmsg(updb));
-            goto error;
-        }
+    if (rc != SQLITE_DONE) {
+        LOGE("Failed to fetch data: %s\n", sqlite3_errmsg(updb));
+        rv = CKR_GENERAL_ERROR;
+        goto error;
     }
 
-out:
     rv = CKR_OK;
 
 error:
@@ -2194,7 +3735,6 @@ error:
     return rv;
 }
 
-
 static CK_RV db_backup(sqlite3 *db, const char *dbpath, sqlite3 **updb, char **copypath) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
@@ -2270,7 +3810,10 @@ static CK_RV db_update(sqlite3 **xdb, const char *dbpath, unsigned old_version,
             dbup_handler_from_4_to_5,
             dbup_handler_from_5_to_6,
             dbup_handler_from_6_to_7,
-            dbup_handler_from_7_to_8
+            dbup_handler_from_7_to_8,
+            dbup_handler_from_8_to_9,
+            dbup_handler_from_9_to_10,
+            dbup_handler_from_10_to_11
     };
 
     /*
@@ -2502,7 +4045,7 @@ CK_RV db_init_new(sqlite3 *db) {
         "CREATE TABLE tobjects("
             "id INTEGER PRIMARY KEY,"
             "tokid INTEGER NOT NULL,"
-            "attrs TEXT NOT NULL,"
+            "attrs TEXT NOT NULL," /* holds a BLOB since schema 9 */
             "FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE"
         ");",
         "CREATE TABLE schema("
@@ -2518,10 +4061,28 @@ CK_RV db_init_new(sqlite3 *db) {
         "        RAISE(FAIL, \"Maximum token count of 255 reached.\")\n"
         "    END;\n"
         "END;\n",
+    };
+
+    const char *version_sql[] = {
         "REPLACE INTO schema (id, schema_version) VALUES (1, "xstr(DB_VERSION) ");",
     };
 
-    return run_sql_list(db, sql, ARRAY_LEN(sql));
+    CK_RV rv = run_sql_list(db, sql, ARRAY_LEN(sql));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = run_sql_list(db, tobject_changes_sql, ARRAY_LEN(tobject_changes_sql));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = run_sql_list(db, tobject_columns_sql, ARRAY_LEN(tobject_columns_sql));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return run_sql_list(db, version_sql, ARRAY_LEN(version_sql));
 }
 
 static CK_RV db_verify_update_ok(const char *dbpath) {
@@ -2550,8 +4111,170 @@ static CK_RV db_verify_update_ok(const char *dbpath) {
     return CKR_OK;
 }
 
+/*
+ * Waits out other connections holding the store with a bounded exponential
+ * backoff, sqlite gives up with SQLITE_BUSY when this returns 0.
+ */
+static int db_busy_handler(void *ctx, int count) {
+
+    unsigned timeout = *(unsigned *)ctx;
+
+    /* the time already slept by the previous calls */
+    unsigned waited = count <= STORE_BUSY_MAX_SHIFT + 1 ?
+            (1u << count) - 1 :
+            (2u << STORE_BUSY_MAX_SHIFT) - 1 +
+                (unsigned)(count - STORE_BUSY_MAX_SHIFT - 1) * (1u << STORE_BUSY_MAX_SHIFT);
+    if (waited >= timeout) {
+        LOGW("Store still busy after %u ms, giving up", timeout);
+        return 0;
+    }
+
+    unsigned delay = 1u << (count < STORE_BUSY_MAX_SHIFT ? count : STORE_BUSY_MAX_SHIFT);
+    if (delay > timeout - waited) {
+        delay = timeout - waited;
+    }
+
+    usleep(delay * 1000);
+
+    return 1;
+}
+
+/*
+ * Runs a PRAGMA and returns the text of its result, which for journal_mode
+ * is the mode actually in effect.
+ */
+static CK_RV db_pragma(sqlite3 *db, const char *sql, char *res, size_t len) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare \"%s\": %s", sql, sqlite3_errmsg(db));
+        goto out;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        LOGE("Cannot step \"%s\": %s", sql, sqlite3_errmsg(db));
+        goto out;
+    }
+
+    if (res) {
+        const char *x = rc == SQLITE_ROW ?
+                (const char *)sqlite3_column_text(stmt, 0) : NULL;
+        snprintf(res, len, "%s", x ? x : "");
+    }
+
+    rv = CKR_OK;
+
+out:
+    sqlite3_finalize(stmt);
+    return rv;
+}
+
+static bool is_one_of(const char *value, const char * const *choices, size_t cnt) {
+
+    size_t i;
+    for (i = 0; i < cnt; i++) {
+        if (!strcasecmp(value, choices[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Applies the store configuration from the environment to a connection:
+ *  - TPM2_PKCS11_STORE_JOURNAL: the journal mode, "wal" lets readers
+ *    proceed while another process writes. It is kept in the store file,
+ *    so it only has to be set once. Unset keeps the mode of the store.
+ *  - TPM2_PKCS11_STORE_SYNC: "normal", "full" or "extra". Defaults to
+ *    "normal" in WAL mode, which cannot corrupt the store, and to sqlite's
+ *    "full" otherwise.
+ *  - TPM2_PKCS11_STORE_BUSY_TIMEOUT: how many ms to wait for other
+ *    processes holding the store before failing, 0 to not wait.
+ */
+DEBUG_VISIBILITY CK_RV db_configure(sqlite3 *db) {
+
+    static unsigned busy_timeout = STORE_BUSY_TIMEOUT_DEFAULT;
+
+    const char *env = getenv(PKCS11_STORE_BUSY_TIMEOUT_ENV_VAR);
+    if (env) {
+        unsigned val = 0;
+        if (!env_to_ms(env, UINT_MAX, &val)) {
+            LOGE("Invalid "PKCS11_STORE_BUSY_TIMEOUT_ENV_VAR", got: \"%s\"", env);
+            return CKR_GENERAL_ERROR;
+        }
+        busy_timeout = val;
+    }
+
+    int rc = sqlite3_busy_handler(db, db_busy_handler, &busy_timeout);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot set busy handler: %s", sqlite3_errmsg(db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    char sql[64];
+    char mode[16] = { 0 };
+
+    const char *pname = sqlite3_db_filename(db, NULL);
+    bool is_in_mem_db = !pname || pname[0] == '\0';
+
+    env = getenv(PKCS11_STORE_JOURNAL_ENV_VAR);
+    if (env && !is_in_mem_db) {
+        /* off and memory can corrupt the store on a crash */
+        static const char *journals[] = { "wal", "delete", "truncate", "persist" };
+        if (!is_one_of(env, journals, ARRAY_LEN(journals))) {
+            LOGE("Invalid "PKCS11_STORE_JOURNAL_ENV_VAR", got: \"%s\"", env);
+            return CKR_GENERAL_ERROR;
+        }
+
+        snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s", env);
+        CK_RV rv = db_pragma(db, sql, mode, sizeof(mode));
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        if (strcasecmp(mode, env)) {
+            LOGE("Cannot set store journal mode to %s, still %s", env, mode);
+            return CKR_GENERAL_ERROR;
+        }
+
+        LOGV("Using store journal mode: %s", mode);
+    } else {
+        CK_RV rv = db_pragma(db, "PRAGMA journal_mode", mode, sizeof(mode));
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    env = getenv(PKCS11_STORE_SYNC_ENV_VAR);
+    if (env) {
+        /* off can corrupt the store on power loss */
+        static const char *syncs[] = { "normal", "full", "extra" };
+        if (!is_one_of(env, syncs, ARRAY_LEN(syncs))) {
+            LOGE("Invalid "PKCS11_STORE_SYNC_ENV_VAR", got: \"%s\"", env);
+            return CKR_GENERAL_ERROR;
+        }
+    } else if (!strcasecmp(mode, "wal")) {
+        env = "normal";
+    } else {
+        return CKR_OK;
+    }
+
+    snprintf(sql, sizeof(sql), "PRAGMA synchronous=%s", env);
+    return db_pragma(db, sql, NULL, 0);
+}
+
 static CK_RV db_setup(sqlite3 **xdb, const char *dbpath) {
 
+    CK_RV rv = db_configure(*xdb);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     /*
      * take the version check lock and figure out what
      * to do:
@@ -2572,7 +4295,7 @@ static CK_RV db_setup(sqlite3 **xdb, const char *dbpath) {
         }
     }
 
-    CK_RV rv = db_verify_update_ok(dbpath);
+    rv = db_verify_update_ok(dbpath);
     if (rv != CKR_OK) {
         goto out;
     }
@@ -2603,6 +4326,10 @@ static CK_RV db_setup(sqlite3 **xdb, const char *dbpath) {
     }
 
     rv = db_update(xdb, dbpath, old_version, DB_VERSION);
+    if (rv == CKR_OK) {
+        /* the upgraded store is opened on a new connection */
+        rv = db_configure(*xdb);
+    }
 
 out:
     if (rv != CKR_OK) {
@@ -2617,11 +4344,113 @@ out:
     return rv;
 }
 
+/*
+ * Opens a store that is never written to, like one baked into a read only
+ * image. With immutable=1 sqlite takes no file locks and doesn't look for a
+ * journal or WAL, so nothing but the store file is touched.
+ */
+DEBUG_VISIBILITY CK_RV db_open_immutable(const char *dbpath, sqlite3 **db) {
+
+    /*
+     * a file: URI, escaping what would end the path. An absolute path gets
+     * an empty authority, or one starting with // would be read as a host.
+     */
+    char uri[sizeof("file://") + 3 * PATH_MAX + sizeof("?immutable=1")];
+    size_t l = snprintf(uri, sizeof(uri), dbpath[0] == '/' ? "file://" : "file:");
+
+    const char *p;
+    for (p = dbpath; *p && l < sizeof(uri) - 4; p++) {
+        if (*p == '%' || *p == '?' || *p == '#') {
+            l += snprintf(&uri[l], sizeof(uri) - l, "%%%02X", (unsigned char)*p);
+        } else {
+            uri[l++] = *p;
+        }
+    }
+
+    if (*p || (size_t)snprintf(&uri[l], sizeof(uri) - l, "?immutable=1")
+            >= sizeof(uri) - l) {
+        LOGE("Store URI is longer than %zu", sizeof(uri));
+        return CKR_GENERAL_ERROR;
+    }
+
+    int rc = sqlite3_open_v2(uri, db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot open database \"%s\": %s", dbpath, sqlite3_errmsg(*db));
+        sqlite3_close(*db);
+        *db = NULL;
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* sorts that outgrow the cache would spill to a temporary file */
+    CK_RV rv = db_pragma(*db, "PRAGMA temp_store=MEMORY", NULL, 0);
+    if (rv != CKR_OK) {
+        sqlite3_close(*db);
+        *db = NULL;
+    }
+
+    return rv;
+}
+
+/*
+ * The version check of db_setup() without the lock, an immutable store
+ * cannot be initialized or upgraded.
+ */
+static CK_RV db_setup_immutable(sqlite3 *db) {
+
+    unsigned version = 0;
+    CK_RV rv = db_get_version(db, &version);
+    if (rv != CKR_OK) {
+        LOGE("Could not get DB version");
+        return rv;
+    }
+
+    if (version == DB_EMPTY) {
+        LOGE("Immutable store is empty, provision it before making it read only");
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (version < DB_VERSION) {
+        LOGE("Immutable store needs an upgrade from version %u to %u, "
+                "upgrade it before making it read only", version, DB_VERSION);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (version > DB_VERSION) {
+        LOGE("DB Version exceeds library version: %u > %u",
+                version, DB_VERSION);
+    }
+
+    return CKR_OK;
+}
+
 DEBUG_VISIBILITY WEAK
 CK_RV db_new(sqlite3 **db) {
 
     char dbpath[PATH_MAX];
     CK_RV rv = db_get_existing(dbpath, sizeof(dbpath));
+    if (global.is_immutable) {
+        if (rv == CKR_OK && (!strncmp(dbpath, "file::memory", 12)
+                || !strcmp(dbpath, ":memory:"))) {
+            LOGE("An in memory store cannot be immutable");
+            return CKR_GENERAL_ERROR;
+        }
+
+        if (rv != CKR_OK) {
+            LOGE("Could not find an immutable pkcs11 store");
+            LOGE("Consider exporting "PKCS11_STORE_ENV_VAR" to point to a valid store directory");
+            return rv;
+        }
+
+        LOGV("Using immutable sqlite3 DB: \"%s\"", dbpath);
+
+        rv = db_open_immutable(dbpath, db);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        return db_setup_immutable(*db);
+    }
+
     if (rv == CKR_TOKEN_NOT_PRESENT) {
         rv = db_create(dbpath, sizeof(dbpath));
     }
@@ -2656,11 +4485,155 @@ static CK_RV db_free(sqlite3 **db) {
     return CKR_OK;
 }
 
+/*
+ * Tags the change log entries written through this connection, so they are
+ * not merged back into the objects they came from. A temporary trigger only
+ * fires for the connection that created it.
+ */
+static void db_track_origin(void) {
+
+    sqlite3_int64 origin = 0;
+    if (RAND_bytes((unsigned char *)&origin, sizeof(origin)) != 1) {
+        LOGW("Could not generate change log origin");
+        return;
+    }
+
+    origin &= INT64_MAX;
+    if (!origin) {
+        origin = 1;
+    }
+
+    char sql[256];
+    snprintf(sql, sizeof(sql),
+        "CREATE TEMP TRIGGER tag_tobject_changes\n"
+        "AFTER INSERT ON main.tobject_changes\n"
+        "BEGIN\n"
+        "    UPDATE tobject_changes SET origin=%lld WHERE seq=new.seq;\n"
+        "END;\n", (long long)origin);
+
+    char *err = NULL;
+    int rc = sqlite3_exec(global.db, sql, NULL, NULL, &err);
+    if (rc != SQLITE_OK) {
+        /* not fatal, our own changes get merged back in */
+        LOGW("Cannot tag own changes: %s", err);
+        sqlite3_free(err);
+        return;
+    }
+
+    global.origin = origin;
+}
+
 CK_RV db_init(void) {
 
-    return db_new(&global.db);
+    CK_RV rv = mutex_create(&global.mutex);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize db mutex: 0x%lx", rv);
+        return rv;
+    }
+
+    global.is_immutable = !!getenv(PKCS11_STORE_IMMUTABLE_ENV_VAR);
+
+    rv = db_new(&global.db);
+    if (rv != CKR_OK) {
+        mutex_destroy(global.mutex);
+        global.mutex = NULL;
+        return rv;
+    }
+
+    if (global.is_immutable) {
+        /* nothing to tag or queue, writes are refused */
+        stmt_cache_init();
+        return CKR_OK;
+    }
+
+    db_track_origin();
+
+    stmt_cache_init();
+
+    rv = queue_init();
+    if (rv != CKR_OK) {
+        stmt_cache_free();
+        db_free(&global.db);
+        mutex_destroy(global.mutex);
+        global.mutex = NULL;
+        return rv;
+    }
+
+    return CKR_OK;
 }
 
 CK_RV db_destroy(void) {
+
+    queue_destroy();
+
+    /* a connection with unfinalized statements cannot be closed */
+    stmt_cache_free();
+
+    mutex_destroy(global.mutex);
+    global.mutex = NULL;
+
     return db_free(&global.db);
 }
+
+CK_RV db_fork_child(void) {
+
+    /*
+     * The parent's mutex may have been held by a thread that doesn't exist
+     * in the child, so never touch it, just replace it.
+     */
+    CK_RV rv = mutex_create(&global.mutex);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize db mutex: 0x%lx", rv);
+        return rv;
+    }
+
+    /* an in memory db has no file locks to share, keep using it */
+    const char *dbpath = sqlite3_db_filename(global.db, "main");
+    if (!dbpath || !dbpath[0]) {
+        return queue_fork_child(false);
+    }
+
+    /*
+     * sqlite connections must not be carried across fork(), open a new one
+     * on the same file. The parent's connection is deliberately leaked,
+     * closing it here would release POSIX locks the parent still holds.
+     */
+    sqlite3 *db = NULL;
+    if (global.is_immutable) {
+        rv = db_open_immutable(dbpath, &db);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        LOGV("Reopened immutable sqlite3 DB after fork: \"%s\"", dbpath);
+
+        global.db = db;
+        stmt_cache_init();
+        return CKR_OK;
+    }
+
+    int rc = sqlite3_open(dbpath, &db);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return CKR_GENERAL_ERROR;
+    }
+
+    LOGV("Reopened sqlite3 DB after fork: \"%s\"", dbpath);
+
+    rv = db_configure(db);
+    if (rv != CKR_OK) {
+        sqlite3_close(db);
+        return rv;
+    }
+
+    global.db = db;
+
+    /* the parent's changes from here on are not ours */
+    db_track_origin();
+
+    /* the kept statements belong to the parent's connection, leak them too */
+    stmt_cache_init();
+
+    return queue_fork_child(true);
+}
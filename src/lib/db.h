@@ -37,8 +37,130 @@ struct pobject_v4 {
 CK_RV db_init(void);
 CK_RV db_destroy(void);
 
+/**
+ * Re-establishes the store connection in the child of a fork(), after
+ * db_init() ran in the parent.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV db_fork_child(void);
+
+/**
+ * Reads the token table, the tokens are not loaded, see db_load_token().
+ * @param t
+ *  Storage for MAX_TOKEN_CNT tokens.
+ * @param len
+ *  The number of tokens read.
+ * @return
+ *  CKR_OK on success.
+ */
 CK_RV db_get_tokens(token *t, size_t *len);
 
+/**
+ * Loads the primary object, seal objects and objects of a token read by
+ * db_get_tokens() or db_get_new_tokens().
+ * @param t
+ *  The token, with its TPM context up.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV db_load_token(token *t);
+
+/**
+ * Reads the tokens in the store that are not in the known list, like
+ * db_get_tokens().
+ * @param known
+ *  The ids of the tokens already loaded.
+ * @param known_len
+ *  The number of known ids.
+ * @param tok
+ *  Storage for the new tokens.
+ * @param max
+ *  The number of tokens tok can hold.
+ * @param len
+ *  The number of new tokens read.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV db_get_new_tokens(const unsigned *known, size_t known_len,
+        token *tok, size_t max, size_t *len);
+
+/**
+ * Gets the store's data version, which changes whenever another connection
+ * commits a change to it, see sqlite's PRAGMA data_version.
+ * @param version
+ *  The data version.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV db_get_data_version(int *version);
+
+/**
+ * Merges the tobject changes other processes made to the store since the
+ * token was loaded or last refreshed. Added objects get new handles,
+ * updated ones keep theirs and removed ones go away. Busy objects are
+ * left as they are and picked up by a later refresh. Call with the token
+ * locked exclusive.
+ * @param tok
+ *  The token to refresh.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV db_refresh_tobjects(token *tok);
+
+/**
+ * Reads the serialized attributes of a tobject, tokens are loaded with just
+ * the summary of them.
+ * @param id
+ *  The tobject id.
+ * @param attrs
+ *  The serialized attributes, free with twist_free().
+ * @return
+ *  CKR_OK on success, CKR_OBJECT_HANDLE_INVALID if the object is no longer
+ *  in the store.
+ */
+CK_RV db_get_tobject_attrs(unsigned id, twist *attrs);
+
+/**
+ * Creates a non-blocking file descriptor that becomes readable when the
+ * store directory changes.
+ * @return
+ *  The file descriptor, or -1 if the store cannot be watched, like an in
+ *  memory store.
+ */
+int db_watch_new(void);
+
+/**
+ * Checks if the store was opened immutable, see TPM2_PKCS11_STORE_IMMUTABLE.
+ * Writes to it fail with CKR_TOKEN_WRITE_PROTECTED.
+ * @return
+ *  true if the store is never written to.
+ */
+bool db_is_immutable(void);
+
+/**
+ * Waits for the writes the calling thread queued for a group commit. Call
+ * with no token locked, so other writers can join the batch meanwhile.
+ * @return
+ *  CKR_OK if they were committed or none were queued.
+ */
+CK_RV db_wait_for_writes(void);
+
+/**
+ * Gets the number of group commits that failed. Their writes were already
+ * applied to the tokens, which have to read their objects again.
+ * @return
+ *  The number of failed group commits.
+ */
+unsigned db_get_failed_commits(void);
+
+/**
+ * Reads the pending change notifications of a db_watch_new() descriptor.
+ * @param fd
+ *  The file descriptor.
+ */
+void db_watch_drain(int fd);
+
 CK_RV db_update_for_pinchange(
         token *tok,
         bool is_so,
@@ -85,6 +207,8 @@ tobject *__real_db_tobject_new(sqlite3_stmt *stmt);
 int init_pobject_v3_from_stmt(sqlite3_stmt *stmt, pobject_v3 *old_pobj);
 int init_tobjects(token *tok);
 int __real_init_tobjects(token *tok);
+int init_tobject_changes(token *tok);
+int __real_init_tobject_changes(token *tok);
 CK_RV convert_pobject_v3_to_v4(pobject_v3 *old_pobj, pobject_v4 *new_pobj);
 CK_RV db_add_pobject_v4(sqlite3 *updb, pobject_v4 *new_pobj);
 int init_pobject_from_stmt(sqlite3_stmt *stmt, tpm_ctx *tpm, pobject *pobj);
@@ -94,6 +218,9 @@ int init_sealobjects(unsigned tokid, sealobject *sealobj);
 int __real_init_sealobjects(unsigned tokid, sealobject *sealobj);
 int get_lock_path(const char *path, char *lockpath);
 FILE *take_lock(const char *path, char *lockpath);
+CK_RV db_configure(sqlite3 *db);
+CK_RV db_open_immutable(const char *dbpath, sqlite3 **db);
+CK_RV db_new(sqlite3 **db);
 #endif
 
 #endif /* SRC_PKCS11_LIB_DB_H_ */
@@ -144,7 +144,7 @@ CK_RV derive(session_ctx* ctx,  CK_MECHANISM_PTR mechanism, /* public EC point *
     assert(tok);
 
     tobject* tobj = NULL;
-    rv = token_load_object(tok, tpm_key, &tobj);
+    rv = token_load_object(tok, tok->tctx, tpm_key, &tobj);
     if (rv != CKR_OK) {
         return rv;
     }
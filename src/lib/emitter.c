@@ -240,6 +240,43 @@ doc_delete:
 
 }
 
+/*
+ * Adds an integer config value to the mapping, values of 0 are the
+ * default and are left out.
+ */
+static bool add_config_size(yaml_document_t *doc, int root, const char *name, size_t value) {
+
+    if (!value) {
+        return true;
+    }
+
+    int key = yaml_document_add_scalar(doc, (yaml_char_t *)YAML_STR_TAG,
+         (yaml_char_t *)name, -1, YAML_ANY_SCALAR_STYLE);
+    if (!key) {
+        LOGE("yaml_document_add_scalar for key failed");
+        return false;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%zu", value);
+
+    int node = yaml_document_add_scalar(doc, (yaml_char_t *)YAML_INT_TAG,
+         (yaml_char_t *)buf, -1, YAML_ANY_SCALAR_STYLE);
+    if (!node) {
+        LOGE("yaml_document_add_scalar for value failed");
+        return false;
+    }
+
+    int rc = yaml_document_append_mapping_pair(doc,
+            root, key, node);
+    if (!rc) {
+        LOGE("yaml_document_append_mapping_pair failed");
+        return false;
+    }
+
+    return true;
+}
+
 WEAK char *emit_config_to_string(token *t) {
 
     yaml_document_t doc = { 0 };
@@ -348,6 +385,17 @@ WEAK char *emit_config_to_string(token *t) {
         }
     }
 
+    /* add the sizing config values, if set */
+    if (!add_config_size(&doc, root, "tpm-ctx-pool-size",
+            t->config.tpm_ctx_pool_size)) {
+        goto doc_delete;
+    }
+
+    if (!add_config_size(&doc, root, "max-sessions",
+            t->config.max_sessions)) {
+        goto doc_delete;
+    }
+
     yaml_emitter_t emitter = { 0 };
 
     /* dummy dump the yaml to get size */
@@ -270,7 +270,8 @@ static CK_RV common_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata,
     }
 
     tobject *tobj;
-    CK_RV rv = token_load_object(tok, key, &tobj);
+    tpm_ctx *tpm = session_ctx_get_tpm(ctx);
+    CK_RV rv = token_load_object(tok, tpm, key, &tobj);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -297,8 +298,12 @@ static CK_RV common_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata,
      * only object and don't go to the TPM.
      */
     if (tobj->pub) {
-        rv = mech_get_tpm_opdata(tok->mdtl, tok->tctx, mechanism, tobj,
+        rv = mech_get_tpm_opdata(tok->mdtl, tpm, mechanism, tobj,
                 &opdata->cryptopdata.tpm_opdata);
+        if (rv == CKR_OK && !supplied_opdata) {
+            tpm_opdata_set_cancel(opdata->cryptopdata.tpm_opdata,
+                    session_ctx_cancel_reset(ctx));
+        }
     } else {
         opdata->use_sw = true;
         rv = sw_encrypt_data_init(mechanism, tobj, &opdata->cryptopdata.sw_enc_data);
@@ -319,6 +324,31 @@ static CK_RV common_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata,
     return CKR_OK;
 }
 
+/*
+ * The update and final calls come in with only the session locked. Software
+ * operations, like an RSA public key encrypt with OpenSSL, only need the token
+ * for reading the object, TPM operations also need the TPM. Internal callers
+ * supplying their own opdata already hold the locks.
+ */
+static tpm_ctx *encrypt_lock(session_ctx *ctx, bool use_sw) {
+
+    if (use_sw) {
+        token_lock_shared(session_ctx_get_token(ctx));
+        return NULL;
+    }
+
+    return session_ctx_lock_tpm(ctx);
+}
+
+static void encrypt_unlock(session_ctx *ctx, tpm_ctx *tpm) {
+
+    if (!tpm) {
+        token_unlock(session_ctx_get_token(ctx));
+    } else {
+        session_ctx_unlock_tpm(ctx, tpm);
+    }
+}
+
 static CK_RV common_update_op (session_ctx *ctx, encrypt_op_data *supplied_opdata, operation op,
         CK_BYTE_PTR part, CK_ULONG part_len,
         CK_BYTE_PTR encrypted_part, CK_ULONG_PTR encrypted_part_len) {
@@ -328,6 +358,8 @@ static CK_RV common_update_op (session_ctx *ctx, encrypt_op_data *supplied_opdat
 
     CK_RV rv = CKR_GENERAL_ERROR;
 
+    bool is_locked = false;
+    tpm_ctx *tpm = NULL;
     encrypt_op_data *opdata = NULL;
     if (!supplied_opdata) {
         rv = session_ctx_opdata_get(ctx, op, &opdata);
@@ -335,10 +367,20 @@ static CK_RV common_update_op (session_ctx *ctx, encrypt_op_data *supplied_opdat
             return rv;
         }
 
+        tpm = encrypt_lock(ctx, opdata->use_sw);
+        is_locked = true;
+
         rv = session_ctx_tobject_authenticated(ctx);
         if (rv != CKR_OK) {
+            encrypt_unlock(ctx, tpm);
             return rv;
         }
+
+        /* the software key is a copy owned by the operation */
+        if (opdata->use_sw) {
+            encrypt_unlock(ctx, tpm);
+            is_locked = false;
+        }
     } else {
         opdata = supplied_opdata;
     }
@@ -352,11 +394,27 @@ static CK_RV common_update_op (session_ctx *ctx, encrypt_op_data *supplied_opdat
         fop = opdata->use_sw ? sw_decrypt : tpm_decrypt;
         break;
     default:
-        return CKR_GENERAL_ERROR;
+        rv = CKR_GENERAL_ERROR;
+        goto out;
     }
 
     rv = fop(&opdata->cryptopdata, opdata->clazz, part, part_len,
             encrypted_part, encrypted_part_len);
+    if (rv == CKR_FUNCTION_CANCELED && !supplied_opdata) {
+        /* a canceled operation is over */
+        tobject *tobj = session_ctx_opdata_get_tobject(ctx);
+        assert(tobj);
+        tobj->is_authenticated = false;
+        encrypt_unlock(ctx, tpm);
+        is_locked = false;
+        session_ctx_opdata_clear(ctx);
+        tobject_user_decrement(tobj);
+    }
+
+out:
+    if (is_locked) {
+        encrypt_unlock(ctx, tpm);
+    }
 
     return rv;
 }
@@ -369,6 +427,8 @@ static CK_RV common_final_op(session_ctx *ctx, encrypt_op_data *supplied_opdata,
     bool reset_ctx = false;
     CK_RV rv = CKR_GENERAL_ERROR;
 
+    bool is_locked = false;
+    tpm_ctx *tpm = NULL;
     encrypt_op_data *opdata = supplied_opdata;
     if (!opdata) {
         rv = session_ctx_opdata_get(ctx, op, &opdata);
@@ -376,8 +436,12 @@ static CK_RV common_final_op(session_ctx *ctx, encrypt_op_data *supplied_opdata,
             return rv;
         }
 
+        tpm = encrypt_lock(ctx, opdata->use_sw);
+        is_locked = true;
+
         rv = session_ctx_tobject_authenticated(ctx);
         if (rv != CKR_OK) {
+            encrypt_unlock(ctx, tpm);
             return rv;
         }
     }
@@ -433,6 +497,10 @@ out:
         }
     }
 
+    if (is_locked) {
+        encrypt_unlock(ctx, tpm);
+    }
+
     return rv;
 }
 
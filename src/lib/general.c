@@ -2,8 +2,10 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "checks.h"
 #include "config.h"
@@ -13,6 +15,7 @@
 #include "mutex.h"
 #include "pkcs11.h"
 #include "session.h"
+#include "slot.h"
 #include "utils.h"
 
 #ifndef VERSION
@@ -136,10 +139,85 @@ CK_RV general_get_func_list(CK_FUNCTION_LIST **function_list) {
 }
 
 static bool _g_is_init;
+
+/*
+ * Set in the child of a fork() of an initialized library, the state is
+ * re-established on the next call rather than in the atfork handler, which
+ * may only do async-signal-safe work.
+ */
+static bool _g_is_forked;
+/* the first C_Initialize in the child picks up the carried over state */
+static bool _g_fork_init_pending;
+static pthread_mutex_t _g_fork_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _g_atfork_once = PTHREAD_ONCE_INIT;
+
+static void general_atfork_child(void) {
+
+    /* a parent thread may have held it */
+    static const pthread_mutex_t init = PTHREAD_MUTEX_INITIALIZER;
+    memcpy(&_g_fork_mutex, &init, sizeof(init));
+
+    _g_is_forked = _g_is_init;
+}
+
+static void general_atfork_register(void) {
+
+    int rc = pthread_atfork(NULL, NULL, general_atfork_child);
+    if (rc) {
+        LOGW("Could not register fork handler, children must call"
+                " C_Finalize and C_Initialize: %s", strerror(rc));
+    }
+}
+
+static void general_fork_child(void) {
+
+    pthread_mutex_lock(&_g_fork_mutex);
+
+    if (!_g_is_forked) {
+        /* another thread of the child got here first */
+        goto out;
+    }
+
+    LOGV("Re-initializing after fork");
+
+    /*
+     * Keep the token and object state parsed in the parent and only replace
+     * what can't cross a fork: the store connection, the TPM connections
+     * and the locks. Failing that, the child must start from scratch.
+     */
+    CK_RV rv = backend_fork_child();
+    if (rv == CKR_OK) {
+        rv = slot_fork_child();
+    }
+
+    if (rv != CKR_OK) {
+        LOGE("Could not re-initialize after fork: 0x%lx", rv);
+        _g_is_init = false;
+    } else {
+        _g_fork_init_pending = true;
+    }
+
+    __atomic_store_n(&_g_is_forked, false, __ATOMIC_RELEASE);
+
+out:
+    pthread_mutex_unlock(&_g_fork_mutex);
+}
+
 bool general_is_init(void) {
+
+    if (__atomic_load_n(&_g_is_forked, __ATOMIC_ACQUIRE)) {
+        general_fork_child();
+    }
+
     return _g_is_init;
 }
 
+bool general_take_fork_init(void) {
+
+    /* only valid after general_is_init() ran the fork handling */
+    return __atomic_exchange_n(&_g_fork_init_pending, false, __ATOMIC_ACQ_REL);
+}
+
 CK_RV general_init(void *init_args) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
@@ -210,6 +288,8 @@ CK_RV general_init(void *init_args) {
         goto err;
     }
 
+    (void)pthread_once(&_g_atfork_once, general_atfork_register);
+
     _g_is_init = true;
 
     return CKR_OK;
@@ -224,6 +304,7 @@ CK_RV general_finalize(void *reserved) {
     }
 
     _g_is_init = false;
+    _g_fork_init_pending = false;
 
     slot_destroy();
     backend_destroy();
@@ -12,6 +12,14 @@ CK_RV general_get_func_list(CK_FUNCTION_LIST **function_list);
 CK_RV general_get_info(CK_INFO *info);
 bool general_is_init(void);
 
+/**
+ * Tells whether the library state was carried over a fork() and not yet
+ * claimed by a C_Initialize in the child. Clears the condition.
+ * @return
+ *  true the first time it's called after the fork, false otherwise.
+ */
+bool general_take_fork_init(void);
+
 CK_RV general_finalize(void *reserved);
 
 #endif /* SRC_GENERAL_H_ */
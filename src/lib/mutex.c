@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <pthread.h>
@@ -170,3 +172,133 @@ CK_RV mutex_unlock(void *mutex) {
 
     return _g_unlock(mutex);
 }
+
+/*
+ * A reader/writer lock is a pthread rwlock when the default handlers are in
+ * use. When the application supplied its own mutex callbacks it falls back
+ * to one of their mutexes, as there is no shared mode in the PKCS11 API.
+ */
+typedef struct rwlock rwlock;
+struct rwlock {
+    bool is_native;
+    pthread_rwlock_t native;
+    void *mutex;
+};
+
+CK_RV rwlock_create(void **lock) {
+
+    if (!_g_create) {
+        return CKR_OK;
+    }
+
+    rwlock *l = calloc(1, sizeof(*l));
+    if (!l) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    l->is_native = _g_create == default_mutex_create;
+    if (!l->is_native) {
+        CK_RV rv = _g_create(&l->mutex);
+        if (rv != CKR_OK) {
+            free(l);
+            return rv;
+        }
+
+        *lock = l;
+        return CKR_OK;
+    }
+
+    int rc = pthread_rwlock_init(&l->native, NULL);
+    if (rc) {
+        LOGE("Could not initialize rwlock: %s", strerror(rc));
+        free(l);
+        return CKR_GENERAL_ERROR;
+    }
+
+    *lock = l;
+    return CKR_OK;
+}
+
+CK_RV rwlock_destroy(void *lock) {
+
+    rwlock *l = (rwlock *)lock;
+    if (!l) {
+        return CKR_OK;
+    }
+
+    CK_RV rv = CKR_OK;
+    if (!l->is_native) {
+        rv = _g_destroy ? _g_destroy(l->mutex) : CKR_OK;
+    } else {
+        int rc = pthread_rwlock_destroy(&l->native);
+        if (rc) {
+            LOGE("Could not destroy rwlock: %s", strerror(rc));
+            return CKR_MUTEX_BAD;
+        }
+    }
+
+    free(l);
+
+    return rv;
+}
+
+CK_RV rwlock_rdlock(void *lock) {
+
+    rwlock *l = (rwlock *)lock;
+    if (!l) {
+        return CKR_OK;
+    }
+
+    if (!l->is_native) {
+        return mutex_lock(l->mutex);
+    }
+
+    int rc = pthread_rwlock_rdlock(&l->native);
+    if (rc) {
+        LOGE("Could not read lock rwlock: %s", strerror(rc));
+        return CKR_MUTEX_BAD;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV rwlock_wrlock(void *lock) {
+
+    rwlock *l = (rwlock *)lock;
+    if (!l) {
+        return CKR_OK;
+    }
+
+    if (!l->is_native) {
+        return mutex_lock(l->mutex);
+    }
+
+    int rc = pthread_rwlock_wrlock(&l->native);
+    if (rc) {
+        LOGE("Could not write lock rwlock: %s", strerror(rc));
+        return CKR_MUTEX_BAD;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV rwlock_unlock(void *lock) {
+
+    rwlock *l = (rwlock *)lock;
+    if (!l) {
+        return CKR_OK;
+    }
+
+    if (!l->is_native) {
+        return mutex_unlock(l->mutex);
+    }
+
+    int rc = pthread_rwlock_unlock(&l->native);
+    if (rc) {
+        LOGE("Could not unlock rwlock: %s", strerror(rc));
+        return CKR_MUTEX_BAD;
+    }
+
+    return CKR_OK;
+}
@@ -62,6 +62,54 @@ CK_RV mutex_lock(void *mutex);
  */
 CK_RV mutex_unlock(void *mutex);
 
+/**
+ * Allocates and initializes a reader/writer lock. When the library uses the
+ * native OS locking this is a pthread rwlock. When the application supplied
+ * its own mutex callbacks, the lock is backed by one of their mutexes and
+ * readers are exclusive as well.
+ * @param rwlock
+ *  The pointer to store the lock at.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV rwlock_create(void **rwlock);
+
+/**
+ * Deallocates and destroys a reader/writer lock.
+ * @param rwlock
+ *  The lock to deallocate.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV rwlock_destroy(void *rwlock);
+
+/**
+ * Locks a reader/writer lock shared.
+ * @param rwlock
+ *  The lock to lock.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV rwlock_rdlock(void *rwlock);
+
+/**
+ * Locks a reader/writer lock exclusive.
+ * @param rwlock
+ *  The lock to lock.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV rwlock_wrlock(void *rwlock);
+
+/**
+ * Unlocks a reader/writer lock held either shared or exclusive.
+ * @param rwlock
+ *  The lock to unlock.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV rwlock_unlock(void *rwlock);
+
 static inline void _mutex_lock_fatal(void *mutex) {
 
     CK_RV rv = mutex_lock(mutex);
@@ -76,6 +124,27 @@ static inline void _mutex_unlock_fatal(void *mutex) {
     UNUSED(rv);
 }
 
+static inline void _rwlock_rdlock_fatal(void *rwlock) {
+
+    CK_RV rv = rwlock_rdlock(rwlock);
+    assert(rv == CKR_OK);
+    UNUSED(rv);
+}
+
+static inline void _rwlock_wrlock_fatal(void *rwlock) {
+
+    CK_RV rv = rwlock_wrlock(rwlock);
+    assert(rv == CKR_OK);
+    UNUSED(rv);
+}
+
+static inline void _rwlock_unlock_fatal(void *rwlock) {
+
+    CK_RV rv = rwlock_unlock(rwlock);
+    assert(rv == CKR_OK);
+    UNUSED(rv);
+}
+
 #ifndef NDEBUG
 /*
  * debugging lock macros, the LOGV is on the top line to report lineno correctly
@@ -89,8 +158,26 @@ static inline void _mutex_unlock_fatal(void *mutex) {
         _mutex_unlock_fatal(mutex); \
         LOGV("UNLOCK(%p)-released", mutex); \
     } while (0)
+
+#define rwlock_rdlock_fatal(rwlock) do { LOGV("RDLOCK(%p)-attempt", rwlock); \
+        _rwlock_rdlock_fatal(rwlock); \
+        LOGV("RDLOCK(%p)-aquired", rwlock); \
+    } while (0)
+
+#define rwlock_wrlock_fatal(rwlock) do { LOGV("WRLOCK(%p)-attempt", rwlock); \
+        _rwlock_wrlock_fatal(rwlock); \
+        LOGV("WRLOCK(%p)-aquired", rwlock); \
+    } while (0)
+
+#define rwlock_unlock_fatal(rwlock) do { LOGV("RWUNLOCK(%p)-attempt", rwlock); \
+        _rwlock_unlock_fatal(rwlock); \
+        LOGV("RWUNLOCK(%p)-released", rwlock); \
+    } while (0)
 #else
 #define mutex_lock_fatal(mutex) _mutex_lock_fatal(mutex)
 #define mutex_unlock_fatal(mutex) _mutex_unlock_fatal(mutex)
+#define rwlock_rdlock_fatal(rwlock) _rwlock_rdlock_fatal(rwlock)
+#define rwlock_wrlock_fatal(rwlock) _rwlock_wrlock_fatal(rwlock)
+#define rwlock_unlock_fatal(rwlock) _rwlock_unlock_fatal(rwlock)
 #endif
 #endif /* SRC_PKCS11_MUTEX_H_ */
@@ -1,11 +1,15 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <openssl/crypto.h>
 #include <openssl/obj_mac.h>
 
+#include "attr_index.h"
+#include "attr_tlv.h"
 #include "attrs.h"
 #include "backend.h"
 #include "checks.h"
@@ -13,23 +17,45 @@
 #include "emitter.h"
 #include "log.h"
 #include "object.h"
+#include "parser.h"
 #include "pkcs11.h"
 #include "session_ctx.h"
 #include "ssl_util.h"
 #include "token.h"
 #include "utils.h"
 
-typedef struct tobject_match_list tobject_match_list;
-struct tobject_match_list {
-    CK_OBJECT_HANDLE tobj_handle;
-    CK_BBOOL cka_private;
-    tobject_match_list *next;
+/*
+ * The attributes decoded when an object is read from the store, so searches
+ * by them don't decode every object. Must cover the types attr_index.c
+ * indexes, and match the tobject_columns of db.c.
+ */
+static const CK_ATTRIBUTE_TYPE summary_types[] = {
+    CKA_CLASS,
+    CKA_PRIVATE,
+    CKA_KEY_TYPE,
+    CKA_ID,
+    CKA_LABEL,
+    CKA_ISSUER,
+    CKA_SERIAL_NUMBER,
+    CKA_SUBJECT,
 };
 
+static CK_RV object_init_from_attr_list(tobject *tobj, attr_list *attrs);
+
+/*
+ * A C_FindObjects cursor, objects are matched as they are pulled. It sees
+ * the objects present at C_FindObjectsInit, in token order, that are still
+ * present when it gets to them, and matches them against their attributes
+ * at that point. Objects added after C_FindObjectsInit are not returned.
+ */
 typedef struct object_find_data object_find_data;
 struct object_find_data {
-    tobject_match_list *head;
-    tobject_match_list *cur;
+    CK_ATTRIBUTE_PTR templ;      /* copy of the search template */
+    CK_ULONG count;
+    bool use_summary;
+    uint64_t last_seq;           /* the newest object to look at */
+    uint64_t cur_seq;            /* the last object looked at, 0 for none */
+    CK_OBJECT_HANDLE cur_handle;
 };
 
 void tobject_free(tobject *tobj) {
@@ -57,6 +83,8 @@ void tobject_free(tobject *tobj) {
 
     attr_list *a = tobject_get_attrs(tobj);
     attr_list_free(a);
+    attr_list_free(tobj->summary);
+    twist_free(tobj->attrs_raw);
     free(tobj);
 }
 
@@ -219,38 +247,23 @@ static bool attr_filter(attr_list *attrs, CK_ATTRIBUTE_PTR templ, CK_ULONG count
     for (i=0; i < count; i++) {
         CK_ATTRIBUTE_PTR search = &templ[i];
 
-        CK_ATTRIBUTE_PTR compare = NULL;
-        bool is_attr_match = false;
-        CK_ULONG j;
-        for(j=0; j < attr_list_get_count(attrs); j++) {
-            const CK_ATTRIBUTE_PTR ptr = attr_list_get_ptr(attrs);
-            compare = &ptr[j];
-
-            if (search->type != compare->type) {
-                continue;
-            }
-
-            if (search->ulValueLen != compare->ulValueLen) {
-                continue;
-            }
-
-            bool match = !memcmp(compare->pValue, search->pValue, search->ulValueLen);
-            if (match) {
-                is_attr_match = true;
-                break;
-            }
-        }
-
         /*
-         * If we didn't get an attribute match, then the searched for attribute wasn't
-         * found and it's not a match. Ie search attribute set must be subset of compare
-         * attribute set
+         * If the searched for attribute isn't found or differs, it's not a
+         * match. Ie search attribute set must be subset of compare attribute
+         * set
          */
+        CK_ATTRIBUTE_PTR compare = attr_get_attribute_by_type(attrs, search->type);
+        if (!compare) {
+            return false;
+        }
 
-        if (!is_attr_match) {
+        if (search->ulValueLen != compare->ulValueLen) {
             return false;
         }
 
+        if (memcmp(compare->pValue, search->pValue, search->ulValueLen)) {
+            return false;
+        }
     }
 
     /*
@@ -262,11 +275,46 @@ static bool attr_filter(attr_list *attrs, CK_ATTRIBUTE_PTR templ, CK_ULONG count
     return true;
 }
 
-tobject *object_attr_filter(tobject *tobj, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+static bool is_summary_type(CK_ATTRIBUTE_TYPE type) {
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(summary_types); i++) {
+        if (summary_types[i] == type) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool is_summary_templ(CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        if (!is_summary_type(templ[i].type)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static CK_RV object_attr_filter(tobject *tobj, CK_ATTRIBUTE_PTR templ,
+        CK_ULONG count, bool use_summary, bool *is_match) {
+
+    attr_list *attrs = NULL;
+    if (use_summary) {
+        attrs = tobject_get_summary(tobj);
+    } else {
+        CK_RV rv = tobject_decode_attrs(tobj);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        attrs = tobject_get_attrs(tobj);
+    }
 
-    attr_list *attrs = tobject_get_attrs(tobj);
-    bool res = attr_filter(attrs, templ, count);
-    return res ? tobj : NULL;
+    *is_match = attr_filter(attrs, templ, count);
+    return CKR_OK;
 }
 
 
@@ -276,37 +324,56 @@ void object_find_data_free(object_find_data **fd) {
         return;
     }
 
-    tobject_match_list *cur = (*fd)->head;
-    while (cur) {
-        tobject_match_list *tmp = cur;
-        cur = cur->next;
-        free(tmp);
-    }
-
+    free((*fd)->templ);
     free(*fd);
     *fd = NULL;
 
     return;
 }
 
-static object_find_data *object_find_data_new(void) {
-    return calloc(1, sizeof(object_find_data));
-}
+static object_find_data *object_find_data_new(CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
 
-static CK_RV do_match_set(tobject_match_list *match_cur, tobject *tobj) {
+    /* the template and its values in one allocation */
+    size_t bytes = 0;
+    safe_mul(bytes, count, sizeof(*templ));
 
-    match_cur->tobj_handle = tobj->obj_handle;
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        if (templ[i].pValue) {
+            safe_adde(bytes, templ[i].ulValueLen);
+        }
+    }
 
-    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_CLASS);
-    if (!a) {
-        LOGE("Objects must have CK_OBJECT_CLASS");
-        assert(0);
-        return CKR_GENERAL_ERROR;
+    object_find_data *fd = calloc(1, sizeof(*fd));
+    if (!fd) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    if (!count) {
+        return fd;
     }
 
-    match_cur->cka_private = attr_list_get_CKA_PRIVATE(tobj->attrs, CK_FALSE);
+    fd->templ = malloc(bytes);
+    if (!fd->templ) {
+        LOGE("oom");
+        free(fd);
+        return NULL;
+    }
 
-    return CKR_OK;
+    CK_BYTE_PTR values = (CK_BYTE_PTR)&fd->templ[count];
+    for (i = 0; i < count; i++) {
+        fd->templ[i] = templ[i];
+        if (templ[i].pValue) {
+            fd->templ[i].pValue = values;
+            memcpy(values, templ[i].pValue, templ[i].ulValueLen);
+            values += templ[i].ulValueLen;
+        }
+    }
+
+    fd->count = count;
+
+    return fd;
 }
 
 CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
@@ -316,85 +383,73 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
         check_pointer(templ);
     }
 
-    CK_RV rv = CKR_GENERAL_ERROR;
-
-    object_find_data *fd = NULL;
-
     bool is_active = session_ctx_opdata_is_active(ctx);
     if (is_active) {
-        rv = CKR_OPERATION_ACTIVE;
-        goto out;
-    }
-
-    fd = object_find_data_new();
-    if (!fd) {
-        rv = CKR_HOST_MEMORY;
-        goto out;
+        return CKR_OPERATION_ACTIVE;
     }
 
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
-    if (!tok->tobjects.head) {
-        LOGV("Token %i contains no objects.", tok->id);
-        goto empty;
+    object_find_data *fd = object_find_data_new(templ, count);
+    if (!fd) {
+        return CKR_HOST_MEMORY;
     }
 
-    tobject_match_list *match_cur = NULL;
-    list *cur = &tok->tobjects.head->l;
-    while(cur) {
+    /* only decode objects when the summary can't answer */
+    fd->use_summary = is_summary_templ(templ, count);
 
-        // Get the current object, and grab it's id for the object handle
-        tobject *tobj = list_entry(cur, tobject, l);
-        cur = cur->next;
+    /* nothing is matched here, object_find() does it as handles are pulled */
+    fd->last_seq = tok->tobjects.last_seq;
 
-        tobject *match = object_attr_filter(tobj, templ, count);
-        if (!match) {
-            continue;
-        }
+    session_ctx_opdata_set(ctx, operation_find, NULL, fd, (opdata_free_fn)object_find_data_free);
 
-        /* we have a match, build the list */
-        if (!fd->head) {
-            /* set the head to point into the list */
-            fd->head = calloc(1, sizeof(*match_cur));
-            if (!fd->head) {
-                rv = CKR_HOST_MEMORY;
-                goto out;
-            }
+    return CKR_OK;
+}
 
-            match_cur = fd->head;
+static size_t find_resume_candidate(tobject * const *candidates, size_t cnt,
+        uint64_t cur_seq) {
 
+    /* candidates are in token order, find the first one past the cursor */
+    size_t lo = 0;
+    size_t hi = cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (candidates[mid]->seq <= cur_seq) {
+            lo = mid + 1;
         } else {
-            assert(match_cur);
-            match_cur->next = calloc(1, sizeof(*match_cur));
-            if (!match_cur->next) {
-                rv = CKR_HOST_MEMORY;
-                goto out;
-            }
-
-            match_cur = match_cur->next;
-        }
-
-        rv = do_match_set(match_cur, tobj);
-        if (rv != CKR_OK) {
-            goto out;
+            hi = mid;
         }
     }
 
-    fd->cur = fd->head;
+    return lo;
+}
+
+static list *find_resume_list(token *tok, object_find_data *fd) {
 
-empty:
+    if (!tok->tobjects.head) {
+        return NULL;
+    }
 
-    session_ctx_opdata_set(ctx, operation_find, NULL, fd, (opdata_free_fn)object_find_data_free);
+    if (!fd->cur_seq) {
+        return &tok->tobjects.head->l;
+    }
 
-    rv = CKR_OK;
+    /* the last object looked at is usually still there */
+    if (fd->cur_handle < tok->tobjects.index_len) {
+        tobject *tobj = tok->tobjects.index[fd->cur_handle];
+        if (tobj && tobj->seq == fd->cur_seq) {
+            return tobj->l.next;
+        }
+    }
 
-out:
-    if (rv != CKR_OK) {
-        object_find_data_free(&fd);
+    /* it was destroyed, walk up to where it was */
+    list *cur = &tok->tobjects.head->l;
+    while (cur && (list_entry(cur, tobject, l))->seq <= fd->cur_seq) {
+        cur = cur->next;
     }
 
-    return rv;
+    return cur;
 }
 
 CK_RV object_find(session_ctx *ctx, CK_OBJECT_HANDLE *object, CK_ULONG max_object_count, CK_ULONG_PTR object_count) {
@@ -410,25 +465,72 @@ CK_RV object_find(session_ctx *ctx, CK_OBJECT_HANDLE *object, CK_ULONG max_objec
         return rv;
     }
 
+    /*
+     * The token is locked shared, the objects are walked from where the
+     * previous call stopped.
+     */
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
+    // filter out CKA_PRIVATE set to CK_TRUE if not logged in and PIN is needed
+    bool hide_private = !token_is_user_logged_in(tok) && !tok->config.empty_user_pin;
+
+    /*
+     * Narrow the search down to the objects sharing one indexed template
+     * value, like CKA_ID, the whole template is still checked on each.
+     */
+    tobject * const *candidates = NULL;
+    size_t candidate_cnt = 0;
+    bool is_indexed = tok->tobjects.attr_index
+            && attr_index_lookup(tok->tobjects.attr_index, opdata->templ,
+                    opdata->count, &candidates, &candidate_cnt);
+
+    size_t i = is_indexed ?
+            find_resume_candidate(candidates, candidate_cnt, opdata->cur_seq) : 0;
+    list *cur = is_indexed ? NULL : find_resume_list(tok, opdata);
+
     CK_ULONG count = 0;
-    while(opdata->cur && count < max_object_count) {
+    while(count < max_object_count) {
+
+        tobject *tobj = NULL;
+        if (is_indexed) {
+            if (i == candidate_cnt) {
+                break;
+            }
+            tobj = candidates[i++];
+        } else {
+            if (!cur) {
+                break;
+            }
+            tobj = list_entry(cur, tobject, l);
+            cur = cur->next;
+        }
 
-        // Get the current object, and grab it's id for the object handle
-        CK_OBJECT_HANDLE handle = opdata->cur->tobj_handle;
+        /* added after C_FindObjectsInit, as is everything after it */
+        if (tobj->seq > opdata->last_seq) {
+            break;
+        }
 
-        // filter out CKA_PRIVATE set to CK_TRUE if not logged in and PIN is needed
-        if (opdata->cur->cka_private && !token_is_user_logged_in(tok) && !tok->config.empty_user_pin) {
-            opdata->cur = opdata->cur->next;
+        opdata->cur_seq = tobj->seq;
+        opdata->cur_handle = tobj->obj_handle;
+
+        bool is_match = false;
+        rv = object_attr_filter(tobj, opdata->templ, opdata->count,
+                opdata->use_summary, &is_match);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        if (!is_match) {
             continue;
         }
 
-        object[count] = handle;
+        if (hide_private
+                && attr_list_get_CKA_PRIVATE(tobject_get_summary(tobj), CK_FALSE)) {
+            continue;
+        }
 
-        // Update our iterator
-        opdata->cur = opdata->cur->next;
+        object[count] = tobj->obj_handle;
 
         count++;
     }
@@ -455,66 +557,54 @@ CK_RV object_find_final(session_ctx *ctx) {
 
 /**
  * given an attribute list with CKA_TPM2_ENC_BLOB, will unwrap it with the token wrapping
- * key and store it in CKA_VALUE.
+ * key into a CKA_VALUE attribute. The attribute list is left untouched, so this is safe
+ * with the token lock held shared.
  * @param tok
  *  The token
  * @param attrs
- *  The attribute list to modify.
+ *  The attribute list to read the wrapped value from.
+ * @param value
+ *  The CKA_VALUE attribute to populate, the caller must cleanse and free pValue
+ *  as a twist.
  * @return
  *  CKR_OK on success.
  */
-static CK_RV unwrap_protected_cka_value(token *tok, attr_list *attrs) {
+static CK_RV unwrap_protected_cka_value(token *tok, attr_list *attrs, CK_ATTRIBUTE_PTR value) {
     /* Caller wants CKA_VALUE in their template and it's not found, we need to fetch it, do we have
      * the wrapped value in the DB? */
     assert(tok->wrappingkey);
 
     CK_ATTRIBUTE_PTR ciphertext_attr = attr_get_attribute_by_type(attrs, CKA_TPM2_ENC_BLOB);
-    if (ciphertext_attr) {
-
-        twist plaintext = NULL;
-        size_t len = 0;
-        if (ciphertext_attr->ulValueLen) {
-            twist ciphertext = twistbin_new(ciphertext_attr->pValue, ciphertext_attr->ulValueLen);
-            if (!ciphertext) {
-                LOGE("oom");
-                return CKR_HOST_MEMORY;
-            }
-
-            CK_RV rv = utils_ctx_unwrap_objauth(tok->wrappingkey, ciphertext, &plaintext);
-            twist_free(ciphertext);
-            if (rv != CKR_OK) {
-                LOGE("Could not unwrap CKA_VALUE");
-                return rv;
-            }
+    if (!ciphertext_attr) {
+        // TODO: Fetch from TPM to support more object types?
+        // TODO: set CKA_VALUE to 0?
+        LOGW("Needed CKA_VALUE but didn't find encrypted blob");
+        return CKR_ATTRIBUTE_TYPE_INVALID;
+    }
 
-            len = twist_len(plaintext);
+    twist plaintext = NULL;
+    size_t len = 0;
+    if (ciphertext_attr->ulValueLen) {
+        twist ciphertext = twistbin_new(ciphertext_attr->pValue, ciphertext_attr->ulValueLen);
+        if (!ciphertext) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
         }
 
-        CK_ATTRIBUTE temp = {
-            .type = CKA_VALUE,
-            .pValue = (void *)plaintext,
-            .ulValueLen = len
-        };
-
-        /*
-         * Add the unwrapped value back to CKA_VALUE
-         *  - Append if not in the list
-         *  - Update if it's in the list
-         */
-        CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(attrs, CKA_TPM2_ENC_BLOB);
-        CK_RV rv = found ?
-                attr_list_update_entry(attrs, &temp) : attr_list_append_entry(&attrs, &temp);
-        twist_free(plaintext);
+        CK_RV rv = utils_ctx_unwrap_objauth(tok->wrappingkey, ciphertext, &plaintext);
+        twist_free(ciphertext);
         if (rv != CKR_OK) {
+            LOGE("Could not unwrap CKA_VALUE");
             return rv;
         }
 
-    } else {
-        // TODO: Fetch from TPM to support more object types?
-        // TODO: set CKA_VALUE to 0?
-        LOGW("Needed CKA_VALUE but didn't find encrypted blob");
+        len = twist_len(plaintext);
     }
 
+    value->type = CKA_VALUE;
+    value->pValue = (void *)plaintext;
+    value->ulValueLen = len;
+
     return CKR_OK;
 }
 
@@ -612,10 +702,14 @@ CK_RV object_get_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
 
         CK_ATTRIBUTE_PTR t = &templ[i];
 
+        CK_ATTRIBUTE unwrapped = { 0 };
         CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(tobj->attrs, t->type);
         if (cka_private && t->type == CKA_VALUE && is_user_logged_in &&
                 (!found || !found->ulValueLen)) {
-            rv = unwrap_protected_cka_value(tok, tobj->attrs);
+            CK_RV tmp_rv = unwrap_protected_cka_value(tok, tobj->attrs, &unwrapped);
+            if (tmp_rv == CKR_OK) {
+                found = &unwrapped;
+            }
             /* continue on processing */
         }
 
@@ -623,19 +717,20 @@ CK_RV object_get_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
             if (!t->pValue) {
                 /* only populate size if the buffer is null */
                 t->ulValueLen = found->ulValueLen;
-                continue;
-            }
-
-            /* The found attribute should fit inside the one to copy to */
-            if (found->ulValueLen > t->ulValueLen) {
+            } else if (found->ulValueLen > t->ulValueLen) {
+                /* The found attribute should fit inside the one to copy to */
                 t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
                 rv = CKR_BUFFER_TOO_SMALL;
-                continue;
+            } else {
+                t->ulValueLen = found->ulValueLen;
+                if (found->ulValueLen && found->pValue) {
+                    memcpy(t->pValue, found->pValue, found->ulValueLen);
+                }
             }
 
-            t->ulValueLen = found->ulValueLen;
-            if (found->ulValueLen && found->pValue) {
-                memcpy(t->pValue, found->pValue, found->ulValueLen);
+            if (unwrapped.pValue) {
+                OPENSSL_cleanse(unwrapped.pValue, unwrapped.ulValueLen);
+                twist_free(unwrapped.pValue);
             }
        } else {
            /* If it's not found it defaults to empty. */
@@ -728,12 +823,21 @@ CK_RV object_set_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
         is_backed_up = true;
     }
 
+    /* index under the new values first, it's the part that can fail */
+    rv = attr_index_add(tok->tobjects.attr_index, tobj, tmp);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
     /* in memory is updated, so update the persistent store */
     rv = backend_update_tobject_attrs(tok, tobj, tmp);
     if (rv != CKR_OK) {
+        attr_index_remove(tok->tobjects.attr_index, tobj, tmp);
         goto error;
     }
 
+    attr_index_remove(tok->tobjects.attr_index, tobj, tobject_get_summary(tobj));
+
     if (is_backed_up) {
         a->pValue = backup.pValue;
         a->ulValueLen = backup.ulValueLen;
@@ -746,6 +850,10 @@ CK_RV object_set_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
     attr_list_free(tobj->attrs);
     tobj->attrs = tmp;
 
+    /* the summary is stale now, the full list takes its place */
+    attr_list_free(tobj->summary);
+    tobj->summary = NULL;
+
     rv = CKR_OK;
 
 out:
@@ -848,36 +956,174 @@ attr_list *tobject_get_attrs(tobject *tobj) {
     return tobj->attrs;
 }
 
-CK_RV _tobject_user_increment(tobject *tobj, const char *filename, int lineno) {
+attr_list *tobject_get_summary(tobject *tobj) {
+    return tobj->summary ? tobj->summary : tobj->attrs;
+}
+
+/*
+ * Stores written before the binary format hold YAML until they are
+ * upgraded, so both are read.
+ */
+static CK_RV attrs_from_raw(const unsigned char *raw, size_t len,
+        const CK_ATTRIBUTE_TYPE *keep, size_t keep_len, attr_list **attrs) {
 
-    if (tobj->active == UINT_MAX) {
-       LOGE("tobject active at max count, cannot issue. id: %u", tobj->id);
-       return CKR_GENERAL_ERROR;
+    if (attr_tlv_is_tlv(raw, len)) {
+        return attr_tlv_decode(raw, len, keep, keep_len, attrs);
     }
 
-    tobj->active++;
-    _LOGV(filename, lineno, "Incremented tobject id: %u, value: %u", tobj->id, tobj->active);
+    bool res = keep ?
+            parse_attribute_subset_from_string(raw, len, keep, keep_len, attrs) :
+            parse_attributes_from_string(raw, len, attrs);
+    if (!res) {
+        LOGE("Could not parse attrs, got: \"%.*s\"", (int)len, raw);
+        return CKR_GENERAL_ERROR;
+    }
 
     return CKR_OK;
 }
 
-CK_RV _tobject_user_decrement(tobject *tobj, const char *filename, int lineno) {
+WEAK CK_RV tobject_set_raw_attrs(tobject *tobj, const unsigned char *raw, size_t len) {
 
-    if (!tobj->active) {
-        LOGE("Returning a non-active tobject id: %u", tobj->id);
-        return CKR_GENERAL_ERROR;
+    attr_list *summary = NULL;
+    CK_RV rv = attrs_from_raw(raw, len, summary_types,
+            ARRAY_LEN(summary_types), &summary);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    twist attrs_raw = twistbin_new(raw, len);
+    if (!attrs_raw) {
+        LOGE("oom");
+        attr_list_free(summary);
+        return CKR_HOST_MEMORY;
     }
 
-    tobj->active--;
-    _LOGV(filename, lineno, "Decremented tobject id: %u, value: %u", tobj->id, tobj->active);
+    tobj->summary = summary;
+    tobj->attrs_raw = attrs_raw;
 
     return CKR_OK;
 }
 
-static bool tobject_is_busy(tobject *tobj) {
+/*
+ * Guards is_decoding of all objects, it's only held to claim or release an
+ * object, the decoding runs without it. Objects are rarely decoded by more
+ * than one thread at a time, so they share one condition to wait on.
+ */
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decode_cond = PTHREAD_COND_INITIALIZER;
+
+void object_fork_child(void) {
+
+    /* a parent thread may have held it */
+    static const pthread_mutex_t lock_init = PTHREAD_MUTEX_INITIALIZER;
+    static const pthread_cond_t cond_init = PTHREAD_COND_INITIALIZER;
+    memcpy(&decode_lock, &lock_init, sizeof(lock_init));
+    memcpy(&decode_cond, &cond_init, sizeof(cond_init));
+}
+
+CK_RV tobject_decode_attrs(tobject *tobj) {
+
+    if (__atomic_load_n(&tobj->attrs, __ATOMIC_ACQUIRE)) {
+        return CKR_OK;
+    }
+
+    /*
+     * One thread decodes, others with the token lock shared sleep until it
+     * is done, as reading from the store may wait on other writers. If it
+     * fails, the next one tries again.
+     */
+    pthread_mutex_lock(&decode_lock);
+    while (tobj->is_decoding) {
+        pthread_cond_wait(&decode_cond, &decode_lock);
+    }
+
+    if (tobj->attrs) {
+        pthread_mutex_unlock(&decode_lock);
+        return CKR_OK;
+    }
+
+    tobj->is_decoding = true;
+    pthread_mutex_unlock(&decode_lock);
+
+    CK_RV rv = CKR_OK;
+
+    /* tokens load just the summary from the store, see db_tobject_new() */
+    if (!tobj->attrs_raw) {
+        rv = db_get_tobject_attrs(tobj->id, &tobj->attrs_raw);
+        if (rv != CKR_OK) {
+            goto out;
+        }
+    }
+
+    attr_list *attrs = NULL;
+    rv = attrs_from_raw((const unsigned char *)tobj->attrs_raw,
+            twist_len(tobj->attrs_raw), NULL, 0, &attrs);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    /* the blobs must be in place before attrs is visible */
+    rv = object_init_from_attr_list(tobj, attrs);
+    if (rv != CKR_OK) {
+        LOGE("Object initialization failed");
+        attr_list_free(attrs);
+        goto out;
+    }
+
+    twist_free(tobj->attrs_raw);
+    tobj->attrs_raw = NULL;
+
+    __atomic_store_n(&tobj->attrs, attrs, __ATOMIC_RELEASE);
+
+out:
+    pthread_mutex_lock(&decode_lock);
+    tobj->is_decoding = false;
+    pthread_cond_broadcast(&decode_cond);
+    pthread_mutex_unlock(&decode_lock);
+
+    return rv;
+}
+
+/*
+ * The active count is modified by callers holding the token lock shared, so
+ * it is updated atomically.
+ */
+CK_RV _tobject_user_increment(tobject *tobj, const char *filename, int lineno) {
+
+    unsigned cur = __atomic_load_n(&tobj->active, __ATOMIC_RELAXED);
+    do {
+        if (cur == UINT_MAX) {
+           LOGE("tobject active at max count, cannot issue. id: %u", tobj->id);
+           return CKR_GENERAL_ERROR;
+        }
+    } while (!__atomic_compare_exchange_n(&tobj->active, &cur, cur + 1,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    _LOGV(filename, lineno, "Incremented tobject id: %u, value: %u", tobj->id, cur + 1);
+
+    return CKR_OK;
+}
+
+CK_RV _tobject_user_decrement(tobject *tobj, const char *filename, int lineno) {
+
+    unsigned cur = __atomic_load_n(&tobj->active, __ATOMIC_RELAXED);
+    do {
+        if (!cur) {
+            LOGE("Returning a non-active tobject id: %u", tobj->id);
+            return CKR_GENERAL_ERROR;
+        }
+    } while (!__atomic_compare_exchange_n(&tobj->active, &cur, cur - 1,
+            false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    _LOGV(filename, lineno, "Decremented tobject id: %u, value: %u", tobj->id, cur - 1);
+
+    return CKR_OK;
+}
+
+bool tobject_is_busy(tobject *tobj) {
     assert(tobj);
 
-    return tobj->active > 0;
+    return __atomic_load_n(&tobj->active, __ATOMIC_ACQUIRE) > 0;
 }
 
 CK_RV object_destroy(session_ctx *ctx, CK_OBJECT_HANDLE object) {
@@ -1270,8 +1516,8 @@ out:
     return rv;
 }
 
-CK_RV object_init_from_attrs(tobject *tobj) {
-    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_OBJAUTH_ENC);
+static CK_RV object_init_from_attr_list(tobject *tobj, attr_list *attrs) {
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_TPM2_OBJAUTH_ENC);
     if (a && a->pValue && a->ulValueLen) {
         tobj->objauth = twistbin_new(a->pValue, a->ulValueLen);
         if (!tobj->objauth) {
@@ -1280,7 +1526,7 @@ CK_RV object_init_from_attrs(tobject *tobj) {
         }
     }
 
-    a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PUB_BLOB);
+    a = attr_get_attribute_by_type(attrs, CKA_TPM2_PUB_BLOB);
     if (a && a->pValue && a->ulValueLen) {
 
         tobj->pub = twistbin_new(a->pValue, a->ulValueLen);
@@ -1290,7 +1536,7 @@ CK_RV object_init_from_attrs(tobject *tobj) {
         }
     }
 
-    a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PRIV_BLOB);
+    a = attr_get_attribute_by_type(attrs, CKA_TPM2_PRIV_BLOB);
     if (a && a->pValue && a->ulValueLen) {
 
         if (!tobj->pub) {
@@ -1305,7 +1551,7 @@ CK_RV object_init_from_attrs(tobject *tobj) {
         }
     }
 
-    a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PERSISTENT_HANDLE);
+    a = attr_get_attribute_by_type(attrs, CKA_TPM2_PERSISTENT_HANDLE);
     if (a && a->pValue && a->ulValueLen) {
         CK_ULONG handle = 0;
         if (attr_CK_ULONG(a, &handle) != CKR_OK) {
@@ -1318,5 +1564,13 @@ CK_RV object_init_from_attrs(tobject *tobj) {
     return CKR_OK;
 
 error:
+    twist_free(tobj->objauth);
+    twist_free(tobj->pub);
+    twist_free(tobj->priv);
+    tobj->objauth = tobj->pub = tobj->priv = NULL;
     return CKR_GENERAL_ERROR;
 }
+
+CK_RV object_init_from_attrs(tobject *tobj) {
+    return object_init_from_attr_list(tobj, tobj->attrs);
+}
@@ -12,6 +12,9 @@
 #include "pkcs11.h"
 #include "twist.h"
 
+/* the most extra TPM contexts a token spreads key operations over */
+#define TPM_CTX_POOL_MAX 8
+
 typedef struct session_ctx session_ctx;
 typedef struct pobject pobject;
 
@@ -24,6 +27,8 @@ struct tobject {
 
     CK_OBJECT_HANDLE obj_handle; /** application visible handle */
 
+    uint64_t seq; /** order the object was added to the token in, never reused */
+
     /*
      * these all exist in the attribute array, but we'll keep some
      * twist copies of them handy for convenience.
@@ -32,13 +37,17 @@ struct tobject {
     twist priv;          /** private tpm data */
     twist objauth;       /** wrapped object auth value */
 
-    attr_list *attrs;    /** object attributes */
+    attr_list *attrs;    /** object attributes, NULL until decoded, see tobject_decode_attrs() */
+    twist attrs_raw;     /** serialized attributes not yet decoded */
+    attr_list *summary;  /** the attributes searched by, decoded up front */
+    bool is_decoding;    /** a thread is decoding attrs_raw, see tobject_decode_attrs() */
 
     list l;             /** list pointer for "listifying" tobjects */
 
     twist unsealed_auth; /** unwrapped auth value */
 
     uint32_t tpm_esys_tr;           /** loaded tpm handle */
+    uint32_t tpm_esys_tr_pool[TPM_CTX_POOL_MAX]; /** handles in the pooled tpm contexts, see tpm_tobject_handle() */
     uint32_t tpm_persistent_handle; /** persistent TPM handle **/
 
     bool is_authenticated; /** true if a context specific login has authenticated use of the object */
@@ -74,6 +83,48 @@ CK_RV tobject_set_blob_data(tobject *tobj, twist pub, twist priv);
  */
 CK_RV tobject_set_auth(tobject *tobj, twist authbin, twist wrappedauthhex);
 
+/**
+ * Sets the serialized attributes of a tobject read from the store. Only a
+ * summary of the attributes searched by is decoded, the rest waits for
+ * tobject_decode_attrs().
+ * @param tobj
+ *  The tobject to set.
+ * @param raw
+ *  The serialized attributes.
+ * @param len
+ *  The length of raw.
+ * @return
+ *  CKR_OK on success.
+ */
+WEAK CK_RV tobject_set_raw_attrs(tobject *tobj, const unsigned char *raw, size_t len);
+
+/**
+ * Decodes the serialized attributes of a tobject into tobj->attrs, if not
+ * done yet. Safe to call concurrently with the token lock held shared.
+ * @param tobj
+ *  The tobject to decode.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tobject_decode_attrs(tobject *tobj);
+
+/**
+ * Resets the lock tobject_decode_attrs() waits on in the child of a fork(),
+ * where a parent thread may have held it.
+ */
+void object_fork_child(void);
+
+/**
+ * Gets the attributes of a tobject that are always available, which
+ * include at least CKA_CLASS, CKA_PRIVATE and the ones attr_index.c
+ * indexes. May be the full attribute list.
+ * @param tobj
+ *  The tobject.
+ * @return
+ *  The attribute list.
+ */
+attr_list *tobject_get_summary(tobject *tobj);
+
 void tobject_set_esys_tr(tobject *tobj, uint32_t esys_tr);
 void tobject_set_persistent_handle(tobject *tobj, uint32_t handle);
 void tobject_set_id(tobject *tobj, unsigned id);
@@ -129,6 +180,16 @@ CK_RV _tobject_user_increment(tobject *tobj, const char *filename, int lineno);
  */
 #define tobject_user_increment(tobj) _tobject_user_increment(tobj, __FILE__, __LINE__)
 
+/**
+ * Checks if a tobject is in use by an operation, such objects cannot be
+ * removed or replaced.
+ * @param tobj
+ *  The tobject to check.
+ * @return
+ *  true if in use.
+ */
+bool tobject_is_busy(tobject *tobj);
+
 CK_RV object_destroy(session_ctx *ctx, CK_OBJECT_HANDLE object);
 
 
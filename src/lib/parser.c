@@ -34,8 +34,28 @@ struct handler_stack {
 
     handler_state state[MAX_DEPTH];
     handler_state *s;
+
+    /* the attribute types to keep, NULL for all */
+    const CK_ATTRIBUTE_TYPE *keep;
+    size_t keep_len;
 };
 
+static bool is_kept(handler_stack *state, CK_ATTRIBUTE_TYPE type) {
+
+    if (!state->keep) {
+        return true;
+    }
+
+    size_t i;
+    for (i = 0; i < state->keep_len; i++) {
+        if (state->keep[i] == type) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 bool push_handler(handler_stack *state, handler h) {
 
     if (state->depth >= MAX_DEPTH) {
@@ -263,7 +283,8 @@ bool handle_attr_event(yaml_event_t *event,
     case YAML_SEQUENCE_END_EVENT:
         /* XXX we know that sequences never come first so the previous state (map) has the key */
         assert(state->s);
-        res = attr_list_add_buf(l, state->state[0].key, state->s->seqbuf, state->s->seqbytes);
+        res = !is_kept(state, state->state[0].key) ||
+                attr_list_add_int_seq(l, state->state[0].key, state->s->seqbuf, state->s->seqbytes);
         free(state->s->seqbuf);
         state->s->seqbuf = NULL;
         if (!res) {
@@ -283,6 +304,13 @@ bool handle_attr_event(yaml_event_t *event,
             return false;
         }
 
+        /* skip converting values that are not kept, this is the costly part */
+        if (state->cur == on_map_scalar_event && state->s->is_value
+                && !is_kept(state, state->s->key)) {
+            state->s->is_value = false;
+            return true;
+        }
+
         return state->cur(event, state->s, l);
     default:
         LOGE("Unhandled YAML event type: %u\n", event->type);
@@ -294,7 +322,8 @@ bool handle_attr_event(yaml_event_t *event,
 
 #define ALLOC_SIZE 16
 
-bool parse_attributes(yaml_parser_t *parser, attr_list **attrs) {
+static bool parse_attributes_keep(yaml_parser_t *parser,
+        const CK_ATTRIBUTE_TYPE *keep, size_t keep_len, attr_list **attrs) {
 
     bool res = false;
 
@@ -305,7 +334,10 @@ bool parse_attributes(yaml_parser_t *parser, attr_list **attrs) {
     }
 
     yaml_event_t event;
-    handler_stack state = { 0 };
+    handler_stack state = {
+        .keep = keep,
+        .keep_len = keep_len,
+    };
     /* while events */
     do {
 
@@ -348,7 +380,12 @@ error:
     return res;
 }
 
-bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
+bool parse_attributes(yaml_parser_t *parser, attr_list **attrs) {
+    return parse_attributes_keep(parser, NULL, 0, attrs);
+}
+
+static bool parse_attributes_from_string_keep(const unsigned char *yaml,
+        size_t size, const CK_ATTRIBUTE_TYPE *keep, size_t keep_len,
         attr_list **attrs) {
 
     yaml_parser_t parser;
@@ -360,7 +397,7 @@ bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
 
     yaml_parser_set_input_string(&parser, yaml, size);
 
-    bool ret = parse_attributes(&parser, attrs);
+    bool ret = parse_attributes_keep(&parser, keep, keep_len, attrs);
     yaml_parser_delete(&parser);
     if (!ret) {
         attr_list_free(*attrs);
@@ -370,6 +407,17 @@ bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
     return ret;
 }
 
+bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
+        attr_list **attrs) {
+    return parse_attributes_from_string_keep(yaml, size, NULL, 0, attrs);
+}
+
+bool parse_attribute_subset_from_string(const unsigned char *yaml, size_t size,
+        const CK_ATTRIBUTE_TYPE *types, size_t len, attr_list **attrs) {
+    assert(types);
+    return parse_attributes_from_string_keep(yaml, size, types, len, attrs);
+}
+
 typedef struct config_state config_state;
 struct config_state {
     bool map_start;
@@ -439,6 +487,22 @@ bool handle_token_config_event(yaml_event_t *e,
             } else if(!strcmp(state->key, "empty-user-pin")) {
                 config->empty_user_pin = !strcmp((const char *)e->data.scalar.value, "true")
                         ? true : false;
+            } else if(!strcmp(state->key, "max-sessions")) {
+                int rc = str_to_ul((const char *)e->data.scalar.value,
+                        &config->max_sessions);
+                if (rc) {
+                    LOGE("Invalid max-sessions, got: \"%s\"",
+                            e->data.scalar.value);
+                    return false;
+                }
+            } else if(!strcmp(state->key, "tpm-ctx-pool-size")) {
+                int rc = str_to_ul((const char *)e->data.scalar.value,
+                        &config->tpm_ctx_pool_size);
+                if (rc) {
+                    LOGE("Invalid tpm-ctx-pool-size, got: \"%s\"",
+                            e->data.scalar.value);
+                    return false;
+                }
             } else {
                 LOGE("Unknown key, got: \"%s\"\n",
                         state->key);
@@ -12,6 +12,25 @@
 WEAK bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
         attr_list **attrs);
 
+/**
+ * Like parse_attributes_from_string() but only converts the values of the
+ * given attribute types, which is much cheaper on objects with big values.
+ * @param yaml
+ *  The serialized attributes.
+ * @param size
+ *  The size of yaml.
+ * @param types
+ *  The attribute types to keep.
+ * @param len
+ *  The number of types.
+ * @param attrs
+ *  The parsed attributes, the ones not present in the yaml are left out.
+ * @return
+ *  true on success.
+ */
+bool parse_attribute_subset_from_string(const unsigned char *yaml, size_t size,
+        const CK_ATTRIBUTE_TYPE *types, size_t len, attr_list **attrs);
+
 bool parse_token_config_from_string(const unsigned char *yaml, size_t size,
         token_config *config);
 
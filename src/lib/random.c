@@ -14,11 +14,16 @@ CK_RV random_get(session_ctx *ctx, CK_BYTE_PTR random_data, CK_ULONG random_len)
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
-    tpm_ctx *tpm = tok->tctx;
+    const bool *cancel = session_ctx_cancel_reset(ctx);
 
-    bool res = tpm_getrandom(tpm, random_data, random_len);
+    /* no keys involved, any context will do */
+    tpm_ctx *tpm = tpm_ctx_pool_lease(tok->tctx_pool, tok->tctx);
 
-    return res ? CKR_OK: CKR_GENERAL_ERROR;
+    tpm_lock(tpm);
+    CK_RV rv = tpm_getrandom(tpm, cancel, random_data, random_len);
+    tpm_unlock(tpm);
+
+    return rv;
 }
 
 CK_RV seed_random(session_ctx *ctx, CK_BYTE_PTR seed, CK_ULONG seed_len) {
@@ -28,8 +33,11 @@ CK_RV seed_random(session_ctx *ctx, CK_BYTE_PTR seed, CK_ULONG seed_len) {
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
-    tpm_ctx *tpm = tok->tctx;
+    tpm_ctx *tpm = tpm_ctx_pool_lease(tok->tctx_pool, tok->tctx);
+
+    tpm_lock(tpm);
     CK_RV rv = tpm_stirrandom(tpm, seed, seed_len);
+    tpm_unlock(tpm);
 
     return rv;
 }
@@ -15,16 +15,6 @@
 #include "tpm.h"
 #include "utils.h"
 
-static CK_RV check_max_sessions(session_table *s_table) {
-
-    CK_ULONG all;
-
-    session_table_get_cnt(s_table, &all, NULL, NULL);
-
-    return (all > MAX_NUM_OF_SESSIONS) ?
-        CKR_SESSION_COUNT : CKR_OK;
-}
-
 #define TOKID_SESSION_SHIFT ((sizeof(CK_SESSION_HANDLE) * 8) - 8)
 
 static inline void add_tokid_to_session_handle(unsigned tokid,
@@ -76,26 +66,36 @@ CK_RV session_open(CK_SLOT_ID slot_id, CK_FLAGS flags, void *application,
 	    return CKR_SLOT_ID_INVALID;
 	}
 
-	rv = check_max_sessions(t->s_table);
+	/* the first session of a slot brings up its token */
+	rv = token_load(t);
 	if (rv != CKR_OK) {
 	    return rv;
 	}
 
+	/*
+	 * The token lock keeps the login state stable until the new
+	 * session is in the table and will see future login events.
+	 */
+	token_lock_shared(t);
+
 	/*
 	 * Cannot open an R/O session when the SO is logged in
 	 */
 	if ((!(flags & CKF_RW_SESSION)) && (t->login_state == token_so_logged_in)) {
-	    return CKR_SESSION_READ_WRITE_SO_EXISTS;
+	    rv = CKR_SESSION_READ_WRITE_SO_EXISTS;
+	    goto out;
 	}
 
 	rv = session_table_new_entry(t->s_table, session, t, flags);
-    if (rv != CKR_OK) {
-        return rv;
-    }
+	if (rv == CKR_OK) {
+	    /* the slot id can change once the lock is dropped */
+	    add_tokid_to_session_handle(t->id, session);
+	}
 
-	add_tokid_to_session_handle(t->id, session);
+out:
+	token_unlock(t);
 
-	return CKR_OK;
+	return rv;
 }
 
 CK_RV session_close(CK_SESSION_HANDLE session) {
@@ -121,14 +121,50 @@ CK_RV session_lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx)
     unsigned tokid = get_tokid_from_session_handle_and_cleanse(&session);
     check_slot_id(tokid, tmp, CKR_SESSION_HANDLE_INVALID);
 
-    *ctx = session_table_lookup(tmp->s_table, session);
-    if (!*ctx) {
+    session_ctx *s = session_table_lookup(tmp->s_table, session);
+    if (!s) {
         return CKR_SESSION_HANDLE_INVALID;
     }
 
-    token_lock(tmp);
+    session_ctx_lock(s);
+
+    /* lost the race with C_CloseSession */
+    if (session_ctx_is_closed(s)) {
+        session_ctx_unlock(s);
+        session_table_put(tmp->s_table, s);
+        return CKR_SESSION_CLOSED;
+    }
 
+    *ctx = s;
     *tok = tmp;
 
     return CKR_OK;
 }
+
+CK_RV session_cancel(CK_SESSION_HANDLE session) {
+
+    token *t = NULL;
+    unsigned tokid = get_tokid_from_session_handle_and_cleanse(&session);
+    check_slot_id(tokid, t, CKR_SESSION_HANDLE_INVALID);
+
+    /*
+     * The operation being canceled holds the session lock, so don't take
+     * it, the table reference keeps the ctx alive.
+     */
+    session_ctx *ctx = session_table_lookup(t->s_table, session);
+    if (!ctx) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    session_ctx_cancel(ctx);
+
+    session_table_put(t->s_table, ctx);
+
+    return CKR_OK;
+}
+
+void session_release(token *tok, session_ctx *ctx) {
+
+    session_ctx_unlock(ctx);
+    session_table_put(tok->s_table, ctx);
+}
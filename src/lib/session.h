@@ -12,8 +12,9 @@ typedef struct session_ctx session_ctx;
 typedef struct token token;
 
 /*
- * This max value CANNOT extend into the upper byte of a CK_SESSION_HANDLE,
- * as that is reserved for the tokid.
+ * Default limit of open sessions per token, the token config key
+ * max-sessions overrides it up to the 16 bit slot index of a
+ * CK_SESSION_HANDLE, see session_table.c.
  */
 #define MAX_NUM_OF_SESSIONS 1024
 
@@ -24,6 +25,40 @@ CK_RV session_close(CK_SESSION_HANDLE session);
 
 CK_RV session_closeall(CK_SLOT_ID slot_id);
 
+/**
+ * Looks up a session by handle, returning it referenced and with the session
+ * lock held. The token lock is NOT taken, callers that touch shared token
+ * state must take it after the session lock.
+ * @param session
+ *  The session handle.
+ * @param tok
+ *  The token the session belongs to.
+ * @param ctx
+ *  The locked session context.
+ * @return
+ *  CKR_OK on success, must be paired with session_release().
+ */
 CK_RV session_lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx);
 
+/**
+ * Cancels the operation running on a session from another thread. Operations
+ * that take several TPM commands, like C_Encrypt on a large buffer, an HMAC
+ * over more than one TPM buffer or C_GenerateRandom, stop at the next command
+ * with CKR_FUNCTION_CANCELED and end, releasing the token and TPM.
+ * @param session
+ *  The session handle.
+ * @return
+ *  CKR_OK on success, CKR_SESSION_HANDLE_INVALID for an unknown session.
+ */
+CK_RV session_cancel(CK_SESSION_HANDLE session);
+
+/**
+ * Unlocks and drops the reference on a session returned by session_lookup().
+ * @param tok
+ *  The token the session belongs to.
+ * @param ctx
+ *  The session context.
+ */
+void session_release(token *tok, session_ctx *ctx);
+
 #endif /* SRC_PKCS11_SESSION_H_ */
@@ -22,6 +22,10 @@
 struct session_ctx {
 
     CK_FLAGS flags;
+    /*
+     * Changed by a login or logout on any session of the token, which
+     * doesn't hold this session's lock, updated atomically.
+     */
     CK_STATE state;
 
     token *tok;
@@ -29,6 +33,21 @@ struct session_ctx {
     generic_opdata opdata;
 
     opdata_free_fn free;
+
+    /* the TPM context leased for the active operation, see session_ctx_lock_tpm() */
+    tpm_ctx *tpm;
+
+    /* guards flags, opdata and the op specific data hung off of it */
+    void *mutex;
+
+    /* references held on the ctx, updated atomically */
+    unsigned refcnt;
+
+    /* set under the session lock once the ctx is pulled out of the table */
+    bool is_closed;
+
+    /* set by C_CancelFunction without the session lock, updated atomically */
+    bool cancel;
 };
 
 void session_ctx_free(session_ctx *ctx) {
@@ -39,6 +58,8 @@ void session_ctx_free(session_ctx *ctx) {
 
     session_ctx_opdata_clear(ctx);
 
+    mutex_destroy(ctx->mutex);
+
     free(ctx);
 }
 
@@ -78,18 +99,59 @@ CK_RV session_ctx_new(session_ctx **ctx, token *tok, CK_FLAGS flags) {
         return CKR_HOST_MEMORY;
     }
 
+    CK_RV rv = mutex_create(&s->mutex);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize session mutex: 0x%lx", rv);
+        free(s);
+        return rv;
+    }
+
     session_set_initial_state(s, tok->login_state, flags);
 
     s->flags = flags;
     s->tok = tok;
 
+    /* the session table holds the initial reference */
+    s->refcnt = 1;
+
     *ctx = s;
 
     return CKR_OK;
 }
 
+void *_session_ctx_get_lock(session_ctx *ctx) {
+    return ctx->mutex;
+}
+
+void session_ctx_ref(session_ctx *ctx) {
+    __atomic_add_fetch(&ctx->refcnt, 1, __ATOMIC_ACQ_REL);
+}
+
+bool session_ctx_unref(session_ctx *ctx) {
+    unsigned old = __atomic_fetch_sub(&ctx->refcnt, 1, __ATOMIC_ACQ_REL);
+    assert(old);
+    return old == 1;
+}
+
+void session_ctx_mark_closed(session_ctx *ctx) {
+    ctx->is_closed = true;
+}
+
+bool session_ctx_is_closed(session_ctx *ctx) {
+    return ctx->is_closed;
+}
+
+void session_ctx_cancel(session_ctx *ctx) {
+    __atomic_store_n(&ctx->cancel, true, __ATOMIC_RELEASE);
+}
+
+const bool *session_ctx_cancel_reset(session_ctx *ctx) {
+    __atomic_store_n(&ctx->cancel, false, __ATOMIC_RELEASE);
+    return &ctx->cancel;
+}
+
 CK_STATE session_ctx_state_get(session_ctx *ctx) {
-    return ctx->state;
+    return __atomic_load_n(&ctx->state, __ATOMIC_ACQUIRE);
 }
 
 CK_FLAGS session_ctx_flags_get(session_ctx *ctx) {
@@ -113,19 +175,24 @@ void session_ctx_login_event(session_ctx *ctx, CK_USER_TYPE usertype) {
      *  - https://www.cryptsoft.com/pkcs11doc/STANDARD/pkcs-11.pdf
      */
 
+    /* only changed with the token held exclusive, so no one else writes it */
+    CK_STATE state = session_ctx_state_get(ctx);
+
     if (usertype == CKU_SO) {
-        assert(ctx->state == CKS_RW_PUBLIC_SESSION);
-        ctx->state = CKS_RW_SO_FUNCTIONS;
+        assert(state == CKS_RW_PUBLIC_SESSION);
+        state = CKS_RW_SO_FUNCTIONS;
     } else {
-        assert(ctx->state == CKS_RO_PUBLIC_SESSION
-                || ctx->state == CKS_RW_PUBLIC_SESSION);
+        assert(state == CKS_RO_PUBLIC_SESSION
+                || state == CKS_RW_PUBLIC_SESSION);
 
-        if (ctx->state == CKS_RO_PUBLIC_SESSION) {
-            ctx->state = CKS_RO_USER_FUNCTIONS;
+        if (state == CKS_RO_PUBLIC_SESSION) {
+            state = CKS_RO_USER_FUNCTIONS;
         } else {
-            ctx->state = CKS_RW_USER_FUNCTIONS;
+            state = CKS_RW_USER_FUNCTIONS;
         }
     }
+
+    __atomic_store_n(&ctx->state, state, __ATOMIC_RELEASE);
 }
 
 void session_ctx_logout_event(session_ctx *ctx) {
@@ -134,12 +201,15 @@ void session_ctx_logout_event(session_ctx *ctx) {
      * Returns a session back to it's initial state.
      * See the comment block insession_ctx_login() for details
      */
-    if (ctx->state == CKS_RW_SO_FUNCTIONS
-            || ctx->state == CKS_RW_USER_FUNCTIONS) {
-        ctx->state = CKS_RW_PUBLIC_SESSION;
+    CK_STATE state = session_ctx_state_get(ctx);
+    if (state == CKS_RW_SO_FUNCTIONS
+            || state == CKS_RW_USER_FUNCTIONS) {
+        state = CKS_RW_PUBLIC_SESSION;
     } else {
-        ctx->state = CKS_RO_PUBLIC_SESSION;
+        state = CKS_RO_PUBLIC_SESSION;
     }
+
+    __atomic_store_n(&ctx->state, state, __ATOMIC_RELEASE);
 }
 
 CK_RV _session_ctx_opdata_get(session_ctx *ctx, operation op, void **data) {
@@ -173,6 +243,36 @@ void session_ctx_opdata_clear(session_ctx *ctx) {
     }
 
     session_ctx_opdata_set(ctx, operation_none, NULL, NULL, NULL);
+    ctx->tpm = NULL;
+}
+
+tpm_ctx *session_ctx_lock_tpm(session_ctx *ctx) {
+
+    token_lock_shared(ctx->tok);
+
+    /* an operation keeps its context, the key and opdata were loaded there */
+    if (!ctx->tpm) {
+        ctx->tpm = token_lease_tpm(ctx->tok);
+    }
+
+    tpm_ctx *tpm = ctx->tpm;
+    tpm_lock(tpm);
+
+    return tpm;
+}
+
+void session_ctx_unlock_tpm(session_ctx *ctx, tpm_ctx *tpm) {
+
+    /* the lease ends with the operation */
+    if (!session_ctx_opdata_is_active(ctx)) {
+        ctx->tpm = NULL;
+    }
+
+    token_unlock_tpm(ctx->tok, tpm);
+}
+
+tpm_ctx *session_ctx_get_tpm(session_ctx *ctx) {
+    return ctx->tpm ? ctx->tpm : ctx->tok->tctx;
 }
 
 static bool is_user(CK_USER_TYPE user) {
@@ -292,12 +392,6 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
         tok->wrappingkey = NULL;
     }
 
-    /*
-     * Ok now start evicting TPM objects from the right
-     * context
-     */
-    tpm_ctx *tpm = tok->tctx;
-
     /*
      * For each object:
      *   - Evict the TPM Handles
@@ -310,29 +404,20 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
             tobject *tobj = list_entry(cur, tobject, l);
             cur = cur->next;
 
-            /* if it's CKA_PRIVATE == CK_TRUE and it has a CKA_VALUE field, clear it */
-            CK_BBOOL cka_private = attr_list_get_CKA_PRIVATE(tobj->attrs, CK_FALSE);
-            CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_VALUE);
+            /*
+             * if it's CKA_PRIVATE == CK_TRUE and it has a CKA_VALUE field, clear it,
+             * objects never decoded have nothing to clear
+             */
+            CK_BBOOL cka_private = attr_list_get_CKA_PRIVATE(
+                    tobject_get_summary(tobj), CK_FALSE);
+            CK_ATTRIBUTE_PTR a = tobj->attrs ?
+                    attr_get_attribute_by_type(tobj->attrs, CKA_VALUE) : NULL;
             if (cka_private && a && a->pValue && a->ulValueLen) {
                 attr_pfree_cleanse(a);
             }
 
-            /*
-             * Do not perform tpm_flushcontext when:
-             *   - tpm_esys_tr is 0, or
-             *   - the object is private and the associated key in the TPM is persistent.
-             *
-             * If the object is public and the associated key in the TPM is persistent,
-             * tpm_flushcontext is still necessary because, during the initialization of the object,
-             * a transient TPM key with only the public component is created from the persistent key.
-             */
-            if (tobj->tpm_esys_tr &&
-                    !(cka_private && tobj->tpm_persistent_handle)) {
-                bool result = tpm_flushcontext(tpm, tobj->tpm_esys_tr);
-                assert(result);
-                UNUSED(result);
-                tobj->tpm_esys_tr = 0;
-
+            /* evict the copies in the token's and the pooled TPM contexts */
+            if (token_flush_tobject(tok, tobj)) {
                 /* Clear the unwrapped auth value for tertiary objects */
                 twist_free(tobj->unsealed_auth);
                 tobj->unsealed_auth = NULL;
@@ -352,6 +437,14 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
 
     tpm_session_stop(tok->tctx);
 
+    size_t i;
+    for (i = 0; i < tpm_ctx_pool_len(tok->tctx_pool); i++) {
+        tpm_ctx *tpm = tpm_ctx_pool_get(tok->tctx_pool, i);
+        if (tpm_session_active(tpm)) {
+            tpm_session_stop(tpm);
+        }
+    }
+
     return CKR_OK;
 }
 
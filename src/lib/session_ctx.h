@@ -60,6 +60,64 @@ CK_RV session_ctx_new(session_ctx **ctx, token *tok, CK_FLAGS flags);
  */
 void *_session_ctx_get_lock(session_ctx *ctx);
 
+#define session_ctx_lock(ctx) mutex_lock_fatal(_session_ctx_get_lock(ctx))
+#define session_ctx_unlock(ctx) mutex_unlock_fatal(_session_ctx_get_lock(ctx))
+
+/**
+ * Takes a reference on the session context. The caller MUST already
+ * hold a reference or otherwise keep the ctx from being freed, see
+ * session_table_lookup().
+ * @param ctx
+ *  The session context to reference.
+ */
+void session_ctx_ref(session_ctx *ctx);
+
+/**
+ * Drops a reference on the session context.
+ * @param ctx
+ *  The session context to dereference.
+ * @return
+ *  True if that was the last reference and the ctx should be freed.
+ */
+bool session_ctx_unref(session_ctx *ctx);
+
+/**
+ * Marks a session context as closed, any thread still holding a
+ * reference will see CKR_SESSION_CLOSED on its next lookup. Call with
+ * the session lock held.
+ * @param ctx
+ *  The session context to mark.
+ */
+void session_ctx_mark_closed(session_ctx *ctx);
+
+/**
+ * Checks if a session has been closed. Call with the session lock held.
+ * @param ctx
+ *  The session context to check.
+ * @return
+ *  True if closed, false otherwise.
+ */
+bool session_ctx_is_closed(session_ctx *ctx);
+
+/**
+ * Requests that the operation running on the session stops at its next
+ * TPM command boundary. Safe to call without the session lock, from any
+ * thread holding a reference.
+ * @param ctx
+ *  The session context to cancel.
+ */
+void session_ctx_cancel(session_ctx *ctx);
+
+/**
+ * Drops a stale cancel request before starting an operation. Call with the
+ * session lock held.
+ * @param ctx
+ *  The session context.
+ * @return
+ *  The cancel flag for the operation, see tpm_opdata_set_cancel().
+ */
+const bool *session_ctx_cancel_reset(session_ctx *ctx);
+
 /**
  * Get the state of the session
  * @param ctx
@@ -150,6 +208,38 @@ tobject *session_ctx_opdata_get_tobject(session_ctx *ctx);
  */
 void session_ctx_opdata_clear(session_ctx *ctx);
 
+/**
+ * Locks the token shared and a TPM context for a key operation on the
+ * session. An operation in progress keeps the context it was started in,
+ * otherwise one is leased from the token, see token_lease_tpm(), and
+ * returned by session_ctx_get_tpm() until the operation ends.
+ * @param ctx
+ *  The session context, locked.
+ * @return
+ *  The locked TPM context.
+ */
+tpm_ctx *session_ctx_lock_tpm(session_ctx *ctx);
+
+/**
+ * Unlocks what session_ctx_lock_tpm() locked. The context stays with the
+ * session while an operation is active.
+ * @param ctx
+ *  The session context, locked.
+ * @param tpm
+ *  The context returned by session_ctx_lock_tpm().
+ */
+void session_ctx_unlock_tpm(session_ctx *ctx, tpm_ctx *tpm);
+
+/**
+ * Gets the TPM context leased by the session, the token's own if none
+ * was leased.
+ * @param ctx
+ *  The session context, locked.
+ * @return
+ *  The TPM context.
+ */
+tpm_ctx *session_ctx_get_tpm(session_ctx *ctx);
+
 /**
  * Sets the operation specific state data
  * @param tok
@@ -2,28 +2,252 @@
 
 #include "config.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 
-#include "mutex.h"
 #include "pkcs11.h"
 #include "session_ctx.h"
 #include "session_table.h"
 #include "token.h"
 #include "utils.h"
 
+/*
+ * A session handle is laid out as:
+ *   | token id (8 bits) | generation | slot index + 1 (16 bits) |
+ * The token id is added by session.c. The generation of a slot is bumped
+ * every time the slot is vacated, so handles of closed sessions never
+ * match a new session reusing the slot.
+ */
+#define SESSION_INDEX_BITS 16
+#define SESSION_INDEX_MASK ((1UL << SESSION_INDEX_BITS) - 1)
+#define SESSION_GEN_BITS ((sizeof(CK_SESSION_HANDLE) * 8) - 8 - SESSION_INDEX_BITS)
+#define SESSION_GEN_MASK ((1UL << SESSION_GEN_BITS) - 1)
+
+/* slots are added in chunks that never move, so lookups need no lock */
+#define SESSION_CHUNK_SLOTS 256
+#define SESSION_MAX_SLOTS SESSION_INDEX_MASK
+#define SESSION_MAX_CHUNKS ((SESSION_MAX_SLOTS + SESSION_CHUNK_SLOTS - 1) / SESSION_CHUNK_SLOTS)
+
+/* the free list head is a slot index + 1 in the low half and an ABA tag in the high half */
+#define FREE_HEAD_INDEX(head) ((uint32_t)((head) & 0xFFFFFFFF))
+#define FREE_HEAD_NEXT(head, index) \
+    (((((head) >> 32) + 1) << 32) | (uint64_t)(index))
+
+/* set in a slot's readers once its session is closed, see slot_release_if_drained() */
+#define SLOT_CLOSING (1U << 31)
+
+typedef struct session_slot session_slot;
+struct session_slot {
+    /* published and vacated atomically, NULL when free */
+    session_ctx *ctx;
+    /* generation of the session in the slot, bumped when it is closed */
+    unsigned long gen;
+    /* lookups in flight that may still dereference ctx, and SLOT_CLOSING */
+    unsigned readers;
+    /* the ctx detached by a close, the table's reference goes with the slot */
+    session_ctx *closed;
+    /* index + 1 of the next free slot while on the free list, 0 ends it */
+    uint32_t next_free;
+};
+
+typedef struct session_chunk session_chunk;
+struct session_chunk {
+    session_slot slots[SESSION_CHUNK_SLOTS];
+};
+
+/*
+ * The table takes no locks. Slots are popped off of a free list with a
+ * compare and swap, and lookups pin the slot while they take a reference on
+ * the ctx. A closer detaches the ctx and marks the slot closing, whoever
+ * unpins it last, the closer or a lookup, puts it back on the free list and
+ * drops the table's reference on the ctx.
+ * When the free list runs dry, a chunk of slots is added until the limit is
+ * reached.
+ */
 struct session_table {
     CK_ULONG cnt;
     CK_ULONG rw_cnt;
-    session_ctx *table[MAX_NUM_OF_SESSIONS];
+    CK_ULONG max;
+    size_t max_chunks;
+    size_t nchunks;
+    uint64_t free_head;
+    session_chunk *chunks[SESSION_MAX_CHUNKS];
 };
 
-CK_RV session_table_new(session_table **t) {
+static inline CK_SESSION_HANDLE slot_to_handle(size_t index, unsigned long gen) {
+    /* 0 is not a good session handle, so offset by 1 */
+    return ((CK_SESSION_HANDLE)(gen & SESSION_GEN_MASK) << SESSION_INDEX_BITS)
+            | (index + 1);
+}
+
+static session_slot *slot_at(session_table *t, size_t index) {
+
+    if (index >= SESSION_MAX_CHUNKS * SESSION_CHUNK_SLOTS) {
+        return NULL;
+    }
+
+    session_chunk *chunk = __atomic_load_n(&t->chunks[index / SESSION_CHUNK_SLOTS],
+            __ATOMIC_ACQUIRE);
+
+    return chunk ? &chunk->slots[index % SESSION_CHUNK_SLOTS] : NULL;
+}
+
+static void free_list_push(session_table *t, size_t first, size_t last);
+
+/*
+ * Puts a closed slot back on the free list once no lookup has it pinned.
+ * Only one caller sees the bare SLOT_CLOSING and gets to clear it.
+ */
+static void slot_release_if_drained(session_table *t, session_slot *slot, size_t index) {
+
+    unsigned expected = SLOT_CLOSING;
+    if (!__atomic_compare_exchange_n(&slot->readers, &expected, 0, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    /* the slot may be reused and closed again once it's pushed */
+    session_ctx *ctx = __atomic_exchange_n(&slot->closed, NULL, __ATOMIC_SEQ_CST);
+    assert(ctx);
+
+    free_list_push(t, index, index);
+
+    session_table_put(t, ctx);
+}
+
+static inline void slot_pin(session_slot *slot) {
+    __atomic_add_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void slot_unpin(session_table *t, session_slot *slot, size_t index) {
+    if (__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST) == SLOT_CLOSING) {
+        slot_release_if_drained(t, slot, index);
+    }
+}
+
+/*
+ * Returns the ctx in the slot with a reference taken, or NULL if the slot
+ * is free or holds a different generation.
+ */
+static session_ctx *slot_get(session_table *t, size_t index, unsigned long gen) {
+
+    session_slot *slot = slot_at(t, index);
+    if (!slot) {
+        return NULL;
+    }
+
+    slot_pin(slot);
+
+    session_ctx *ctx = __atomic_load_n(&slot->ctx, __ATOMIC_SEQ_CST);
+    unsigned long cur_gen = __atomic_load_n(&slot->gen, __ATOMIC_SEQ_CST);
+    if (ctx && (cur_gen & SESSION_GEN_MASK) == gen) {
+        session_ctx_ref(ctx);
+    } else {
+        ctx = NULL;
+    }
+
+    slot_unpin(t, slot, index);
+
+    return ctx;
+}
+
+/*
+ * Pushes the slots first to last, already chained through next_free, onto
+ * the free list.
+ */
+static void free_list_push(session_table *t, size_t first, size_t last) {
+
+    session_slot *tail = slot_at(t, last);
+    assert(tail);
+
+    uint64_t head = __atomic_load_n(&t->free_head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        __atomic_store_n(&tail->next_free, FREE_HEAD_INDEX(head), __ATOMIC_RELAXED);
+        next = FREE_HEAD_NEXT(head, first + 1);
+    } while (!__atomic_compare_exchange_n(&t->free_head, &head, next, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static bool free_list_pop(session_table *t, size_t *index) {
+
+    uint64_t head = __atomic_load_n(&t->free_head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do {
+        uint32_t top = FREE_HEAD_INDEX(head);
+        if (!top) {
+            return false;
+        }
+
+        /* may be stale if another thread pops first, the tag catches that */
+        session_slot *slot = slot_at(t, top - 1);
+        next = FREE_HEAD_NEXT(head,
+                __atomic_load_n(&slot->next_free, __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&t->free_head, &head, next, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    *index = FREE_HEAD_INDEX(head) - 1;
+
+    return true;
+}
+
+/*
+ * Adds a chunk of slots to the free list. Returns CKR_OK if the table grew,
+ * either by this caller or a concurrent one, and CKR_SESSION_COUNT if it is
+ * as big as it may get.
+ */
+static CK_RV session_table_grow(session_table *t) {
+
+    size_t n = __atomic_load_n(&t->nchunks, __ATOMIC_ACQUIRE);
+    if (n >= t->max_chunks) {
+        return CKR_SESSION_COUNT;
+    }
+
+    session_chunk *chunk = calloc(1, sizeof(*chunk));
+    if (!chunk) {
+        return CKR_HOST_MEMORY;
+    }
+
+    size_t i;
+    for (i = 0; i < SESSION_CHUNK_SLOTS - 1; i++) {
+        /* next_free holds index + 1 of the next slot */
+        chunk->slots[i].next_free = (n * SESSION_CHUNK_SLOTS) + i + 2;
+    }
+
+    session_chunk *expected = NULL;
+    if (!__atomic_compare_exchange_n(&t->chunks[n], &expected, chunk, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* someone beat us to it */
+        free(chunk);
+        return CKR_OK;
+    }
+
+    __atomic_store_n(&t->nchunks, n + 1, __ATOMIC_RELEASE);
+
+    free_list_push(t, n * SESSION_CHUNK_SLOTS,
+            ((n + 1) * SESSION_CHUNK_SLOTS) - 1);
+
+    return CKR_OK;
+}
+
+CK_RV session_table_new(session_table **t, CK_ULONG max) {
 
     session_table *x = calloc(1, sizeof(session_table));
     if (!x) {
         return CKR_HOST_MEMORY;
     }
 
+    if (!max) {
+        max = MAX_NUM_OF_SESSIONS;
+    } else if (max > SESSION_MAX_SLOTS) {
+        LOGW("Session limit %lu is too large, using %lu", max,
+                (CK_ULONG)SESSION_MAX_SLOTS);
+        max = SESSION_MAX_SLOTS;
+    }
+
+    x->max = max;
+    x->max_chunks = (max + SESSION_CHUNK_SLOTS - 1) / SESSION_CHUNK_SLOTS;
+
     *t = x;
 
     return CKR_OK;
@@ -35,59 +259,90 @@ void session_table_free(session_table *t) {
         return;
     }
 
+    size_t i;
+    for (i = 0; i < t->nchunks; i++) {
+        free(t->chunks[i]);
+    }
+
     free(t);
 }
 
+CK_ULONG session_table_get_max(session_table *t) {
+    return t->max;
+}
+
 void session_table_get_cnt(session_table *t, CK_ULONG_PTR all, CK_ULONG_PTR rw, CK_ULONG_PTR ro) {
 
-    /* All counts should always be greater than or equal to rw count */
-    assert(t->cnt >= t->rw_cnt);
+    CK_ULONG rw_cnt = __atomic_load_n(&t->rw_cnt, __ATOMIC_ACQUIRE);
+    CK_ULONG cnt = __atomic_load_n(&t->cnt, __ATOMIC_ACQUIRE);
+
+    /*
+     * All counts should always be greater than or equal to rw count, the
+     * two loads may straddle an open or close though.
+     */
+    if (rw_cnt > cnt) {
+        rw_cnt = cnt;
+    }
 
     if (all) {
-        *all = t->cnt;
+        *all = cnt;
     }
 
     if (rw) {
-        *rw = t->rw_cnt;
+        *rw = rw_cnt;
     }
 
     if (ro) {
-        *ro = t->cnt - t->rw_cnt;
+        *ro = cnt - rw_cnt;
     }
 }
 
 CK_RV session_table_new_entry(session_table *t, CK_SESSION_HANDLE *handle,
         token *tok, CK_FLAGS flags) {
 
-    CK_SESSION_HANDLE free_handle = 0;
-    session_ctx **open_slot = NULL;
-    size_t i;
-    for (i=0; i < ARRAY_LEN(t->table); i++) {
-        if (!t->table[i]) {
-            /* 0 is not a good session handle, so offset by 1 */
-            free_handle = i + 1;
-            open_slot = &t->table[i];
-            break;
-        }
-    }
-
-    if (!open_slot) {
+    /* reserve our place under the limit, this also guarantees us a slot */
+    if (__atomic_fetch_add(&t->cnt, 1, __ATOMIC_ACQ_REL) >= t->max) {
+        __atomic_sub_fetch(&t->cnt, 1, __ATOMIC_ACQ_REL);
         LOGV("No available session slot found");
         return CKR_SESSION_COUNT;
     }
 
-    CK_RV rv = session_ctx_new(open_slot, tok, flags);
+    session_ctx *ctx = NULL;
+    CK_RV rv = session_ctx_new(&ctx, tok, flags);
     if (rv != CKR_OK) {
+        __atomic_sub_fetch(&t->cnt, 1, __ATOMIC_ACQ_REL);
         return rv;
     }
 
-    *handle = free_handle;
-    t->cnt++;
+    /*
+     * The table can only be out of slots when closed sessions are still
+     * pinned by lookups, which return the slots as they finish.
+     */
+    size_t index;
+    while (!free_list_pop(t, &index)) {
+        rv = session_table_grow(t);
+        if (rv != CKR_OK) {
+            LOGV("No available session slot found");
+            session_ctx_free(ctx);
+            __atomic_sub_fetch(&t->cnt, 1, __ATOMIC_ACQ_REL);
+            return rv;
+        }
+    }
+
+    session_slot *slot = slot_at(t, index);
+    assert(slot);
 
+    /* count it before anyone can find it and close it */
     if(flags & CKF_RW_SESSION) {
-        t->rw_cnt++;
+        __atomic_add_fetch(&t->rw_cnt, 1, __ATOMIC_ACQ_REL);
     }
 
+    /* only the closer of this ctx bumps the generation */
+    unsigned long gen = __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&slot->ctx, ctx, __ATOMIC_SEQ_CST);
+
+    *handle = slot_to_handle(index, gen);
+
     return CKR_OK;
 }
 
@@ -103,59 +358,102 @@ static CK_RV do_logout_if_needed(session_ctx *ctx) {
     return session_ctx_logout(ctx);
 }
 
-static CK_RV session_table_free_ctx_by_ctx(token *t, session_ctx **ctx) {
+void session_table_put(session_table *t, session_ctx *ctx) {
+
+    UNUSED(t);
+
+    if (session_ctx_unref(ctx)) {
+        session_ctx_free(ctx);
+    }
+}
+
+static CK_RV session_table_free_slot(token *t, size_t index, unsigned long gen) {
 
     session_table *stable = t->s_table;
 
     CK_RV rv = CKR_OK;
 
-    CK_STATE state = session_ctx_state_get(*ctx);
-    if(state == CKS_RW_PUBLIC_SESSION
-        || state == CKS_RW_USER_FUNCTIONS
-        || state == CKS_RW_SO_FUNCTIONS) {
-        assert(stable->rw_cnt);
-        stable->rw_cnt--;
+    session_slot *slot = slot_at(stable, index);
+    if (!slot) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    /* claim the close, only one caller can move the generation on */
+    unsigned long expected = __atomic_load_n(&slot->gen, __ATOMIC_SEQ_CST);
+    session_ctx *ctx = __atomic_load_n(&slot->ctx, __ATOMIC_SEQ_CST);
+    if (!ctx || (expected & SESSION_GEN_MASK) != gen
+            || !__atomic_compare_exchange_n(&slot->gen, &expected, expected + 1,
+                    false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return CKR_SESSION_HANDLE_INVALID;
     }
 
-    stable->cnt--;
+    /* detach the ctx from the table so no new lookups can find it */
+    session_ctx *detached = __atomic_exchange_n(&slot->ctx, NULL, __ATOMIC_SEQ_CST);
+    assert(detached == ctx);
+
+    /* the table's reference may be gone before we are done with it */
+    session_ctx_ref(detached);
+    __atomic_store_n(&slot->closed, detached, __ATOMIC_SEQ_CST);
+
+    /*
+     * Lookups that loaded the old pointer are done with it once unpinned,
+     * the last one out gives the slot back, which may be us.
+     */
+    __atomic_fetch_or(&slot->readers, SLOT_CLOSING, __ATOMIC_SEQ_CST);
+    slot_release_if_drained(stable, slot, index);
+
+    if (session_ctx_flags_get(detached) & CKF_RW_SESSION) {
+        __atomic_sub_fetch(&stable->rw_cnt, 1, __ATOMIC_ACQ_REL);
+    }
+
+    bool is_last = !__atomic_sub_fetch(&stable->cnt, 1, __ATOMIC_ACQ_REL);
+
+    /*
+     * Wait out anyone in the middle of an operation on this session, and
+     * make sure anyone who raced us on the lookup sees it as closed.
+     */
+    session_ctx_lock(detached);
+    session_ctx_mark_closed(detached);
+    session_ctx_unlock(detached);
 
     /* Per the spec, when session count hits 0, logout */
-    if (!stable->cnt) {
-        rv = do_logout_if_needed(*ctx);
+    if (is_last) {
+        token_lock(t);
+        rv = do_logout_if_needed(detached);
+        token_unlock(t);
         if (rv != CKR_OK) {
             LOGE("do_logout_if_needed failed: 0x%lx", rv);
         }
     }
 
-    session_ctx_free(*ctx);
-
-    *ctx = NULL;
+    /* drop our reference */
+    session_table_put(stable, detached);
 
     return rv;
 }
 
-static session_ctx **_session_table_lookup(session_table *t, CK_SESSION_HANDLE handle) {
+session_ctx *session_table_lookup(session_table *t, CK_SESSION_HANDLE handle) {
 
-    if (handle == 0 || handle > ARRAY_LEN(t->table)) {
+    CK_SESSION_HANDLE index = handle & SESSION_INDEX_MASK;
+    if (index == 0) {
         return NULL;
     }
 
-    return &t->table[handle - 1];
-}
-
-session_ctx *session_table_lookup(session_table *t, CK_SESSION_HANDLE handle) {
+    unsigned long gen = (handle >> SESSION_INDEX_BITS) & SESSION_GEN_MASK;
 
-    return *_session_table_lookup(t, handle);
+    return slot_get(t, index - 1, gen);
 }
 
 CK_RV session_table_free_ctx_by_handle(token *t, CK_SESSION_HANDLE handle) {
 
-    session_ctx **ctx = _session_table_lookup(t->s_table, handle);
-    if (!*ctx) {
+    CK_SESSION_HANDLE index = handle & SESSION_INDEX_MASK;
+    if (index == 0) {
         return CKR_SESSION_HANDLE_INVALID;
     }
 
-    return session_table_free_ctx_by_ctx(t, ctx);
+    unsigned long gen = (handle >> SESSION_INDEX_BITS) & SESSION_GEN_MASK;
+
+    return session_table_free_slot(t, index - 1, gen);
 }
 
 CK_RV session_table_free_ctx_all(token *t) {
@@ -166,19 +464,28 @@ CK_RV session_table_free_ctx_all(token *t) {
         return CKR_OK;
     }
 
-    unsigned i;
-    for (i=0; i < ARRAY_LEN(t->s_table->table); i++) {
-        CK_SESSION_HANDLE handle = i;
+    size_t nslots = __atomic_load_n(&t->s_table->nchunks, __ATOMIC_ACQUIRE)
+            * SESSION_CHUNK_SLOTS;
+
+    size_t i;
+    for (i=0; i < nslots; i++) {
+        session_slot *slot = slot_at(t->s_table, i);
 
         /*
          * skip dead handles
          */
-        session_ctx **ctx = &t->s_table->table[handle];
-        if (!*ctx) {
+        if (!__atomic_load_n(&slot->ctx, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        unsigned long gen = __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE);
+
+        CK_RV rv = session_table_free_slot(t, i, gen & SESSION_GEN_MASK);
+        /* someone else closed it first */
+        if (rv == CKR_SESSION_HANDLE_INVALID) {
             continue;
         }
 
-        CK_RV rv = session_table_free_ctx_by_ctx(t, ctx);
         if (rv != CKR_OK) {
             LOGE("Failed to free session_ctx: 0x%lx", rv);
             had_error = true;
@@ -193,30 +500,52 @@ CK_RV session_table_free_ctx(token *t, CK_SESSION_HANDLE handle) {
     return session_table_free_ctx_by_handle(t, handle);
 }
 
+/*
+ * Login state changes are made with the token lock held exclusive, which
+ * keeps new sessions out while the open ones are walked.
+ */
 void session_table_login_event(session_table *s_table, CK_USER_TYPE user) {
 
+    size_t nslots = __atomic_load_n(&s_table->nchunks, __ATOMIC_ACQUIRE)
+            * SESSION_CHUNK_SLOTS;
+
     size_t i;
-    for (i=0; i < ARRAY_LEN(s_table->table); i++) {
+    for (i=0; i < nslots; i++) {
+
+        session_slot *slot = slot_at(s_table, i);
+        unsigned long gen = __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE);
 
-        session_ctx *ctx = s_table->table[i];
+        session_ctx *ctx = slot_get(s_table, i, gen & SESSION_GEN_MASK);
         if (!ctx) {
             continue;
         }
 
         session_ctx_login_event(ctx, user);
+
+        session_table_put(s_table, ctx);
     }
 }
 
 void token_logout_all_sessions(token *tok) {
 
+    session_table *s_table = tok->s_table;
+
+    size_t nslots = __atomic_load_n(&s_table->nchunks, __ATOMIC_ACQUIRE)
+            * SESSION_CHUNK_SLOTS;
+
     size_t i;
-    for (i=0; i < ARRAY_LEN(tok->s_table->table); i++) {
+    for (i=0; i < nslots; i++) {
+
+        session_slot *slot = slot_at(s_table, i);
+        unsigned long gen = __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE);
 
-        session_ctx *ctx = tok->s_table->table[i];
+        session_ctx *ctx = slot_get(s_table, i, gen & SESSION_GEN_MASK);
         if (!ctx) {
             continue;
         }
 
         session_ctx_logout_event(ctx);
+
+        session_table_put(s_table, ctx);
     }
 }
@@ -11,23 +11,55 @@ typedef struct token token;
 
 typedef struct session_table session_table;
 
-CK_RV session_table_new(session_table **t);
+/**
+ * Creates a session table that grows on demand.
+ * @param t
+ *  The session table to create.
+ * @param max
+ *  The maximum number of open sessions, 0 for MAX_NUM_OF_SESSIONS.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV session_table_new(session_table **t, CK_ULONG max);
 void session_table_free(session_table *t);
 
+CK_ULONG session_table_get_max(session_table *t);
+
 void session_table_get_cnt(session_table *t, unsigned long *all, unsigned long *rw, unsigned long *ro);
 
 CK_RV session_table_new_entry(session_table *t,
         CK_SESSION_HANDLE *handle, token *tok, CK_FLAGS flags);
 
+/**
+ * Looks up a session context by handle and takes a reference on it.
+ * @param t
+ *  The session table.
+ * @param handle
+ *  The session handle with the token id removed.
+ * @return
+ *  The referenced session context or NULL if not found or if the handle
+ *  belongs to a closed session. Drop the reference
+ *  with session_table_put().
+ */
 session_ctx *session_table_lookup(session_table *t, CK_SESSION_HANDLE handle);
 
+/**
+ * Drops a reference taken by session_table_lookup(), freeing the
+ * session context when it was closed and this was the last user.
+ * @param t
+ *  The session table.
+ * @param ctx
+ *  The session context to release.
+ */
+void session_table_put(session_table *t, session_ctx *ctx);
+
 CK_RV session_table_free_ctx_by_handle(token *t, CK_SESSION_HANDLE handle);
 CK_RV session_table_free_ctx(token *t, CK_SESSION_HANDLE handle);
 CK_RV session_table_free_ctx_all(token *t);
 
 /**
- * performs a session_ctx_login_event() call for each item in the table
- * with the session table lock held.
+ * performs a session_ctx_login_event() call for each item in the table.
+ * Call with the token lock held exclusive.
  * @param s_table
  *  The session table
  * @param user
@@ -36,8 +68,8 @@ CK_RV session_table_free_ctx_all(token *t);
 void session_table_login_event(session_table *s_table, CK_USER_TYPE user);
 
 /**
- * performs a session_ctx_logout_event() call for each item in the table
- * with the session table lock held.
+ * performs a session_ctx_logout_event() call for each item in the table.
+ * Call with the token lock held exclusive.
  * @param s_table
  *  The session table
  * @param called_session
@@ -161,7 +161,7 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
     assert(tok);
 
     tobject *tobj = NULL;
-    rv = token_load_object(tok, key, &tobj);
+    rv = token_load_object(tok, session_ctx_get_tpm(ctx), key, &tobj);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -194,7 +194,7 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
     }
 
     tpm_op_data *tpm_opdata;
-    rv = mech_get_tpm_opdata(tok->mdtl, tok->tctx, mechanism, tobj, &tpm_opdata);
+    rv = mech_get_tpm_opdata(tok->mdtl, session_ctx_get_tpm(ctx), mechanism, tobj, &tpm_opdata);
     if (rv != CKR_OK) {
         tpm_opdata_free(&tpm_opdata);
         return rv;
@@ -219,6 +219,8 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
 
     opdata->crypto_opdata->cryptopdata.tpm_opdata = tpm_opdata;
 
+    tpm_opdata_set_cancel(tpm_opdata, session_ctx_cancel_reset(ctx));
+
     /*
      * Store everything for later
      */
@@ -239,7 +241,16 @@ static CK_RV common_update(operation op, session_ctx *ctx, CK_BYTE_PTR part, CK_
         return rv;
     }
 
+    /*
+     * Called with only the session locked. The object's attributes are token
+     * state, hashing or buffering the data is not and runs unlocked.
+     */
+    token *tok = session_ctx_get_token(ctx);
+    assert(tok);
+
+    token_lock_shared(tok);
     rv = session_ctx_tobject_authenticated(ctx);
+    token_unlock(tok);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -492,7 +503,13 @@ CK_RV sign(session_ctx *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR si
     if (rv != CKR_OK) {
         return rv;
     }
-    return sign_final_ex(ctx, signature, signature_len, true);
+
+    /* only the signing itself needs the TPM */
+    tpm_ctx *tpm = session_ctx_lock_tpm(ctx);
+    rv = sign_final_ex(ctx, signature, signature_len, true);
+    session_ctx_unlock_tpm(ctx, tpm);
+
+    return rv;
 }
 
 CK_RV verify_init (session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
@@ -570,7 +587,11 @@ CK_RV verify(session_ctx *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR
         return rv;
     }
 
-    return verify_final(ctx, signature, signature_len);
+    tpm_ctx *tpm = session_ctx_lock_tpm(ctx);
+    rv = verify_final(ctx, signature, signature_len);
+    session_ctx_unlock_tpm(ctx, tpm);
+
+    return rv;
 }
 
 CK_RV verify_recover_init (session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
@@ -1,21 +1,88 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "checks.h"
 #include "backend.h"
 #include "mech.h"
+#include "object.h"
 #include "pkcs11.h"
+#include "session_table.h"
 #include "slot.h"
 #include "token.h"
 #include "utils.h"
 
+/*
+ * How long C_WaitForSlotEvent sleeps between checks of the store when it
+ * cannot be watched, and at most when a change notification went to another
+ * waiting thread.
+ */
+#define SLOT_EVENT_POLL_MS 1000
+
 static struct {
     size_t token_cnt;
     token *token;
     void *mutex;
-} global;
+
+    /* slot ids with an event not yet reported, guarded by mutex */
+    CK_SLOT_ID pending[MAX_TOKEN_CNT];
+    size_t pending_cnt;
+
+    struct {
+        /*
+         * Serializes store refreshes and guards the fields below. Lock order
+         * is event -> token -> slot.
+         */
+        void *mutex;
+        int store_version;
+        /* a new token could not be added yet, check the store again */
+        bool retry;
+        /* store change notifications, -1 if the store cannot be watched */
+        int watch_fd;
+        /* written on C_Finalize to release blocked waiters */
+        int wake_fd[2];
+        bool is_watching;
+        bool is_finalizing;
+        /*
+         * Threads in C_WaitForSlotEvent, C_Finalize waits on left for the
+         * last one to leave. Guarded by waiters_lock, a pthread mutex as
+         * application supplied mutexes come without condition variables.
+         */
+        unsigned waiters;
+        pthread_mutex_t waiters_lock;
+        pthread_cond_t left;
+    } event;
+} global = {
+    .event = {
+        .watch_fd = -1,
+        .wake_fd = { -1, -1 },
+        .waiters_lock = PTHREAD_MUTEX_INITIALIZER,
+        .left = PTHREAD_COND_INITIALIZER,
+    }
+};
+
+static void slot_lock(void) {
+    mutex_lock_fatal(global.mutex);
+}
+
+static void slot_unlock(void) {
+    mutex_unlock_fatal(global.mutex);
+}
+
+static void event_lock(void) {
+    mutex_lock_fatal(global.event.mutex);
+}
+
+static void event_unlock(void) {
+    mutex_unlock_fatal(global.event.mutex);
+}
 
 CK_RV slot_init(void) {
 
@@ -24,19 +91,67 @@ CK_RV slot_init(void) {
         return rv;
     }
 
-    return backend_get_tokens(&global.token, &global.token_cnt);
-}
+    rv = mutex_create(&global.event.mutex);
+    if (rv != CKR_OK) {
+        return rv;
+    }
 
-static void slot_lock(void) {
-    mutex_lock_fatal(global.mutex);
+    global.event.is_finalizing = false;
+    global.pending_cnt = 0;
+
+    rv = backend_get_tokens(&global.token, &global.token_cnt);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* tokens present at startup are not events */
+    return backend_get_store_version(&global.event.store_version);
 }
 
-static void slot_unlock(void) {
-    mutex_unlock_fatal(global.mutex);
+static void slot_event_close(void) {
+
+    if (global.event.watch_fd >= 0) {
+        close(global.event.watch_fd);
+    }
+
+    if (global.event.wake_fd[0] >= 0) {
+        close(global.event.wake_fd[0]);
+        close(global.event.wake_fd[1]);
+    }
+
+    global.event.watch_fd = -1;
+    global.event.wake_fd[0] = global.event.wake_fd[1] = -1;
+    global.event.is_watching = false;
 }
 
 void slot_destroy(void) {
 
+    /*
+     * Release threads blocked in C_WaitForSlotEvent, they return
+     * CKR_CRYPTOKI_NOT_INITIALIZED, and wait for them to leave.
+     */
+    __atomic_store_n(&global.event.is_finalizing, true, __ATOMIC_RELEASE);
+
+    if (global.event.mutex) {
+        event_lock();
+        if (global.event.wake_fd[1] >= 0) {
+            ssize_t n = write(global.event.wake_fd[1], "", 1);
+            UNUSED(n);
+        }
+        event_unlock();
+    }
+
+    pthread_mutex_lock(&global.event.waiters_lock);
+    while (global.event.waiters) {
+        pthread_cond_wait(&global.event.left, &global.event.waiters_lock);
+    }
+    pthread_mutex_unlock(&global.event.waiters_lock);
+
+    slot_event_close();
+
+    mutex_destroy(global.event.mutex);
+    global.event.mutex = NULL;
+
     token_free_list(&global.token, &global.token_cnt);
 
     CK_RV rv = mutex_destroy(global.mutex);
@@ -46,6 +161,45 @@ void slot_destroy(void) {
     }
 }
 
+CK_RV slot_fork_child(void) {
+
+    /* parent threads holding these don't exist in the child, replace them */
+    object_fork_child();
+
+    CK_RV rv = mutex_create(&global.mutex);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = mutex_create(&global.event.mutex);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* the descriptors are the child's own copies, nobody waits on them */
+    slot_event_close();
+
+    /* a parent thread may have held it */
+    static const pthread_mutex_t lock_init = PTHREAD_MUTEX_INITIALIZER;
+    static const pthread_cond_t cond_init = PTHREAD_COND_INITIALIZER;
+    memcpy(&global.event.waiters_lock, &lock_init, sizeof(lock_init));
+    memcpy(&global.event.left, &cond_init, sizeof(cond_init));
+    global.event.waiters = 0;
+
+    size_t i;
+    for (i = 0; i < global.token_cnt; i++) {
+        rv = token_fork_child(&global.token[i]);
+        if (rv != CKR_OK) {
+            LOGE("Could not re-initialize token %u after fork",
+                    global.token[i].id);
+            return rv;
+        }
+    }
+
+    /* the data version is per store connection, start from the new one */
+    return backend_get_store_version(&global.event.store_version);
+}
+
 token *slot_get_token(CK_SLOT_ID slot_id) {
 
     slot_lock();
@@ -111,7 +265,7 @@ CK_RV slot_get_info (CK_SLOT_ID slot_id, CK_SLOT_INFO *info) {
         return CKR_SLOT_ID_INVALID;
     }
 
-    token_lock(token);
+    token_lock_shared(token);
 
     CK_TOKEN_INFO token_info;
     if (token_get_info(token, &token_info)) {
@@ -139,8 +293,14 @@ CK_RV slot_mechanism_list_get (CK_SLOT_ID slot_id, CK_MECHANISM_TYPE *mechanism_
         return CKR_SLOT_ID_INVALID;
     }
 
-    token_lock(t);
-    CK_RV rv = mech_get_supported(t->mdtl, mechanism_list, count);
+    /* the mechanisms are read from the TPM */
+    CK_RV rv = token_load(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    token_lock_shared(t);
+    rv = mech_get_supported(t->mdtl, mechanism_list, count);
     token_unlock(t);
     return rv;
 }
@@ -154,17 +314,78 @@ CK_RV slot_mechanism_info_get (CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type, CK_ME
         return CKR_SLOT_ID_INVALID;
     }
 
-    token_lock(t);
-
-    CK_RV rv = mech_get_info(t->mdtl, t->tctx, type, info);
+    CK_RV rv = token_load(t);
     if (rv != CKR_OK) {
-        token_unlock(t);
         return rv;
     }
 
+    token_lock_shared(t);
+
+    tpm_ctx *tpm = tpm_ctx_pool_lease(t->tctx_pool, t->tctx);
+
+    tpm_lock(tpm);
+    rv = mech_get_info(t->mdtl, tpm, type, info);
+    tpm_unlock(tpm);
+
     token_unlock(t);
 
-    return CKR_OK;
+    return rv;
+}
+
+static bool slot_id_in_use_locked(CK_SLOT_ID id) {
+
+    size_t i;
+    for (i=0; i < global.token_cnt; i++) {
+        if (global.token[i].id == id) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static unsigned slot_free_id_locked(const token *reserved, size_t reserved_len) {
+
+    unsigned id;
+    for (id=1; id < MAX_TOKEN_CNT; id++) {
+        if (slot_id_in_use_locked(id)) {
+            continue;
+        }
+
+        size_t i;
+        for (i=0; i < reserved_len; i++) {
+            if (reserved[i].id == id) {
+                break;
+            }
+        }
+
+        if (i == reserved_len) {
+            return id;
+        }
+    }
+
+    return 0;
+}
+
+static void slot_post_event_locked(CK_SLOT_ID slot_id) {
+
+    size_t i;
+    for (i=0; i < global.pending_cnt; i++) {
+        if (global.pending[i] == slot_id) {
+            return;
+        }
+    }
+
+    if (global.pending_cnt < ARRAY_LEN(global.pending)) {
+        global.pending[global.pending_cnt++] = slot_id;
+    }
+}
+
+void slot_post_event(CK_SLOT_ID slot_id) {
+
+    slot_lock();
+    slot_post_event_locked(slot_id);
+    slot_unlock();
 }
 
 CK_RV slot_add_uninit_token(void) {
@@ -185,14 +406,18 @@ CK_RV slot_add_uninit_token(void) {
            }
         }
 
+        /* store tokens found later can take any id, so don't go by count */
+        unsigned id = slot_free_id_locked(NULL, 0);
         token *t = &global.token[global.token_cnt++];
-        t->id = global.token_cnt;
-        rv = token_min_init(t);
+        t->id = id;
+        rv = token_slot_init(t);
         if (rv != CKR_OK) {
            goto out;
         }
 
         assert(t->id);
+
+        slot_post_event_locked(t->id);
     } else {
         LOGW("Reached max tokens in store");
     }
@@ -203,3 +428,276 @@ out:
     slot_unlock();
     return rv;
 }
+
+static token *slot_get_placeholder_locked(void) {
+
+    size_t i;
+    for (i=0; i < global.token_cnt; i++) {
+        token *t = &global.token[i];
+        if (!t->config.is_initialized) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * The empty slot took the smallest free id when it was made, a token added
+ * to the store since then by another process can have the same one. Move
+ * the empty slot out of the way unless an application is using it.
+ */
+static bool slot_renumber_placeholder_locked(token *placeholder,
+        const token *new_tokens, size_t new_len) {
+
+    CK_ULONG sessions = 0;
+    session_table_get_cnt(placeholder->s_table, &sessions, NULL, NULL);
+    if (sessions) {
+        LOGV("Slot %u has open sessions, deferring new token",
+                placeholder->id);
+        return false;
+    }
+
+    unsigned id = slot_free_id_locked(new_tokens, new_len);
+    if (!id) {
+        LOGW("No free slot id for the uninitialized token");
+        return false;
+    }
+
+    LOGV("Moving uninitialized token from slot %u to %u", placeholder->id, id);
+    placeholder->id = id;
+    slot_post_event_locked(id);
+
+    return true;
+}
+
+/*
+ * Adds the tokens that showed up in the store since the last look. Caller
+ * holds the event lock.
+ */
+static CK_RV slot_refresh(void) {
+
+    int version = 0;
+    CK_RV rv = backend_get_store_version(&version);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (version == global.event.store_version && !global.event.retry) {
+        return CKR_OK;
+    }
+
+    global.event.store_version = version;
+    global.event.retry = false;
+
+    /*
+     * Hold the empty slot so C_InitToken can't turn it into a store token
+     * while we look for new ones, it would be loaded twice.
+     */
+    token *placeholder;
+    while (true) {
+        slot_lock();
+        placeholder = slot_get_placeholder_locked();
+        slot_unlock();
+
+        if (!placeholder) {
+            break;
+        }
+
+        token_lock(placeholder);
+        if (!placeholder->config.is_initialized) {
+            break;
+        }
+        token_unlock(placeholder);
+    }
+
+    unsigned known[MAX_TOKEN_CNT];
+    size_t known_len = 0;
+    size_t room = 0;
+
+    slot_lock();
+    size_t i;
+    for (i=0; i < global.token_cnt; i++) {
+        token *t = &global.token[i];
+        if (t->config.is_initialized) {
+            known[known_len++] = t->id;
+        }
+    }
+
+    /* keep room for the empty slot */
+    if (global.token_cnt + 1 < MAX_TOKEN_CNT) {
+        room = MAX_TOKEN_CNT - 1 - global.token_cnt;
+    }
+    slot_unlock();
+
+    if (!room) {
+        LOGW("Reached max tokens in store");
+        goto out;
+    }
+
+    token *tok = calloc(room, sizeof(token));
+    if (!tok) {
+        LOGE("oom");
+        rv = CKR_HOST_MEMORY;
+        goto out;
+    }
+
+    size_t len = 0;
+    rv = backend_get_new_tokens(known, known_len, tok, room, &len);
+    if (rv != CKR_OK) {
+        free(tok);
+        goto out;
+    }
+
+    slot_lock();
+    for (i=0; i < len; i++) {
+        token *t = &tok[i];
+
+        if (placeholder && placeholder->id == t->id
+                && !slot_renumber_placeholder_locked(placeholder, tok, len)) {
+            token_free(t);
+            global.event.retry = true;
+            continue;
+        }
+
+        LOGV("Adding token %u from the store", t->id);
+        global.token[global.token_cnt++] = *t;
+        slot_post_event_locked(t->id);
+    }
+    slot_unlock();
+
+    /* the tokens now live in the slot list */
+    free(tok);
+
+out:
+    if (placeholder) {
+        token_unlock(placeholder);
+    }
+
+    return rv;
+}
+
+static bool slot_event_pop(CK_SLOT_ID *slot_id) {
+
+    bool found = false;
+
+    slot_lock();
+    if (global.pending_cnt) {
+        *slot_id = global.pending[0];
+        global.pending_cnt--;
+        memmove(global.pending, &global.pending[1],
+                global.pending_cnt * sizeof(global.pending[0]));
+        found = true;
+    }
+    slot_unlock();
+
+    return found;
+}
+
+static CK_RV slot_event_watch(void) {
+
+    if (global.event.is_watching) {
+        return CKR_OK;
+    }
+
+    if (pipe(global.event.wake_fd)) {
+        LOGE("Could not create pipe: %s", strerror(errno));
+        global.event.wake_fd[0] = global.event.wake_fd[1] = -1;
+        return CKR_GENERAL_ERROR;
+    }
+
+    unsigned i;
+    for (i=0; i < ARRAY_LEN(global.event.wake_fd); i++) {
+        int fd = global.event.wake_fd[i];
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    /* if the store can't be watched we fall back to polling it */
+    global.event.watch_fd = backend_watch_store();
+    if (global.event.watch_fd < 0) {
+        LOGV("Store not watchable, polling every %u ms", SLOT_EVENT_POLL_MS);
+    }
+
+    global.event.is_watching = true;
+
+    return CKR_OK;
+}
+
+static void slot_event_sleep(int wake_fd, int watch_fd) {
+
+    struct pollfd fds[2] = {
+        { .fd = wake_fd,  .events = POLLIN },
+        { .fd = watch_fd, .events = POLLIN },
+    };
+
+    nfds_t cnt = watch_fd < 0 ? 1 : 2;
+
+    int rc = poll(fds, cnt, SLOT_EVENT_POLL_MS);
+    if (rc < 0 && errno != EINTR) {
+        LOGW("poll failed: %s", strerror(errno));
+    }
+
+    if (rc > 0 && watch_fd >= 0 && (fds[1].revents & POLLIN)) {
+        backend_watch_drain(watch_fd);
+    }
+}
+
+CK_RV slot_wait_for_event(CK_FLAGS flags, CK_SLOT_ID *slot_id, void *reserved) {
+
+    check_pointer(slot_id);
+
+    if (reserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&global.event.waiters_lock);
+    global.event.waiters++;
+    pthread_mutex_unlock(&global.event.waiters_lock);
+
+    event_lock();
+
+    CK_RV rv = slot_event_watch();
+    while (rv == CKR_OK) {
+
+        if (__atomic_load_n(&global.event.is_finalizing, __ATOMIC_ACQUIRE)) {
+            rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+            break;
+        }
+
+        if (slot_event_pop(slot_id)) {
+            break;
+        }
+
+        rv = slot_refresh();
+        if (rv != CKR_OK) {
+            break;
+        }
+
+        if (slot_event_pop(slot_id)) {
+            break;
+        }
+
+        if (flags & CKF_DONT_BLOCK) {
+            rv = CKR_NO_EVENT;
+            break;
+        }
+
+        int wake_fd = global.event.wake_fd[0];
+        int watch_fd = global.event.watch_fd;
+
+        event_unlock();
+        slot_event_sleep(wake_fd, watch_fd);
+        event_lock();
+    }
+
+    event_unlock();
+
+    pthread_mutex_lock(&global.event.waiters_lock);
+    if (!--global.event.waiters) {
+        pthread_cond_broadcast(&global.event.left);
+    }
+    pthread_mutex_unlock(&global.event.waiters_lock);
+
+    return rv;
+}
@@ -14,6 +14,13 @@ typedef struct token token;
 CK_RV slot_init(void);
 void slot_destroy(void);
 
+/**
+ * Re-establishes the slots and their tokens in the child of a fork().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV slot_fork_child(void);
+
 token *slot_get_token(CK_SLOT_ID slot_id);
 
 CK_RV slot_get_list (unsigned char token_present, CK_SLOT_ID *slot_list, unsigned long *count);
@@ -22,4 +29,27 @@ CK_RV slot_mechanism_list_get (CK_SLOT_ID slotID, CK_MECHANISM_TYPE *mechanism_l
 CK_RV slot_mechanism_info_get (CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO *info);
 CK_RV slot_add_uninit_token(void);
 
+/**
+ * Queues a slot event for C_WaitForSlotEvent, for changes made by this
+ * process that the store won't tell us about.
+ * @param slot_id
+ *  The slot that changed.
+ */
+void slot_post_event(CK_SLOT_ID slot_id);
+
+/**
+ * Returns the next slot event, looking in the store for new tokens first.
+ * Blocks until there is one unless CKF_DONT_BLOCK is set in flags.
+ * @param flags
+ *  The C_WaitForSlotEvent flags.
+ * @param slot_id
+ *  The slot with the event.
+ * @param reserved
+ *  Must be NULL.
+ * @return
+ *  CKR_OK on an event, CKR_NO_EVENT if there is none and the call would
+ *  block, CKR_CRYPTOKI_NOT_INITIALIZED if C_Finalize ran while waiting.
+ */
+CK_RV slot_wait_for_event(CK_FLAGS flags, CK_SLOT_ID *slot_id, void *reserved);
+
 #endif /* SRC_SLOT_H_ */
@@ -7,17 +7,22 @@
 #include <string.h>
 #include <time.h>
 
+#include <openssl/crypto.h>
+
+#include "attr_index.h"
 #include "attrs.h"
 #include "backend.h"
 #include "checks.h"
 #include "list.h"
 #include "mech.h"
+#include "mutex.h"
 #include "object.h"
 #include "pkcs11.h"
 #include "session.h"
 #include "session_table.h"
 #include "slot.h"
 #include "token.h"
+#include "tpm.h"
 #include "utils.h"
 
 static const CK_UTF8CHAR TPM2_TOKEN_SERIAL_NUMBER[] = "0000000000000000";
@@ -42,43 +47,140 @@ DEBUG_VISIBILITY void pobject_free(pobject *pobj) {
     memset(pobj, 0, sizeof(*pobj));
 }
 
-WEAK CK_RV token_min_init(token *t) {
+static void token_free_tobjects(token *t) {
+
+    if (t->tobjects.head) {
+        list *cur = &t->tobjects.head->l;
+        while(cur) {
+            tobject *tobj = list_entry(cur, tobject, l);
+            cur = cur->next;
+            tobject_free(tobj);
+        }
+    }
+    t->tobjects.head = t->tobjects.tail = NULL;
+
+    free(t->tobjects.index);
+    t->tobjects.index = NULL;
+    t->tobjects.index_len = 0;
+
+    free(t->tobjects.released);
+    t->tobjects.released = NULL;
+    t->tobjects.released_cnt = 0;
+    t->tobjects.last_handle = 0;
+
+    attr_index_free(t->tobjects.attr_index);
+    t->tobjects.attr_index = NULL;
+}
+
+WEAK CK_RV token_slot_init(token *t) {
 
     /*
      * Initialize the per-token session table
      */
-    CK_RV rv = session_table_new(&t->s_table);
+    CK_RV rv = session_table_new(&t->s_table, t->config.max_sessions);
     if (rv != CKR_OK) {
         LOGE("Could not initialize session table");
         return rv;
     }
 
+    rv = rwlock_create(&t->rwlock);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize rwlock: 0x%lx", rv);
+    }
+
+    return rv;
+}
+
+static CK_RV token_tpm_init(token *t) {
+
     /*
-     * Initialize the per-token tpm context
+     * Initialize the per-token tpm context, kept if a later step of
+     * token_load() fails
      */
-    rv = backend_ctx_new(t);
-    if (rv != CKR_OK) {
-        LOGE("Could not initialize tpm ctx: 0x%lx", rv);
-        return rv;
+    if (!t->tctx) {
+        CK_RV rv = backend_ctx_new(t);
+        if (rv != CKR_OK) {
+            LOGE("Could not initialize tpm ctx: 0x%lx", rv);
+            return rv;
+        }
     }
 
     /*
      * Initialize the per-token mechanism details table
      */
-    rv = mdetail_new(t->tctx, &t->mdtl, t->config.pss_sigs_good);
+    if (!t->mdtl) {
+        CK_RV rv = mdetail_new(t->tctx, &t->mdtl, t->config.pss_sigs_good);
+        if (rv != CKR_OK) {
+            LOGE("Could not initialize tpm mdetails: 0x%lx", rv);
+            return rv;
+        }
+    }
+
+    return CKR_OK;
+}
+
+WEAK CK_RV token_min_init(token *t) {
+
+    CK_RV rv = token_slot_init(t);
     if (rv != CKR_OK) {
-        LOGE("Could not initialize tpm mdetails: 0x%lx", rv);
         return rv;
     }
 
-    rv = mutex_create(&t->mutex);
+    rv = token_tpm_init(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    t->is_loaded = true;
+
+    return CKR_OK;
+}
+
+CK_RV token_load_locked(token *t) {
+
+    if (t->is_loaded) {
+        return CKR_OK;
+    }
+
+    CK_RV rv = token_tpm_init(t);
     if (rv != CKR_OK) {
-        LOGE("Could not initialize mutex: 0x%lx", rv);
+        return rv;
     }
 
+    rv = backend_load_token(t);
+    if (rv != CKR_OK) {
+        LOGE("Could not load token %u: 0x%lx", t->id, rv);
+        /* drop what was loaded, the TPM context stays for the next try */
+        if (t->pobject.config.is_transient && t->pobject.handle) {
+            tpm_flushcontext(t->tctx, t->pobject.handle);
+        }
+        token_reset(t);
+        token_free_tobjects(t);
+        return rv;
+    }
+
+    LOGV("Loaded token %u", t->id);
+
+    /* readers check it without the lock, see token_load() */
+    __atomic_store_n(&t->is_loaded, true, __ATOMIC_RELEASE);
+
+    return CKR_OK;
+}
+
+CK_RV token_load(token *t) {
+
+    if (__atomic_load_n(&t->is_loaded, __ATOMIC_ACQUIRE)) {
+        return CKR_OK;
+    }
+
+    token_lock(t);
+    CK_RV rv = token_load_locked(t);
+    token_unlock(t);
+
     return rv;
 }
 
+
 void token_reset(token *t) {
 
     /* forget the primary object so it can be reinitialized as needed */
@@ -91,6 +193,77 @@ void token_reset(token *t) {
      */
 }
 
+CK_RV token_fork_child(token *t) {
+
+    /*
+     * Locks and sessions may be held by parent threads that don't exist in
+     * the child. Abandon them rather than destroying them under a holder.
+     */
+    CK_RV rv = rwlock_create(&t->rwlock);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize rwlock: 0x%lx", rv);
+        return rv;
+    }
+
+    rv = session_table_new(&t->s_table, t->config.max_sessions);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize session table");
+        return rv;
+    }
+
+    /* no sessions means no one is logged in, see session_ctx_logout() */
+    if (t->wrappingkey) {
+        OPENSSL_cleanse((void *)t->wrappingkey, twist_len(t->wrappingkey));
+        twist_free(t->wrappingkey);
+        t->wrappingkey = NULL;
+    }
+
+    t->login_state = token_no_one_logged_in;
+
+    /*
+     * The parsed objects stay, their TPM handles belong to the parent's
+     * context and are reloaded on next use.
+     */
+    if (t->tobjects.head) {
+
+        list *cur = &t->tobjects.head->l;
+        while(cur) {
+            tobject *tobj = list_entry(cur, tobject, l);
+            cur = cur->next;
+
+            /* nothing was unwrapped from objects never decoded */
+            CK_BBOOL cka_private = attr_list_get_CKA_PRIVATE(
+                    tobject_get_summary(tobj), CK_FALSE);
+            CK_ATTRIBUTE_PTR a = tobj->attrs ?
+                    attr_get_attribute_by_type(tobj->attrs, CKA_VALUE) : NULL;
+            if (cka_private && a && a->pValue && a->ulValueLen) {
+                attr_pfree_cleanse(a);
+            }
+
+            tobj->active = 0;
+            tobj->is_decoding = false;
+            tobj->is_authenticated = false;
+            tobj->tpm_esys_tr = 0;
+            memset(tobj->tpm_esys_tr_pool, 0, sizeof(tobj->tpm_esys_tr_pool));
+
+            twist_free(tobj->unsealed_auth);
+            tobj->unsealed_auth = NULL;
+        }
+    }
+
+    /*
+     * Tokens that aren't loaded yet bring up their own TPM context on first
+     * use, one left from a failed load belongs to the parent.
+     */
+    if (!t->is_loaded) {
+        t->tctx = NULL;
+        t->tctx_pool = NULL;
+        return CKR_OK;
+    }
+
+    return backend_ctx_fork_child(t);
+}
+
 void token_free_list(token **tok_ptr, size_t *ptr_len) {
 
     size_t len = *ptr_len;
@@ -109,110 +282,152 @@ void token_free_list(token **tok_ptr, size_t *ptr_len) {
     free(t);
 }
 
-WEAK CK_RV token_add_tobject_last(token *tok, tobject *t) {
+/*
+ * Handles are handed out densely from 1, so the index is a flat array
+ * indexed by handle rather than a hash table.
+ */
+#define TOKEN_INDEX_MIN 64
+
+static CK_RV token_index_set(token *tok, CK_OBJECT_HANDLE handle, tobject *t) {
+
+    size_t len = tok->tobjects.index_len;
+    if (handle >= len) {
+        size_t new_len = len ? len : TOKEN_INDEX_MIN;
+        while (new_len <= handle) {
+            if (new_len > SIZE_MAX / 2 / sizeof(tobject *)) {
+                LOGE("Too many objects for token, id: %u", tok->id);
+                return CKR_HOST_MEMORY;
+            }
+            new_len *= 2;
+        }
 
-    if (!tok->tobjects.tail) {
-        t->l.prev = t->l.next = NULL;
-        tok->tobjects.tail = tok->tobjects.head = t;
-        t->obj_handle = 1;
-        return CKR_OK;
-    }
+        /*
+         * Released handles are below the index length, so sizing the free
+         * stack along with the index means releasing never allocates.
+         */
+        CK_OBJECT_HANDLE *released = realloc(tok->tobjects.released,
+                new_len * sizeof(*released));
+        if (!released) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+        tok->tobjects.released = released;
 
-    CK_OBJECT_HANDLE handle = tok->tobjects.tail->obj_handle;
-    if (handle == ~((CK_OBJECT_HANDLE)0)) {
-        LOGE("Too many objects for token, id: %u, label: %*s", tok->id,
-                (int)sizeof(tok->label), tok->label);
-        return CKR_OK;
+        tobject **index = realloc(tok->tobjects.index,
+                new_len * sizeof(*index));
+        if (!index) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+
+        memset(&index[len], 0, (new_len - len) * sizeof(*index));
+        tok->tobjects.index = index;
+        tok->tobjects.index_len = new_len;
     }
 
-    handle++;
-    t->obj_handle = handle;
-    tok->tobjects.tail->l.next = &t->l;
-    t->l.prev = &tok->tobjects.tail->l;
-    tok->tobjects.tail = t;
+    tok->tobjects.index[handle] = t;
+
     return CKR_OK;
 }
 
-CK_RV token_add_tobject(token *tok, tobject *t) {
+static CK_RV token_link_tobject(token *tok, tobject *t, CK_OBJECT_HANDLE handle) {
 
-    if (!tok->tobjects.head) {
-        t->l.prev = t->l.next = NULL;
-        tok->tobjects.tail = tok->tobjects.head = t;
-        t->obj_handle = 1;
-        return CKR_OK;
+    /* the index keeps its lists in seq order, so it's set up front */
+    t->seq = tok->tobjects.last_seq + 1;
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+    if (!tok->tobjects.attr_index) {
+        rv = attr_index_new(&tok->tobjects.attr_index);
+        if (rv != CKR_OK) {
+            return rv;
+        }
     }
 
-    /* minimum potential handle to add */
-    CK_OBJECT_HANDLE index = 2;
+    rv = attr_index_add(tok->tobjects.attr_index, t, tobject_get_summary(t));
+    if (rv != CKR_OK) {
+        return rv;
+    }
 
-    list *cur = &tok->tobjects.head->l;
-    while(cur) {
+    rv = token_index_set(tok, handle, t);
+    if (rv != CKR_OK) {
+        attr_index_remove(tok->tobjects.attr_index, t, tobject_get_summary(t));
+        return rv;
+    }
 
-        if (index == 0) {
-            LOGE("Rollover, too many objects for token, id: %u, label: %*s", tok->id,
-                    (int)sizeof(tok->label), tok->label);
-            return CKR_OK;
-        }
+    t->obj_handle = handle;
+    tok->tobjects.last_seq = t->seq;
 
-        tobject *c = list_entry(cur, tobject, l);
+    /* the list is in insertion order, handles are found through the index */
+    t->l.next = NULL;
+    if (tok->tobjects.tail) {
+        t->l.prev = &tok->tobjects.tail->l;
+        tok->tobjects.tail->l.next = &t->l;
+    } else {
+        t->l.prev = NULL;
+        tok->tobjects.head = t;
+    }
+    tok->tobjects.tail = t;
 
-        /* end of list, just add it updating the tail pointer */
-        if (!c->l.next) {
-            t->obj_handle = index;
-            t->l.prev = cur;
-            cur->next = &t->l;
-            tok->tobjects.tail = t;
-            return CKR_OK;
-        }
+    return CKR_OK;
+}
 
-        tobject *n = list_entry(c->l.next, tobject, l);
+WEAK CK_RV token_add_tobject_last(token *tok, tobject *t) {
+
+    CK_OBJECT_HANDLE handle = tok->tobjects.last_handle;
+    if (handle == ~((CK_OBJECT_HANDLE)0)) {
+        LOGE("Too many objects for token, id: %u, label: %*s", tok->id,
+                (int)sizeof(tok->label), tok->label);
+        return CKR_OK;
+    }
 
-        /* gap */
-        if (n->obj_handle - c->obj_handle > 1) {
-            assert(index < n->obj_handle && index > c->obj_handle);
-            t->obj_handle = index;
+    handle++;
 
-            /* new object should point to next and previous */
-            t->l.next = &n->l;
-            t->l.prev = cur;
+    CK_RV rv = token_link_tobject(tok, t, handle);
+    if (rv != CKR_OK) {
+        return rv;
+    }
 
-            /* existing object ahead should point back at new object */
-            n->l.prev = &t->l;
+    tok->tobjects.last_handle = handle;
 
-            /* existing object behind should point forward at new object */
-            c->l.next = &t->l;
+    return CKR_OK;
+}
 
-            return CKR_OK;
-        }
+CK_RV token_add_tobject(token *tok, tobject *t) {
+
+    /* reuse the most recently released handle, if any */
+    if (!tok->tobjects.released_cnt) {
+        return token_add_tobject_last(tok, t);
+    }
 
-        index++;
-        cur = cur->next;
+    size_t top = tok->tobjects.released_cnt - 1;
+    CK_RV rv = token_link_tobject(tok, t, tok->tobjects.released[top]);
+    if (rv != CKR_OK) {
+        return rv;
     }
 
-    LOGE("Could not insert tobject into token");
+    tok->tobjects.released_cnt = top;
 
-    return CKR_GENERAL_ERROR;
+    return CKR_OK;
 }
 
 CK_RV token_find_tobject(token *tok, CK_OBJECT_HANDLE handle, tobject **tobj) {
     assert(tok);
     assert(tobj);
 
-    if (!tok->tobjects.head) {
+    if (handle >= tok->tobjects.index_len
+            || !tok->tobjects.index[handle]) {
         return CKR_KEY_HANDLE_INVALID;
     }
 
-    list *cur = &tok->tobjects.head->l;
-    while(cur) {
-        tobject *c = list_entry(cur, tobject, l);
-        if (c->obj_handle == handle) {
-            *tobj = c;
-            return CKR_OK;
-        }
-        cur = cur->next;
+    /* objects read from the store are decoded on first use */
+    tobject *t = tok->tobjects.index[handle];
+    CK_RV rv = tobject_decode_attrs(t);
+    if (rv != CKR_OK) {
+        return rv;
     }
 
-    return CKR_KEY_HANDLE_INVALID;
+    *tobj = t;
+    return CKR_OK;
 }
 
 void token_rm_tobject(token *tok, tobject *t) {
@@ -246,6 +461,69 @@ void token_rm_tobject(token *tok, tobject *t) {
     }
 
     t->l.next = t->l.prev = NULL;
+
+    assert(t->obj_handle < tok->tobjects.index_len);
+    tok->tobjects.index[t->obj_handle] = NULL;
+
+    attr_index_remove(tok->tobjects.attr_index, t, tobject_get_summary(t));
+
+    /* the stack is as long as the index, see token_index_set() */
+    assert(tok->tobjects.released_cnt < tok->tobjects.index_len);
+    tok->tobjects.released[tok->tobjects.released_cnt++] = t->obj_handle;
+}
+
+CK_RV token_replace_tobject(token *tok, tobject *old, tobject *new) {
+
+    assert(old->obj_handle < tok->tobjects.index_len);
+    assert(tok->tobjects.index[old->obj_handle] == old);
+
+    /* same place in the index lists, searches resume by seq */
+    new->seq = old->seq;
+
+    CK_RV rv = attr_index_add(tok->tobjects.attr_index, new,
+            tobject_get_summary(new));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    attr_index_remove(tok->tobjects.attr_index, old, tobject_get_summary(old));
+
+    new->obj_handle = old->obj_handle;
+    tok->tobjects.index[new->obj_handle] = new;
+
+    new->l = old->l;
+    if (new->l.prev) {
+        new->l.prev->next = &new->l;
+    } else {
+        tok->tobjects.head = new;
+    }
+
+    if (new->l.next) {
+        new->l.next->prev = &new->l;
+    } else {
+        tok->tobjects.tail = new;
+    }
+
+    old->l.next = old->l.prev = NULL;
+
+    /* an attribute change keeps the key loaded, new key material doesn't */
+    if (tobject_decode_attrs(new) == CKR_OK
+            && twist_eq(old->pub, new->pub)
+            && twist_eq(old->priv, new->priv)) {
+        new->tpm_esys_tr = old->tpm_esys_tr;
+        memcpy(new->tpm_esys_tr_pool, old->tpm_esys_tr_pool,
+                sizeof(new->tpm_esys_tr_pool));
+        new->unsealed_auth = old->unsealed_auth;
+        new->is_authenticated = old->is_authenticated;
+        old->tpm_esys_tr = 0;
+        memset(old->tpm_esys_tr_pool, 0, sizeof(old->tpm_esys_tr_pool));
+        old->unsealed_auth = NULL;
+        return CKR_OK;
+    }
+
+    token_flush_tobject(tok, old);
+
+    return CKR_OK;
 }
 
 void token_config_free(token_config *c) {
@@ -269,25 +547,25 @@ void token_free(token *t) {
 
     if (t->pobject.config.is_transient) {
         tpm_flushcontext(t->tctx, t->pobject.handle);
+
+        size_t i;
+        for (i = 0; i < tpm_ctx_pool_len(t->tctx_pool); i++) {
+            if (t->tctx_pool_primary[i]) {
+                tpm_flushcontext(tpm_ctx_pool_get(t->tctx_pool, i),
+                        t->tctx_pool_primary[i]);
+            }
+        }
     }
 
     pobject_free(&t->pobject);
 
-    if (t->tobjects.head) {
-        list *cur = &t->tobjects.head->l;
-        while(cur) {
-            tobject *tobj = list_entry(cur, tobject, l);
-            cur = cur->next;
-            tobject_free(tobj);
-        }
-    }
-    t->tobjects.head = t->tobjects.tail = NULL;
+    token_free_tobjects(t);
 
     backend_ctx_free(t);
     t->tctx = NULL;
 
-    mutex_destroy(t->mutex);
-    t->mutex = NULL;
+    rwlock_destroy(t->rwlock);
+    t->rwlock = NULL;
 
     token_config_free(&t->config);
 
@@ -304,7 +582,16 @@ CK_RV token_get_info (token *t, CK_TOKEN_INFO *info) {
 
     memset(info, 0, sizeof(*info));
 
-    rval = tpm_get_token_info(t->tctx, info);
+    if (t->is_loaded) {
+        /* callers hold the token shared, the TPM still needs serializing */
+        tpm_ctx *tpm = tpm_ctx_pool_lease(t->tctx_pool, t->tctx);
+        tpm_lock(tpm);
+        rval = tpm_get_token_info(tpm, info);
+        tpm_unlock(tpm);
+    } else {
+        /* don't bring up a token just to describe it */
+        rval = tpm_get_token_info_by_tcti(t->config.tcti, info);
+    }
     if (rval != CKR_OK) {
         return CKR_GENERAL_ERROR;
     }
@@ -321,6 +608,10 @@ CK_RV token_get_info (token *t, CK_TOKEN_INFO *info) {
         info->flags |= CKF_USER_PIN_INITIALIZED;
     }
 
+    if (backend_is_write_protected(t)) {
+        info->flags |= CKF_WRITE_PROTECTED;
+    }
+
     // Identification
     str_padded_copy(info->label, t->label);
     str_padded_copy(info->serialNumber, TPM2_TOKEN_SERIAL_NUMBER);
@@ -335,8 +626,8 @@ CK_RV token_get_info (token *t, CK_TOKEN_INFO *info) {
     // Maximums and Minimums
     info->ulMaxPinLen = 128;
     info->ulMinPinLen = 0;
-    info->ulMaxSessionCount = MAX_NUM_OF_SESSIONS;
-    info->ulMaxRwSessionCount = MAX_NUM_OF_SESSIONS;
+    info->ulMaxSessionCount = session_table_get_max(t->s_table);
+    info->ulMaxRwSessionCount = info->ulMaxSessionCount;
 
     // Session
     session_table_get_cnt(t->s_table, &info->ulSessionCount, &info->ulRwSessionCount, NULL);
@@ -375,6 +666,11 @@ CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label)
         return CKR_ARGUMENTS_BAD;
     }
 
+    rv = token_load_locked(t);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     twist sopin = twistbin_new(pin, pin_len);
     if (!sopin) {
         LOGE("oom");
@@ -403,6 +699,9 @@ CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label)
     /* Ownership of newsalthex is transferred in the previous call */
     newsalthex = NULL;
 
+    /* the store id replaced the slot id, tell C_WaitForSlotEvent */
+    slot_post_event(t->id);
+
     rv = slot_add_uninit_token();
     if (rv != CKR_OK) {
         LOGW("Could not add uninitialized token");
@@ -439,11 +738,139 @@ bool token_is_so_logged_in(token *tok) {
 
 
 void token_lock(token *t) {
-    mutex_lock_fatal(t->mutex);
+    rwlock_wrlock_fatal(t->rwlock);
+}
+
+void token_lock_shared(token *t) {
+    rwlock_rdlock_fatal(t->rwlock);
+}
+
+void token_lock_shared_sync(token *t) {
+
+    token_lock_shared(t);
+
+    /* an unloaded token reads the current objects when it is loaded */
+    if (!t->is_loaded || !backend_tobjects_changed(t)) {
+        return;
+    }
+
+    /* no upgrades, someone else may have refreshed in between */
+    token_unlock(t);
+    token_lock(t);
+
+    CK_RV rv = backend_refresh_tobjects(t);
+    if (rv != CKR_OK) {
+        /* not fatal, the objects loaded so far are still good */
+        LOGW("Could not refresh objects from the store: 0x%lx", rv);
+    }
+
+    token_unlock(t);
+    token_lock_shared(t);
+}
+
+void token_lock_tpm(token *t, tpm_ctx *tpm) {
+    token_lock_shared(t);
+    tpm_lock(tpm);
 }
 
 void token_unlock(token *t) {
-    mutex_unlock_fatal(t->mutex);
+    rwlock_unlock_fatal(t->rwlock);
+}
+
+void token_unlock_tpm(token *t, tpm_ctx *tpm) {
+    tpm_unlock(tpm);
+    token_unlock(t);
+}
+
+tpm_ctx *token_lease_tpm(token *t) {
+
+    /*
+     * Pooled contexts unwrap the object auth they load keys with, so they are
+     * only used once the wrapping key is known, see token_load_object().
+     */
+    if (!t->tctx_pool || !__atomic_load_n(&t->wrappingkey, __ATOMIC_ACQUIRE)) {
+        return t->tctx;
+    }
+
+    return tpm_ctx_pool_lease(t->tctx_pool, t->tctx);
+}
+
+bool token_flush_tobject(token *tok, tobject *tobj) {
+
+    /*
+     * If the object is public and the associated key in the TPM is persistent,
+     * tpm_flushcontext is still necessary because, during the initialization of the object,
+     * a transient TPM key with only the public component is created from the persistent key.
+     */
+    CK_BBOOL cka_private = attr_list_get_CKA_PRIVATE(
+            tobject_get_summary(tobj), CK_FALSE);
+    bool is_ours = !(cka_private && tobj->tpm_persistent_handle);
+
+    bool is_flushed = false;
+    if (tobj->tpm_esys_tr && is_ours) {
+        if (tok->tctx) {
+            bool result = tpm_flushcontext(tok->tctx, tobj->tpm_esys_tr);
+            assert(result);
+            UNUSED(result);
+        }
+        tobj->tpm_esys_tr = 0;
+        is_flushed = true;
+    }
+
+    size_t i;
+    for (i = 0; i < tpm_ctx_pool_len(tok->tctx_pool); i++) {
+        if (!tobj->tpm_esys_tr_pool[i] || !is_ours) {
+            continue;
+        }
+
+        bool result = tpm_flushcontext(tpm_ctx_pool_get(tok->tctx_pool, i),
+                tobj->tpm_esys_tr_pool[i]);
+        assert(result);
+        UNUSED(result);
+        tobj->tpm_esys_tr_pool[i] = 0;
+        is_flushed = true;
+    }
+
+    return is_flushed;
+}
+
+/*
+ * ESYS_TR handles only exist in the context that made them, so a pooled
+ * context sets up its own primary object and auth session the first time
+ * it's used, like backend_esysdb_ctx_fork_child() does for the token's own.
+ * Called with the pooled context locked.
+ */
+static CK_RV token_pool_ctx_init(token *tok, tpm_ctx *tpm) {
+
+    CK_RV rv = CKR_OK;
+    unsigned idx = tpm_ctx_pool_index(tpm);
+    assert(idx);
+
+    uint32_t *primary = &tok->tctx_pool_primary[idx - 1];
+    if (!*primary) {
+        pobject *pobj = &tok->pobject;
+        if (pobj->config.is_transient) {
+            rv = tpm_create_transient_primary_from_template(tpm,
+                    pobj->config.template_name, pobj->objauth, primary);
+        } else {
+            rv = tpm_deserialize_handle(tpm, pobj->config.blob, primary) ?
+                    CKR_OK : CKR_GENERAL_ERROR;
+        }
+        if (rv != CKR_OK) {
+            LOGE("Could not set up the primary object in pooled TPM context %u", idx);
+            return rv;
+        }
+    }
+
+    /* stopped by session_ctx_logout() */
+    if (!tpm_session_active(tpm)) {
+        rv = tpm_session_start(tpm, tok->pobject.objauth, *primary);
+        if (rv != CKR_OK) {
+            LOGE("Could not start Auth Session in pooled TPM context %u", idx);
+        }
+    }
+
+    return rv;
 }
 
 CK_RV token_setpin(token *tok, CK_UTF8CHAR_PTR oldpin, CK_ULONG oldlen, CK_UTF8CHAR_PTR newpin, CK_ULONG newlen) {
@@ -576,12 +1003,32 @@ out:
     return rv;
 }
 
-CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj) {
+CK_RV token_load_object(token *tok, tpm_ctx *tpm, CK_OBJECT_HANDLE key, tobject **loaded_tobj) {
     CK_RV rv;
-    tpm_ctx *tpm = tok->tctx;
+
+    /*
+     * Called under token_lock_tpm(), the lazily populated fields below, ie the
+     * wrapping key for empty PIN tokens and the tobject TPM state, are only
+     * written with the TPM lock held. The wrapping key is unsealed in the
+     * token's own context, pooled ones are only leased once it's known, see
+     * token_lease_tpm(). Each context has its own handle for the object, the
+     * unwrapped auth is shared by all of them.
+     */
+    bool is_pooled = tpm != tok->tctx;
+    if (is_pooled) {
+        /* leased before a logout */
+        if (!tok->wrappingkey) {
+            return CKR_USER_NOT_LOGGED_IN;
+        }
+
+        rv = token_pool_ctx_init(tok, tpm);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
 
     /* Unseal the wrapping key, if the user PIN is empty */
-    if (!tok->wrappingkey && tok->config.empty_user_pin) {
+    if (!is_pooled && !tok->wrappingkey && tok->config.empty_user_pin) {
         twist tpin = twistbin_new("", 0);
         if (!tpin) {
             return CKR_HOST_MEMORY;
@@ -631,17 +1078,22 @@ CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj)
      * The object may already be loaded by the TPM or may just be
      * a public key object not-resident in the TPM.
      */
-    if (tobj->tpm_esys_tr || (!tobj->pub && !tobj->tpm_persistent_handle)) {
+    uint32_t *handle = tpm_tobject_handle(tpm, tobj);
+    if (*handle || (!tobj->pub && !tobj->tpm_persistent_handle)) {
         *loaded_tobj = tobj;
         return CKR_OK;
     }
 
+    uint32_t parent = is_pooled ?
+            tok->tctx_pool_primary[tpm_ctx_pool_index(tpm) - 1] :
+            tok->pobject.handle;
+
     if (tobj->tpm_persistent_handle && v != CKO_SECRET_KEY) {
         if (v == CKO_PRIVATE_KEY) {
             rv = tpm_get_esys_tr(
                     tpm,
                     tobj->tpm_persistent_handle,
-                    &tobj->tpm_esys_tr,
+                    handle,
                     NULL);
             if (rv != CKR_OK) {
                 return rv;
@@ -651,7 +1103,7 @@ CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj)
                     tpm,
                     tobj->tpm_persistent_handle,
                     NULL,
-                    &tobj->tpm_esys_tr);
+                    handle);
             if (rv != CKR_OK) {
                 return rv;
             }
@@ -659,21 +1111,34 @@ CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj)
     } else {
         rv = tpm_loadobj(
                 tpm,
-                tok->pobject.handle, tok->pobject.objauth,
+                parent, tok->pobject.objauth,
                 tobj->pub, tobj->priv,
-                &tobj->tpm_esys_tr);
+                handle);
         if (rv != CKR_OK) {
             return rv;
         }
     }
 
+    /* another context may have loaded the object already */
+    if (__atomic_load_n(&tobj->unsealed_auth, __ATOMIC_ACQUIRE)) {
+        *loaded_tobj = tobj;
+        return CKR_OK;
+    }
+
+    twist unsealed_auth = NULL;
     rv = utils_ctx_unwrap_objauth(tok->wrappingkey, tobj->objauth,
-            &tobj->unsealed_auth);
+            &unsealed_auth);
     if (rv != CKR_OK) {
         LOGE("Error unwrapping tertiary object auth");
         return rv;
     }
 
+    twist expected = NULL;
+    if (!__atomic_compare_exchange_n(&tobj->unsealed_auth, &expected,
+            unsealed_auth, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        twist_free(unsealed_auth);
+    }
+
     *loaded_tobj = tobj;
     return CKR_OK;
 }
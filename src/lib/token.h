@@ -23,6 +23,8 @@ struct token_config {
     char *tcti;           /* token specific tcti config */
     pss_config_state pss_sigs_good;
     bool empty_user_pin;  /* user PIN of the token is empty */
+    size_t max_sessions;  /* open session limit, 0 for the default */
+    size_t tpm_ctx_pool_size; /* extra TPM contexts for key operations, see token_lease_tpm() */
 };
 
 typedef struct session_table session_table;
@@ -36,6 +38,7 @@ enum token_login_state {
 };
 
 typedef struct tobject tobject;
+typedef struct attr_index attr_index;
 
 typedef struct pobject_config pobject_config;
 struct pobject_config {
@@ -88,6 +91,10 @@ struct token {
     union { /* anon union for backend data */
         struct {
             sealobject sealobject;
+            /* the store as of the last refresh, see db_refresh_tobjects() */
+            int store_version;
+            int64_t change_seq;
+            unsigned failed_commits;
         } esysdb; /* esysdb */
         struct {
             void *ctx;
@@ -99,11 +106,28 @@ struct token {
     /* This context will be filled by fapi for use with esys-only commands. */
     tpm_ctx *tctx;
 
+    /* optional extra contexts key operations are spread over, see token_lease_tpm() */
+    tpm_ctx_pool *tctx_pool;
+    /* the primary object in each pooled context, 0 until the context is first used */
+    uint32_t tctx_pool_primary[TPM_CTX_POOL_MAX];
+
     twist wrappingkey;
 
     struct {
         tobject *head;
         tobject *tail;
+        /* tobjects by obj_handle, NULL for unused handles */
+        tobject **index;
+        size_t index_len;
+        /* highest handle handed out so far */
+        CK_OBJECT_HANDLE last_handle;
+        /* seq of the most recently added tobject */
+        uint64_t last_seq;
+        /* stack of handles freed by token_rm_tobject() for reuse */
+        CK_OBJECT_HANDLE *released;
+        size_t released_cnt;
+        /* tobjects by the values of the attributes searched by */
+        attr_index *attr_index;
     } tobjects;
 
     session_table *s_table;
@@ -112,7 +136,14 @@ struct token {
 
     mdetail *mdtl;
 
-    void *mutex;
+    /*
+     * Shared for calls that only read token state, exclusive for calls that
+     * change it, see token_lock() and friends.
+     */
+    void *rwlock;
+
+    /* the TPM context, primary and objects are up, see token_load() */
+    bool is_loaded;
 };
 
 /**
@@ -130,6 +161,17 @@ void token_free(token *t);
 void token_config_free(token_config *c);
 
 
+/**
+ * Re-establishes a token in the child of a fork(). Object state parsed
+ * from the store is kept, sessions and logins are dropped and the TPM
+ * contexts are replaced.
+ * @param t
+ *  The token.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV token_fork_child(token *t);
+
 /**
  * Free's a list of tokens
  * @param t
@@ -142,9 +184,9 @@ void token_config_free(token_config *c);
 void token_free_list(token **t, size_t *len);
 
 /**
- * Adds a tobject into the token tobject list filling in
- * gaps along the way and using the gap index as the object
- * handle index.
+ * Adds a tobject to the end of the token tobject list, reusing the
+ * most recently released object handle if there is one and taking
+ * the next unused one otherwise. O(1).
  * @param tok
  *  The token to insert into.
  * @param t
@@ -154,13 +196,23 @@ void token_free_list(token **t, size_t *len);
  */
 CK_RV token_add_tobject(token *tok, tobject *t);
 
+/**
+ * Finds a tobject by handle, decoding its attributes if needed.
+ * @param tok
+ *  The token to search.
+ * @param handle
+ *  The object handle.
+ * @param tobj
+ *  The found tobject.
+ * @return
+ *  CKR_OK on success, CKR_KEY_HANDLE_INVALID if there is no such object.
+ */
 CK_RV token_find_tobject(token *tok, CK_OBJECT_HANDLE handle, tobject **tobj);
 
 /**
- * Adds a tobject to the END of the tobject list incrementing the
- * previous tobject index number and using that. This DOES NOT gap
- * fill, and thus is really best for use only in the DB initialization
- * logic to prevent multiple iterations of the linked list during initialization.
+ * Adds a tobject to the END of the tobject list using the next never
+ * used object handle. This DOES NOT reuse released handles, and thus is
+ * really best for use only in the DB initialization logic.
  * @param tok
  *  The token to insert into.
  * @param t
@@ -172,6 +224,22 @@ CK_RV token_add_tobject_last(token *tok, tobject *t);
 
 void token_rm_tobject(token *tok, tobject *t);
 
+/**
+ * Replaces a tobject with a newer copy of it, for changes made to the store
+ * by someone else. The new tobject takes over the handle and the position
+ * of the old one, so handles and ongoing searches stay valid. The old one
+ * is unlinked but not freed.
+ * @param tok
+ *  The token holding old.
+ * @param old
+ *  The tobject to replace, must not be busy.
+ * @param new
+ *  The tobject to put in its place.
+ * @return
+ *  CKR_OK on success, the token is unchanged on failure.
+ */
+CK_RV token_replace_tobject(token *tok, tobject *old, tobject *new);
+
 CK_RV token_get_info(token *t, CK_TOKEN_INFO *info);
 
 /**
@@ -200,13 +268,88 @@ CK_RV token_setpin(token *tok, CK_UTF8CHAR_PTR old_pin, CK_ULONG old_len, CK_UTF
 
 CK_RV token_initpin(token *tok, CK_UTF8CHAR_PTR new_pin, CK_ULONG new_len);
 
+/**
+ * Locks the token exclusive, for calls that modify the token state, ie the
+ * object list, attributes or the login state.
+ * @param t
+ *  The token to lock.
+ */
 void token_lock(token *t);
+
+/**
+ * Locks the token shared, for calls that only read the token state. These
+ * run concurrently with each other and with calls holding token_lock_tpm().
+ * @param t
+ *  The token to lock.
+ */
+void token_lock_shared(token *t);
+
+/**
+ * Like token_lock_shared(), but first merges in the objects other processes
+ * changed in the store since the last time, which takes the token lock
+ * exclusive for a moment. For calls that should see those changes, like
+ * C_FindObjectsInit.
+ * @param t
+ *  The token to lock.
+ */
+void token_lock_shared_sync(token *t);
+
+/**
+ * Locks the token shared and serializes use of a TPM context. For calls
+ * that issue TPM commands but only read the token state.
+ * @param t
+ *  The token to lock.
+ * @param tpm
+ *  The token's context to lock, see token_lease_tpm().
+ */
+void token_lock_tpm(token *t, tpm_ctx *tpm);
+
+/**
+ * Unlocks a token locked with token_lock() or token_lock_shared().
+ * @param t
+ *  The token to unlock.
+ */
 void token_unlock(token *t);
 
+/**
+ * Unlocks a token locked with token_lock_tpm().
+ * @param t
+ *  The token to unlock.
+ * @param tpm
+ *  The context passed to token_lock_tpm().
+ */
+void token_unlock_tpm(token *t, tpm_ctx *tpm);
+
+/**
+ * Picks the TPM context for a key operation, round robin over the token's
+ * pool, see the token config key tpm-ctx-pool-size. Keys are loaded into a
+ * pooled context the first time it is used for them. Until the wrapping key
+ * is known, or without a pool, this is the token's own context.
+ * @param t
+ *  The token, locked at least shared.
+ * @return
+ *  The context, not locked.
+ */
+tpm_ctx *token_lease_tpm(token *t);
+
+/**
+ * Flushes an object from all of the token's TPM contexts it's loaded in.
+ * Private keys that are persistent in the TPM are left alone.
+ * @param tok
+ *  The token, locked exclusive.
+ * @param tobj
+ *  The object.
+ * @return
+ *  true if the object was flushed from at least one context.
+ */
+bool token_flush_tobject(token *tok, tobject *tobj);
+
 /**
  * Look up and possibly load an unloaded tobject.
  * @param tok
  *  The token to look up the object on.
+ * @param tpm
+ *  The context to load it into, locked with token_lock_tpm().
  * @param key
  *  The object handle to look for.
  * @param loaded_tobj
@@ -217,9 +360,44 @@ void token_unlock(token *t);
  *   CKR_KEY_HANDLE_INVALID - invalid key handle
  *   Others like: CKR_GENERAL_ERROR and CKR_HOST_MEMORY
  */
-CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj);
+CK_RV token_load_object(token *tok, tpm_ctx *tpm, CK_OBJECT_HANDLE key, tobject **loaded_tobj);
 
+/**
+ * Sets up what a slot needs before its token is loaded, the session table
+ * and the token lock.
+ * @param t
+ *  The token, with its id and config.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV token_slot_init(token *t);
+
+/**
+ * token_slot_init() plus the TPM context, for tokens that are set up
+ * completely right away.
+ * @param t
+ *  The token, with its id and config.
+ * @return
+ *  CKR_OK on success.
+ */
 CK_RV token_min_init(token *t);
+
+/**
+ * Brings up the TPM context, primary object and objects of a token on first
+ * use. Until then a token is just a slot with a label and a config.
+ * @param t
+ *  The token, not locked.
+ * @return
+ *  CKR_OK on success or if already loaded. On failure the token stays
+ *  unloaded and the next call tries again.
+ */
+CK_RV token_load(token *t);
+
+/**
+ * Like token_load(), with the token locked exclusive.
+ */
+CK_RV token_load_locked(token *t);
+
 void token_reset(token *t);
 
 CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label);
@@ -9,6 +9,7 @@
 #include <stddef.h>
 
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include <openssl/asn1.h>
 #include <openssl/bn.h>
@@ -30,7 +31,6 @@
 #include "digest.h"
 #include "encrypt.h"
 #include "log.h"
-#include "mutex.h"
 #include "pkcs11.h"
 #include "ssl_util.h"
 #include "tpm.h"
@@ -175,6 +175,19 @@ struct tpm_ctx {
 
     bool did_check_for_encdec2;
     bool use_encdec2;
+
+    /*
+     * A ticket lock serializing ESAPI use for callers sharing the token lock.
+     * Callers get the context in the order they asked for it, which lets
+     * tpm_yield() hand it to the ones waiting. Guarded by lock.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned next_ticket;
+    unsigned now_serving;
+
+    /* 0 for a token's own context, i + 1 for context i of a pool */
+    unsigned pool_idx;
 };
 
 #define TPM2B_INIT(xsize) { .size = xsize, }
@@ -191,6 +204,9 @@ struct tpm_op_data {
     mdetail *mdtl;
     CK_MECHANISM mech;
 
+    /* the owning session's cancel flag, checked between TPM commands */
+    const bool *cancel;
+
     union {
         struct {
             TPMT_SIG_SCHEME sig;
@@ -292,9 +308,166 @@ void tpm_ctx_free(tpm_ctx *ctx) {
     Esys_Finalize(&ctx->esys_ctx);
     Tss2_TctiLdr_Finalize(&ctx->tcti_ctx);
 
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
     free(ctx);
 }
 
+/* with ctx->lock held */
+static void tpm_wait_for_turn(tpm_ctx *ctx, unsigned ticket) {
+    while (ctx->now_serving != ticket) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+}
+
+void tpm_lock(tpm_ctx *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    tpm_wait_for_turn(ctx, ctx->next_ticket++);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void tpm_unlock(tpm_ctx *ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->now_serving++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static bool tpm_is_canceled(const bool *cancel) {
+    return cancel && __atomic_load_n(cancel, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called between the chunks of a multi command operation with the TPM lock
+ * held. If other callers are waiting on the TPM, hand the lock to the next
+ * one and take a ticket behind those already waiting, so a short command like
+ * a sign only waits for the current chunk and not for the whole bulk
+ * operation. Done in the calling thread, as the ESAPI context does not allow
+ * handing the work to a dispatcher thread.
+ *
+ * Everyone calling tpm_lock() holds the token at least shared, so with the
+ * token held exclusive there are never waiters and this is a no-op for callers
+ * that did not take the TPM lock.
+ *
+ * Returns CKR_FUNCTION_CANCELED if C_CancelFunction was called on the session
+ * that owns the operation, the caller then stops and unwinds, releasing the
+ * TPM and token. The lock is held on return either way.
+ */
+static CK_RV tpm_yield(tpm_ctx *ctx, const bool *cancel) {
+
+    if (tpm_is_canceled(cancel)) {
+        return CKR_FUNCTION_CANCELED;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+
+    /* no one waiting behind the holder, or no holder, see above */
+    if (ctx->next_ticket - ctx->now_serving <= 1) {
+        pthread_mutex_unlock(&ctx->lock);
+        return CKR_OK;
+    }
+
+    ctx->now_serving++;
+    pthread_cond_broadcast(&ctx->cond);
+    tpm_wait_for_turn(ctx, ctx->next_ticket++);
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* canceled while waiting for our turn */
+    return tpm_is_canceled(cancel) ? CKR_FUNCTION_CANCELED : CKR_OK;
+}
+
+struct tpm_ctx_pool {
+    size_t len;
+    unsigned next;
+    tpm_ctx *ctx[];
+};
+
+CK_RV tpm_ctx_pool_new(const char *tcti, size_t size, tpm_ctx_pool **pool) {
+
+    *pool = NULL;
+
+    if (!size) {
+        return CKR_OK;
+    }
+
+    /* each context is a TCTI connection and holds a copy of the keys used */
+    if (size > TPM_CTX_POOL_MAX) {
+        LOGW("TPM context pool size %zu is too large, using %u", size,
+                TPM_CTX_POOL_MAX);
+        size = TPM_CTX_POOL_MAX;
+    }
+
+    tpm_ctx_pool *p = calloc(1, sizeof(*p) + size * sizeof(p->ctx[0]));
+    if (!p) {
+        return CKR_HOST_MEMORY;
+    }
+
+    size_t i;
+    for (i = 0; i < size; i++) {
+        CK_RV rv = tpm_ctx_new(tcti, &p->ctx[i]);
+        if (rv != CKR_OK) {
+            /* a TCTI without a resource manager allows one connection */
+            LOGW("Could only open %zu of %zu pooled TPM contexts", i, size);
+            break;
+        }
+        p->ctx[i]->pool_idx = i + 1;
+        p->len++;
+    }
+
+    if (!p->len) {
+        free(p);
+        return CKR_OK;
+    }
+
+    *pool = p;
+
+    return CKR_OK;
+}
+
+void tpm_ctx_pool_free(tpm_ctx_pool *pool) {
+
+    if (!pool) {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < pool->len; i++) {
+        tpm_ctx_free(pool->ctx[i]);
+    }
+
+    free(pool);
+}
+
+tpm_ctx *tpm_ctx_pool_lease(tpm_ctx_pool *pool, tpm_ctx *fallback) {
+
+    if (!pool) {
+        return fallback;
+    }
+
+    unsigned i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    return pool->ctx[i % pool->len];
+}
+
+size_t tpm_ctx_pool_len(tpm_ctx_pool *pool) {
+    return pool ? pool->len : 0;
+}
+
+tpm_ctx *tpm_ctx_pool_get(tpm_ctx_pool *pool, size_t i) {
+    assert(i < pool->len);
+    return pool->ctx[i];
+}
+
+unsigned tpm_ctx_pool_index(tpm_ctx *ctx) {
+    return ctx->pool_idx;
+}
+
+uint32_t *tpm_tobject_handle(tpm_ctx *ctx, tobject *tobj) {
+    return ctx->pool_idx ?
+            &tobj->tpm_esys_tr_pool[ctx->pool_idx - 1] : &tobj->tpm_esys_tr;
+}
+
 static bool set_esys_auth(ESYS_CONTEXT *esys_ctx, ESYS_TR handle, twist auth) {
 
     TPM2B_AUTH tpm_auth = TPM2B_EMPTY_INIT;
@@ -424,6 +597,9 @@ CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx) {
         return CKR_HOST_MEMORY;
     }
 
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+
     esys = esys_ctx_init(tcti);
     if (!esys) {
         goto error;
@@ -793,11 +969,80 @@ CK_RV tpm_get_token_info (tpm_ctx *ctx, CK_TOKEN_INFO *info) {
     return CKR_OK;
 }
 
-bool tpm_getrandom(tpm_ctx *ctx, BYTE *data, size_t size) {
+/* the token info of each TCTI config, see tpm_get_token_info_by_tcti() */
+typedef struct tpm_info_cache tpm_info_cache;
+struct tpm_info_cache {
+    tpm_info_cache *next;
+    char *tcti;
+    CK_TOKEN_INFO info;
+};
+
+static tpm_info_cache *info_cache;
+
+static bool tcti_equal(const char *a, const char *b) {
+    return a && b ? !strcmp(a, b) : a == b;
+}
+
+CK_RV tpm_get_token_info_by_tcti(const char *tcti, CK_TOKEN_INFO *info) {
+
+    check_pointer(info);
+
+    tpm_info_cache *c = __atomic_load_n(&info_cache, __ATOMIC_ACQUIRE);
+    for (; c; c = c->next) {
+        if (tcti_equal(c->tcti, tcti)) {
+            *info = c->info;
+            return CKR_OK;
+        }
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    if (tcti) {
+        c->tcti = strdup(tcti);
+        if (!c->tcti) {
+            LOGE("oom");
+            free(c);
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    tpm_ctx *ctx = NULL;
+    CK_RV rv = tpm_ctx_new(tcti, &ctx);
+    if (rv != CKR_OK) {
+        LOGE("Could not initialize tpm ctx: 0x%lx", rv);
+        goto error;
+    }
+
+    rv = tpm_get_token_info(ctx, &c->info);
+    tpm_ctx_free(ctx);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    *info = c->info;
+
+    /* a racing caller may add the same config, both entries are good */
+    c->next = __atomic_load_n(&info_cache, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&info_cache, &c->next, c, false,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return CKR_OK;
+
+error:
+    free(c->tcti);
+    free(c);
+    return rv;
+}
+
+CK_RV tpm_getrandom(tpm_ctx *ctx, const bool *cancel, BYTE *data, size_t size) {
 
     size_t offset = 0;
 
-    bool result = false;
+    CK_RV rv = CKR_GENERAL_ERROR;
 
     /*
      * This will get re-used once allocated by esys
@@ -828,13 +1073,21 @@ bool tpm_getrandom(tpm_ctx *ctx, BYTE *data, size_t size) {
         size -= rand_bytes->size;
         Esys_Free(rand_bytes);
         rand_bytes = NULL;
+
+        if (size) {
+            CK_RV yrv = tpm_yield(ctx, cancel);
+            if (yrv != CKR_OK) {
+                rv = yrv;
+                goto out;
+            }
+        }
     }
 
-    result = true;
+    rv = CKR_OK;
 
 out:
 
-    return result;
+    return rv;
 }
 
 CK_RV tpm_stirrandom(tpm_ctx *ctx, CK_BYTE_PTR seed, CK_ULONG seed_len) {
@@ -1234,7 +1487,7 @@ static CK_RV tpm_hmac_large(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG data
     assert(tctx);
 
     twist auth = tobj->unsealed_auth;
-    TPMI_DH_OBJECT handle = tobj->tpm_esys_tr;
+    TPMI_DH_OBJECT handle = *tpm_tobject_handle(tctx, tobj);
 
     ESYS_TR session = tctx->hmac_session;
 
@@ -1292,6 +1545,16 @@ static CK_RV tpm_hmac_large(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG data
         }
 
         bytes_remaining -= sizeof(buffer.buffer);
+
+        rv = tpm_yield(tctx, opdata->cancel);
+        if (rv != CKR_OK) {
+            /* don't leave the sequence taking up a TPM object slot */
+            rval = Esys_FlushContext(tctx->esys_ctx, seq_handle);
+            if (rval != TSS2_RC_SUCCESS) {
+                LOGW("Esys_FlushContext: %s", Tss2_RC_Decode(rval));
+            }
+            return rv;
+        }
     }
 
     assert(bytes_remaining <= sizeof(buffer.buffer));
@@ -1358,7 +1621,7 @@ static CK_RV tpm_hmac(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, C
     assert(tctx);
 
     twist auth = tobj->unsealed_auth;
-    TPMI_DH_OBJECT handle = tobj->tpm_esys_tr;
+    TPMI_DH_OBJECT handle = *tpm_tobject_handle(tctx, tobj);
 
     ESYS_TR session = tctx->hmac_session;
 
@@ -1417,7 +1680,7 @@ CK_RV tpm_sign(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_
     assert(tctx);
 
     twist auth = tobj->unsealed_auth;
-    TPMI_DH_OBJECT handle = tobj->tpm_esys_tr;
+    TPMI_DH_OBJECT handle = *tpm_tobject_handle(tctx, tobj);
     ESYS_CONTEXT *ectx = tctx->esys_ctx;
     ESYS_TR session = tctx->hmac_session;
     TPMT_SIG_SCHEME *scheme = NULL;
@@ -1550,7 +1813,7 @@ CK_RV tpm_verify(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYT
     assert(tctx);
 
     // TPMI_DH_OBJECT handle = tobj->obj_handle;
-    ESYS_TR handle = tobj->tpm_esys_tr;
+    ESYS_TR handle = *tpm_tobject_handle(tctx, tobj);
 
     ESYS_CONTEXT *ectx = tctx->esys_ctx;
     TPMT_SIG_SCHEME *scheme = opdata->op_type == CKK_RSA ? &opdata->rsa.sig :
@@ -1706,7 +1969,7 @@ CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech,
      * TPM is hardcoded to MGF1 + <name alg> in the TPM, make sure what is requested is supported
      */
     CK_RSA_PKCS_MGF_TYPE supported_mgf;
-    CK_RV rv = get_oaep_mgf1_alg(tctx, tobj->tpm_esys_tr, &supported_mgf);
+    CK_RV rv = get_oaep_mgf1_alg(tctx, *tpm_tobject_handle(tctx, tobj), &supported_mgf);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -2284,6 +2547,12 @@ void tpm_opdata_reset(tpm_op_data *opdata) {
     }
 }
 
+void tpm_opdata_set_cancel(tpm_op_data *opdata, const bool *cancel) {
+    if (opdata) {
+        opdata->cancel = cancel;
+    }
+}
+
 void tpm_opdata_free(tpm_op_data **opdata) {
 
     if (opdata) {
@@ -2323,7 +2592,7 @@ CK_RV tpm_rsa_decrypt(tpm_op_data *tpm_enc_data,
     memcpy(tpm_ctext.buffer, ctext, ctextlen);
 
     twist auth = tpm_enc_data->tobj->unsealed_auth;
-    ESYS_TR handle = tpm_enc_data->tobj->tpm_esys_tr;
+    ESYS_TR handle = *tpm_tobject_handle(ctx, tpm_enc_data->tobj);
     bool result = set_esys_auth(ctx->esys_ctx, handle, auth);
     if (!result) {
         return CKR_GENERAL_ERROR;
@@ -2424,7 +2693,7 @@ CK_RV tpm_rsa_encrypt(tpm_op_data *tpm_enc_data,
     }
     memcpy(message.buffer, pptext, pptextlen);
 
-    ESYS_TR handle = tpm_enc_data->tobj->tpm_esys_tr;
+    ESYS_TR handle = *tpm_tobject_handle(ctx, tpm_enc_data->tobj);
 
     TPM2B_PUBLIC_KEY_RSA *ctext;
 
@@ -2549,7 +2818,7 @@ static TSS2_RC do_part_encrypt_decrypt(
     return rval;
 }
 
-static CK_RV encrypt_decrypt(tpm_ctx *ctx, uint32_t handle, twist objauth, TPMI_ALG_SYM_MODE mode, TPMI_YES_NO is_decrypt,
+static CK_RV encrypt_decrypt(tpm_ctx *ctx, const bool *cancel, uint32_t handle, twist objauth, TPMI_ALG_SYM_MODE mode, TPMI_YES_NO is_decrypt,
         TPM2B_IV *iv, CK_BYTE_PTR data_in, CK_ULONG data_in_len, CK_BYTE_PTR data_out, CK_ULONG_PTR data_out_len) {
 
     /*
@@ -2620,6 +2889,13 @@ static CK_RV encrypt_decrypt(tpm_ctx *ctx, uint32_t handle, twist objauth, TPMI_
 
         /* update the offset for the next go around */
         offset += part_len;
+
+        if (offset < data_in_len) {
+            CK_RV rv = tpm_yield(ctx, cancel);
+            if (rv != CKR_OK) {
+                return rv;
+            }
+        }
     }
 
     assert(offset == data_in_len);
@@ -2651,7 +2927,7 @@ static CK_RV do_buffered_encdec(tpm_op_data *tpm_enc_data,
     TPM2B_IV *iv = &tpm_enc_data->sym.iv;
 
     twist auth = tpm_enc_data->tobj->unsealed_auth;
-    ESYS_TR handle = tpm_enc_data->tobj->tpm_esys_tr;
+    ESYS_TR handle = *tpm_tobject_handle(ctx, tpm_enc_data->tobj);
 
     /* final calls don't have input data, they just exhaust the internal buffer if present */
     bool is_final = !in;
@@ -2722,7 +2998,7 @@ static CK_RV do_buffered_encdec(tpm_op_data *tpm_enc_data,
             }
         }
 
-        rv = encrypt_decrypt(ctx, handle, auth, mode, encdec,
+        rv = encrypt_decrypt(ctx, tpm_enc_data->cancel, handle, auth, mode, encdec,
                 iv,
                 (CK_BYTE_PTR)full_buffer, modified_full_buffer_len,
                 out, outlen);
@@ -4163,7 +4439,14 @@ void tpm_init(void) {
 }
 
 void tpm_destroy(void) {
-    /* pass nothing to do */
+
+    tpm_info_cache *c = __atomic_exchange_n(&info_cache, NULL, __ATOMIC_ACQUIRE);
+    while (c) {
+        tpm_info_cache *next = c->next;
+        free(c->tcti);
+        free(c);
+        c = next;
+    }
 }
 
 CK_RV tpm_serialize_handle(ESYS_CONTEXT *esys, ESYS_TR handle, twist *buf) {
@@ -4722,7 +5005,7 @@ CK_RV tpm_get_pss_sig_state(tpm_ctx *tctx, tobject *tobj,
             .digest = { 0 }
     };
 
-    bool res = set_esys_auth(tctx->esys_ctx, tobj->tpm_esys_tr,
+    bool res = set_esys_auth(tctx->esys_ctx, *tpm_tobject_handle(tctx, tobj),
             tobj->unsealed_auth);
     if (!res) {
         return CKR_GENERAL_ERROR;
@@ -4730,7 +5013,7 @@ CK_RV tpm_get_pss_sig_state(tpm_ctx *tctx, tobject *tobj,
 
     TSS2_RC rval = Esys_Sign(
             tctx->esys_ctx,
-            tobj->tpm_esys_tr,
+            *tpm_tobject_handle(tctx, tobj),
             ESYS_TR_PASSWORD,
             ESYS_TR_NONE,
             ESYS_TR_NONE,
@@ -4804,12 +5087,12 @@ CK_RV tpm_ec_ecdh1_derive(tpm_ctx *tctx, tobject *tobj, uint8_t *ecc_point,
         return rv;
     }
 
-    bool res = set_esys_auth(tctx->esys_ctx, tobj->tpm_esys_tr, tobj->unsealed_auth);
+    bool res = set_esys_auth(tctx->esys_ctx, *tpm_tobject_handle(tctx, tobj), tobj->unsealed_auth);
     if (!res) {
         return CKR_GENERAL_ERROR;
     }
 
-    rv = Esys_ECDH_ZGen(tctx->esys_ctx, tobj->tpm_esys_tr, ESYS_TR_PASSWORD,
+    rv = Esys_ECDH_ZGen(tctx->esys_ctx, *tpm_tobject_handle(tctx, tobj), ESYS_TR_PASSWORD,
                         ESYS_TR_NONE, ESYS_TR_NONE, &in_point, &out_point);
     if (rv != CKR_OK) {
         return rv;
@@ -50,6 +50,101 @@ CK_RV tpm_ctx_new(const char *tcti, tpm_ctx **tctx);
 
 CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx);
 
+/**
+ * Serializes use of the TPM context. ESAPI contexts are not thread safe, so
+ * any caller issuing commands without holding the token lock exclusive
+ * must hold this.
+ * @param ctx
+ *  The tpm context to lock.
+ */
+void tpm_lock(tpm_ctx *ctx);
+
+/**
+ * Unlocks a TPM context locked with tpm_lock().
+ * @param ctx
+ *  The tpm context to unlock.
+ */
+void tpm_unlock(tpm_ctx *ctx);
+
+typedef struct tpm_ctx_pool tpm_ctx_pool;
+
+/**
+ * Creates a pool of additional TPM contexts, each with its own ESAPI and
+ * TCTI contexts and, once used for keys, its own auth session, see
+ * tpm_tobject_handle().
+ * @param tcti
+ *  An optional (can be null) tcti config string.
+ * @param size
+ *  The number of contexts to create, at most TPM_CTX_POOL_MAX. If the TCTI
+ *  refuses a connection the pool is created with the contexts opened so far.
+ * @param pool
+ *  The pool to create, NULL when size is 0 or no context could be opened.
+ * @return
+ *  CKR_OK on success, anything else is a failure.
+ */
+CK_RV tpm_ctx_pool_new(const char *tcti, size_t size, tpm_ctx_pool **pool);
+
+/**
+ * Frees a pool and all of its contexts.
+ * @param pool
+ *  The pool to free, may be NULL.
+ */
+void tpm_ctx_pool_free(tpm_ctx_pool *pool);
+
+/**
+ * Leases a context from the pool, picked round robin. It is not locked, lock
+ * it with tpm_lock() for each command. If the pool is NULL, the fallback
+ * context is returned instead.
+ * @param pool
+ *  The pool to lease from, may be NULL.
+ * @param fallback
+ *  The context to use when there is no pool.
+ * @return
+ *  The context to use.
+ */
+tpm_ctx *tpm_ctx_pool_lease(tpm_ctx_pool *pool, tpm_ctx *fallback);
+
+/**
+ * The number of contexts in a pool.
+ * @param pool
+ *  The pool, may be NULL.
+ * @return
+ *  The number of contexts, 0 for a NULL pool.
+ */
+size_t tpm_ctx_pool_len(tpm_ctx_pool *pool);
+
+/**
+ * Gets a context of a pool.
+ * @param pool
+ *  The pool.
+ * @param i
+ *  The index of the context, below tpm_ctx_pool_len().
+ * @return
+ *  The context.
+ */
+tpm_ctx *tpm_ctx_pool_get(tpm_ctx_pool *pool, size_t i);
+
+/**
+ * Gets the position of a context in its pool.
+ * @param ctx
+ *  The context.
+ * @return
+ *  i + 1 for the context at index i of a pool, 0 for a context not in one.
+ */
+unsigned tpm_ctx_pool_index(tpm_ctx *ctx);
+
+/**
+ * ESYS_TR handles only exist in the context that created them, so an object
+ * has a handle for each context it is loaded in. Gets the one for ctx.
+ * @param ctx
+ *  The context.
+ * @param tobj
+ *  The object.
+ * @return
+ *  Where the handle of tobj in ctx is kept, 0 while it is not loaded there.
+ */
+uint32_t *tpm_tobject_handle(tpm_ctx *ctx, tobject *tobj);
+
 /**
  * Retrieves Spec Version, FW Version, Manufacturer and Model from TPM
  * and populates the provided CK_TOKEN_INFO structure.
@@ -65,6 +160,19 @@ CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx);
  */
 CK_RV tpm_get_token_info (tpm_ctx *ctx, CK_TOKEN_INFO *info);
 
+/**
+ * Like tpm_get_token_info(), for tokens that don't have a TPM context yet.
+ * The fixed TPM properties are read once per TCTI config, over a context
+ * that is closed again.
+ * @param tcti
+ *  An optional (can be null) tcti config string.
+ * @param info
+ *  The CK_TOKEN_INFO structure where the data is written to
+ * @return
+ *  CKR_OK on success, CKR_GENERAL_ERROR otherwise
+ */
+CK_RV tpm_get_token_info_by_tcti(const char *tcti, CK_TOKEN_INFO *info);
+
 CK_RV tpm_is_rsa_keysize_supported(tpm_ctx *tctx, CK_ULONG test_size);
 
 CK_RV tpm_find_max_rsa_keysize(tpm_ctx *tctx, CK_ULONG_PTR min, CK_ULONG_PTR max);
@@ -79,14 +187,16 @@ CK_RV tpm_is_ecc_curve_supported(tpm_ctx *tctx, int nid);
  * Generates random bytes from the TPM
  * @param ctx
  *  The tpm api context.
+ * @param cancel
+ *  Checked between TPM commands, may be NULL.
  * @param data
  *  The date to write the random bytes into.
  * @param size
  *  The number of random bytes to generate.
  * @return
- *  true on success, false otherwise.
+ *  CKR_OK on success, CKR_FUNCTION_CANCELED if cancel got set.
  */
-bool tpm_getrandom(tpm_ctx *ctx, uint8_t *data, size_t size);
+CK_RV tpm_getrandom(tpm_ctx *ctx, const bool *cancel, uint8_t *data, size_t size);
 
 CK_RV tpm_stirrandom(tpm_ctx *ctx, unsigned char *seed, unsigned long seed_len);
 
@@ -135,6 +245,16 @@ CK_RV tpm_hmac_sha384_get_opdata(mdetail *mdtl, tpm_ctx *tctx, CK_MECHANISM_PTR
 CK_RV tpm_hmac_sha512_get_opdata(mdetail *mdtl, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
 
 void tpm_opdata_reset(tpm_op_data *opdata);
+
+/**
+ * Ties an operation to a cancel flag. Operations that take several TPM
+ * commands stop between them with CKR_FUNCTION_CANCELED once it is set.
+ * @param opdata
+ *  The operation.
+ * @param cancel
+ *  The flag, must outlive the operation.
+ */
+void tpm_opdata_set_cancel(tpm_op_data *opdata, const bool *cancel);
 void tpm_opdata_free(tpm_op_data **opdata);
 
 CK_RV tpm_encrypt(crypto_op_data *opdata, CK_OBJECT_CLASS clazz, CK_BYTE_PTR ptext, CK_ULONG ptextlen, CK_BYTE_PTR ctext, CK_ULONG_PTR ctextlen);
@@ -7,6 +7,7 @@
 
 #include "pkcs11.h"
 
+#include "backend.h"
 #include "derive.h"
 #include "digest.h"
 #include "encrypt.h"
@@ -35,6 +36,25 @@
  */
 #define _TRACE_RET(rv) LOGV("return \"%s\" value: %lu", __func__, rv);
 
+/**
+ * Waits for the store writes of a call that changed objects, once it dropped
+ * its locks, so other writers to the token can share the commit meanwhile.
+ * If the commit failed, the token drops what it undid, like the objects the
+ * call added, before the call returns. An error of the call itself takes
+ * precedence.
+ */
+#define _WAIT_FOR_WRITES(t, rv) \
+    do { \
+        CK_RV _wait_rv = backend_wait_for_writes(); \
+        if (_wait_rv != CKR_OK) { \
+            token_lock_shared_sync(t); \
+            token_unlock(t); \
+        } \
+        if (rv == CKR_OK) { \
+            rv = _wait_rv; \
+        } \
+    } while (0)
+
 /**
  * Calls a user supplied function with arguments logging the function entry and
  * exit.
@@ -111,7 +131,8 @@
  */
 #define _CHECK_NO_INIT(label) \
     if (general_is_init()) { \
-        rv = CKR_CRYPTOKI_ALREADY_INITIALIZED; \
+        rv = general_take_fork_init() ? \
+                CKR_OK : CKR_CRYPTOKI_ALREADY_INITIALIZED; \
         goto label; \
     }
 
@@ -125,6 +146,8 @@
  *    do not need a particular state AFAIK.
  *  - manages token locking
  *
+ * @param lockfn
+ *  The token lock routine, token_lock() or token_lock_shared().
  * @param userfun
  *  The userfunction to call, ie the internal API.
  * @param ...
@@ -132,7 +155,7 @@
  * @return
  *  The internal API's result as rv.
  */
-#define TOKEN_WITH_LOCK_BY_SLOT(userfunc, slot, ...) \
+#define __TOKEN_WITH_LOCKFN_BY_SLOT(lockfn, userfunc, slot, ...) \
 do { \
     \
     _TRACE_CALL; \
@@ -145,7 +168,7 @@ do { \
         goto out; \
     } \
     \
-    token_lock(t); \
+    lockfn(t); \
     rv = userfunc(t, ##__VA_ARGS__); \
     token_unlock(t); \
   out: \
@@ -153,14 +176,26 @@ do { \
     return rv; \
 } while (0)
 
+/*
+ * Locks the token exclusive, for slot routines that change the token.
+ */
+#define TOKEN_WITH_LOCK_BY_SLOT(userfunc, slot, ...) __TOKEN_WITH_LOCKFN_BY_SLOT(token_lock, userfunc, slot, ##__VA_ARGS__)
+
+/*
+ * Locks the token shared, for slot routines that only read the token.
+ */
+#define TOKEN_WITH_SHARED_LOCK_BY_SLOT(userfunc, slot, ...) __TOKEN_WITH_LOCKFN_BY_SLOT(token_lock_shared, userfunc, slot, ##__VA_ARGS__)
+
 /**
  * Raw interface (DO NOT USE DIRECTLY) for calling into the internal interface from a cryptoki
- * routine that takes a session handle. Performs all locking on token.
+ * routine that takes a session handle and only touches session local state, ie the
+ * session_ctx and its opdata. Only the session is locked, so other sessions on the same
+ * token keep running.
  *
  * @note
  *  - Requires a CK_RV rv to be declared.
  *  - do not use directly, use the ones with auth model.
- *  - manages token locking
+ *  - manages session locking
  *
  * @param userfun
  *  The userfunction to call, ie the internal API.
@@ -169,7 +204,106 @@ do { \
  * @return
  *  The internal API's result as rv.
  */
+#define __SESSION_WITH_LOCK(authfn, userfunc, session, ...) \
+do { \
+    _TRACE_CALL; \
+    CK_RV rv = CKR_GENERAL_ERROR; \
+    \
+    _CHECK_INIT(out); \
+    \
+    token *t = NULL; \
+    session_ctx *ctx = NULL; \
+    rv = session_lookup(session, &t, &ctx); \
+    if (rv != CKR_OK) { \
+        goto out; \
+    } \
+    \
+    rv = authfn(ctx); \
+    if (rv != CKR_OK) { \
+        goto release; \
+    } \
+    rv = userfunc(ctx, ##__VA_ARGS__); \
+  release: \
+    session_release(t, ctx); \
+  out: \
+    _TRACE_RET(rv); \
+    return rv; \
+} while (0)
+
+/**
+ * Raw interface (DO NOT USE DIRECTLY) for calling into the internal interface from a cryptoki
+ * routine that takes a session handle. Performs all locking on session and token.
+ *
+ * @note
+ *  - Requires a CK_RV rv to be declared.
+ *  - do not use directly, use the ones with auth model.
+ *  - manages session and token locking
+ *
+ * @param lockfn
+ *  The token lock routine to use.
+ * @param unlockfn
+ *  The matching token unlock routine.
+ * @param userfun
+ *  The userfunction to call, ie the internal API.
+ * @param ...
+ *  The arguments to the internal API call from cryptoki.
+ * @return
+ *  The internal API's result as rv.
+ */
+#define __TOKEN_WITH_LOCKFN_BY_SESSION(lockfn, unlockfn, authfn, userfunc, session, ...) \
+do { \
+    _TRACE_CALL; \
+    CK_RV rv = CKR_GENERAL_ERROR; \
+    \
+    _CHECK_INIT(out); \
+    \
+    token *t = NULL; \
+    session_ctx *ctx = NULL; \
+    rv = session_lookup(session, &t, &ctx); \
+    if (rv != CKR_OK) { \
+        goto out; \
+    } \
+    \
+    lockfn(t); \
+    rv = authfn(ctx); \
+    if (rv != CKR_OK) { \
+        goto unlock; \
+    } \
+    rv = userfunc(ctx, ##__VA_ARGS__); \
+  unlock: \
+    unlockfn(t); \
+    session_release(t, ctx); \
+    _WAIT_FOR_WRITES(t, rv); \
+  out: \
+    _TRACE_RET(rv); \
+    return rv; \
+} while (0)
+
+/*
+ * Locks the token exclusive, for calls that change token state.
+ */
 #define __TOKEN_WITH_LOCK_BY_SESSION(authfn, userfunc, session, ...) \
+    __TOKEN_WITH_LOCKFN_BY_SESSION(token_lock, token_unlock, authfn, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Locks the token shared, for calls that only read token state. Calls that still issue
+ * TPM commands without a key, like C_GenerateRandom, take the TPM lock themselves.
+ */
+#define __TOKEN_WITH_SHARED_LOCK_BY_SESSION(authfn, userfunc, session, ...) \
+    __TOKEN_WITH_LOCKFN_BY_SESSION(token_lock_shared, token_unlock, authfn, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Locks the token shared after merging in the object changes made by other processes,
+ * for calls that should see them.
+ */
+#define __TOKEN_WITH_SYNCED_LOCK_BY_SESSION(authfn, userfunc, session, ...) \
+    __TOKEN_WITH_LOCKFN_BY_SESSION(token_lock_shared_sync, token_unlock, authfn, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Locks the token shared and the session's TPM context, for calls that read token state
+ * and issue TPM commands, see session_ctx_lock_tpm().
+ */
+#define __TOKEN_WITH_TPM_LOCK_BY_SESSION(authfn, userfunc, session, ...) \
 do { \
     _TRACE_CALL; \
     CK_RV rv = CKR_GENERAL_ERROR; \
@@ -183,13 +317,16 @@ do { \
         goto out; \
     } \
     \
+    tpm_ctx *tpm = session_ctx_lock_tpm(ctx); \
     rv = authfn(ctx); \
     if (rv != CKR_OK) { \
         goto unlock; \
     } \
     rv = userfunc(ctx, ##__VA_ARGS__); \
   unlock: \
-    token_unlock(t); \
+    session_ctx_unlock_tpm(ctx, tpm); \
+    session_release(t, ctx); \
+    _WAIT_FOR_WRITES(t, rv); \
   out: \
     _TRACE_RET(rv); \
     return rv; \
@@ -209,6 +346,7 @@ do { \
         goto out; \
     } \
     \
+    token_lock(t); \
     rv = authfn(ctx); \
     if (rv != CKR_OK) { \
         goto unlock; \
@@ -216,6 +354,8 @@ do { \
     rv = userfunc(t, ##__VA_ARGS__); \
   unlock: \
     token_unlock(t); \
+    session_release(t, ctx); \
+    _WAIT_FOR_WRITES(t, rv); \
   out: \
     _TRACE_RET(rv); \
     return rv; \
@@ -238,6 +378,7 @@ do { \
         goto out; \
     } \
     \
+    token_lock(t); \
     rv = authfn(ctx); \
     if (rv != CKR_OK) { \
         goto unlock; \
@@ -245,6 +386,8 @@ do { \
     rv = userfunc(t, ctx, ##__VA_ARGS__); \
   unlock: \
     token_unlock(t); \
+    session_release(t, ctx); \
+    _WAIT_FOR_WRITES(t, rv); \
   out: \
     _TRACE_RET(rv); \
     return rv; \
@@ -373,6 +516,31 @@ static inline CK_RV auth_init_pin_state(session_ctx *ctx) {
  */
 #define TOKEN_WITH_LOCK_BY_SESSION_LOGGED_IN(userfunc, session, ...) __TOKEN_WITH_LOCK_BY_SESSION(auth_any_logged_in, userfunc, session, ##__VA_ARGS__)
 
+/*
+ * Does what __SESSION_WITH_LOCK does, and checks that the session is at least RO Public Ie any session would work.
+ */
+#define SESSION_WITH_LOCK_PUB_RO(userfunc, session, ...) __SESSION_WITH_LOCK(auth_min_ro_pub, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Does what __SESSION_WITH_LOCK does, and checks that the session is at least RO User. Ie user logged in and R/O or R/W session.
+ */
+#define SESSION_WITH_LOCK_USER_RO(userfunc, session, ...) __SESSION_WITH_LOCK(auth_min_ro_user, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Does what __TOKEN_WITH_SHARED_LOCK_BY_SESSION does, and checks that the session is at least RO Public Ie any session would work.
+ */
+#define TOKEN_WITH_SHARED_LOCK_BY_SESSION_PUB_RO(userfunc, session, ...) __TOKEN_WITH_SHARED_LOCK_BY_SESSION(auth_min_ro_pub, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Does what __TOKEN_WITH_SYNCED_LOCK_BY_SESSION does, and checks that the session is at least RO Public Ie any session would work.
+ */
+#define TOKEN_WITH_SYNCED_LOCK_BY_SESSION_PUB_RO(userfunc, session, ...) __TOKEN_WITH_SYNCED_LOCK_BY_SESSION(auth_min_ro_pub, userfunc, session, ##__VA_ARGS__)
+
+/*
+ * Does what __TOKEN_WITH_TPM_LOCK_BY_SESSION does, and checks that the session is at least RO User. Ie user logged in and R/O or R/W session.
+ */
+#define TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(userfunc, session, ...) __TOKEN_WITH_TPM_LOCK_BY_SESSION(auth_min_ro_user, userfunc, session, ##__VA_ARGS__)
+
 #define TOKEN_WITH_LOCK_BY_SESSION_SET_PIN_STATE(userfunc, session, ...) __TOKEN_WITH_LOCK_BY_SESSION_TOKEN(auth_set_pin_state, userfunc, session, ##__VA_ARGS__)
 
 #define TOKEN_WITH_LOCK_BY_SESSION_INIT_PIN_STATE(userfunc, session, ...) __TOKEN_WITH_LOCK_BY_SESSION_TOKEN(auth_init_pin_state, userfunc, session, ##__VA_ARGS__)
@@ -403,11 +571,11 @@ CK_RV C_GetSlotInfo (CK_SLOT_ID slotID, CK_SLOT_INFO *info) {
 }
 
 CK_RV C_GetTokenInfo (CK_SLOT_ID slotID, CK_TOKEN_INFO *info) {
-    TOKEN_WITH_LOCK_BY_SLOT(token_get_info, slotID, info);
+    TOKEN_WITH_SHARED_LOCK_BY_SLOT(token_get_info, slotID, info);
 }
 
 CK_RV C_WaitForSlotEvent (CK_FLAGS flags, CK_SLOT_ID *slot, void *pReserved) {
-    TOKEN_UNSUPPORTED;
+    TOKEN_CALL_INIT(slot_wait_for_event, flags, slot, pReserved);
 }
 
 CK_RV C_GetMechanismList (CK_SLOT_ID slotID, CK_MECHANISM_TYPE *mechanism_list, CK_ULONG_PTR count) {
@@ -443,7 +611,7 @@ CK_RV C_CloseAllSessions (CK_SLOT_ID slotID) {
 }
 
 CK_RV C_GetSessionInfo (CK_SESSION_HANDLE session, CK_SESSION_INFO *info) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(session_ctx_get_info, session, info);
+    SESSION_WITH_LOCK_PUB_RO(session_ctx_get_info, session, info);
 }
 
 CK_RV C_GetOperationState (CK_SESSION_HANDLE session, CK_BYTE_PTR operation_state, CK_ULONG_PTR operation_state_len) {
@@ -479,7 +647,7 @@ CK_RV C_GetObjectSize (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object, CK_UL
 }
 
 CK_RV C_GetAttributeValue (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(object_get_attributes, session, object, templ, count);
+    TOKEN_WITH_SHARED_LOCK_BY_SESSION_PUB_RO(object_get_attributes, session, object, templ, count);
 }
 
 CK_RV C_SetAttributeValue (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
@@ -487,59 +655,59 @@ CK_RV C_SetAttributeValue (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object, C
 }
 
 CK_RV C_FindObjectsInit (CK_SESSION_HANDLE session, CK_ATTRIBUTE *templ, CK_ULONG count) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(object_find_init, session, templ, count);
+    TOKEN_WITH_SYNCED_LOCK_BY_SESSION_PUB_RO(object_find_init, session, templ, count);
 }
 
 CK_RV C_FindObjects (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE *object, CK_ULONG max_object_count, CK_ULONG_PTR object_count) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(object_find, session, object, max_object_count, object_count);
+    TOKEN_WITH_SHARED_LOCK_BY_SESSION_PUB_RO(object_find, session, object, max_object_count, object_count);
 }
 
 CK_RV C_FindObjectsFinal (CK_SESSION_HANDLE session) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(object_find_final, session);
+    SESSION_WITH_LOCK_PUB_RO(object_find_final, session);
 }
 
 CK_RV C_EncryptInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_init, session, mechanism, key);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(encrypt_init, session, mechanism, key);
 }
 
 CK_RV C_Encrypt (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR encrypted_data, CK_ULONG_PTR encrypted_data_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_oneshot, session, data, data_len, encrypted_data, encrypted_data_len);
+    SESSION_WITH_LOCK_USER_RO(encrypt_oneshot, session, data, data_len, encrypted_data, encrypted_data_len);
 }
 
 CK_RV C_EncryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len, CK_BYTE_PTR encrypted_part, CK_ULONG_PTR encrypted_part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_update, session, part, part_len, encrypted_part, encrypted_part_len);
+    SESSION_WITH_LOCK_USER_RO(encrypt_update, session, part, part_len, encrypted_part, encrypted_part_len);
 }
 
 CK_RV C_EncryptFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR last_encrypted_part, CK_ULONG_PTR last_encrypted_part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_final, session, last_encrypted_part, last_encrypted_part_len);
+    SESSION_WITH_LOCK_USER_RO(encrypt_final, session, last_encrypted_part, last_encrypted_part_len);
 }
 
 CK_RV C_DecryptInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_init, session, mechanism, key);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(decrypt_init, session, mechanism, key);
 }
 
 CK_RV C_Decrypt (CK_SESSION_HANDLE session, CK_BYTE_PTR encrypted_data, CK_ULONG encrypted_data_len, CK_BYTE_PTR data, CK_ULONG_PTR data_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_oneshot, session, encrypted_data, encrypted_data_len, data, data_len);
+    SESSION_WITH_LOCK_USER_RO(decrypt_oneshot, session, encrypted_data, encrypted_data_len, data, data_len);
 }
 
 CK_RV C_DecryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR encrypted_part, CK_ULONG encrypted_part_len, CK_BYTE_PTR part, CK_ULONG_PTR part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_update, session, encrypted_part, encrypted_part_len, part, part_len);
+    SESSION_WITH_LOCK_USER_RO(decrypt_update, session, encrypted_part, encrypted_part_len, part, part_len);
 }
 
 CK_RV C_DecryptFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR last_part, CK_ULONG_PTR last_part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_final, session, last_part, last_part_len);
+    SESSION_WITH_LOCK_USER_RO(decrypt_final, session, last_part, last_part_len);
 }
 
 CK_RV C_DigestInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(digest_init, session, mechanism);
+    SESSION_WITH_LOCK_USER_RO(digest_init, session, mechanism);
 }
 
 CK_RV C_Digest (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR digest, CK_ULONG_PTR digest_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(digest_oneshot, session, data, data_len, digest, digest_len);
+    SESSION_WITH_LOCK_USER_RO(digest_oneshot, session, data, data_len, digest, digest_len);
 }
 
 CK_RV C_DigestUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(digest_update, session, part, part_len);
+    SESSION_WITH_LOCK_USER_RO(digest_update, session, part, part_len);
 }
 
 CK_RV C_DigestKey (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key) {
@@ -547,23 +715,23 @@ CK_RV C_DigestKey (CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key) {
 }
 
 CK_RV C_DigestFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR digest, CK_ULONG_PTR digest_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(digest_final, session, digest, digest_len);
+    SESSION_WITH_LOCK_USER_RO(digest_final, session, digest, digest_len);
 }
 
 CK_RV C_SignInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign_init, session, mechanism, key);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(sign_init, session, mechanism, key);
 }
 
 CK_RV C_Sign (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign, session, data, data_len, signature, signature_len);
+    SESSION_WITH_LOCK_USER_RO(sign, session, data, data_len, signature, signature_len);
 }
 
 CK_RV C_SignUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign_update, session, part, part_len);
+    SESSION_WITH_LOCK_USER_RO(sign_update, session, part, part_len);
 }
 
 CK_RV C_SignFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign_final, session, signature, signature_len);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(sign_final, session, signature, signature_len);
 }
 
 CK_RV C_SignRecoverInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
@@ -575,27 +743,27 @@ CK_RV C_SignRecover (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_
 }
 
 CK_RV C_VerifyInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_init, session, mechanism, key);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(verify_init, session, mechanism, key);
 }
 
 CK_RV C_Verify (CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG signature_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify, session, data, data_len, signature, signature_len);
+    SESSION_WITH_LOCK_USER_RO(verify, session, data, data_len, signature, signature_len);
 }
 
 CK_RV C_VerifyUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_update, session, part, part_len);
+    SESSION_WITH_LOCK_USER_RO(verify_update, session, part, part_len);
 }
 
 CK_RV C_VerifyFinal (CK_SESSION_HANDLE session, CK_BYTE_PTR signature, CK_ULONG signature_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_final, session, signature, signature_len);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(verify_final, session, signature, signature_len);
 }
 
 CK_RV C_VerifyRecoverInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_recover_init, session, mechanism, key);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(verify_recover_init, session, mechanism, key);
 }
 
 CK_RV C_VerifyRecover (CK_SESSION_HANDLE session, CK_BYTE_PTR signature, CK_ULONG signature_len, CK_BYTE_PTR data, CK_ULONG_PTR data_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_recover, session, signature, signature_len, data, data_len);
+    TOKEN_WITH_TPM_LOCK_BY_SESSION_USER_RO(verify_recover, session, signature, signature_len, data, data_len);
 }
 
 CK_RV C_DigestEncryptUpdate (CK_SESSION_HANDLE session, CK_BYTE_PTR part, CK_ULONG part_len, CK_BYTE_PTR encrypted_part, CK_ULONG_PTR encrypted_part_len) {
@@ -635,11 +803,11 @@ CK_RV C_DeriveKey (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT
 }
 
 CK_RV C_SeedRandom (CK_SESSION_HANDLE session, CK_BYTE_PTR seed, CK_ULONG seed_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(seed_random, session, seed, seed_len);
+    TOKEN_WITH_SHARED_LOCK_BY_SESSION_PUB_RO(seed_random, session, seed, seed_len);
 }
 
 CK_RV C_GenerateRandom (CK_SESSION_HANDLE session, CK_BYTE_PTR random_data, CK_ULONG random_len) {
-    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(random_get, session, random_data, random_len);
+    TOKEN_WITH_SHARED_LOCK_BY_SESSION_PUB_RO(random_get, session, random_data, random_len);
 }
 
 CK_RV C_GetFunctionStatus (CK_SESSION_HANDLE session) {
@@ -647,7 +815,7 @@ CK_RV C_GetFunctionStatus (CK_SESSION_HANDLE session) {
 }
 
 CK_RV C_CancelFunction (CK_SESSION_HANDLE session) {
-    TOKEN_UNSUPPORTED;
+    TOKEN_CALL_INIT(session_cancel, session);
 }
 
 // TODO REMOVE ME
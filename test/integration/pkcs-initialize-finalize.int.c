@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sqlite3.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <tss2/tss2_sys.h>
 
@@ -219,6 +222,88 @@ static void test_double_calls(void **state) {
     *do_teardown = true;
 }
 
+static void test_c_wait_for_slot_event(void **state) {
+	UNUSED(state);
+
+    CK_SLOT_ID slot = 0;
+    CK_RV rv = C_WaitForSlotEvent(CKF_DONT_BLOCK, &slot, (void *)0xDEADBEEF);
+    assert_int_equal(rv, CKR_ARGUMENTS_BAD);
+
+    /* tokens present at C_Initialize are not events */
+    rv = C_WaitForSlotEvent(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+}
+
+static int fork_child(void) {
+
+    /* the state is carried over, no C_Initialize needed to use it */
+    CK_ULONG count = 0;
+    CK_RV rv = C_GetSlotList(CK_TRUE, NULL, &count);
+    if (rv != CKR_OK || !count) {
+        return 1;
+    }
+
+    /* the first C_Initialize in the child claims it */
+    rv = C_Initialize(NULL);
+    if (rv != CKR_OK) {
+        return 2;
+    }
+
+    rv = C_Initialize(NULL);
+    if (rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
+        return 3;
+    }
+
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_SLOT_ID slots[6];
+    count = ARRAY_LEN(slots);
+    rv = C_GetSlotList(CK_TRUE, slots, &count);
+    if (rv != CKR_OK) {
+        return 4;
+    }
+
+    rv = C_OpenSession(slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+    if (rv != CKR_OK) {
+        return 5;
+    }
+
+    CK_BYTE buf[16];
+    rv = C_GenerateRandom(session, buf, sizeof(buf));
+    if (rv != CKR_OK) {
+        return 6;
+    }
+
+    rv = C_Finalize(NULL);
+    return rv == CKR_OK ? 0 : 7;
+}
+
+static void test_fork(void **state) {
+	UNUSED(state);
+
+    pid_t pid = fork();
+    assert_int_not_equal(pid, -1);
+
+    if (!pid) {
+        /* no cmocka in the child, it can't report back */
+        _exit(fork_child());
+    }
+
+    int status = 0;
+    pid_t rc = waitpid(pid, &status, 0);
+    assert_int_equal(rc, pid);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+
+    /* the child's work must not disturb the parent */
+    CK_ULONG count = 0;
+    CK_RV rv = C_GetSlotList(CK_TRUE, NULL, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_not_equal(count, 0);
+
+    rv = C_Initialize(NULL);
+    assert_int_equal(rv, CKR_CRYPTOKI_ALREADY_INITIALIZED);
+}
+
 int main() {
 
     const struct CMUnitTest tests[] = {
@@ -230,6 +315,10 @@ int main() {
             test_setup, test_teardown),
         cmocka_unit_test_setup_teardown(test_c_finalize_bad,
             test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_c_wait_for_slot_event,
+            test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_fork,
+            test_setup, test_teardown),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
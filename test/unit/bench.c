@@ -0,0 +1,645 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <dirent.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "attr_index.h"
+#include "attr_tlv.h"
+#include "attrs.h"
+#include "db.h"
+#include "emitter.h"
+#include "mutex.h"
+#include "object.h"
+#include "parser.h"
+#include "token.h"
+#include "twist.h"
+
+/*
+ * Timings of the object, attribute and store handling, printed rather than
+ * checked as they depend on the machine. Not part of make check, run with
+ * make bench. The behavior they go through is covered by the unit tests.
+ */
+
+#define BENCH_OBJECTS 100000
+#define BENCH_BATCH   10000
+#define BENCH_CERTS   20000
+#define BENCH_ATTRS   48
+#define BENCH_LOOKUPS 1000000
+#define BENCH_DUPS    100000
+#define BENCH_DECODES 2000
+
+/* every store operation is a transaction, so an fsync on most filesystems */
+#define BENCH_DB_OBJECTS 1000
+#define BENCH_DB_BATCH   250
+
+/* writers on one token, see TPM2_PKCS11_STORE_COMMIT_WINDOW */
+#define BENCH_DB_THREADS        8
+#define BENCH_DB_THREAD_OBJECTS 125
+
+static char store[] = "/tmp/tpm2_pkcs11_bench_XXXXXX";
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int group_setup(void **state) {
+    (void) state;
+
+    if (!mkdtemp(store)) {
+        return -1;
+    }
+
+    setenv("TPM2_PKCS11_STORE", store, 1);
+
+    return db_init() == CKR_OK ? 0 : -1;
+}
+
+/* the store is flat, the database and the journal files next to it */
+static int remove_store(void) {
+
+    DIR *d = opendir(store);
+    if (!d) {
+        return -1;
+    }
+
+    int rc = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), "%s/%s", store, e->d_name);
+        if (n < 0 || (size_t)n >= sizeof(path) || unlink(path)) {
+            rc = -1;
+        }
+    }
+
+    closedir(d);
+
+    return rmdir(store) ? -1 : rc;
+}
+
+static int group_teardown(void **state) {
+    (void) state;
+
+    CK_RV rv = db_destroy();
+
+    int rc = remove_store();
+
+    return rv == CKR_OK && !rc ? 0 : -1;
+}
+
+static void token_clear(token *tok) {
+
+    while (tok->tobjects.head) {
+        tobject *tobj = tok->tobjects.head;
+        token_rm_tobject(tok, tobj);
+        tobject_free(tobj);
+    }
+
+    free(tok->tobjects.index);
+    free(tok->tobjects.released);
+    attr_index_free(tok->tobjects.attr_index);
+}
+
+static tobject *add(token *tok) {
+
+    tobject *tobj = tobject_new();
+    assert_non_null(tobj);
+
+    /*
+     * already decoded, lookups don't go to the parser. CKA_TOKEN isn't in the
+     * attribute index, so only the handle table is exercised.
+     */
+    tobj->attrs = attr_list_new();
+    assert_non_null(tobj->attrs);
+
+    bool r = attr_list_add_bool(tobj->attrs, CKA_TOKEN, CK_TRUE);
+    assert_true(r);
+
+    CK_RV rv = token_add_tobject(tok, tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    return tobj;
+}
+
+static tobject *add_cert(token *tok, unsigned id) {
+
+    tobject *tobj = tobject_new();
+    assert_non_null(tobj);
+
+    tobj->attrs = attr_list_new();
+    assert_non_null(tobj->attrs);
+
+    bool r = attr_list_add_int(tobj->attrs, CKA_CLASS, CKO_CERTIFICATE);
+    assert_true(r);
+
+    r = attr_list_add_buf(tobj->attrs, CKA_ID, (CK_BYTE_PTR)&id, sizeof(id));
+    assert_true(r);
+
+    CK_RV rv = token_add_tobject(tok, tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    return tobj;
+}
+
+static void bench_token_create_destroy(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    tobject **objs = calloc(BENCH_OBJECTS, sizeof(*objs));
+    assert_non_null(objs);
+
+    /* the cost per object should not grow with the number of objects */
+    size_t i;
+    for (i = 0; i < BENCH_OBJECTS; i += BENCH_BATCH) {
+        uint64_t start = now_ns();
+
+        size_t j;
+        for (j = i; j < i + BENCH_BATCH; j++) {
+            objs[j] = add(&tok);
+        }
+
+        printf("create %6zu..%6zu: %6.1f ns/object\n", i, i + BENCH_BATCH,
+                (double)(now_ns() - start) / BENCH_BATCH);
+    }
+
+    /* punch holes in every other handle, then fill them again */
+    for (i = 0; i < BENCH_OBJECTS; i += BENCH_BATCH) {
+        uint64_t start = now_ns();
+
+        size_t j;
+        for (j = i; j < i + BENCH_BATCH; j += 2) {
+            token_rm_tobject(&tok, objs[j]);
+            tobject_free(objs[j]);
+            objs[j] = add(&tok);
+        }
+
+        printf("reuse  %6zu..%6zu: %6.1f ns/object\n", i, i + BENCH_BATCH,
+                (double)(now_ns() - start) / (BENCH_BATCH / 2));
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < BENCH_OBJECTS; i++) {
+        token_rm_tobject(&tok, objs[i]);
+        tobject_free(objs[i]);
+    }
+
+    printf("destroy %zu: %6.1f ns/object\n", (size_t)BENCH_OBJECTS,
+            (double)(now_ns() - start) / BENCH_OBJECTS);
+
+    token_clear(&tok);
+    free(objs);
+}
+
+static void bench_token_attr_index(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    unsigned i;
+    for (i = 0; i < BENCH_CERTS; i++) {
+        add_cert(&tok, i);
+    }
+
+    CK_OBJECT_CLASS clazz = CKO_CERTIFICATE;
+    unsigned id = 0;
+    CK_ATTRIBUTE templ[] = {
+        { .type = CKA_CLASS, .pValue = &clazz, .ulValueLen = sizeof(clazz) },
+        { .type = CKA_ID,    .pValue = &id,    .ulValueLen = sizeof(id)    },
+    };
+
+    tobject * const *objs = NULL;
+    size_t len = 0;
+    uint64_t start = now_ns();
+    for (i = 0; i < BENCH_CERTS; i++) {
+        id = i;
+        bool found = attr_index_lookup(tok.tobjects.attr_index, templ, 2,
+                &objs, &len);
+        assert_true(found);
+        assert_int_equal(len, 1);
+    }
+
+    printf("lookup by CKA_ID in %u certs: %6.1f ns/lookup\n", BENCH_CERTS,
+            (double)(now_ns() - start) / BENCH_CERTS);
+
+    token_clear(&tok);
+}
+
+static void bench_attr_lookup(void **state) {
+    (void) state;
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    CK_ULONG i;
+    for (i = 0; i < BENCH_ATTRS; i++) {
+        bool r = attr_list_add_int(attrs, CKA_VENDOR_DEFINED + i, i);
+        assert_true(r);
+    }
+
+    /* the scan is what every lookup used to be */
+    CK_ATTRIBUTE_TYPE last = CKA_VENDOR_DEFINED + BENCH_ATTRS - 1;
+    CK_ATTRIBUTE_PTR raw = attr_list_get_ptr(attrs);
+    CK_ULONG cnt = attr_list_get_count(attrs);
+
+    uint64_t start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type_raw(raw, cnt, last);
+        assert_non_null(a);
+    }
+    uint64_t scan_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, last);
+        assert_non_null(a);
+    }
+    uint64_t index_ns = now_ns() - start;
+
+    printf("lookup of attribute %u: scan %5.1f ns index %5.1f ns\n",
+            BENCH_ATTRS, (double)scan_ns / BENCH_LOOKUPS,
+            (double)index_ns / BENCH_LOOKUPS);
+
+    attr_list_free(attrs);
+}
+
+static uint64_t dup_ns(attr_list *attrs) {
+
+    uint64_t start = now_ns();
+
+    unsigned i;
+    for (i = 0; i < BENCH_DUPS; i++) {
+        attr_list *copy = NULL;
+        CK_RV rv = attr_list_dup(attrs, &copy);
+        assert_int_equal(rv, CKR_OK);
+        attr_list_free(copy);
+    }
+
+    return now_ns() - start;
+}
+
+static void bench_attr_dup(void **state) {
+    (void) state;
+
+    CK_ULONG id = 0x1234;
+    CK_ULONG mechs[] = { CKM_RSA_PKCS, CKM_ECDSA };
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    bool r = attr_list_add_int(attrs, CKA_CLASS, CKO_PRIVATE_KEY);
+    assert_true(r);
+    r = attr_list_add_bool(attrs, CKA_SIGN, CK_TRUE);
+    assert_true(r);
+    r = attr_list_add_buf(attrs, CKA_ID, (CK_BYTE_PTR)&id, sizeof(id));
+    assert_true(r);
+    r = attr_list_add_int_seq(attrs, CKA_ALLOWED_MECHANISMS,
+            (CK_BYTE_PTR)mechs, sizeof(mechs));
+    assert_true(r);
+    r = attr_list_add_buf(attrs, CKA_LABEL, NULL, 0);
+    assert_true(r);
+
+    /* the object copies made on every C_GetAttributeValue */
+    twist raw = attr_tlv_encode(attrs);
+    assert_non_null(raw);
+
+    attr_list *loaded = NULL;
+    CK_RV rv = attr_tlv_decode((unsigned char *)raw, twist_len(raw), NULL, 0, &loaded);
+    assert_int_equal(rv, CKR_OK);
+    twist_free(raw);
+
+    uint64_t arena_ns = dup_ns(loaded);
+    uint64_t compact_ns = dup_ns(attrs);
+
+    printf("dup of %lu attributes: arena %5.1f ns compact %5.1f ns\n",
+            attr_list_get_count(attrs), (double)arena_ns / BENCH_DUPS,
+            (double)compact_ns / BENCH_DUPS);
+
+    attr_list_free(loaded);
+    attr_list_free(attrs);
+}
+
+static void bench_attr_decode(void **state) {
+    (void) state;
+
+    CK_ULONG id = 0x1234;
+
+    /* a certificate sized object */
+    CK_BYTE value[1500];
+    size_t i;
+    for (i = 0; i < sizeof(value); i++) {
+        value[i] = (CK_BYTE)i;
+    }
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    bool res = attr_list_add_int(attrs, CKA_CLASS, CKO_CERTIFICATE);
+    assert_true(res);
+    res = attr_list_add_bool(attrs, CKA_TOKEN, CK_TRUE);
+    assert_true(res);
+    res = attr_list_add_buf(attrs, CKA_ID, (CK_BYTE_PTR)&id, sizeof(id));
+    assert_true(res);
+    res = attr_list_add_buf(attrs, CKA_LABEL, (CK_BYTE_PTR)"label", 5);
+    assert_true(res);
+    res = attr_list_add_buf(attrs, CKA_VALUE, value, sizeof(value));
+    assert_true(res);
+
+    char *yaml = emit_attributes_to_string(attrs);
+    assert_non_null(yaml);
+    twist tlv = attr_tlv_encode(attrs);
+    assert_non_null(tlv);
+
+    size_t yaml_len = strlen(yaml);
+    size_t tlv_len = twist_len(tlv);
+    printf("stored size yaml: %zu tlv: %zu\n", yaml_len, tlv_len);
+
+    uint64_t start = now_ns();
+    for (i = 0; i < BENCH_DECODES; i++) {
+        attr_list *decoded = NULL;
+        res = parse_attributes_from_string((const unsigned char *)yaml,
+                yaml_len, &decoded);
+        assert_true(res);
+        attr_list_free(decoded);
+    }
+    uint64_t yaml_ns = now_ns() - start;
+
+    start = now_ns();
+    for (i = 0; i < BENCH_DECODES; i++) {
+        attr_list *decoded = NULL;
+        CK_RV rv = attr_tlv_decode((const unsigned char *)tlv, tlv_len,
+                NULL, 0, &decoded);
+        assert_int_equal(rv, CKR_OK);
+        attr_list_free(decoded);
+    }
+    uint64_t tlv_ns = now_ns() - start;
+
+    printf("decode yaml: %6.1f us tlv: %6.1f us\n",
+            (double)yaml_ns / BENCH_DECODES / 1000,
+            (double)tlv_ns / BENCH_DECODES / 1000);
+
+    free(yaml);
+    twist_free(tlv);
+    attr_list_free(attrs);
+}
+
+static tobject *new_cert(unsigned id) {
+
+    tobject *tobj = tobject_new();
+    assert_non_null(tobj);
+
+    tobj->attrs = attr_list_new();
+    assert_non_null(tobj->attrs);
+
+    bool r = attr_list_add_int(tobj->attrs, CKA_CLASS, CKO_CERTIFICATE);
+    assert_true(r);
+
+    r = attr_list_add_bool(tobj->attrs, CKA_PRIVATE, CK_FALSE);
+    assert_true(r);
+
+    r = attr_list_add_buf(tobj->attrs, CKA_ID, (CK_BYTE_PTR)&id, sizeof(id));
+    assert_true(r);
+
+    r = attr_list_add_buf(tobj->attrs, CKA_LABEL, (CK_BYTE_PTR)"bench", 5);
+    assert_true(r);
+
+    CK_BYTE value[512] = { 0 };
+    r = attr_list_add_buf(tobj->attrs, CKA_VALUE, value, sizeof(value));
+    assert_true(r);
+
+    return tobj;
+}
+
+static void print_rate(const char *op, size_t i, uint64_t start) {
+
+    double ns = (double)(now_ns() - start) / BENCH_DB_BATCH;
+    printf("%-6s %5zu..%5zu: %8.1f us/object %8.0f objects/s\n", op, i,
+            i + BENCH_DB_BATCH, ns / 1000, 1000000000.0 / ns);
+}
+
+static void bench_db_create_update_delete(void **state) {
+    (void) state;
+
+    token tok = { .id = 1 };
+
+    tobject **objs = calloc(BENCH_DB_OBJECTS, sizeof(*objs));
+    assert_non_null(objs);
+
+    size_t i;
+    for (i = 0; i < BENCH_DB_OBJECTS; i += BENCH_DB_BATCH) {
+        uint64_t start = now_ns();
+
+        size_t j;
+        for (j = i; j < i + BENCH_DB_BATCH; j++) {
+            objs[j] = new_cert(j);
+            CK_RV rv = db_add_new_object(&tok, objs[j]);
+            assert_int_equal(rv, CKR_OK);
+
+            rv = db_wait_for_writes();
+            assert_int_equal(rv, CKR_OK);
+        }
+
+        print_rate("create", i, start);
+    }
+
+    for (i = 0; i < BENCH_DB_OBJECTS; i += BENCH_DB_BATCH) {
+        uint64_t start = now_ns();
+
+        size_t j;
+        for (j = i; j < i + BENCH_DB_BATCH; j++) {
+            CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(objs[j]->attrs,
+                    CKA_LABEL);
+            assert_non_null(a);
+            memcpy(a->pValue, "BENCH", 5);
+
+            CK_RV rv = db_update_tobject_attrs(objs[j]->id, objs[j]->attrs);
+            assert_int_equal(rv, CKR_OK);
+
+            rv = db_wait_for_writes();
+            assert_int_equal(rv, CKR_OK);
+        }
+
+        print_rate("update", i, start);
+    }
+
+    /* what was written is what a token loads */
+    token loaded = { .id = 1 };
+    int rc = init_tobjects(&loaded);
+    assert_int_equal(rc, 0);
+
+    i = 0;
+    list *cur = loaded.tobjects.head ? &loaded.tobjects.head->l : NULL;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        cur = cur->next;
+
+        assert_int_equal(tobj->id, objs[i]->id);
+
+        CK_RV rv = tobject_decode_attrs(tobj);
+        assert_int_equal(rv, CKR_OK);
+
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_LABEL);
+        assert_non_null(a);
+        assert_memory_equal(a->pValue, "BENCH", 5);
+
+        token_rm_tobject(&loaded, tobj);
+        tobject_free(tobj);
+        i++;
+    }
+
+    assert_int_equal(i, BENCH_DB_OBJECTS);
+    free(loaded.tobjects.index);
+    free(loaded.tobjects.released);
+    attr_index_free(loaded.tobjects.attr_index);
+
+    for (i = 0; i < BENCH_DB_OBJECTS; i += BENCH_DB_BATCH) {
+        uint64_t start = now_ns();
+
+        size_t j;
+        for (j = i; j < i + BENCH_DB_BATCH; j++) {
+            CK_RV rv = db_delete_object(objs[j]);
+            assert_int_equal(rv, CKR_OK);
+
+            rv = db_wait_for_writes();
+            assert_int_equal(rv, CKR_OK);
+            tobject_free(objs[j]);
+        }
+
+        print_rate("delete", i, start);
+    }
+
+    free(objs);
+}
+
+typedef struct bench_writer bench_writer;
+struct bench_writer {
+    token *tok;
+    tobject **objs;
+    unsigned failed;
+};
+
+/* holds the token like the PKCS#11 calls do and waits for the commit after */
+static CK_RV bench_write(token *tok, CK_RV (*write)(token *tok, tobject *tobj),
+        tobject *tobj) {
+
+    token_lock(tok);
+    CK_RV rv = write(tok, tobj);
+    token_unlock(tok);
+
+    CK_RV rv2 = db_wait_for_writes();
+
+    return rv == CKR_OK ? rv2 : rv;
+}
+
+static CK_RV bench_update(token *tok, tobject *tobj) {
+    (void) tok;
+    return db_update_tobject_attrs(tobj->id, tobj->attrs);
+}
+
+static CK_RV bench_delete(token *tok, tobject *tobj) {
+    (void) tok;
+    return db_delete_object(tobj);
+}
+
+static void *bench_writer_run(void *arg) {
+
+    bench_writer *w = (bench_writer *)arg;
+
+    size_t i;
+    for (i = 0; i < BENCH_DB_THREAD_OBJECTS; i++) {
+        tobject *tobj = w->objs[i];
+        if (bench_write(w->tok, db_add_new_object, tobj) != CKR_OK
+                || bench_write(w->tok, bench_update, tobj) != CKR_OK
+                || bench_write(w->tok, bench_delete, tobj) != CKR_OK) {
+            w->failed++;
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_db_concurrent_writes(void **state) {
+    (void) state;
+
+    token tok = { .id = 1 };
+    CK_RV rv = rwlock_create(&tok.rwlock);
+    assert_int_equal(rv, CKR_OK);
+
+    bench_writer w[BENCH_DB_THREADS] = { 0 };
+    pthread_t threads[BENCH_DB_THREADS];
+
+    size_t i;
+    for (i = 0; i < BENCH_DB_THREADS; i++) {
+        w[i].tok = &tok;
+        w[i].objs = calloc(BENCH_DB_THREAD_OBJECTS, sizeof(*w[i].objs));
+        assert_non_null(w[i].objs);
+
+        size_t j;
+        for (j = 0; j < BENCH_DB_THREAD_OBJECTS; j++) {
+            w[i].objs[j] = new_cert(i * BENCH_DB_THREAD_OBJECTS + j);
+        }
+    }
+
+    uint64_t start = now_ns();
+
+    for (i = 0; i < BENCH_DB_THREADS; i++) {
+        int rc = pthread_create(&threads[i], NULL, bench_writer_run, &w[i]);
+        assert_int_equal(rc, 0);
+    }
+
+    for (i = 0; i < BENCH_DB_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double s = (double)(now_ns() - start) / 1000000000.0;
+    printf("%d threads on one token: %8.0f writes/s\n", BENCH_DB_THREADS,
+            BENCH_DB_THREADS * BENCH_DB_THREAD_OBJECTS * 3 / s);
+
+    for (i = 0; i < BENCH_DB_THREADS; i++) {
+        assert_int_equal(w[i].failed, 0);
+
+        size_t j;
+        for (j = 0; j < BENCH_DB_THREAD_OBJECTS; j++) {
+            tobject_free(w[i].objs[j]);
+        }
+        free(w[i].objs);
+    }
+
+    rwlock_destroy(tok.rwlock);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(bench_token_create_destroy),
+        cmocka_unit_test(bench_token_attr_index),
+        cmocka_unit_test(bench_attr_lookup),
+        cmocka_unit_test(bench_attr_dup),
+        cmocka_unit_test(bench_attr_decode),
+        cmocka_unit_test(bench_db_create_update_delete),
+        cmocka_unit_test(bench_db_concurrent_writes),
+    };
+
+    return cmocka_run_group_tests(tests, group_setup, group_teardown);
+}
@@ -11,7 +11,11 @@
 
 #include <cmocka.h>
 
+#include "attr_tlv.h"
 #include "attrs.h"
+#include "typed_memory.h"
+
+#define INDEX_ATTRS 48
 
 static void test_config_parser_empty_seq(void **state) {
     (void) state;
@@ -57,12 +61,203 @@ static void test_config_parser_empty_seq(void **state) {
     attr_list_free(attrs);
 }
 
+static void assert_all_found(attr_list *attrs, CK_ULONG cnt) {
+
+    CK_ULONG i;
+    for (i = 0; i < cnt; i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_VENDOR_DEFINED + i);
+        assert_non_null(a);
+        assert_int_equal(*(CK_ULONG_PTR)a->pValue, i);
+    }
+
+    assert_null(attr_get_attribute_by_type(attrs, CKA_VENDOR_DEFINED + cnt));
+    assert_null(attr_get_attribute_by_type(attrs, CKA_CLASS));
+}
+
+static void test_attr_list_index(void **state) {
+    (void) state;
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    /* crosses the point where the index gets built and then resized */
+    CK_ULONG i;
+    for (i = 0; i < INDEX_ATTRS; i++) {
+        bool r = attr_list_add_int(attrs, CKA_VENDOR_DEFINED + i, i);
+        assert_true(r);
+        assert_all_found(attrs, i + 1);
+    }
+
+    /* a duplicate type doesn't shadow the first one */
+    bool r = attr_list_add_int(attrs, CKA_VENDOR_DEFINED, 42);
+    assert_true(r);
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_VENDOR_DEFINED);
+    assert_non_null(a);
+    assert_int_equal(*(CK_ULONG_PTR)a->pValue, 0);
+
+    attr_list *copy = NULL;
+    CK_RV rv = attr_list_dup(attrs, &copy);
+    assert_int_equal(rv, CKR_OK);
+    assert_all_found(copy, INDEX_ATTRS);
+
+    /* appending moves the attributes, the index must follow */
+    attr_list *more = attr_list_new();
+    assert_non_null(more);
+    r = attr_list_add_bool(more, CKA_SIGN, CK_TRUE);
+    assert_true(r);
+
+    copy = attr_list_append_attrs(copy, &more);
+    assert_non_null(copy);
+    assert_null(more);
+    assert_all_found(copy, INDEX_ATTRS);
+    a = attr_get_attribute_by_type(copy, CKA_SIGN);
+    assert_non_null(a);
+
+    attr_list_free(copy);
+    attr_list_free(attrs);
+}
+
+static void assert_values(attr_list *attrs, CK_ULONG id) {
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_CLASS);
+    assert_non_null(a);
+    assert_int_equal(*(CK_ULONG_PTR)a->pValue, CKO_PRIVATE_KEY);
+    assert_int_equal(type_from_ptr(a->pValue, a->ulValueLen), TYPE_BYTE_INT);
+
+    a = attr_get_attribute_by_type(attrs, CKA_SIGN);
+    assert_non_null(a);
+    assert_int_equal(*(CK_BBOOL *)a->pValue, CK_TRUE);
+    assert_int_equal(type_from_ptr(a->pValue, a->ulValueLen), TYPE_BYTE_BOOL);
+
+    a = attr_get_attribute_by_type(attrs, CKA_ID);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, sizeof(id));
+    assert_memory_equal(a->pValue, &id, sizeof(id));
+    assert_int_equal(type_from_ptr(a->pValue, a->ulValueLen), TYPE_BYTE_HEX_STR);
+
+    a = attr_get_attribute_by_type(attrs, CKA_ALLOWED_MECHANISMS);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 2 * sizeof(CK_ULONG));
+    assert_int_equal(((CK_ULONG_PTR)a->pValue)[1], CKM_ECDSA);
+    assert_int_equal(type_from_ptr(a->pValue, a->ulValueLen), TYPE_BYTE_INT_SEQ);
+
+    a = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(a);
+    assert_null(a->pValue);
+    assert_int_equal(a->ulValueLen, 0);
+}
+
+static void test_attr_list_arena(void **state) {
+    (void) state;
+
+    CK_ULONG id = 0x1234;
+    CK_ULONG mechs[] = { CKM_RSA_PKCS, CKM_ECDSA };
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    bool r = attr_list_add_int(attrs, CKA_CLASS, CKO_PRIVATE_KEY);
+    assert_true(r);
+    r = attr_list_add_bool(attrs, CKA_SIGN, CK_TRUE);
+    assert_true(r);
+    r = attr_list_add_buf(attrs, CKA_ID, (CK_BYTE_PTR)&id, sizeof(id));
+    assert_true(r);
+    r = attr_list_add_int_seq(attrs, CKA_ALLOWED_MECHANISMS,
+            (CK_BYTE_PTR)mechs, sizeof(mechs));
+    assert_true(r);
+    r = attr_list_add_buf(attrs, CKA_LABEL, NULL, 0);
+    assert_true(r);
+
+    /* built up one by one, copied by compacting */
+    attr_list *copy = NULL;
+    CK_RV rv = attr_list_dup(attrs, &copy);
+    assert_int_equal(rv, CKR_OK);
+    assert_values(copy, id);
+
+    /* the copies don't share values */
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(copy, CKA_ID);
+    assert_ptr_not_equal(a->pValue, attr_get_attribute_by_type(attrs, CKA_ID)->pValue);
+
+    /* a reserved list is copied in one go, twice to copy a copy */
+    twist raw = attr_tlv_encode(attrs);
+    assert_non_null(raw);
+
+    attr_list *loaded = NULL;
+    rv = attr_tlv_decode((unsigned char *)raw, twist_len(raw), NULL, 0, &loaded);
+    assert_int_equal(rv, CKR_OK);
+    twist_free(raw);
+    assert_values(loaded, id);
+
+    attr_list *copy2 = NULL;
+    rv = attr_list_dup(loaded, &copy2);
+    assert_int_equal(rv, CKR_OK);
+    attr_list_free(loaded);
+    assert_values(copy2, id);
+
+    attr_list *copy3 = NULL;
+    rv = attr_list_dup(copy2, &copy3);
+    assert_int_equal(rv, CKR_OK);
+    attr_list_free(copy2);
+    assert_values(copy3, id);
+
+    /* growing moves the array out of the arena, the values stay put */
+    void *value = attr_get_attribute_by_type(copy3, CKA_ID)->pValue;
+    CK_ULONG i;
+    for (i = 0; i < INDEX_ATTRS; i++) {
+        r = attr_list_add_int(copy3, CKA_VENDOR_DEFINED + i, i);
+        assert_true(r);
+    }
+    assert_ptr_equal(attr_get_attribute_by_type(copy3, CKA_ID)->pValue, value);
+    assert_values(copy3, id);
+    a = attr_get_attribute_by_type(copy3, CKA_VENDOR_DEFINED + INDEX_ATTRS - 1);
+    assert_non_null(a);
+    assert_int_equal(*(CK_ULONG_PTR)a->pValue, INDEX_ATTRS - 1);
+
+    /* a new length gets new memory, the same one is written in place */
+    CK_BYTE longer[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    CK_ATTRIBUTE update = {
+        .type = CKA_ID, .pValue = longer, .ulValueLen = sizeof(longer)
+    };
+    rv = attr_list_update_entry(copy3, &update);
+    assert_int_equal(rv, CKR_OK);
+    a = attr_get_attribute_by_type(copy3, CKA_ID);
+    assert_ptr_not_equal(a->pValue, value);
+    assert_memory_equal(a->pValue, longer, sizeof(longer));
+    assert_int_equal(type_from_ptr(a->pValue, a->ulValueLen), TYPE_BYTE_HEX_STR);
+
+    value = a->pValue;
+    longer[0] = 42;
+    rv = attr_list_update_entry(copy3, &update);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(a->pValue, value);
+    assert_memory_equal(a->pValue, longer, sizeof(longer));
+
+    /* the appended values come along with their memory */
+    copy = attr_list_append_attrs(copy, &copy3);
+    assert_non_null(copy);
+    assert_null(copy3);
+    a = attr_get_attribute_by_type_raw(attr_list_get_ptr(copy),
+            attr_list_get_count(copy), CKA_VENDOR_DEFINED + INDEX_ATTRS - 1);
+    assert_non_null(a);
+    assert_int_equal(*(CK_ULONG_PTR)a->pValue, INDEX_ATTRS - 1);
+
+    attr_pfree_cleanse(a);
+    assert_null(a->pValue);
+    assert_int_equal(a->ulValueLen, 0);
+
+    attr_list_free(copy);
+
+    attr_list_free(attrs);
+}
+
 int main(int argc, char* argv[]) {
     (void) argc;
     (void) argv;
 
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_config_parser_empty_seq),
+        cmocka_unit_test(test_attr_list_index),
+        cmocka_unit_test(test_attr_list_arena),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
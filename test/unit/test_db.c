@@ -15,6 +15,7 @@
 
 #include <sqlite3.h>
 
+#include "attr_tlv.h"
 #include "db.h"
 #include "debug.h"
 #include "object.h"
@@ -26,7 +27,6 @@
 typedef struct will_return_data will_return_data;
 struct will_return_data {
     bool call_real;
-    token t;
 	union {
 		int rc;
 		void *data;
@@ -102,6 +102,9 @@ int __wrap_sqlite3_finalize(sqlite3_stmt *pStmt) {
 	return d->rc;
 }
 
+/* every statement prepared, ; terminated, to check what went into them */
+static char prepared_sql[256];
+
 int __wrap_sqlite3_prepare_v2(sqlite3 *db,
   const char *zSql,
   int nByte,
@@ -109,11 +112,13 @@ int __wrap_sqlite3_prepare_v2(sqlite3 *db,
   const char **pzTail
 ) {
 	UNUSED(db);
-	UNUSED(zSql);
 	UNUSED(nByte);
 	UNUSED(ppStmt);
 	UNUSED(pzTail);
 
+	size_t len = strlen(prepared_sql);
+	snprintf(&prepared_sql[len], sizeof(prepared_sql) - len, "%s;", zSql);
+
 	will_return_data *d = mock_type(will_return_data *);
 	if (d->rc == SQLITE_OK) {
 		*ppStmt = (sqlite3_stmt *)0xBADCC0DE;
@@ -130,6 +135,15 @@ int __wrap_sqlite3_bind_int(sqlite3_stmt *pStmt, int iCol, int value) {
 	return d->rc;
 }
 
+int __wrap_sqlite3_bind_int64(sqlite3_stmt *pStmt, int iCol, sqlite3_int64 value) {
+	UNUSED(pStmt);
+	UNUSED(iCol);
+	UNUSED(value);
+
+	will_return_data *d = mock_type(will_return_data *);
+	return d->rc;
+}
+
 int __wrap_sqlite3_bind_text(sqlite3_stmt *pStmt, int iCol, const char *text, int len, void(*fnp)(void *data)) {
 	UNUSED(pStmt);
 	UNUSED(iCol);
@@ -209,6 +223,51 @@ int __wrap_sqlite3_exec(
     return d->rc;
 }
 
+static int (*busy_handler)(void *arg, int count);
+static void *busy_handler_arg;
+
+int __wrap_sqlite3_busy_handler(sqlite3 *db, int (*handler)(void *arg, int count),
+        void *arg) {
+    UNUSED(db);
+
+    busy_handler = handler;
+    busy_handler_arg = arg;
+
+    will_return_data *d = mock_type(will_return_data *);
+    return d->rc;
+}
+
+const char *__wrap_sqlite3_db_filename(sqlite3 *db, const char *zDbName) {
+    UNUSED(db);
+    UNUSED(zDbName);
+
+    will_return_data *d = mock_type(will_return_data *);
+    return d->data;
+}
+
+static char opened_uri[3 * PATH_MAX + 32];
+static int opened_flags;
+
+int __wrap_sqlite3_open_v2(const char *filename, sqlite3 **ppDb, int flags,
+        const char *zVfs) {
+    UNUSED(zVfs);
+
+    snprintf(opened_uri, sizeof(opened_uri), "%s", filename);
+    opened_flags = flags;
+
+    /* sqlite hands out a connection even when the open fails */
+    *ppDb = BAD_PTR;
+
+    will_return_data *d = mock_type(will_return_data *);
+    return d->rc;
+}
+
+/* the connections here are all fake */
+int __wrap_sqlite3_close(sqlite3 *db) {
+    UNUSED(db);
+    return SQLITE_OK;
+}
+
 sqlite3_int64 __wrap_sqlite3_last_insert_rowid(sqlite3 *db) {
     UNUSED(db);
 
@@ -244,19 +303,10 @@ tobject *db_tobject_new(sqlite3_stmt *stmt) {
 }
 
 /* weak override */
-bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
-        attr_list **attrs) {
-	UNUSED(yaml);
-	UNUSED(size);
-	UNUSED(attrs);
-
-	will_return_data *d = mock_type(will_return_data *);
-	return d->rcb;
-}
-
-/* weak override */
-WEAK CK_RV object_init_from_attrs(tobject *tobj) {
+CK_RV tobject_set_raw_attrs(tobject *tobj, const unsigned char *raw, size_t len) {
 	UNUSED(tobj);
+	UNUSED(raw);
+	UNUSED(len);
 
 	will_return_data *d = mock_type(will_return_data *);
 	return d->rv;
@@ -304,10 +354,10 @@ CK_RV tpm_create_transient_primary_from_template(tpm_ctx *tpm,
 }
 
 /* weak override */
-CK_RV token_min_init(token *t) {
+CK_RV token_slot_init(token *t) {
+    UNUSED(t);
 
     will_return_data *d = mock_type(will_return_data *);
-    *t = d->t;
     return d->rv;
 }
 
@@ -331,6 +381,16 @@ int init_sealobjects(unsigned tokid, sealobject *sealobj) {
     return d->rc;
 }
 
+/* weak override */
+int init_tobject_changes(token *tok) {
+
+    will_return_data *d = mock_type(will_return_data *);
+    if (d->call_real) {
+        return __real_init_tobject_changes(tok);
+    }
+    return d->rc;
+}
+
 /* weak override */
 int init_tobjects(token *tok) {
 
@@ -342,7 +402,16 @@ int init_tobjects(token *tok) {
 }
 
 /* weak override */
-char *emit_attributes_to_string(attr_list *attrs) {
+CK_RV db_new(sqlite3 **db) {
+
+    *db = BAD_PTR;
+
+    will_return_data *d = mock_type(will_return_data *);
+    return d->rv;
+}
+
+/* weak override */
+twist attr_tlv_encode(attr_list *attrs) {
     UNUSED(attrs);
     will_return_data *d = mock_type(will_return_data *);
     return d->data;
@@ -441,7 +510,7 @@ static void db_tobject_new_tobject_sqlite3_column_unknown_fail(void **state) {
     assert_null(t);
 }
 
-static void db_tobject_new_tobject_sqlite3_column_text_fail(void **state) {
+static void db_tobject_new_tobject_sqlite3_column_blob_fail(void **state) {
     (void) state;
 
     will_return_data d[] = {
@@ -450,7 +519,7 @@ static void db_tobject_new_tobject_sqlite3_column_text_fail(void **state) {
 		{ .rc = 1 },           /* sqlite3_data_count */
 		{ .data = "attrs" },   /* sqlite3_column_name */
 		{ .rc = 0 },           /* sqlite3_column_bytes */
-		{ .data = NULL },      /* sqlite3_column_text */
+		{ .data = NULL },      /* sqlite3_column_blob */
     };
 
     will_return(db_tobject_new,              &d[0]);
@@ -458,7 +527,7 @@ static void db_tobject_new_tobject_sqlite3_column_text_fail(void **state) {
     will_return(__wrap_sqlite3_data_count,   &d[2]);
     will_return(__wrap_sqlite3_column_name,  &d[3]);
     will_return(__wrap_sqlite3_column_bytes, &d[4]);
-    will_return(__wrap_sqlite3_column_text,  &d[5]);
+    will_return(__wrap_sqlite3_column_blob,  &d[5]);
 
     tobject *t = db_tobject_new(BAD_PTR);
     assert_null(t);
@@ -473,34 +542,8 @@ static void db_tobject_new_tobject_sqlite3_attrs_text_fail(void **state) {
 		{ .rc = 1 },           /* sqlite3_data_count */
 		{ .data = "attrs" },   /* sqlite3_column_name */
 		{ .rc = 4 },           /* sqlite3_column_bytes */
-		{ .data = "bad" },     /* sqlite3_column_text */
-		{ .rcb = false },      /* parse_attributes_from_string */
-    };
-
-    will_return(db_tobject_new,               &d[0]);
-    will_return(tobject_new,                  &d[1]);
-    will_return(__wrap_sqlite3_data_count,    &d[2]);
-    will_return(__wrap_sqlite3_column_name,   &d[3]);
-    will_return(__wrap_sqlite3_column_bytes,  &d[4]);
-    will_return(__wrap_sqlite3_column_text,   &d[5]);
-    will_return(parse_attributes_from_string, &d[6]);
-
-    tobject *t = db_tobject_new(BAD_PTR);
-    assert_null(t);
-}
-
-static void db_tobject_new_tobject_object_init_from_attrs_fail(void **state) {
-    (void) state;
-
-    will_return_data d[] = {
-        { .call_real = true },      /* db_tobject_new call real */
-		{ .data = *state },         /* tobject_new */
-		{ .rc = 1 },                /* sqlite3_data_count */
-		{ .data = "attrs" },        /* sqlite3_column_name */
-		{ .rc = 3 },                /* sqlite3_column_bytes */
-		{ .data = "good" },         /* sqlite3_column_text */
-		{ .rcb = true },            /* parse_attributes_from_string */
-		{ .rv = CKR_GENERAL_ERROR } /* object_init_from_attrs */
+		{ .data = "bad" },     /* sqlite3_column_blob */
+		{ .rv = CKR_GENERAL_ERROR }, /* tobject_set_raw_attrs */
     };
 
     will_return(db_tobject_new,               &d[0]);
@@ -508,9 +551,8 @@ static void db_tobject_new_tobject_object_init_from_attrs_fail(void **state) {
     will_return(__wrap_sqlite3_data_count,    &d[2]);
     will_return(__wrap_sqlite3_column_name,   &d[3]);
     will_return(__wrap_sqlite3_column_bytes,  &d[4]);
-    will_return(__wrap_sqlite3_column_text,   &d[5]);
-    will_return(parse_attributes_from_string, &d[6]);
-    will_return(object_init_from_attrs,       &d[7]);
+    will_return(__wrap_sqlite3_column_blob,   &d[5]);
+    will_return(tobject_set_raw_attrs,        &d[6]);
 
     tobject *t = db_tobject_new(BAD_PTR);
     assert_null(t);
@@ -1185,85 +1227,81 @@ static void test_db_get_tokens_token_overcount_fail(void **state) {
         { .rc = SQLITE_OK             }, /* sqlite3_prepare_v2 */
         { .rc = SQLITE_ROW            }, /* sqlite3_step */
         { .rc = 0                     }, /* sqlite3_data_count (no per token data)*/
-        { .rv = CKR_OK                }, /* token_min_init */
-        { .rc = SQLITE_OK             }, /* init_pobject */
+        { .rv = CKR_OK                }, /* token_slot_init */
         { .rc = SQLITE_OK             }, /* sqlite3_finalize */
     };
 
     will_return_always(__wrap_sqlite3_prepare_v2,  &d[0]);
     will_return_always(__wrap_sqlite3_step,        &d[1]);
     will_return_always(__wrap_sqlite3_data_count,  &d[2]);
-    will_return_always(token_min_init,             &d[3]);
-    will_return_always(init_pobject,               &d[4]);
-    will_return(__wrap_sqlite3_finalize,           &d[5]);
+    will_return_always(token_slot_init,            &d[3]);
+    will_return(__wrap_sqlite3_finalize,           &d[4]);
 
     CK_RV rv = db_get_tokens(tok, &len);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
     assert_int_equal(len, 0);
 }
 
-static void test_db_get_tokens_init_seal_objects_fail(void **state) {
+static void test_db_get_tokens_token_slot_init_fail(void **state) {
 
     size_t len = 42;
     token *tok = (token *)*state;
 
-    token t = {
-        .config = {
-            .is_initialized = true
-        }
-    };
-
     will_return_data d[] = {
         { .rc = SQLITE_OK             }, /* sqlite3_prepare_v2 */
         { .rc = SQLITE_ROW            }, /* sqlite3_step */
         { .rc = 0                     }, /* sqlite3_data_count (no per token data)*/
-        { .rv = CKR_OK, .t = t        }, /* token_min_init */
-        { .rc = SQLITE_OK             }, /* init_pobject */
-        { .rc = SQLITE_ERROR          }, /* init_sealobjects */
+        { .rv = CKR_GENERAL_ERROR     }, /* token_slot_init */
         { .rc = SQLITE_OK             }, /* sqlite3_finalize */
     };
 
     will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
     will_return(__wrap_sqlite3_step,        &d[1]);
     will_return(__wrap_sqlite3_data_count,  &d[2]);
-    will_return(token_min_init,             &d[3]);
-    will_return(init_pobject,               &d[4]);
-    will_return(init_sealobjects,           &d[5]);
-    will_return(__wrap_sqlite3_finalize,    &d[6]);
+    will_return(token_slot_init,            &d[3]);
+    will_return(__wrap_sqlite3_finalize,    &d[4]);
 
     CK_RV rv = db_get_tokens(tok, &len);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
     assert_int_equal(len, 0);
 }
 
-static void test_db_get_tokens_token_min_init_fail(void **state) {
+static void test_db_load_token_init_pobject_fail(void **state) {
+    UNUSED(state);
 
-    size_t len = 42;
-    token *tok = (token *)*state;
+    token t = {
+        .config = {
+            .is_initialized = true
+        }
+    };
 
     will_return_data d[] = {
-        { .rc = SQLITE_OK             }, /* sqlite3_prepare_v2 */
-        { .rc = SQLITE_ROW            }, /* sqlite3_step */
-        { .rc = 0                     }, /* sqlite3_data_count (no per token data)*/
-        { .rv = CKR_GENERAL_ERROR     }, /* token_min_init */
-        { .rc = SQLITE_OK             }, /* sqlite3_finalize */
+        { .rc = SQLITE_ERROR          }, /* init_pobject */
     };
 
-    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
-    will_return(__wrap_sqlite3_step,        &d[1]);
-    will_return(__wrap_sqlite3_data_count,  &d[2]);
-    will_return(token_min_init,             &d[3]);
-    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(init_pobject,               &d[0]);
 
-    CK_RV rv = db_get_tokens(tok, &len);
+    CK_RV rv = db_load_token(&t);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
-    assert_int_equal(len, 0);
 }
 
-static void test_db_get_tokens_init_pobjects_fail(void **state) {
+static void test_db_load_token_uninitialized(void **state) {
+    UNUSED(state);
 
-    size_t len = 42;
-    token *tok = (token *)*state;
+    token t = { 0 };
+
+    will_return_data d[] = {
+        { .rc = SQLITE_OK             }, /* init_pobject */
+    };
+
+    will_return(init_pobject,               &d[0]);
+
+    CK_RV rv = db_load_token(&t);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_db_load_token_start_fail(void **state) {
+    UNUSED(state);
 
     token t = {
         .config = {
@@ -1272,30 +1310,44 @@ static void test_db_get_tokens_init_pobjects_fail(void **state) {
     };
 
     will_return_data d[] = {
-        { .rc = SQLITE_OK             }, /* sqlite3_prepare_v2 */
-        { .rc = SQLITE_ROW            }, /* sqlite3_step */
-        { .rc = 0                     }, /* sqlite3_data_count (no per token data)*/
-        { .rv = CKR_OK, .t = t        }, /* token_min_init */
-        { .rc = SQLITE_ERROR          }, /* init_pobject */
-        { .rc = SQLITE_OK             }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK             }, /* init_pobject */
+        { .rc = SQLITE_ERROR          }, /* sqlite3_exec (BEGIN TRANSACTION) */
     };
 
-    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
-    will_return(__wrap_sqlite3_step,        &d[1]);
-    will_return(__wrap_sqlite3_data_count,  &d[2]);
-    will_return(token_min_init,             &d[3]);
-    will_return(init_pobject,               &d[4]);
-    will_return(__wrap_sqlite3_finalize,    &d[5]);
+    will_return(init_pobject,               &d[0]);
+    will_return(__wrap_sqlite3_exec,        &d[1]);
 
-    CK_RV rv = db_get_tokens(tok, &len);
+    CK_RV rv = db_load_token(&t);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
-    assert_int_equal(len, 0);
 }
 
-static void test_db_get_tokens_init_tobjects_fail(void **state) {
+static void test_db_load_token_init_seal_objects_fail(void **state) {
+    UNUSED(state);
 
-    size_t len = 42;
-    token *tok = (token *)*state;
+    token t = {
+        .config = {
+            .is_initialized = true
+        }
+    };
+
+    will_return_data d[] = {
+        { .rc = SQLITE_OK             }, /* init_pobject */
+        { .rc = SQLITE_OK             }, /* sqlite3_exec (BEGIN TRANSACTION) */
+        { .rc = SQLITE_ERROR          }, /* init_sealobjects */
+        { .rc = SQLITE_OK             }, /* sqlite3_exec (ROLLBACK) */
+    };
+
+    will_return(init_pobject,               &d[0]);
+    will_return(__wrap_sqlite3_exec,        &d[1]);
+    will_return(init_sealobjects,           &d[2]);
+    will_return(__wrap_sqlite3_exec,        &d[3]);
+
+    CK_RV rv = db_load_token(&t);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+}
+
+static void test_db_load_token_init_tobjects_fail(void **state) {
+    UNUSED(state);
 
     token t = {
         .config = {
@@ -1304,28 +1356,52 @@ static void test_db_get_tokens_init_tobjects_fail(void **state) {
     };
 
     will_return_data d[] = {
-        { .rc = SQLITE_OK             }, /* sqlite3_prepare_v2 */
-        { .rc = SQLITE_ROW            }, /* sqlite3_step */
-        { .rc = 0                     }, /* sqlite3_data_count (no per token data)*/
-        { .rv = CKR_OK, .t = t        }, /* token_min_init */
         { .rc = SQLITE_OK             }, /* init_pobject */
+        { .rc = SQLITE_OK             }, /* sqlite3_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_OK             }, /* init_sealobjects */
+        { .rc = SQLITE_OK             }, /* init_tobject_changes */
         { .rc = SQLITE_ERROR          }, /* init_tobjects */
-        { .rc = SQLITE_OK             }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK             }, /* sqlite3_exec (ROLLBACK) */
     };
 
-    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
-    will_return(__wrap_sqlite3_step,        &d[1]);
-    will_return(__wrap_sqlite3_data_count,  &d[2]);
-    will_return(token_min_init,             &d[3]);
-    will_return(init_pobject,               &d[4]);
-    will_return(init_sealobjects,           &d[5]);
-    will_return(init_tobjects,              &d[6]);
-    will_return(__wrap_sqlite3_finalize,    &d[7]);
+    will_return(init_pobject,               &d[0]);
+    will_return(__wrap_sqlite3_exec,        &d[1]);
+    will_return(init_sealobjects,           &d[2]);
+    will_return(init_tobject_changes,       &d[3]);
+    will_return(init_tobjects,              &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[5]);
 
-    CK_RV rv = db_get_tokens(tok, &len);
+    CK_RV rv = db_load_token(&t);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
-    assert_int_equal(len, 0);
+}
+
+static void test_db_load_token(void **state) {
+    UNUSED(state);
+
+    token t = {
+        .config = {
+            .is_initialized = true
+        }
+    };
+
+    will_return_data d[] = {
+        { .rc = SQLITE_OK             }, /* init_pobject */
+        { .rc = SQLITE_OK             }, /* sqlite3_exec (BEGIN TRANSACTION) */
+        { .rc = SQLITE_OK             }, /* init_sealobjects */
+        { .rc = SQLITE_OK             }, /* init_tobject_changes */
+        { .rc = SQLITE_OK             }, /* init_tobjects */
+        { .rc = SQLITE_OK             }, /* sqlite3_exec (COMMIT) */
+    };
+
+    will_return(init_pobject,               &d[0]);
+    will_return(__wrap_sqlite3_exec,        &d[1]);
+    will_return(init_sealobjects,           &d[2]);
+    will_return(init_tobject_changes,       &d[3]);
+    will_return(init_tobjects,              &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[5]);
+
+    CK_RV rv = db_load_token(&t);
+    assert_int_equal(rv, CKR_OK);
 }
 
 static void test_db_get_tokens_config_fail(void **state) {
@@ -1700,17 +1776,17 @@ static void test_db_update_for_pinchange_commit_fail(void **state) {
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
-static void test_db_add_new_object_emit_attributes_to_string_fail(void **state) {
+static void test_db_add_new_object_attr_tlv_encode_fail(void **state) {
     UNUSED(state);
 
     token t = { .id = 76 };
     tobject tobj = { 0 };
 
     will_return_data d[] = {
-        { .data = NULL                }, /* emit_attributes_to_string */
+        { .data = NULL                }, /* attr_tlv_encode */
     };
 
-    will_return(emit_attributes_to_string,        &d[0]);
+    will_return(attr_tlv_encode,        &d[0]);
 
     CK_RV rv = db_add_new_object(&t, &tobj);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -1723,13 +1799,13 @@ static void test_db_add_new_object_sqlite3_prepare_v2_fail(void **state) {
     tobject tobj = { 0 };
 
     will_return_data d[] = {
-        { .data = __real_strdup("attrs in yaml") }, /* emit_attributes_to_string */
+        { .data = (void *)twist_new("attrs") }, /* attr_tlv_encode */
         { .rc = SQLITE_ERROR                     }, /* sqlite3_prepare_v2 */
     };
 
     assert_non_null(d[0].data);
 
-    will_return(emit_attributes_to_string,  &d[0]);
+    will_return(attr_tlv_encode,  &d[0]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
 
     CK_RV rv = db_add_new_object(&t, &tobj);
@@ -1743,11 +1819,12 @@ static void test_db_add_new_object_sqlite_step_fail(void **state) {
     tobject tobj = { 0 };
 
     will_return_data d[] = {
-        { .data = __real_strdup("attrs in yaml") }, /* emit_attributes_to_string */
+        { .data = (void *)twist_new("attrs") }, /* attr_tlv_encode */
         { .rc = SQLITE_OK                        }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_OK                        }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                        }, /* sqlite3_bind_int64 */
         { .rc = SQLITE_OK                        }, /* sqlite3_bind_int */
-        { .rc = SQLITE_OK                        }, /* sqlite3_bind_text */
+        { .rc = SQLITE_OK                        }, /* sqlite3_bind_blob */
         { .rc = SQLITE_ERROR                     }, /* sqlite3_step */
         { .rc = SQLITE_OK                        }, /* sqlite3_finalize */
         { .rc = SQLITE_OK                        }, /* sqlite_exec (ROLLBACK) */
@@ -1755,14 +1832,15 @@ static void test_db_add_new_object_sqlite_step_fail(void **state) {
 
     assert_non_null(d[0].data);
 
-    will_return(emit_attributes_to_string,  &d[0]);
+    will_return(attr_tlv_encode,  &d[0]);
     will_return(__wrap_sqlite3_exec,        &d[1]);
     will_return(__wrap_sqlite3_prepare_v2,  &d[2]);
-    will_return(__wrap_sqlite3_bind_int,    &d[3]);
-    will_return(__wrap_sqlite3_bind_text,   &d[4]);
-    will_return(__wrap_sqlite3_step,        &d[5]);
-    will_return(__wrap_sqlite3_finalize,    &d[6]);
-    will_return(__wrap_sqlite3_exec,        &d[7]);
+    will_return(__wrap_sqlite3_bind_int64,  &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_bind_blob,   &d[5]);
+    will_return(__wrap_sqlite3_step,        &d[6]);
+    will_return(__wrap_sqlite3_finalize,    &d[7]);
+    will_return(__wrap_sqlite3_exec,        &d[8]);
 
     CK_RV rv = db_add_new_object(&t, &tobj);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -1775,11 +1853,12 @@ static void test_db_add_new_object_sqlite3_last_insert_rowid_fail(void **state)
     tobject tobj = { 0 };
 
     will_return_data d[] = {
-        { .data = __real_strdup("attrs in yaml") }, /* emit_attributes_to_string */
+        { .data = (void *)twist_new("attrs") }, /* attr_tlv_encode */
         { .rc = SQLITE_OK                        }, /* sqlite_exec (BEGIN TRANSACTION) */
         { .rc = SQLITE_OK                        }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                        }, /* sqlite3_bind_int64 */
         { .rc = SQLITE_OK                        }, /* sqlite3_bind_int */
-        { .rc = SQLITE_OK                        }, /* sqlite3_bind_text */
+        { .rc = SQLITE_OK                        }, /* sqlite3_bind_blob */
         { .rc = SQLITE_DONE                      }, /* sqlite3_step */
         { .u64 = 0                               }, /* sqlite3_last_insert_rowid */
         { .rc = SQLITE_ERROR                     }, /* sqlite3_finalize (force warning) */
@@ -1788,15 +1867,16 @@ static void test_db_add_new_object_sqlite3_last_insert_rowid_fail(void **state)
 
     assert_non_null(d[0].data);
 
-    will_return(emit_attributes_to_string,        &d[0]);
+    will_return(attr_tlv_encode,        &d[0]);
     will_return(__wrap_sqlite3_exec,              &d[1]);
     will_return(__wrap_sqlite3_prepare_v2,        &d[2]);
-    will_return(__wrap_sqlite3_bind_int,          &d[3]);
-    will_return(__wrap_sqlite3_bind_text,         &d[4]);
-    will_return(__wrap_sqlite3_step,              &d[5]);
-    will_return(__wrap_sqlite3_last_insert_rowid, &d[6]);
-    will_return(__wrap_sqlite3_finalize,          &d[7]);
-    will_return(__wrap_sqlite3_exec,              &d[8]);
+    will_return(__wrap_sqlite3_bind_int64,        &d[3]);
+    will_return(__wrap_sqlite3_bind_int,          &d[4]);
+    will_return(__wrap_sqlite3_bind_blob,         &d[5]);
+    will_return(__wrap_sqlite3_step,              &d[6]);
+    will_return(__wrap_sqlite3_last_insert_rowid, &d[7]);
+    will_return(__wrap_sqlite3_finalize,          &d[8]);
+    will_return(__wrap_sqlite3_exec,              &d[9]);
 
     CK_RV rv = db_add_new_object(&t, &tobj);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -2138,14 +2218,18 @@ static void test_db_update_token_sqlite3_bind_int_fail(void **state) {
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
-static void test_db_update_tobject_attrs_emit_attributes_to_string_fail(void **state) {
+static void test_db_update_tobject_attrs_attr_tlv_encode_fail(void **state) {
     UNUSED(state);
 
     will_return_data d[] = {
-        { .data = NULL }, /* emit_attributes_to_string */
+        { .rc = SQLITE_OK }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .data = NULL    }, /* attr_tlv_encode */
+        { .rc = SQLITE_OK }, /* sqlite_exec (ROLLBACK) */
     };
 
-    will_return(emit_attributes_to_string,  &d[0]);
+    will_return(__wrap_sqlite3_exec,        &d[0]);
+    will_return(attr_tlv_encode,            &d[1]);
+    will_return(__wrap_sqlite3_exec,        &d[2]);
 
     CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -2155,35 +2239,43 @@ static void test_db_update_tobject_attrs_sqlite3_prepare_v2_fail(void **state) {
     UNUSED(state);
 
     will_return_data d[] = {
-        { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
-        { .rc = SQLITE_ERROR              }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .data = (void *)twist_new("foobar") }, /* attr_tlv_encode */
+        { .rc = SQLITE_ERROR                  }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (ROLLBACK) */
     };
 
-    assert_non_null(d[0].data);
+    assert_non_null(d[1].data);
 
-    will_return(emit_attributes_to_string,  &d[0]);
-    will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
+    will_return(__wrap_sqlite3_exec,        &d[0]);
+    will_return(attr_tlv_encode,            &d[1]);
+    will_return(__wrap_sqlite3_prepare_v2,  &d[2]);
+    will_return(__wrap_sqlite3_exec,        &d[3]);
 
     CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
-static void test_db_update_tobject_attrs_sqlite3_bind_text_fail(void **state) {
+static void test_db_update_tobject_attrs_sqlite3_bind_blob_fail(void **state) {
     UNUSED(state);
 
     will_return_data d[] = {
-        { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
-        { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
-        { .rc = SQLITE_ERROR              }, /* sqlite3_bind_text */
-        { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .data = (void *)twist_new("foobar") }, /* attr_tlv_encode */
+        { .rc = SQLITE_OK                     }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_ERROR                  }, /* sqlite3_bind_blob */
+        { .rc = SQLITE_OK                     }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (ROLLBACK) */
     };
 
-    assert_non_null(d[0].data);
+    assert_non_null(d[1].data);
 
-    will_return(emit_attributes_to_string,  &d[0]);
-    will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_finalize,    &d[3]);
+    will_return(__wrap_sqlite3_exec,        &d[0]);
+    will_return(attr_tlv_encode,            &d[1]);
+    will_return(__wrap_sqlite3_prepare_v2,  &d[2]);
+    will_return(__wrap_sqlite3_bind_blob,   &d[3]);
+    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[5]);
 
     CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -2193,20 +2285,24 @@ static void test_db_update_tobject_attrs_sqlite3_bind_int_fail(void **state) {
     UNUSED(state);
 
     will_return_data d[] = {
-        { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
-        { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
-        { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
-        { .rc = SQLITE_ERROR              }, /* sqlite3_bind_int */
-        { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .data = (void *)twist_new("foobar") }, /* attr_tlv_encode */
+        { .rc = SQLITE_OK                     }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                     }, /* sqlite3_bind_blob */
+        { .rc = SQLITE_ERROR                  }, /* sqlite3_bind_int */
+        { .rc = SQLITE_OK                     }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (ROLLBACK) */
     };
 
-    assert_non_null(d[0].data);
+    assert_non_null(d[1].data);
 
-    will_return(emit_attributes_to_string,  &d[0]);
-    will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_bind_int,    &d[3]);
-    will_return(__wrap_sqlite3_finalize,    &d[4]);
+    will_return(__wrap_sqlite3_exec,        &d[0]);
+    will_return(attr_tlv_encode,            &d[1]);
+    will_return(__wrap_sqlite3_prepare_v2,  &d[2]);
+    will_return(__wrap_sqlite3_bind_blob,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_finalize,    &d[5]);
+    will_return(__wrap_sqlite3_exec,        &d[6]);
 
     CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -2216,22 +2312,26 @@ static void test_db_update_tobject_attrs_sqlite3_step_fail(void **state) {
     UNUSED(state);
 
     will_return_data d[] = {
-        { .data = __real_strdup("foobar") }, /* emit_attributes_to_string */
-        { .rc = SQLITE_OK                 }, /* sqlite3_prepare_v2 */
-        { .rc = SQLITE_OK                 }, /* sqlite3_bind_text */
-        { .rc = SQLITE_OK                 }, /* sqlite3_bind_int */
-        { .rc = SQLITE_ERROR              }, /* sqlite3_step */
-        { .rc = SQLITE_OK                 }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (BEGIN TRANSACTION) */
+        { .data = (void *)twist_new("foobar") }, /* attr_tlv_encode */
+        { .rc = SQLITE_OK                     }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_OK                     }, /* sqlite3_bind_blob */
+        { .rc = SQLITE_OK                     }, /* sqlite3_bind_int */
+        { .rc = SQLITE_ERROR                  }, /* sqlite3_step */
+        { .rc = SQLITE_OK                     }, /* sqlite3_finalize */
+        { .rc = SQLITE_OK                     }, /* sqlite_exec (ROLLBACK) */
     };
 
-    assert_non_null(d[0].data);
+    assert_non_null(d[1].data);
 
-    will_return(emit_attributes_to_string,  &d[0]);
-    will_return(__wrap_sqlite3_prepare_v2,  &d[1]);
-    will_return(__wrap_sqlite3_bind_text,   &d[2]);
-    will_return(__wrap_sqlite3_bind_int,    &d[3]);
-    will_return(__wrap_sqlite3_step,        &d[4]);
-    will_return(__wrap_sqlite3_finalize,    &d[5]);
+    will_return(__wrap_sqlite3_exec,        &d[0]);
+    will_return(attr_tlv_encode,            &d[1]);
+    will_return(__wrap_sqlite3_prepare_v2,  &d[2]);
+    will_return(__wrap_sqlite3_bind_blob,   &d[3]);
+    will_return(__wrap_sqlite3_bind_int,    &d[4]);
+    will_return(__wrap_sqlite3_step,        &d[5]);
+    will_return(__wrap_sqlite3_finalize,    &d[6]);
+    will_return(__wrap_sqlite3_exec,        &d[7]);
 
     CK_RV rv = db_update_tobject_attrs(42, (attr_list *)0xDEADBEEF);
     assert_int_equal(rv, CKR_GENERAL_ERROR);
@@ -2839,6 +2939,460 @@ static void test_db_add_token_sqlite3_step_2_fail(void **state) {
     assert_int_equal(rv, CKR_GENERAL_ERROR);
 }
 
+#define STORE_PATH "/tmp/tpm2_pkcs11/tpm2_pkcs11.sqlite3"
+
+static int db_configure_setup(void **state) {
+    UNUSED(state);
+
+    prepared_sql[0] = '\0';
+    busy_handler = NULL;
+    busy_handler_arg = NULL;
+
+    unsetenv("TPM2_PKCS11_STORE_JOURNAL");
+    unsetenv("TPM2_PKCS11_STORE_SYNC");
+    unsetenv("TPM2_PKCS11_STORE_BUSY_TIMEOUT");
+
+    return 0;
+}
+
+static int db_configure_teardown(void **state) {
+
+    db_configure_setup(state);
+
+    /* the busy timeout is kept, don't leave a short one behind */
+    setenv("TPM2_PKCS11_STORE_BUSY_TIMEOUT", "5000", 1);
+    will_return_data d[] = {
+        { .rc = SQLITE_OK     }, /* sqlite3_busy_handler */
+        { .data = NULL        }, /* sqlite3_db_filename (in memory) */
+        { .rc = SQLITE_OK     }, /* sqlite3_prepare_v2 */
+        { .rc = SQLITE_DONE   }, /* sqlite3_step */
+        { .rc = SQLITE_OK     }, /* sqlite3_finalize */
+    };
+
+    will_return(__wrap_sqlite3_busy_handler, &d[0]);
+    will_return(__wrap_sqlite3_db_filename,  &d[1]);
+    will_return(__wrap_sqlite3_prepare_v2,   &d[2]);
+    will_return(__wrap_sqlite3_step,         &d[3]);
+    will_return(__wrap_sqlite3_finalize,     &d[4]);
+
+    CK_RV rv = db_configure(BAD_PTR);
+
+    return db_configure_setup(state) || rv != CKR_OK;
+}
+
+/* queues the PRAGMA journal_mode query, which reports mode */
+static void will_return_journal_mode(will_return_data d[4], const char *mode) {
+
+    d[0].rc = SQLITE_OK;          /* sqlite3_prepare_v2 */
+    d[1].rc = SQLITE_ROW;         /* sqlite3_step */
+    d[2].data = (void *)mode;     /* sqlite3_column_text */
+    d[3].rc = SQLITE_OK;          /* sqlite3_finalize */
+
+    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
+    will_return(__wrap_sqlite3_step,        &d[1]);
+    will_return(__wrap_sqlite3_column_text, &d[2]);
+    will_return(__wrap_sqlite3_finalize,    &d[3]);
+}
+
+/* queues a PRAGMA without a result */
+static void will_return_pragma(will_return_data d[3]) {
+
+    d[0].rc = SQLITE_OK;          /* sqlite3_prepare_v2 */
+    d[1].rc = SQLITE_DONE;        /* sqlite3_step */
+    d[2].rc = SQLITE_OK;          /* sqlite3_finalize */
+
+    will_return(__wrap_sqlite3_prepare_v2,  &d[0]);
+    will_return(__wrap_sqlite3_step,        &d[1]);
+    will_return(__wrap_sqlite3_finalize,    &d[2]);
+}
+
+static void will_return_open(will_return_data d[2]) {
+
+    d[0].rc = SQLITE_OK;              /* sqlite3_busy_handler */
+    d[1].data = (void *)STORE_PATH;   /* sqlite3_db_filename */
+
+    will_return(__wrap_sqlite3_busy_handler, &d[0]);
+    will_return(__wrap_sqlite3_db_filename,  &d[1]);
+}
+
+static void test_db_configure_defaults(void **state) {
+    UNUSED(state);
+
+    will_return_data open[2];
+    will_return_data journal[4];
+    will_return_open(open);
+    will_return_journal_mode(journal, "delete");
+
+    /* keeps the journal mode of the store and sqlite's synchronous */
+    CK_RV rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_OK);
+    assert_string_equal(prepared_sql, "PRAGMA journal_mode;");
+    assert_non_null(busy_handler);
+}
+
+static void test_db_configure_wal(void **state) {
+    UNUSED(state);
+
+    setenv("TPM2_PKCS11_STORE_JOURNAL", "WAL", 1);
+
+    will_return_data open[2];
+    will_return_data journal[4];
+    will_return_data sync[3];
+    will_return_open(open);
+    will_return_journal_mode(journal, "wal");
+    will_return_pragma(sync);
+
+    /* WAL mode is safe with synchronous=normal, so it is the default */
+    CK_RV rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_OK);
+    assert_string_equal(prepared_sql,
+            "PRAGMA journal_mode=WAL;PRAGMA synchronous=normal;");
+}
+
+static void test_db_configure_sync(void **state) {
+    UNUSED(state);
+
+    static const char *syncs[] = { "normal", "FULL", "extra" };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(syncs); i++) {
+        prepared_sql[0] = '\0';
+        setenv("TPM2_PKCS11_STORE_SYNC", syncs[i], 1);
+
+        will_return_data open[2];
+        will_return_data journal[4];
+        will_return_data sync[3];
+        will_return_open(open);
+        will_return_journal_mode(journal, "delete");
+        will_return_pragma(sync);
+
+        CK_RV rv = db_configure(BAD_PTR);
+        assert_int_equal(rv, CKR_OK);
+
+        char expected[64];
+        snprintf(expected, sizeof(expected),
+                "PRAGMA journal_mode;PRAGMA synchronous=%s;", syncs[i]);
+        assert_string_equal(prepared_sql, expected);
+    }
+}
+
+static void test_db_configure_journal_not_applied(void **state) {
+    UNUSED(state);
+
+    setenv("TPM2_PKCS11_STORE_JOURNAL", "wal", 1);
+
+    will_return_data open[2];
+    will_return_data journal[4];
+    will_return_open(open);
+
+    /* sqlite reports the mode in effect, it keeps the old one if it can't switch */
+    will_return_journal_mode(journal, "delete");
+
+    CK_RV rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+}
+
+static void test_db_configure_in_memory_ignores_journal(void **state) {
+    UNUSED(state);
+
+    setenv("TPM2_PKCS11_STORE_JOURNAL", "wal", 1);
+
+    will_return_data open[2] = {
+        { .rc = SQLITE_OK   }, /* sqlite3_busy_handler */
+        { .data = ""        }, /* sqlite3_db_filename */
+    };
+    will_return(__wrap_sqlite3_busy_handler, &open[0]);
+    will_return(__wrap_sqlite3_db_filename,  &open[1]);
+
+    will_return_data journal[4];
+    will_return_journal_mode(journal, "memory");
+
+    CK_RV rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_OK);
+    assert_string_equal(prepared_sql, "PRAGMA journal_mode;");
+}
+
+static void test_db_configure_bad_journal(void **state) {
+    UNUSED(state);
+
+    /* off and memory can lose the store, the rest is not a mode */
+    static const char *bad[] = {
+        "off",
+        "memory",
+        "",
+        "wals",
+        "wal; PRAGMA synchronous=off",
+        "wal\n",
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(bad); i++) {
+        setenv("TPM2_PKCS11_STORE_JOURNAL", bad[i], 1);
+
+        will_return_data open[2];
+        will_return_open(open);
+
+        CK_RV rv = db_configure(BAD_PTR);
+        assert_int_equal(rv, CKR_GENERAL_ERROR);
+
+        /* rejected before it gets near a statement */
+        assert_string_equal(prepared_sql, "");
+    }
+}
+
+static void test_db_configure_bad_sync(void **state) {
+    UNUSED(state);
+
+    static const char *bad[] = {
+        "off",
+        "0",
+        "",
+        "normal; DROP TABLE tokens",
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(bad); i++) {
+        prepared_sql[0] = '\0';
+        setenv("TPM2_PKCS11_STORE_SYNC", bad[i], 1);
+
+        will_return_data open[2];
+        will_return_data journal[4];
+        will_return_open(open);
+        will_return_journal_mode(journal, "wal");
+
+        CK_RV rv = db_configure(BAD_PTR);
+        assert_int_equal(rv, CKR_GENERAL_ERROR);
+        assert_string_equal(prepared_sql, "PRAGMA journal_mode;");
+    }
+}
+
+static void test_db_configure_bad_busy_timeout(void **state) {
+    UNUSED(state);
+
+    static const char *bad[] = {
+        "",
+        "-1",
+        "abc",
+        "10ms",
+        "4294967296",
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(bad); i++) {
+        setenv("TPM2_PKCS11_STORE_BUSY_TIMEOUT", bad[i], 1);
+
+        /* fails before touching the connection */
+        CK_RV rv = db_configure(BAD_PTR);
+        assert_int_equal(rv, CKR_GENERAL_ERROR);
+        assert_null(busy_handler);
+    }
+}
+
+static void test_db_configure_busy_handler(void **state) {
+    UNUSED(state);
+
+    setenv("TPM2_PKCS11_STORE_BUSY_TIMEOUT", "3", 1);
+
+    will_return_data open[2];
+    will_return_data journal[4];
+    will_return_open(open);
+    will_return_journal_mode(journal, "delete");
+
+    CK_RV rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_OK);
+    assert_non_null(busy_handler);
+
+    /* sleeps 1 then 2 ms, then the 3 ms are used up */
+    assert_int_equal(busy_handler(busy_handler_arg, 0), 1);
+    assert_int_equal(busy_handler(busy_handler_arg, 1), 1);
+    assert_int_equal(busy_handler(busy_handler_arg, 2), 0);
+
+    /* the backoff stops doubling, a long wait still ends */
+    assert_int_equal(busy_handler(busy_handler_arg, 1000), 0);
+
+    /* 0 doesn't wait at all */
+    setenv("TPM2_PKCS11_STORE_BUSY_TIMEOUT", "0", 1);
+    will_return_open(open);
+    will_return_journal_mode(journal, "delete");
+
+    rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(busy_handler(busy_handler_arg, 0), 0);
+}
+
+static void test_db_configure_busy_handler_fail(void **state) {
+    UNUSED(state);
+
+    will_return_data d = { .rc = SQLITE_MISUSE };
+    will_return(__wrap_sqlite3_busy_handler, &d);
+
+    CK_RV rv = db_configure(BAD_PTR);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+    assert_string_equal(prepared_sql, "");
+}
+
+static int db_immutable_setup(void **state) {
+    UNUSED(state);
+
+    prepared_sql[0] = '\0';
+    opened_uri[0] = '\0';
+    opened_flags = 0;
+
+    return 0;
+}
+
+static void will_return_open_immutable(will_return_data d[4]) {
+
+    d[0].rc = SQLITE_OK;      /* sqlite3_open_v2 */
+    d[1].rc = SQLITE_OK;      /* sqlite3_prepare_v2 (PRAGMA temp_store) */
+    d[2].rc = SQLITE_DONE;    /* sqlite3_step */
+    d[3].rc = SQLITE_OK;      /* sqlite3_finalize */
+
+    will_return(__wrap_sqlite3_open_v2,    &d[0]);
+    will_return(__wrap_sqlite3_prepare_v2, &d[1]);
+    will_return(__wrap_sqlite3_step,       &d[2]);
+    will_return(__wrap_sqlite3_finalize,   &d[3]);
+}
+
+static void test_db_open_immutable_uri(void **state) {
+    UNUSED(state);
+
+    static const struct {
+        const char *path;
+        const char *uri;
+    } tests[] = {
+        { "/tmp/tpm2_pkcs11.sqlite3",
+          "file:///tmp/tpm2_pkcs11.sqlite3?immutable=1" },
+        /* would end the path or start an escape */
+        { "/a%b/c?d/e#f/tpm2_pkcs11.sqlite3",
+          "file:///a%25b/c%3Fd/e%23f/tpm2_pkcs11.sqlite3?immutable=1" },
+        /* not a host */
+        { "//tpm2_pkcs11.sqlite3",
+          "file:////tpm2_pkcs11.sqlite3?immutable=1" },
+        { "store/tpm2_pkcs11.sqlite3",
+          "file:store/tpm2_pkcs11.sqlite3?immutable=1" },
+    };
+
+    size_t i;
+    for (i = 0; i < ARRAY_LEN(tests); i++) {
+        prepared_sql[0] = '\0';
+
+        will_return_data d[4];
+        will_return_open_immutable(d);
+
+        sqlite3 *db = NULL;
+        CK_RV rv = db_open_immutable(tests[i].path, &db);
+        assert_int_equal(rv, CKR_OK);
+        assert_ptr_equal(db, BAD_PTR);
+
+        assert_string_equal(opened_uri, tests[i].uri);
+        assert_int_equal(opened_flags, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI);
+
+        /* nothing spills to a temporary file next to the store */
+        assert_string_equal(prepared_sql, "PRAGMA temp_store=MEMORY;");
+    }
+}
+
+static void test_db_open_immutable_longest_path(void **state) {
+    UNUSED(state);
+
+    /* the longest path there is, all of it escaped */
+    char path[PATH_MAX];
+    memset(path, '%', sizeof(path) - 1);
+    path[0] = '/';
+    path[sizeof(path) - 1] = '\0';
+
+    will_return_data d[4];
+    will_return_open_immutable(d);
+
+    sqlite3 *db = NULL;
+    CK_RV rv = db_open_immutable(path, &db);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(strlen(opened_uri),
+            strlen("file://") + 1 + 3 * (PATH_MAX - 2) + strlen("?immutable=1"));
+}
+
+static void test_db_open_immutable_path_too_long(void **state) {
+    UNUSED(state);
+
+    /* the store lookup never gives more than PATH_MAX, but it mustn't overflow */
+    size_t len = 2 * PATH_MAX;
+    char *path = malloc(len + 1);
+    assert_non_null(path);
+    memset(path, '#', len);
+    path[len] = '\0';
+
+    sqlite3 *db = BAD_PTR;
+    CK_RV rv = db_open_immutable(path, &db);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+
+    /* never opened */
+    assert_string_equal(opened_uri, "");
+
+    free(path);
+}
+
+static void test_db_open_immutable_open_fail(void **state) {
+    UNUSED(state);
+
+    will_return_data d = { .rc = SQLITE_CANTOPEN };
+    will_return(__wrap_sqlite3_open_v2, &d);
+
+    sqlite3 *db = NULL;
+    CK_RV rv = db_open_immutable("/nonexistent/tpm2_pkcs11.sqlite3", &db);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+    assert_null(db);
+    assert_string_equal(prepared_sql, "");
+}
+
+static void test_db_immutable_rejects_writes(void **state) {
+    UNUSED(state);
+
+    setenv("TPM2_PKCS11_STORE_IMMUTABLE", "1", 1);
+
+    will_return_data d[] = {
+        { .call_real = true }, /* calloc (db mutex) */
+        { .rv = CKR_OK      }, /* db_new */
+    };
+    will_return_always(__wrap_calloc, &d[0]);
+    will_return(db_new,               &d[1]);
+
+    CK_RV rv = db_init();
+    unsetenv("TPM2_PKCS11_STORE_IMMUTABLE");
+    assert_int_equal(rv, CKR_OK);
+    assert_true(db_is_immutable());
+
+    token tok = { .id = 1, .config = { .is_initialized = true } };
+    tobject tobj = { .id = 1 };
+    pobject pobj = { 0 };
+    unsigned pid = 0;
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    /* refused up front, nothing is prepared or queued */
+    rv = db_add_new_object(&tok, &tobj);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+    rv = db_update_tobject_attrs(tobj.id, attrs);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+    rv = db_delete_object(&tobj);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+    rv = db_add_primary(&pobj, &pid);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+    rv = db_add_token(&tok);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+    rv = db_update_token_config(&tok);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+    rv = db_update_for_pinchange(&tok, false, NULL, NULL, NULL);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    assert_string_equal(prepared_sql, "");
+
+    attr_list_free(attrs);
+
+    rv = db_destroy();
+    assert_int_equal(rv, CKR_OK);
+}
+
 static void test_db_get_lock_path(void **state) {
     UNUSED(state);
 
@@ -2893,14 +3447,11 @@ int main(int argc, char* argv[]) {
 			db_tobject_new_tobject_sqlite3_column_unknown_fail,
 			tobject_setup),
 		cmocka_unit_test_setup(
-			db_tobject_new_tobject_sqlite3_column_text_fail,
+			db_tobject_new_tobject_sqlite3_column_blob_fail,
 			tobject_setup),
 		cmocka_unit_test_setup(
 			db_tobject_new_tobject_sqlite3_attrs_text_fail,
 			tobject_setup),
-		cmocka_unit_test_setup(
-			db_tobject_new_tobject_object_init_from_attrs_fail,
-			tobject_setup),
 		cmocka_unit_test(init_tobjects_db_tobject_new_fail),
 		cmocka_unit_test(init_pobject_v3_from_stmt_sqlite3_column_text_fail),
 		cmocka_unit_test(init_pobject_v3_from_stmt_strdup_fail),
@@ -2932,14 +3483,14 @@ int main(int argc, char* argv[]) {
                 test_db_get_tokens_setup),
         cmocka_unit_test_setup(test_db_get_tokens_token_overcount_fail,
                 test_db_get_tokens_setup),
-        cmocka_unit_test_setup(test_db_get_tokens_token_min_init_fail,
-                test_db_get_tokens_setup),
-        cmocka_unit_test_setup(test_db_get_tokens_init_pobjects_fail,
-                test_db_get_tokens_setup),
-        cmocka_unit_test_setup(test_db_get_tokens_init_seal_objects_fail,
-                test_db_get_tokens_setup),
-        cmocka_unit_test_setup(test_db_get_tokens_init_tobjects_fail,
+        cmocka_unit_test_setup(test_db_get_tokens_token_slot_init_fail,
                 test_db_get_tokens_setup),
+        cmocka_unit_test(test_db_load_token_init_pobject_fail),
+        cmocka_unit_test(test_db_load_token_uninitialized),
+        cmocka_unit_test(test_db_load_token_start_fail),
+        cmocka_unit_test(test_db_load_token_init_seal_objects_fail),
+        cmocka_unit_test(test_db_load_token_init_tobjects_fail),
+        cmocka_unit_test(test_db_load_token),
         cmocka_unit_test_setup(test_db_get_tokens_config_fail,
                 test_db_get_tokens_setup),
         cmocka_unit_test_setup(test_db_get_tokens_parse_token_config_from_string_fail,
@@ -2955,7 +3506,7 @@ int main(int argc, char* argv[]) {
         cmocka_unit_test(test_db_update_for_pinchange_sqlite3_step_fail),
         cmocka_unit_test(test_db_update_for_pinchange_sqlite3_finalize_fail),
         cmocka_unit_test(test_db_update_for_pinchange_commit_fail),
-        cmocka_unit_test(test_db_add_new_object_emit_attributes_to_string_fail),
+        cmocka_unit_test(test_db_add_new_object_attr_tlv_encode_fail),
         cmocka_unit_test(test_db_add_new_object_sqlite3_prepare_v2_fail),
         cmocka_unit_test(test_db_add_new_object_sqlite_step_fail),
         cmocka_unit_test(test_db_add_new_object_sqlite3_last_insert_rowid_fail),
@@ -2973,9 +3524,9 @@ int main(int argc, char* argv[]) {
         cmocka_unit_test(test_db_update_token_sqlite3_prepare_v2_fail),
         cmocka_unit_test(test_db_update_token_sqlite3_bind_text_fail),
         cmocka_unit_test(test_db_update_token_sqlite3_bind_int_fail),
-        cmocka_unit_test(test_db_update_tobject_attrs_emit_attributes_to_string_fail),
+        cmocka_unit_test(test_db_update_tobject_attrs_attr_tlv_encode_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_prepare_v2_fail),
-        cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_bind_text_fail),
+        cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_bind_blob_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_bind_int_fail),
         cmocka_unit_test(test_db_update_tobject_attrs_sqlite3_step_fail),
         cmocka_unit_test(test_db_add_token_emit_config_to_string_fail),
@@ -2994,6 +3545,36 @@ int main(int argc, char* argv[]) {
         cmocka_unit_test(test_db_add_token_sqlite3_bind_blob_2_fail),
         cmocka_unit_test(test_db_add_token_sqlite3_step_2_fail),
         cmocka_unit_test(test_db_get_lock_path),
+        cmocka_unit_test_setup_teardown(test_db_configure_defaults,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_wal,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_sync,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_journal_not_applied,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_in_memory_ignores_journal,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_bad_journal,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_bad_sync,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_bad_busy_timeout,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_busy_handler,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup_teardown(test_db_configure_busy_handler_fail,
+                db_configure_setup, db_configure_teardown),
+        cmocka_unit_test_setup(test_db_open_immutable_uri,
+                db_immutable_setup),
+        cmocka_unit_test_setup(test_db_open_immutable_longest_path,
+                db_immutable_setup),
+        cmocka_unit_test_setup(test_db_open_immutable_path_too_long,
+                db_immutable_setup),
+        cmocka_unit_test_setup(test_db_open_immutable_open_fail,
+                db_immutable_setup),
+        cmocka_unit_test_setup(test_db_immutable_rejects_writes,
+                db_immutable_setup),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <openssl/rsa.h>
+
+#include "attrs.h"
+#include "encrypt.h"
+#include "object.h"
+#include "session_ctx.h"
+#include "token.h"
+#include "tpm.h"
+#include "utils.h"
+
+#define FAKE_SESSION ((session_ctx *)0xBADCC0DE)
+#define FAKE_TOKEN   ((token *)0xDEADBEEF)
+#define FAKE_TPM     ((tpm_ctx *)0xCAFEF00D)
+
+/*
+ * The session state the wrappers below stand in for: the active operation,
+ * its object and what is locked right now.
+ */
+static struct {
+    encrypt_op_data *opdata;
+    tobject *tobj;
+    unsigned token_locks;
+    unsigned tpm_locks;
+    unsigned tpm_lock_calls;
+    unsigned token_lock_calls;
+    unsigned decrements;
+} session;
+
+CK_RV __wrap__session_ctx_opdata_get(session_ctx *ctx, operation op, void **data) {
+    UNUSED(op);
+
+    assert_ptr_equal(ctx, FAKE_SESSION);
+
+    if (!session.opdata) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    *data = session.opdata;
+    return CKR_OK;
+}
+
+token *__wrap_session_ctx_get_token(session_ctx *ctx) {
+    assert_ptr_equal(ctx, FAKE_SESSION);
+    return FAKE_TOKEN;
+}
+
+void __wrap_token_lock_shared(token *t) {
+    assert_ptr_equal(t, FAKE_TOKEN);
+    session.token_locks++;
+    session.token_lock_calls++;
+}
+
+void __wrap_token_unlock(token *t) {
+    assert_ptr_equal(t, FAKE_TOKEN);
+    assert_int_equal(session.token_locks, 1);
+    session.token_locks--;
+}
+
+tpm_ctx *__wrap_session_ctx_lock_tpm(session_ctx *ctx) {
+    assert_ptr_equal(ctx, FAKE_SESSION);
+    session.tpm_locks++;
+    session.tpm_lock_calls++;
+    return FAKE_TPM;
+}
+
+void __wrap_session_ctx_unlock_tpm(session_ctx *ctx, tpm_ctx *tpm) {
+    assert_ptr_equal(ctx, FAKE_SESSION);
+    assert_ptr_equal(tpm, FAKE_TPM);
+    assert_int_equal(session.tpm_locks, 1);
+    session.tpm_locks--;
+}
+
+CK_RV __wrap_session_ctx_tobject_authenticated(session_ctx *ctx) {
+    assert_ptr_equal(ctx, FAKE_SESSION);
+    return CKR_OK;
+}
+
+tobject *__wrap_session_ctx_opdata_get_tobject(session_ctx *ctx) {
+    assert_ptr_equal(ctx, FAKE_SESSION);
+    return session.tobj;
+}
+
+void __wrap_session_ctx_opdata_clear(session_ctx *ctx) {
+    assert_ptr_equal(ctx, FAKE_SESSION);
+    assert_non_null(session.opdata);
+    encrypt_op_data_free(&session.opdata);
+}
+
+CK_RV __wrap__tobject_user_decrement(tobject *tobj, const char *filename, int lineno) {
+    UNUSED(filename);
+    UNUSED(lineno);
+
+    assert_ptr_equal(tobj, session.tobj);
+    session.decrements++;
+    return CKR_OK;
+}
+
+/* a TPM operation with the TPM held, returns the mocked rv */
+CK_RV __wrap_tpm_encrypt(crypto_op_data *opdata, CK_OBJECT_CLASS clazz,
+        CK_BYTE_PTR ptext, CK_ULONG ptextlen,
+        CK_BYTE_PTR ctext, CK_ULONG_PTR ctextlen) {
+    UNUSED(opdata);
+    UNUSED(clazz);
+    UNUSED(ptext);
+    UNUSED(ptextlen);
+    UNUSED(ctext);
+    UNUSED(ctextlen);
+
+    assert_int_equal(session.tpm_locks, 1);
+    return mock_type(CK_RV);
+}
+
+/* the software key is a copy, encrypting with it holds no locks */
+int __real_RSA_public_encrypt(int flen, const unsigned char *from,
+        unsigned char *to, RSA *rsa, int padding);
+
+int __wrap_RSA_public_encrypt(int flen, const unsigned char *from,
+        unsigned char *to, RSA *rsa, int padding) {
+
+    assert_int_equal(session.token_locks, 0);
+    assert_int_equal(session.tpm_locks, 0);
+    return __real_RSA_public_encrypt(flen, from, to, rsa, padding);
+}
+
+static int test_setup(void **state) {
+    UNUSED(state);
+
+    memset(&session, 0, sizeof(session));
+
+    tobject *tobj = calloc(1, sizeof(*tobj));
+    assert_non_null(tobj);
+
+    /* any odd modulus will do for a public key operation */
+    CK_BYTE modulus[256];
+    memset(modulus, 0xFF, sizeof(modulus));
+    CK_BYTE exponent[] = { 0x01, 0x00, 0x01 };
+
+    tobj->attrs = attr_list_new();
+    assert_non_null(tobj->attrs);
+    bool r = attr_list_add_int(tobj->attrs, CKA_CLASS, CKO_PUBLIC_KEY);
+    assert_true(r);
+    r = attr_list_add_buf(tobj->attrs, CKA_MODULUS, modulus, sizeof(modulus));
+    assert_true(r);
+    r = attr_list_add_buf(tobj->attrs, CKA_PUBLIC_EXPONENT, exponent, sizeof(exponent));
+    assert_true(r);
+
+    tobj->is_authenticated = true;
+    session.tobj = tobj;
+
+    return 0;
+}
+
+static int test_teardown(void **state) {
+    UNUSED(state);
+
+    if (session.opdata) {
+        encrypt_op_data_free(&session.opdata);
+    }
+
+    attr_list_free(session.tobj->attrs);
+    free(session.tobj);
+    session.tobj = NULL;
+
+    return 0;
+}
+
+static void start_sw_op(void) {
+
+    encrypt_op_data *opdata = encrypt_op_data_new(session.tobj);
+    assert_non_null(opdata);
+
+    CK_MECHANISM mech = { .mechanism = CKM_RSA_PKCS };
+    CK_RV rv = sw_encrypt_data_init(&mech, session.tobj,
+            &opdata->cryptopdata.sw_enc_data);
+    assert_int_equal(rv, CKR_OK);
+    opdata->use_sw = true;
+
+    session.opdata = opdata;
+}
+
+static void start_tpm_op(void) {
+
+    encrypt_op_data *opdata = encrypt_op_data_new(session.tobj);
+    assert_non_null(opdata);
+
+    session.opdata = opdata;
+}
+
+static void test_encrypt_sw_key_skips_tpm_lock(void **state) {
+    UNUSED(state);
+
+    start_sw_op();
+
+    CK_BYTE ptext[] = "plaintext";
+    CK_BYTE ctext[256];
+    CK_ULONG ctext_len = sizeof(ctext);
+
+    CK_RV rv = encrypt_update(FAKE_SESSION, ptext, sizeof(ptext),
+            ctext, &ctext_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(ctext_len, sizeof(ctext));
+
+    /* only the token is locked, and only to check the object */
+    assert_int_equal(session.tpm_lock_calls, 0);
+    assert_int_equal(session.token_lock_calls, 1);
+    assert_int_equal(session.token_locks, 0);
+}
+
+static void test_encrypt_cancel_leaves_session_usable(void **state) {
+    UNUSED(state);
+
+    start_tpm_op();
+
+    will_return(__wrap_tpm_encrypt, CKR_FUNCTION_CANCELED);
+
+    CK_BYTE ptext[] = "plaintext";
+    CK_BYTE ctext[256];
+    CK_ULONG ctext_len = sizeof(ctext);
+
+    CK_RV rv = encrypt_update(FAKE_SESSION, ptext, sizeof(ptext),
+            ctext, &ctext_len);
+    assert_int_equal(rv, CKR_FUNCTION_CANCELED);
+
+    /* the operation is over and nothing is left locked */
+    assert_int_equal(session.tpm_lock_calls, 1);
+    assert_int_equal(session.tpm_locks, 0);
+    assert_int_equal(session.token_locks, 0);
+    assert_null(session.opdata);
+    assert_int_equal(session.decrements, 1);
+    assert_false(session.tobj->is_authenticated);
+
+    /* so continuing it fails without touching the locks */
+    ctext_len = sizeof(ctext);
+    rv = encrypt_update(FAKE_SESSION, ptext, sizeof(ptext),
+            ctext, &ctext_len);
+    assert_int_equal(rv, CKR_OPERATION_NOT_INITIALIZED);
+    assert_int_equal(session.tpm_lock_calls, 1);
+    assert_int_equal(session.token_lock_calls, 0);
+
+    /* and the session can start another one */
+    start_sw_op();
+
+    ctext_len = sizeof(ctext);
+    rv = encrypt_update(FAKE_SESSION, ptext, sizeof(ptext),
+            ctext, &ctext_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(ctext_len, sizeof(ctext));
+    assert_int_equal(session.tpm_locks, 0);
+    assert_int_equal(session.token_locks, 0);
+}
+
+int main(int argc, char* argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_encrypt_sw_key_skips_tpm_lock,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_encrypt_cancel_leaves_session_usable,
+                test_setup, test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -11,8 +11,12 @@
 
 #include <cmocka.h>
 
+#include "attr_tlv.h"
 #include "attrs.h"
+#include "emitter.h"
 #include "parser.h"
+#include "twist.h"
+#include "typed_memory.h"
 
 /* yaml file processed with xxd -i */
 static const unsigned char _attrs_yaml[] = {
@@ -98,6 +102,144 @@ static void test_attr_parser_good(void **state) {
     attr_list_free(attrs);
 }
 
+static void assert_attrs_equal(attr_list *a, attr_list *b) {
+
+    CK_ULONG count = attr_list_get_count(a);
+    assert_int_equal(count, attr_list_get_count(b));
+
+    CK_ATTRIBUTE_PTR x = attr_list_get_ptr(a);
+    CK_ATTRIBUTE_PTR y = attr_list_get_ptr(b);
+
+    CK_ULONG i;
+    for (i = 0; i < count; i++) {
+        assert_int_equal(x[i].type, y[i].type);
+        assert_int_equal(x[i].ulValueLen, y[i].ulValueLen);
+        assert_int_equal(type_from_ptr(x[i].pValue, x[i].ulValueLen),
+                type_from_ptr(y[i].pValue, y[i].ulValueLen));
+        if (x[i].ulValueLen) {
+            assert_memory_equal(x[i].pValue, y[i].pValue, x[i].ulValueLen);
+        }
+    }
+}
+
+static void test_attr_tlv_round_trip(void **state) {
+    (void) state;
+
+    attr_list *attrs = NULL;
+    bool res = parse_attributes_from_string(_attrs_yaml, _attrs_yaml_len,
+            &attrs);
+    assert_true(res);
+
+    /* has ints, bools, an empty string, hex strings and an int sequence */
+    assert_false(attr_tlv_is_tlv(_attrs_yaml, _attrs_yaml_len));
+
+    twist tlv = attr_tlv_encode(attrs);
+    assert_non_null(tlv);
+    assert_true(attr_tlv_is_tlv((const unsigned char *)tlv, twist_len(tlv)));
+
+    attr_list *decoded = NULL;
+    CK_RV rv = attr_tlv_decode((const unsigned char *)tlv, twist_len(tlv),
+            NULL, 0, &decoded);
+    assert_int_equal(rv, CKR_OK);
+    assert_attrs_equal(attrs, decoded);
+    attr_list_free(decoded);
+
+    /* a subset skips the rest */
+    CK_ATTRIBUTE_TYPE keep[] = { CKA_CLASS, CKA_ID, CKA_ALLOWED_MECHANISMS };
+    rv = attr_tlv_decode((const unsigned char *)tlv, twist_len(tlv),
+            keep, ARRAY_LEN(keep), &decoded);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(attr_list_get_count(decoded), ARRAY_LEN(keep));
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(decoded, CKA_ALLOWED_MECHANISMS);
+    assert_non_null(a);
+    CK_ATTRIBUTE_PTR b = attr_get_attribute_by_type(attrs, CKA_ALLOWED_MECHANISMS);
+    assert_int_equal(a->ulValueLen, b->ulValueLen);
+    assert_memory_equal(a->pValue, b->pValue, a->ulValueLen);
+    attr_list_free(decoded);
+
+    twist_free(tlv);
+    attr_list_free(attrs);
+}
+
+static void test_attr_tlv_bad(void **state) {
+    (void) state;
+
+    attr_list *attrs = NULL;
+    bool res = parse_attributes_from_string(_attrs_yaml, _attrs_yaml_len,
+            &attrs);
+    assert_true(res);
+
+    twist tlv = attr_tlv_encode(attrs);
+    assert_non_null(tlv);
+    attr_list_free(attrs);
+
+    size_t len = twist_len(tlv);
+    unsigned char *buf = malloc(len);
+    assert_non_null(buf);
+    memcpy(buf, tlv, len);
+    twist_free(tlv);
+
+    /* cut in the middle of the last value */
+    attr_list *decoded = NULL;
+    CK_RV rv = attr_tlv_decode(buf, len - 1, NULL, 0, &decoded);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+
+    /* a version from the future is not guessed at */
+    buf[4]++;
+    assert_true(attr_tlv_is_tlv(buf, len));
+    rv = attr_tlv_decode(buf, len, NULL, 0, &decoded);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+
+    free(buf);
+}
+
+static void test_attr_tlv_smaller_than_yaml(void **state) {
+    (void) state;
+
+    /* a certificate sized object */
+    CK_BYTE value[1500];
+    size_t i;
+    for (i = 0; i < sizeof(value); i++) {
+        value[i] = (CK_BYTE)i;
+    }
+
+    attr_list *attrs = NULL;
+    bool res = parse_attributes_from_string(_attrs_yaml, _attrs_yaml_len,
+            &attrs);
+    assert_true(res);
+    res = attr_list_add_buf(attrs, CKA_VALUE, value, sizeof(value));
+    assert_true(res);
+
+    char *yaml = emit_attributes_to_string(attrs);
+    assert_non_null(yaml);
+    twist tlv = attr_tlv_encode(attrs);
+    assert_non_null(tlv);
+
+    /* the same attributes in less than half the space */
+    size_t yaml_len = strlen(yaml);
+    size_t tlv_len = twist_len(tlv);
+    assert_true(tlv_len * 2 < yaml_len);
+
+    attr_list *from_yaml = NULL;
+    res = parse_attributes_from_string((const unsigned char *)yaml,
+            yaml_len, &from_yaml);
+    assert_true(res);
+    assert_attrs_equal(attrs, from_yaml);
+    attr_list_free(from_yaml);
+
+    attr_list *from_tlv = NULL;
+    CK_RV rv = attr_tlv_decode((const unsigned char *)tlv, tlv_len,
+            NULL, 0, &from_tlv);
+    assert_int_equal(rv, CKR_OK);
+    assert_attrs_equal(attrs, from_tlv);
+    attr_list_free(from_tlv);
+
+    free(yaml);
+    twist_free(tlv);
+    attr_list_free(attrs);
+}
+
 static const unsigned char _config_yaml[] = {
   0x21, 0x21, 0x6d, 0x61, 0x70, 0x20, 0x7b, 0x0a, 0x20, 0x20, 0x3f, 0x20,
   0x21, 0x21, 0x73, 0x74, 0x72, 0x20, 0x22, 0x74, 0x6f, 0x6b, 0x65, 0x6e,
@@ -277,6 +419,9 @@ int main(int argc, char* argv[]) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_config_parser_empty_seq),
         cmocka_unit_test(test_attr_parser_good),
+        cmocka_unit_test(test_attr_tlv_round_trip),
+        cmocka_unit_test(test_attr_tlv_bad),
+        cmocka_unit_test(test_attr_tlv_smaller_than_yaml),
         cmocka_unit_test(test_config_parser_good),
         cmocka_unit_test(test_token_config_parser_no_tags),
         cmocka_unit_test(test_token_config_parser_missing_tags),
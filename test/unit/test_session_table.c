@@ -0,0 +1,370 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "mutex.h"
+#include "session.h"
+#include "session_ctx.h"
+#include "session_table.h"
+#include "token.h"
+
+#define CHURN_ITERATIONS 200000
+#define CHURN_THREADS    8
+
+typedef struct test_state test_state;
+struct test_state {
+    token tok;
+};
+
+static int setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    CK_RV rv = rwlock_create(&s->tok.rwlock);
+    assert_int_equal(rv, CKR_OK);
+
+    *state = s;
+
+    return 0;
+}
+
+static int teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    CK_RV rv = session_table_free_ctx_all(&s->tok);
+    assert_int_equal(rv, CKR_OK);
+
+    session_table_free(s->tok.s_table);
+    rwlock_destroy(s->tok.rwlock);
+    free(s);
+
+    return 0;
+}
+
+static void open_session(token *tok, CK_SESSION_HANDLE *handle) {
+
+    CK_RV rv = session_table_new_entry(tok->s_table, handle, tok,
+            CKF_SERIAL_SESSION | CKF_RW_SESSION);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_not_equal(*handle, 0);
+}
+
+static void test_session_table_stale_handle(void **state) {
+
+    test_state *s = (test_state *)*state;
+    token *tok = &s->tok;
+
+    CK_RV rv = session_table_new(&tok->s_table, 0);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_SESSION_HANDLE first;
+    open_session(tok, &first);
+
+    rv = session_table_free_ctx(tok, first);
+    assert_int_equal(rv, CKR_OK);
+
+    /* the slot gets reused, the handle must not */
+    CK_SESSION_HANDLE second;
+    open_session(tok, &second);
+    assert_int_not_equal(first, second);
+
+    session_ctx *ctx = session_table_lookup(tok->s_table, first);
+    assert_null(ctx);
+
+    rv = session_table_free_ctx(tok, first);
+    assert_int_equal(rv, CKR_SESSION_HANDLE_INVALID);
+
+    ctx = session_table_lookup(tok->s_table, second);
+    assert_non_null(ctx);
+    session_table_put(tok->s_table, ctx);
+}
+
+static void test_session_table_limit(void **state) {
+
+    test_state *s = (test_state *)*state;
+    token *tok = &s->tok;
+
+    /* not a multiple of the chunk size */
+    CK_ULONG max = 300;
+
+    CK_RV rv = session_table_new(&tok->s_table, max);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(session_table_get_max(tok->s_table), max);
+
+    CK_SESSION_HANDLE *handles = calloc(max, sizeof(*handles));
+    assert_non_null(handles);
+
+    CK_ULONG i;
+    for (i = 0; i < max; i++) {
+        open_session(tok, &handles[i]);
+    }
+
+    CK_ULONG all = 0, rw = 0, ro = 0;
+    session_table_get_cnt(tok->s_table, &all, &rw, &ro);
+    assert_int_equal(all, max);
+    assert_int_equal(rw, max);
+    assert_int_equal(ro, 0);
+
+    CK_SESSION_HANDLE extra;
+    rv = session_table_new_entry(tok->s_table, &extra, tok,
+            CKF_SERIAL_SESSION);
+    assert_int_equal(rv, CKR_SESSION_COUNT);
+
+    /* closing one makes room for one */
+    rv = session_table_free_ctx(tok, handles[max / 2]);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = session_table_new_entry(tok->s_table, &handles[max / 2], tok,
+            CKF_SERIAL_SESSION);
+    assert_int_equal(rv, CKR_OK);
+
+    session_table_get_cnt(tok->s_table, &all, &rw, &ro);
+    assert_int_equal(all, max);
+    assert_int_equal(rw, max - 1);
+    assert_int_equal(ro, 1);
+
+    rv = session_table_free_ctx_all(tok);
+    assert_int_equal(rv, CKR_OK);
+
+    session_table_get_cnt(tok->s_table, &all, &rw, &ro);
+    assert_int_equal(all, 0);
+    assert_int_equal(rw, 0);
+    assert_int_equal(ro, 0);
+
+    free(handles);
+}
+
+static void test_session_table_churn(void **state) {
+
+    test_state *s = (test_state *)*state;
+    token *tok = &s->tok;
+
+    CK_RV rv = session_table_new(&tok->s_table, 0);
+    assert_int_equal(rv, CKR_OK);
+
+    /* keep a few open so closes never hit the last session logout */
+    CK_SESSION_HANDLE keep[3];
+    unsigned i;
+    for (i = 0; i < ARRAY_LEN(keep); i++) {
+        open_session(tok, &keep[i]);
+    }
+
+    CK_SESSION_HANDLE last = 0;
+    for (i = 0; i < CHURN_ITERATIONS; i++) {
+        CK_SESSION_HANDLE handle;
+        open_session(tok, &handle);
+        assert_int_not_equal(handle, last);
+
+        session_ctx *ctx = session_table_lookup(tok->s_table, handle);
+        assert_non_null(ctx);
+        session_table_put(tok->s_table, ctx);
+
+        rv = session_table_free_ctx(tok, handle);
+        assert_int_equal(rv, CKR_OK);
+
+        last = handle;
+    }
+
+    CK_ULONG all = 0;
+    session_table_get_cnt(tok->s_table, &all, NULL, NULL);
+    assert_int_equal(all, ARRAY_LEN(keep));
+}
+
+static void *churn_thread(void *arg) {
+
+    token *tok = (token *)arg;
+
+    unsigned i;
+    for (i = 0; i < CHURN_ITERATIONS / CHURN_THREADS; i++) {
+        CK_SESSION_HANDLE handle;
+        CK_RV rv = session_table_new_entry(tok->s_table, &handle, tok,
+                CKF_SERIAL_SESSION);
+        if (rv != CKR_OK) {
+            return (void *)(uintptr_t)rv;
+        }
+
+        session_ctx *ctx = session_table_lookup(tok->s_table, handle);
+        if (!ctx) {
+            return (void *)(uintptr_t)CKR_SESSION_HANDLE_INVALID;
+        }
+        session_table_put(tok->s_table, ctx);
+
+        rv = session_table_free_ctx(tok, handle);
+        if (rv != CKR_OK) {
+            return (void *)(uintptr_t)rv;
+        }
+
+        /* a closed handle stays dead */
+        ctx = session_table_lookup(tok->s_table, handle);
+        if (ctx) {
+            session_table_put(tok->s_table, ctx);
+            return (void *)(uintptr_t)CKR_GENERAL_ERROR;
+        }
+    }
+
+    return NULL;
+}
+
+static void test_session_table_concurrent_churn(void **state) {
+
+    test_state *s = (test_state *)*state;
+    token *tok = &s->tok;
+
+    /* small enough that threads fight over slots and the limit */
+    CK_RV rv = session_table_new(&tok->s_table, CHURN_THREADS);
+    assert_int_equal(rv, CKR_OK);
+
+    pthread_t threads[CHURN_THREADS];
+    unsigned i;
+    for (i = 0; i < ARRAY_LEN(threads); i++) {
+        int rc = pthread_create(&threads[i], NULL, churn_thread, tok);
+        assert_int_equal(rc, 0);
+    }
+
+    for (i = 0; i < ARRAY_LEN(threads); i++) {
+        void *result = NULL;
+        int rc = pthread_join(threads[i], &result);
+        assert_int_equal(rc, 0);
+        assert_int_equal((uintptr_t)result, CKR_OK);
+    }
+
+    CK_ULONG all = 1;
+    session_table_get_cnt(tok->s_table, &all, NULL, NULL);
+    assert_int_equal(all, 0);
+}
+
+/* one chunk, so every slot is needed to open the last session */
+#define LOOKUP_MAX_SESSIONS 256
+
+typedef struct lookup_state lookup_state;
+struct lookup_state {
+    token *tok;
+    CK_SESSION_HANDLE handles[CHURN_THREADS];
+    bool stop;
+};
+
+typedef struct churn_arg churn_arg;
+struct churn_arg {
+    lookup_state *ls;
+    unsigned i;
+};
+
+static void *lookup_churn_thread(void *arg) {
+
+    churn_arg *c = (churn_arg *)arg;
+    token *tok = c->ls->tok;
+
+    unsigned i;
+    for (i = 0; i < CHURN_ITERATIONS / CHURN_THREADS; i++) {
+        CK_SESSION_HANDLE handle;
+        CK_RV rv = session_table_new_entry(tok->s_table, &handle, tok,
+                CKF_SERIAL_SESSION);
+        if (rv != CKR_OK) {
+            return (void *)(uintptr_t)rv;
+        }
+
+        /* let the lookup threads race the close */
+        __atomic_store_n(&c->ls->handles[c->i], handle, __ATOMIC_RELEASE);
+
+        rv = session_table_free_ctx(tok, handle);
+        if (rv != CKR_OK) {
+            return (void *)(uintptr_t)rv;
+        }
+    }
+
+    return NULL;
+}
+
+static void *lookup_thread(void *arg) {
+
+    lookup_state *ls = (lookup_state *)arg;
+
+    unsigned i = 0;
+    while (!__atomic_load_n(&ls->stop, __ATOMIC_ACQUIRE)) {
+        CK_SESSION_HANDLE handle = __atomic_load_n(
+                &ls->handles[i++ % CHURN_THREADS], __ATOMIC_ACQUIRE);
+        session_ctx *ctx = session_table_lookup(ls->tok->s_table, handle);
+        if (ctx) {
+            session_table_put(ls->tok->s_table, ctx);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_session_table_lookup_during_close(void **state) {
+
+    test_state *s = (test_state *)*state;
+    token *tok = &s->tok;
+
+    CK_RV rv = session_table_new(&tok->s_table, LOOKUP_MAX_SESSIONS);
+    assert_int_equal(rv, CKR_OK);
+
+    lookup_state ls = { .tok = tok };
+
+    pthread_t lookups[2];
+    unsigned i;
+    for (i = 0; i < ARRAY_LEN(lookups); i++) {
+        int rc = pthread_create(&lookups[i], NULL, lookup_thread, &ls);
+        assert_int_equal(rc, 0);
+    }
+
+    pthread_t threads[CHURN_THREADS];
+    churn_arg args[CHURN_THREADS];
+    for (i = 0; i < ARRAY_LEN(threads); i++) {
+        args[i].ls = &ls;
+        args[i].i = i;
+        int rc = pthread_create(&threads[i], NULL, lookup_churn_thread, &args[i]);
+        assert_int_equal(rc, 0);
+    }
+
+    for (i = 0; i < ARRAY_LEN(threads); i++) {
+        void *result = NULL;
+        int rc = pthread_join(threads[i], &result);
+        assert_int_equal(rc, 0);
+        assert_int_equal((uintptr_t)result, CKR_OK);
+    }
+
+    __atomic_store_n(&ls.stop, true, __ATOMIC_RELEASE);
+    for (i = 0; i < ARRAY_LEN(lookups); i++) {
+        int rc = pthread_join(lookups[i], NULL);
+        assert_int_equal(rc, 0);
+    }
+
+    /* slots released by the lookups instead of the closers are back too */
+    for (i = 0; i < LOOKUP_MAX_SESSIONS; i++) {
+        CK_SESSION_HANDLE handle;
+        open_session(tok, &handle);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_session_table_stale_handle,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_session_table_limit,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_session_table_churn,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_session_table_concurrent_churn,
+                setup, teardown),
+        cmocka_unit_test_setup_teardown(test_session_table_lookup_during_close,
+                setup, teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,388 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "attr_index.h"
+#include "attrs.h"
+#include "object.h"
+#include "token.h"
+
+/* enough to span several chunks of the handle index, see test/unit/bench.c for timings */
+#define TEST_OBJECTS 1000
+#define TEST_BATCH   100
+#define TEST_CERTS   1000
+
+static void token_clear(token *tok) {
+
+    while (tok->tobjects.head) {
+        tobject *tobj = tok->tobjects.head;
+        token_rm_tobject(tok, tobj);
+        tobject_free(tobj);
+    }
+
+    free(tok->tobjects.index);
+    free(tok->tobjects.released);
+    attr_index_free(tok->tobjects.attr_index);
+}
+
+static tobject *add(token *tok) {
+
+    tobject *tobj = tobject_new();
+    assert_non_null(tobj);
+
+    /*
+     * already decoded, lookups don't go to the parser. CKA_TOKEN isn't in the
+     * attribute index, so only the handle table is exercised.
+     */
+    tobj->attrs = attr_list_new();
+    assert_non_null(tobj->attrs);
+
+    bool r = attr_list_add_bool(tobj->attrs, CKA_TOKEN, CK_TRUE);
+    assert_true(r);
+
+    CK_RV rv = token_add_tobject(tok, tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    return tobj;
+}
+
+static void test_token_handle_reuse(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    tobject *a = add(&tok);
+    tobject *b = add(&tok);
+    tobject *c = add(&tok);
+    assert_int_equal(a->obj_handle, 1);
+    assert_int_equal(b->obj_handle, 2);
+    assert_int_equal(c->obj_handle, 3);
+
+    token_rm_tobject(&tok, b);
+    tobject_free(b);
+
+    tobject *found = NULL;
+    CK_RV rv = token_find_tobject(&tok, 2, &found);
+    assert_int_equal(rv, CKR_KEY_HANDLE_INVALID);
+
+    /* a released handle is handed out again before a new one */
+    tobject *d = add(&tok);
+    assert_int_equal(d->obj_handle, 2);
+
+    rv = token_find_tobject(&tok, 2, &found);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(found, d);
+
+    tobject *e = add(&tok);
+    assert_int_equal(e->obj_handle, 4);
+
+    rv = token_find_tobject(&tok, 0, &found);
+    assert_int_equal(rv, CKR_KEY_HANDLE_INVALID);
+    rv = token_find_tobject(&tok, 5, &found);
+    assert_int_equal(rv, CKR_KEY_HANDLE_INVALID);
+
+    token_clear(&tok);
+}
+
+static void test_token_create_destroy(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    tobject **objs = calloc(TEST_OBJECTS, sizeof(*objs));
+    assert_non_null(objs);
+
+    size_t i;
+    for (i = 0; i < TEST_OBJECTS; i++) {
+        objs[i] = add(&tok);
+        assert_int_equal(objs[i]->obj_handle, i + 1);
+    }
+
+    /* punch holes in every other handle, then fill them again */
+    for (i = 0; i < TEST_OBJECTS; i += TEST_BATCH) {
+        size_t j;
+        for (j = i; j < i + TEST_BATCH; j += 2) {
+            CK_OBJECT_HANDLE handle = objs[j]->obj_handle;
+            token_rm_tobject(&tok, objs[j]);
+            tobject_free(objs[j]);
+            objs[j] = add(&tok);
+            assert_int_equal(objs[j]->obj_handle, handle);
+        }
+    }
+
+    /* no new handles were needed for the replacements */
+    assert_int_equal(tok.tobjects.last_handle, TEST_OBJECTS);
+
+    for (i = 0; i < TEST_OBJECTS; i++) {
+        tobject *found = NULL;
+        CK_RV rv = token_find_tobject(&tok, objs[i]->obj_handle, &found);
+        assert_int_equal(rv, CKR_OK);
+        assert_ptr_equal(found, objs[i]);
+    }
+
+    for (i = 0; i < TEST_OBJECTS; i++) {
+        token_rm_tobject(&tok, objs[i]);
+        tobject_free(objs[i]);
+    }
+
+    assert_null(tok.tobjects.head);
+    assert_null(tok.tobjects.tail);
+
+    token_clear(&tok);
+    free(objs);
+}
+
+static tobject *add_cert(token *tok, unsigned id) {
+
+    tobject *tobj = tobject_new();
+    assert_non_null(tobj);
+
+    tobj->attrs = attr_list_new();
+    assert_non_null(tobj->attrs);
+
+    bool r = attr_list_add_int(tobj->attrs, CKA_CLASS, CKO_CERTIFICATE);
+    assert_true(r);
+
+    r = attr_list_add_buf(tobj->attrs, CKA_ID, (CK_BYTE_PTR)&id, sizeof(id));
+    assert_true(r);
+
+    CK_RV rv = token_add_tobject(tok, tobj);
+    assert_int_equal(rv, CKR_OK);
+
+    return tobj;
+}
+
+static void test_token_attr_index(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    tobject **certs = calloc(TEST_CERTS, sizeof(*certs));
+    assert_non_null(certs);
+
+    unsigned i;
+    for (i = 0; i < TEST_CERTS; i++) {
+        certs[i] = add_cert(&tok, i);
+    }
+
+    CK_OBJECT_CLASS clazz = CKO_CERTIFICATE;
+    unsigned id = 0;
+    CK_ATTRIBUTE templ[] = {
+        { .type = CKA_CLASS, .pValue = &clazz, .ulValueLen = sizeof(clazz) },
+        { .type = CKA_ID,    .pValue = &id,    .ulValueLen = sizeof(id)    },
+        { .type = CKA_SIGN,  .pValue = NULL,   .ulValueLen = 0             },
+    };
+
+    /* the most selective indexed attribute wins */
+    tobject * const *objs = NULL;
+    size_t len = 0;
+    for (i = 0; i < TEST_CERTS; i++) {
+        id = i;
+        bool found = attr_index_lookup(tok.tobjects.attr_index, templ, 2,
+                &objs, &len);
+        assert_true(found);
+        assert_int_equal(len, 1);
+        assert_ptr_equal(objs[0], certs[i]);
+    }
+
+    bool found = attr_index_lookup(tok.tobjects.attr_index, templ, 1,
+            &objs, &len);
+    assert_true(found);
+    assert_int_equal(len, TEST_CERTS);
+
+    /* not indexed, the caller has to scan */
+    found = attr_index_lookup(tok.tobjects.attr_index, &templ[2], 1,
+            &objs, &len);
+    assert_false(found);
+
+    /* removed objects leave the index */
+    id = 42;
+    token_rm_tobject(&tok, certs[id]);
+    tobject_free(certs[id]);
+
+    found = attr_index_lookup(tok.tobjects.attr_index, templ, 2,
+            &objs, &len);
+    assert_true(found);
+    assert_int_equal(len, 0);
+
+    /* re-indexing under new values */
+    attr_list *attrs = NULL;
+    CK_RV rv = attr_list_dup(certs[7]->attrs, &attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_ATTRIBUTE new_id = { .type = CKA_ID, .pValue = &id, .ulValueLen = sizeof(id) };
+    rv = attr_list_update_entry(attrs, &new_id);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = attr_index_add(tok.tobjects.attr_index, certs[7], attrs);
+    assert_int_equal(rv, CKR_OK);
+    attr_index_remove(tok.tobjects.attr_index, certs[7], certs[7]->attrs);
+    attr_list_free(certs[7]->attrs);
+    certs[7]->attrs = attrs;
+
+    found = attr_index_lookup(tok.tobjects.attr_index, templ, 2,
+            &objs, &len);
+    assert_true(found);
+    assert_int_equal(len, 1);
+    assert_ptr_equal(objs[0], certs[7]);
+
+    id = 7;
+    found = attr_index_lookup(tok.tobjects.attr_index, templ, 2,
+            &objs, &len);
+    assert_true(found);
+    assert_int_equal(len, 0);
+
+    token_clear(&tok);
+    free(certs);
+}
+
+static void test_token_attr_index_order(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    tobject *a = add_cert(&tok, 1);
+    tobject *b = add_cert(&tok, 2);
+    tobject *c = add_cert(&tok, 3);
+    assert_true(a->seq < b->seq);
+    assert_true(b->seq < c->seq);
+
+    /* a reused handle still goes after everything already there */
+    token_rm_tobject(&tok, b);
+    tobject_free(b);
+    b = add_cert(&tok, 2);
+    assert_int_equal(b->obj_handle, 2);
+    assert_true(b->seq > c->seq);
+
+    /* re-indexing doesn't move an object to the end */
+    attr_list *attrs = NULL;
+    CK_RV rv = attr_list_dup(a->attrs, &attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    unsigned id = 4;
+    CK_ATTRIBUTE new_id = { .type = CKA_ID, .pValue = &id, .ulValueLen = sizeof(id) };
+    rv = attr_list_update_entry(attrs, &new_id);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = attr_index_add(tok.tobjects.attr_index, a, attrs);
+    assert_int_equal(rv, CKR_OK);
+    attr_index_remove(tok.tobjects.attr_index, a, a->attrs);
+    attr_list_free(a->attrs);
+    a->attrs = attrs;
+
+    CK_OBJECT_CLASS clazz = CKO_CERTIFICATE;
+    CK_ATTRIBUTE templ = {
+        .type = CKA_CLASS, .pValue = &clazz, .ulValueLen = sizeof(clazz)
+    };
+
+    tobject * const *objs = NULL;
+    size_t len = 0;
+    bool found = attr_index_lookup(tok.tobjects.attr_index, &templ, 1,
+            &objs, &len);
+    assert_true(found);
+    assert_int_equal(len, 3);
+    assert_ptr_equal(objs[0], a);
+    assert_ptr_equal(objs[1], c);
+    assert_ptr_equal(objs[2], b);
+
+    token_clear(&tok);
+}
+
+static void test_token_replace_tobject(void **state) {
+    (void) state;
+
+    token tok = { 0 };
+
+    tobject *a = add_cert(&tok, 1);
+    tobject *b = add_cert(&tok, 2);
+    tobject *c = add_cert(&tok, 3);
+
+    /* a newer copy of b from the store, under a new CKA_ID */
+    tobject *b2 = tobject_new();
+    assert_non_null(b2);
+
+    CK_RV rv = attr_list_dup(b->attrs, &b2->attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    unsigned id = 4;
+    CK_ATTRIBUTE new_id = { .type = CKA_ID, .pValue = &id, .ulValueLen = sizeof(id) };
+    rv = attr_list_update_entry(b2->attrs, &new_id);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = token_replace_tobject(&tok, b, b2);
+    assert_int_equal(rv, CKR_OK);
+
+    /* same handle and place */
+    assert_int_equal(b2->obj_handle, b->obj_handle);
+    assert_int_equal(b2->seq, b->seq);
+    assert_ptr_equal(list_entry(a->l.next, tobject, l), b2);
+    assert_ptr_equal(list_entry(c->l.prev, tobject, l), b2);
+
+    tobject *found = NULL;
+    rv = token_find_tobject(&tok, b2->obj_handle, &found);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(found, b2);
+
+    CK_ATTRIBUTE templ = { .type = CKA_ID, .pValue = &id, .ulValueLen = sizeof(id) };
+    tobject * const *objs = NULL;
+    size_t len = 0;
+    bool is_indexed = attr_index_lookup(tok.tobjects.attr_index, &templ, 1,
+            &objs, &len);
+    assert_true(is_indexed);
+    assert_int_equal(len, 1);
+    assert_ptr_equal(objs[0], b2);
+
+    id = 2;
+    is_indexed = attr_index_lookup(tok.tobjects.attr_index, &templ, 1,
+            &objs, &len);
+    assert_true(is_indexed);
+    assert_int_equal(len, 0);
+
+    tobject_free(b);
+
+    /* the ends of the list */
+    tobject *c2 = tobject_new();
+    assert_non_null(c2);
+    rv = attr_list_dup(c->attrs, &c2->attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = token_replace_tobject(&tok, c, c2);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(tok.tobjects.tail, c2);
+    tobject_free(c);
+
+    tobject *a2 = tobject_new();
+    assert_non_null(a2);
+    rv = attr_list_dup(a->attrs, &a2->attrs);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = token_replace_tobject(&tok, a, a2);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(tok.tobjects.head, a2);
+    tobject_free(a);
+
+    token_clear(&tok);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_token_handle_reuse),
+        cmocka_unit_test(test_token_create_destroy),
+        cmocka_unit_test(test_token_attr_index),
+        cmocka_unit_test(test_token_attr_index_order),
+        cmocka_unit_test(test_token_replace_tobject),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
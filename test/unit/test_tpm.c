@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <tss2/tss2_esys.h>
+#include <tss2/tss2_tctildr.h>
+
+#include "tpm.h"
+#include "utils.h"
+
+#define FAKE_ESYS_CTX ((ESYS_CONTEXT *)0xBADCC0DE)
+
+TSS2_RC __wrap_Esys_Initialize(ESYS_CONTEXT **esys_context,
+        TSS2_TCTI_CONTEXT *tcti, TSS2_ABI_VERSION *abiVersion) {
+    UNUSED(tcti);
+    UNUSED(abiVersion);
+
+    *esys_context = FAKE_ESYS_CTX;
+    return TSS2_RC_SUCCESS;
+}
+
+void __wrap_Esys_Finalize(ESYS_CONTEXT **esys_context) {
+    *esys_context = NULL;
+}
+
+void __wrap_Tss2_TctiLdr_Finalize(TSS2_TCTI_CONTEXT **tcti) {
+    *tcti = NULL;
+}
+
+/* counts callers that blocked in tpm_lock() or tpm_yield() */
+static unsigned cond_waits;
+
+int __real_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+
+int __wrap_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    __atomic_add_fetch(&cond_waits, 1, __ATOMIC_RELEASE);
+    return __real_pthread_cond_wait(cond, mutex);
+}
+
+/*
+ * A second caller of the TPM context, started while the first chunk of a
+ * multi chunk command runs. It records when it got the context in events.
+ */
+typedef struct waiter waiter;
+struct waiter {
+    tpm_ctx *ctx;
+    pthread_t thread;
+    bool *cancel;
+};
+
+static waiter *first_chunk_waiter;
+static char events[8];
+static size_t events_len;
+
+static void event_add(char c) {
+    assert_true(events_len < sizeof(events) - 1);
+    events[events_len++] = c;
+}
+
+static void *waiter_run(void *arg) {
+
+    waiter *w = (waiter *)arg;
+
+    tpm_lock(w->ctx);
+    events[events_len++] = 'W';
+    /* like C_CancelFunction on the session of the bulk operation */
+    if (w->cancel) {
+        __atomic_store_n(w->cancel, true, __ATOMIC_RELEASE);
+    }
+    tpm_unlock(w->ctx);
+
+    return NULL;
+}
+
+static void waiter_start(waiter *w) {
+
+    unsigned waits = __atomic_load_n(&cond_waits, __ATOMIC_ACQUIRE);
+
+    int rc = pthread_create(&w->thread, NULL, waiter_run, w);
+    assert_int_equal(rc, 0);
+
+    /* the chunk is done once the waiter is blocked on the context */
+    while (__atomic_load_n(&cond_waits, __ATOMIC_ACQUIRE) == waits) {
+        sched_yield();
+    }
+}
+
+/* returns the bytes asked for, filled with the mocked value, or fails */
+TSS2_RC __wrap_Esys_GetRandom(ESYS_CONTEXT *esysContext, ESYS_TR shandle1,
+        ESYS_TR shandle2, ESYS_TR shandle3, UINT16 bytesRequested,
+        TPM2B_DIGEST **randomBytes) {
+    UNUSED(shandle1);
+    UNUSED(shandle2);
+    UNUSED(shandle3);
+
+    assert_ptr_equal(esysContext, FAKE_ESYS_CTX);
+
+    event_add('R');
+    if (first_chunk_waiter) {
+        waiter_start(first_chunk_waiter);
+        first_chunk_waiter = NULL;
+    }
+
+    TSS2_RC rc = mock_type(TSS2_RC);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    TPM2B_DIGEST *d = calloc(1, sizeof(*d));
+    assert_non_null(d);
+
+    d->size = bytesRequested;
+    memset(d->buffer, 0xAA, bytesRequested);
+
+    *randomBytes = d;
+    return TSS2_RC_SUCCESS;
+}
+
+static int test_setup(void **state) {
+
+    tpm_ctx *ctx = NULL;
+    CK_RV rv = tpm_ctx_new_fromtcti(NULL, &ctx);
+    if (rv != CKR_OK) {
+        return -1;
+    }
+
+    *state = ctx;
+
+    events_len = 0;
+    memset(events, 0, sizeof(events));
+
+    return 0;
+}
+
+static int test_teardown(void **state) {
+
+    tpm_ctx_free((tpm_ctx *)*state);
+
+    return 0;
+}
+
+static void test_tpm_getrandom(void **state) {
+
+    tpm_ctx *ctx = (tpm_ctx *)*state;
+
+    BYTE data[100] = { 0 };
+    BYTE expected[sizeof(data)];
+    memset(expected, 0xAA, sizeof(expected));
+
+    will_return_count(__wrap_Esys_GetRandom, TSS2_RC_SUCCESS, 2);
+
+    CK_RV rv = tpm_getrandom(ctx, NULL, data, sizeof(data));
+    assert_int_equal(rv, CKR_OK);
+    assert_memory_equal(data, expected, sizeof(data));
+}
+
+static void test_tpm_getrandom_second_chunk_fail(void **state) {
+
+    tpm_ctx *ctx = (tpm_ctx *)*state;
+
+    BYTE data[100] = { 0 };
+
+    will_return(__wrap_Esys_GetRandom, TSS2_RC_SUCCESS);
+    will_return(__wrap_Esys_GetRandom, TPM2_RC_FAILURE);
+
+    CK_RV rv = tpm_getrandom(ctx, NULL, data, sizeof(data));
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+}
+
+static void test_tpm_getrandom_canceled(void **state) {
+
+    tpm_ctx *ctx = (tpm_ctx *)*state;
+
+    BYTE data[100] = { 0 };
+    bool cancel = true;
+
+    /* checked between chunks, so the first one is still done */
+    will_return(__wrap_Esys_GetRandom, TSS2_RC_SUCCESS);
+
+    CK_RV rv = tpm_getrandom(ctx, &cancel, data, sizeof(data));
+    assert_int_equal(rv, CKR_FUNCTION_CANCELED);
+}
+
+static void test_tpm_yield_to_waiter(void **state) {
+
+    tpm_ctx *ctx = (tpm_ctx *)*state;
+
+    BYTE data[100] = { 0 };
+
+    will_return_count(__wrap_Esys_GetRandom, TSS2_RC_SUCCESS, 2);
+
+    waiter w = { .ctx = ctx };
+    first_chunk_waiter = &w;
+
+    tpm_lock(ctx);
+    CK_RV rv = tpm_getrandom(ctx, NULL, data, sizeof(data));
+    tpm_unlock(ctx);
+    assert_int_equal(rv, CKR_OK);
+
+    pthread_join(w.thread, NULL);
+
+    /* the waiter got the context between the chunks */
+    assert_string_equal(events, "RWR");
+}
+
+static void test_tpm_yield_canceled_while_waiting(void **state) {
+
+    tpm_ctx *ctx = (tpm_ctx *)*state;
+
+    BYTE data[100] = { 0 };
+    bool cancel = false;
+
+    /* the second chunk is never sent */
+    will_return(__wrap_Esys_GetRandom, TSS2_RC_SUCCESS);
+
+    waiter w = { .ctx = ctx, .cancel = &cancel };
+    first_chunk_waiter = &w;
+
+    tpm_lock(ctx);
+    CK_RV rv = tpm_getrandom(ctx, &cancel, data, sizeof(data));
+    tpm_unlock(ctx);
+    assert_int_equal(rv, CKR_FUNCTION_CANCELED);
+
+    pthread_join(w.thread, NULL);
+
+    assert_string_equal(events, "RW");
+
+    /* the context is free again */
+    tpm_lock(ctx);
+    tpm_unlock(ctx);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_tpm_getrandom,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_getrandom_second_chunk_fail,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_getrandom_canceled,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_yield_to_waiter,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_tpm_yield_canceled_while_waiting,
+                test_setup, test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -379,7 +379,7 @@ class AddCert(Command):
     @staticmethod
     def get_id_by_label(tobj, keylabel):
 
-        attrs = yaml.safe_load(io.StringIO(tobj['attrs']))
+        attrs = Db.loadattrs(tobj['attrs'])
 
         if CKA_LABEL in attrs:
             x = attrs[CKA_LABEL]
@@ -392,7 +392,7 @@ class AddCert(Command):
     @staticmethod
     def get_label_by_id(tobj, keyid):
 
-        attrs = yaml.safe_load(io.StringIO(tobj['attrs']))
+        attrs = Db.loadattrs(tobj['attrs'])
 
         if CKA_ID in attrs:
             x = attrs[CKA_ID]
@@ -437,8 +437,7 @@ class ObjMod(Command):
             obj = db.getobject(tid)
             if obj is None:
                 sys.exit('Not found, object with id: {}'.format(tid))
-        s = obj['attrs']
-        obj_attrs = yaml.safe_load(s)
+        obj_attrs = Db.loadattrs(obj['attrs'])
 
         # if we don't have any update data, just dump the attributes
         if not key and not inattrs:
@@ -709,7 +708,7 @@ class Export(Command):
     @staticmethod
     def _handle_tpm_key(db, obj, pin, is_so_pin, hierarchyauth, format, output_prefix):
 
-        attrs = yaml.safe_load(io.StringIO(obj['attrs']))
+        attrs = Db.loadattrs(obj['attrs'])
         cka_class = attrs[CKA_CLASS]      
 
         if cka_class == CKO_SECRET_KEY:
@@ -741,7 +740,7 @@ class Export(Command):
 
         obj = db.getobject(tid)
    
-        attrs = yaml.safe_load(io.StringIO(obj['attrs']))
+        attrs = Db.loadattrs(obj['attrs'])
         
         cka_class = attrs[CKA_CLASS]
 
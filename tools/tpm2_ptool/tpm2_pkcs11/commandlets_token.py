@@ -156,7 +156,7 @@ class VerifyCommand(Command):
 
             for tobj in tobjs:
 
-                attrs = yaml.safe_load(tobj['attrs'])
+                attrs = Db.loadattrs(tobj['attrs'])
 
                 priv=None
                 if CKA_TPM2_PRIV_BLOB in attrs:
@@ -509,6 +509,13 @@ def _empty_validator(s):
     return s
 
 
+def _uint_validator(s):
+    value = int(s)
+    if value < 0:
+        raise ValueError("Expected a non-negative integer, got: %d" % value)
+    return value
+
+
 def _forbid_set_empty_user_pin(_):
     raise RuntimeError("'empty-user-pin' can only be set with changepin or initpin")
 
@@ -523,6 +530,8 @@ class ConfigCommand(Command):
         'log-level'  : _empty_validator.__func__,
         'tcti'       : _empty_validator.__func__,
         'empty-user-pin': _forbid_set_empty_user_pin,
+        'tpm-ctx-pool-size': _uint_validator,
+        'max-sessions': _uint_validator,
     }
 
     # adhere to an interface
@@ -678,7 +687,7 @@ class ListObjectsCommand(Command):
         token = db.gettoken(args['label'])
         objects = db.getobjects(token['id'])
         for o in objects:
-            y = yaml.safe_load(o['attrs'])
+            y = Db.loadattrs(o['attrs'])
             d = {
                 'id': o['id'],
                 'CKA_LABEL' : binascii.unhexlify(y[CKA_LABEL]).decode(),
@@ -1,15 +1,23 @@
 # SPDX-License-Identifier: BSD-2-Clause
+import binascii
 import fcntl
 import io
 import os
 import sys
 import sqlite3
+import struct
 import textwrap
 import yaml
 
 from .pkcs11t import (
     CKA_ALLOWED_MECHANISMS,
     CKA_CLASS,
+    CKA_PRIVATE,
+    CKA_ID,
+    CKA_LABEL,
+    CKA_ISSUER,
+    CKA_SERIAL_NUMBER,
+    CKA_SUBJECT,
     CKO_SECRET_KEY,
     CKO_PRIVATE_KEY,
     CKA_KEY_TYPE,
@@ -22,7 +30,42 @@ from .pkcs11t import (
     CKM_ECDSA_SHA512
 )
 
-VERSION = 8
+VERSION = 11
+
+#
+# The binary tobject attribute format, see src/lib/attr_tlv.h:
+#   header: 0x00 'T' 'L' 'V' <version>
+#   record: <type:8> <memory type:1> <length:4> <value:length>
+#
+TLV_MAGIC = b'\x00TLV'
+TLV_VERSION = 1
+TLV_RECORD = struct.Struct('<QBI')
+TLV_ULONG = struct.Struct('<Q')
+
+TYPE_BYTE_INT = 1
+TYPE_BYTE_BOOL = 2
+TYPE_BYTE_INT_SEQ = 3
+TYPE_BYTE_HEX_STR = 4
+
+#
+# The attributes objects are searched by, kept in tobjects columns next to
+# the encoded ones. Keep in sync with tobject_columns in src/lib/db.c.
+#
+TOBJECT_COLUMNS = (
+    ('class', CKA_CLASS),
+    ('private', CKA_PRIVATE),
+    ('key_type', CKA_KEY_TYPE),
+    ('ckaid', CKA_ID),
+    ('label', CKA_LABEL),
+    ('issuer', CKA_ISSUER),
+    ('serial', CKA_SERIAL_NUMBER),
+    ('subject', CKA_SUBJECT),
+)
+
+# The store settings shared with the library, see db_configure() in db.c
+STORE_JOURNALS = ('wal', 'delete', 'truncate', 'persist')
+STORE_SYNCS = ('normal', 'full', 'extra')
+STORE_BUSY_TIMEOUT_DEFAULT = 5000
 
 #
 # With Db() as db:
@@ -32,8 +75,44 @@ class Db(object):
     def __init__(self, dirpath):
         self._path = os.path.join(dirpath, "tpm2_pkcs11.sqlite3")
 
+    @staticmethod
+    def _connect(path):
+        timeout = os.environ.get('TPM2_PKCS11_STORE_BUSY_TIMEOUT',
+                                 STORE_BUSY_TIMEOUT_DEFAULT)
+        try:
+            timeout = int(timeout, 0) if isinstance(timeout, str) else timeout
+        except ValueError:
+            sys.exit('Invalid TPM2_PKCS11_STORE_BUSY_TIMEOUT, got: "{}"'.format(timeout))
+
+        # Take the write lock when a transaction starts rather than on its
+        # first write, which cannot wait for it
+        conn = sqlite3.connect(path, timeout=timeout / 1000.0,
+                               isolation_level='IMMEDIATE')
+
+        journal = os.environ.get('TPM2_PKCS11_STORE_JOURNAL')
+        if journal is not None:
+            if journal.lower() not in STORE_JOURNALS:
+                sys.exit('Invalid TPM2_PKCS11_STORE_JOURNAL, got: "{}"'.format(journal))
+            mode = conn.execute('PRAGMA journal_mode={}'.format(journal)).fetchone()[0]
+            if mode.lower() != journal.lower():
+                sys.exit('Cannot set store journal mode to {}, still {}'.format(journal, mode))
+        else:
+            mode = conn.execute('PRAGMA journal_mode').fetchone()[0]
+
+        sync = os.environ.get('TPM2_PKCS11_STORE_SYNC')
+        if sync is not None:
+            if sync.lower() not in STORE_SYNCS:
+                sys.exit('Invalid TPM2_PKCS11_STORE_SYNC, got: "{}"'.format(sync))
+        elif mode.lower() == 'wal':
+            sync = 'normal'
+
+        if sync is not None:
+            conn.execute('PRAGMA synchronous={}'.format(sync))
+
+        return conn
+
     def __enter__(self):
-        self._conn = sqlite3.connect(self._path)
+        self._conn = Db._connect(self._path)
         self._conn.row_factory = sqlite3.Row
         self._conn.execute('PRAGMA foreign_keys = ON;')
         self._create()
@@ -205,11 +284,106 @@ class Db(object):
         c = self._conn.cursor()
         return self.addprimary_raw(c, 'pobjects', config, objauth, hierarchy)
 
+    @staticmethod
+    def dumpattrs(attrs):
+        '''
+        Encodes a dict of tobject attributes in the binary format. Byte strings
+        are hex strings like in the YAML format.
+        '''
+        out = bytearray(TLV_MAGIC)
+        out.append(TLV_VERSION)
+
+        for k, v in attrs.items():
+            # bool first, it is an int too
+            if isinstance(v, bool):
+                memtype, value = TYPE_BYTE_BOOL, bytes([1 if v else 0])
+            elif isinstance(v, int):
+                memtype, value = TYPE_BYTE_INT, TLV_ULONG.pack(v)
+            elif isinstance(v, (list, tuple)):
+                memtype = TYPE_BYTE_INT_SEQ
+                value = b''.join(TLV_ULONG.pack(x) for x in v)
+            elif isinstance(v, str):
+                memtype, value = TYPE_BYTE_HEX_STR, binascii.unhexlify(v)
+            elif v is None:
+                memtype, value = TYPE_BYTE_HEX_STR, b''
+            else:
+                raise RuntimeError('Cannot encode attribute {}: {}'.format(k, type(v)))
+
+            out += TLV_RECORD.pack(k, memtype, len(value))
+            out += value
+
+        return sqlite3.Binary(bytes(out))
+
+    @staticmethod
+    def loadattrs(raw):
+        '''
+        Decodes tobject attributes as stored in the DB, either in the binary
+        format or YAML from before schema version 9.
+        '''
+        if isinstance(raw, str):
+            return yaml.safe_load(io.StringIO(raw))
+
+        raw = bytes(raw)
+        if not raw.startswith(TLV_MAGIC):
+            return yaml.safe_load(io.StringIO(raw.decode()))
+
+        version = raw[len(TLV_MAGIC)]
+        if version != TLV_VERSION:
+            raise RuntimeError('Unknown attribute encoding version: {}'.format(version))
+
+        attrs = {}
+        off = len(TLV_MAGIC) + 1
+        while off < len(raw):
+            k, memtype, length = TLV_RECORD.unpack_from(raw, off)
+            off += TLV_RECORD.size
+            value = raw[off:off + length]
+            if len(value) != length:
+                raise RuntimeError('Truncated attribute: {}'.format(k))
+            off += length
+
+            if memtype == TYPE_BYTE_BOOL:
+                attrs[k] = value != b'\x00'
+            elif memtype == TYPE_BYTE_INT:
+                attrs[k] = TLV_ULONG.unpack(value)[0]
+            elif memtype == TYPE_BYTE_INT_SEQ:
+                attrs[k] = [x[0] for x in TLV_ULONG.iter_unpack(value)]
+            elif memtype == TYPE_BYTE_HEX_STR:
+                attrs[k] = binascii.hexlify(value).decode()
+            else:
+                raise RuntimeError('Unknown memory type for attribute {}: {}'.format(k, memtype))
+
+        return attrs
+
+    @staticmethod
+    def _tobject_columns(attrs):
+        '''
+        The values of the tobjects columns for a dict of attributes, NULL for
+        the ones it doesn't have.
+        '''
+        columns = {}
+        for name, attr in TOBJECT_COLUMNS:
+            v = attrs.get(attr)
+            if isinstance(v, bool):
+                v = 1 if v else 0
+            elif isinstance(v, int):
+                # stored like the library does, as a signed 64 bit value
+                v = v - (1 << 64) if v >= (1 << 63) else v
+            elif isinstance(v, str):
+                v = sqlite3.Binary(binascii.unhexlify(v))
+            elif attr in attrs:
+                # present but empty
+                v = sqlite3.Binary(b'')
+            columns[name] = v
+
+        return columns
+
     def addtertiary(self, tokid, pkcs11_object):
+        attrs = dict(pkcs11_object)
         tobject = {
             'tokid': tokid,
-            'attrs': yaml.safe_dump(dict(pkcs11_object), canonical=True),
+            'attrs': Db.dumpattrs(attrs),
         }
+        tobject.update(Db._tobject_columns(attrs))
 
         columns = ', '.join(tobject.keys())
         placeholders = ', '.join('?' * len(tobject))
@@ -222,15 +396,24 @@ class Db(object):
     @staticmethod
     def _updatetertiary(db, tid, attrs):
         c = db.cursor()
-        attrs = yaml.safe_dump(attrs, canonical=True)
+        attrs = Db.dumpattrs(attrs)
         values = [attrs, tid]
 
         sql = 'UPDATE tobjects SET attrs=? WHERE id=?'
         c.execute(sql, values)
 
+    @staticmethod
+    def _updatecolumns(db, tid, attrs):
+        columns = Db._tobject_columns(attrs)
+
+        sql = 'UPDATE tobjects SET {} WHERE id=?'.format(
+            ', '.join('{}=?'.format(k) for k in columns.keys()))
+        db.cursor().execute(sql, list(columns.values()) + [tid])
+
     def updatetertiary(self, tid, attrs):
 
         self._updatetertiary(self._conn, tid, attrs)
+        self._updatecolumns(self._conn, tid, attrs)
 
     def updatepin(self, is_so, token, sealauth, sealpriv, sealpub=None):
 
@@ -427,7 +610,7 @@ class Db(object):
         tobjs = c.fetchall()
 
         for t in tobjs:
-            attrs = yaml.safe_load(io.StringIO(t['attrs']))
+            attrs = Db.loadattrs(t['attrs'])
 
             # IF the object is definitely a SECRET KEY of AES and has
             # CKM_AES_CBC_PAD AND CKM_AES_CTR in allowed mechanisms, skip it.
@@ -471,7 +654,7 @@ class Db(object):
         algs_to_add = set([ CKM_ECDSA_SHA256, CKM_ECDSA_SHA384, CKM_ECDSA_SHA512])
 
         for t in tobjs:
-            attrs = yaml.safe_load(io.StringIO(t['attrs']))
+            attrs = Db.loadattrs(t['attrs'])
 
             # Fix the duplicate add of CBC_PAD from version 4 -> 5 upgrade and
             # replace one with CBC_CTR
@@ -514,7 +697,7 @@ class Db(object):
         tobjs = c.fetchall()
 
         for t in tobjs:
-            attrs = yaml.safe_load(io.StringIO(t['attrs']))
+            attrs = Db.loadattrs(t['attrs'])
 
             # Fix the duplicate add of CBC_PAD from version 4 -> 5 upgrade and
             # replace one with CBC_CTR
@@ -550,7 +733,7 @@ class Db(object):
         tobjs = c.fetchall()
 
         for t in tobjs:
-            attrs = yaml.safe_load(io.StringIO(t['attrs']))
+            attrs = Db.loadattrs(t['attrs'])
             for attr in attrs:
                 # The allowed mechanism attribute is a buffer of hexadecimal
                 # written as a string instead of being a sequence of int
@@ -561,6 +744,114 @@ class Db(object):
 
             Db._updatetertiary(dbbakcon, t['id'], attrs)
 
+    def _update_on_9(self, dbbakcon):
+        '''
+        Between version 8 and 9 of the DB the following changes need to be made:
+
+        Table tobjects:
+
+        The attributes are stored in the binary format instead of YAML.
+        '''
+
+        c = dbbakcon.cursor()
+
+        c.execute('SELECT * from tobjects')
+        tobjs = c.fetchall()
+
+        for t in tobjs:
+            attrs = Db.loadattrs(t['attrs'])
+            Db._updatetertiary(dbbakcon, t['id'], attrs)
+
+    def _update_on_10(self, dbbakcon):
+        '''
+        Between version 9 and 10 of the DB the following changes need to be made:
+
+        Table tobject_changes:
+
+        New, a log of the changed tobjects rows filled in by triggers, the
+        library uses it to pick up changes made by other processes.
+        '''
+
+        c = dbbakcon.cursor()
+        Db._create_tobject_changes(c)
+
+    def _update_on_11(self, dbbakcon):
+        '''
+        Between version 10 and 11 of the DB the following changes need to be made:
+
+        Table tobjects:
+
+        New columns holding the attributes objects are searched by, see
+        TOBJECT_COLUMNS, and the tobjects_summary index over them.
+        '''
+
+        c = dbbakcon.cursor()
+        Db._create_tobject_columns(c)
+
+        c.execute('SELECT id, attrs from tobjects')
+        tobjs = c.fetchall()
+
+        for t in tobjs:
+            attrs = Db.loadattrs(t['attrs'])
+            Db._updatecolumns(dbbakcon, t['id'], attrs)
+
+    @staticmethod
+    def _create_tobject_columns(c):
+
+        # Keep in sync with tobject_columns_sql in src/lib/db.c
+        for name, attr in TOBJECT_COLUMNS:
+            kind = 'INTEGER' if attr in (CKA_CLASS, CKA_PRIVATE, CKA_KEY_TYPE) else 'BLOB'
+            c.execute('ALTER TABLE tobjects ADD COLUMN {} {};'.format(name, kind))
+
+        c.execute('CREATE INDEX tobjects_summary ON tobjects (tokid, {});'.format(
+            ', '.join(name for name, _ in TOBJECT_COLUMNS)))
+
+    @staticmethod
+    def _create_tobject_changes(c):
+
+        # Keep in sync with tobject_changes_sql in src/lib/db.c
+        sql = [
+            textwrap.dedent('''
+            CREATE TABLE tobject_changes(
+                seq INTEGER PRIMARY KEY AUTOINCREMENT,
+                tokid INTEGER NOT NULL,
+                id INTEGER NOT NULL,
+                origin INTEGER
+            );
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER log_tobject_insert
+                AFTER INSERT ON tobjects
+                BEGIN
+                    INSERT INTO tobject_changes (tokid, id) VALUES (new.tokid, new.id);
+                END;
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER log_tobject_update
+                AFTER UPDATE ON tobjects
+                BEGIN
+                    INSERT INTO tobject_changes (tokid, id) VALUES (new.tokid, new.id);
+                END;
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER log_tobject_delete
+                AFTER DELETE ON tobjects
+                BEGIN
+                    INSERT INTO tobject_changes (tokid, id) VALUES (old.tokid, old.id);
+                END;
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER prune_tobject_changes
+                AFTER INSERT ON tobject_changes
+                BEGIN
+                    DELETE FROM tobject_changes WHERE seq <= new.seq - 4096;
+                END;
+            '''),
+        ]
+
+        for s in sql:
+            c.execute(s)
+
     def update_db(self, old_version, new_version=VERSION):
 
         # were doing the update, so make a backup to manipulate
@@ -602,7 +893,7 @@ class Db(object):
         os.rename(dbbakpath, self._path)
 
         # re-establish a connection
-        self._conn = sqlite3.connect(self._path)
+        self._conn = Db._connect(self._path)
         self._conn.row_factory = sqlite3.Row
 
     def _get_version(self):
@@ -692,6 +983,9 @@ class Db(object):
         for s in sql:
             c.execute(s)
 
+        Db._create_tobject_changes(c)
+        Db._create_tobject_columns(c)
+
     # TODO collapse object tables into one, since they are common besides type.
     # move sealobject metadata into token metadata table.
     #
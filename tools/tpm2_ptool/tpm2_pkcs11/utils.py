@@ -29,6 +29,7 @@ from tpm2_pytss.types import (
     TPM2B_PRIVATE,
 )
 
+from .db import Db
 from .pkcs11t import *  # noqa
 
 def str2bytes(s):
@@ -428,7 +429,7 @@ def getauth(db, obj, pin, is_sopin, hierarchyauth):
     pobject = db.getprimary(pid)
     token = db.gettoken(id=tokid)
 
-    attrs = yaml.safe_load(io.StringIO(obj['attrs']))
+    attrs = Db.loadattrs(obj['attrs'])
     
     with TemporaryDirectory() as d:
         tpm2 = Tpm2(d)
@@ -496,7 +497,7 @@ def dump_blobs(db, obj, pin, is_sopin, output_prefix):
     pid = db.getpid_by_tokid(tokid)
     pobj = db.getprimary(pid)
 
-    attrs = yaml.safe_load(io.StringIO(obj['attrs']))
+    attrs = Db.loadattrs(obj['attrs'])
 
     pub_blob = TPM2B_PUBLIC.unmarshal(binascii.unhexlify(attrs[CKA_TPM2_PUB_BLOB]))[0]
     priv_blob = TPM2B_PRIVATE.unmarshal(binascii.unhexlify(attrs[CKA_TPM2_PRIV_BLOB]))[0]
@@ -526,7 +527,7 @@ def dump_tsspem(db, obj, pin, is_sopin, output_prefix):
     pid = db.getpid_by_tokid(tokid)
     pobj = db.getprimary(pid)
 
-    attrs = yaml.safe_load(io.StringIO(obj['attrs']))
+    attrs = Db.loadattrs(obj['attrs'])
 
     pub_blob = TPM2B_PUBLIC.unmarshal(binascii.unhexlify(attrs[CKA_TPM2_PUB_BLOB]))[0]
     priv_blob = TPM2B_PRIVATE.unmarshal(binascii.unhexlify(attrs[CKA_TPM2_PRIV_BLOB]))[0]
@@ -548,7 +549,7 @@ def dump_tsspem(db, obj, pin, is_sopin, output_prefix):
 
 def dump_pubpem(db, obj, pin, is_sopin, output_prefix):
     
-    attrs = yaml.safe_load(io.StringIO(obj['attrs']))
+    attrs = Db.loadattrs(obj['attrs'])
     
     pub_blob = TPM2B_PUBLIC.unmarshal(binascii.unhexlify(attrs[CKA_TPM2_PUB_BLOB]))[0]
 